@@ -0,0 +1,34 @@
+#pragma once
+
+// The driver's API header (structures and IOCTL codes) on its own, for the parts of the SDK that don't talk to the
+// device and so can be built and checked on any OS. On Windows it comes with the Windows SDK's definitions as usual;
+// elsewhere the few macros the header uses are defined here, and the device interface GUID is left out.
+
+#ifdef _WIN32
+
+#include <windows.h>
+#include <winioctl.h>
+
+#else
+
+#define DONT_INCLUDE_INITGUID
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8)
+
+// As in winioctl.h
+#define FILE_DEVICE_UNKNOWN 0x00000022
+#define METHOD_BUFFERED 0
+#define FILE_ANY_ACCESS 0
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+#endif
+
+#include <cstdint>
+
+#include "../us4oem/Us4OemAPI.h"
+
+// Whether a status (NTSTATUS) in one of the API's long fields is a success. NTSTATUS is 32 bits; where long is wider,
+// as on 64-bit Linux, the failure codes would read as positive numbers otherwise.
+inline bool us4oemStatusSucceeded(long status) {
+	return static_cast<int32_t>(status) >= 0;
+}
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "api.hpp"
+#include "regsequence.hpp"
+
+// A list of commands executed by the driver in a single call, see Us4OemDevice::submitBatch.
+// Saves a user/kernel round trip per command, which adds up for short commands issued back to back
+// (e.g. setting up DMA buffers or clearing state between acquisitions).
+// Commands are numbered in the order they were added, starting at 0; results are looked up by that index.
+//
+// Example:
+//   Us4OemBatch batch;
+//   batch.pollClearPending()
+//        .allocDmaContig(4096);
+//   device.submitBatch(batch);
+//   auto response = batch.output<us4oem_dma_contiguous_buffer_response>(1);
+class Us4OemBatch {
+public:
+	Us4OemBatch() {
+		clear();
+	}
+
+	// If set, the driver keeps going after a command fails instead of skipping the rest.
+	Us4OemBatch& continueOnError(bool enable = true) {
+		header()->flags = enable ? (header()->flags | US4OEM_BATCH_FLAG_CONTINUE_ON_ERROR)
+			: (header()->flags & ~US4OEM_BATCH_FLAG_CONTINUE_ON_ERROR);
+		return *this;
+	}
+
+	// Removes all commands.
+	void clear() {
+		buffer.assign(sizeof(us4oem_batch_header), 0);
+		offsets.clear();
+		header()->total_length = buffer.size();
+	}
+
+	Us4OemBatch& pollClearPending() {
+		return add(US4OEM_WIN32_IOCTL_CLEAR_PENDING, nullptr, 0, 0);
+	}
+
+	Us4OemBatch& setStickyMode(bool status) {
+		return add(US4OEM_WIN32_IOCTL_SET_STICKY_MODE, &status, sizeof(status), 0);
+	}
+
+	Us4OemBatch& setIrqModeration(unsigned long maxIrqs, unsigned long maxDelayUs) {
+		us4oem_irq_moderation_argument arg = {};
+		arg.max_irqs = maxIrqs;
+		arg.max_delay_us = maxDelayUs;
+		return add(US4OEM_WIN32_IOCTL_SET_IRQ_MODERATION, &arg, sizeof(arg), 0);
+	}
+
+	// Result: us4oem_dma_contiguous_buffer_response
+	Us4OemBatch& allocDmaContig(unsigned long length) {
+		us4oem_dma_allocation_argument arg = {};
+		arg.length = length;
+		return add(US4OEM_WIN32_IOCTL_ALLOCATE_DMA_CONTIGIOUS_BUFFER, &arg, sizeof(arg), sizeof(us4oem_dma_contiguous_buffer_response));
+	}
+
+	Us4OemBatch& deallocDmaContig(unsigned long long pa) {
+		return add(US4OEM_WIN32_IOCTL_DEALLOCATE_DMA_CONTIGIOUS_BUFFER, &pa, sizeof(pa), 0);
+	}
+
+	// Releases a DMA buffer or a mapping by its handle (drivers with US4OEM_CAPABILITY_HANDLES)
+	Us4OemBatch& releaseHandle(us4oem_handle handle) {
+		return add(US4OEM_WIN32_IOCTL_RELEASE_HANDLE, &handle, sizeof(handle), 0);
+	}
+
+	Us4OemBatch& deallocAll() {
+		return add(US4OEM_WIN32_IOCTL_DEALLOCATE_ALL_DMA_BUFFERS, nullptr, 0, 0);
+	}
+
+	// Result: us4oem_mmap_response
+	Us4OemBatch& mmap(us4oem_mmap_area area, void* va = nullptr, unsigned long lengthLimit = 0) {
+		us4oem_mmap_argument arg = {};
+		arg.area = area;
+		arg.va = va;
+		arg.length_limit = lengthLimit;
+		return add(US4OEM_WIN32_IOCTL_MMAP, &arg, sizeof(arg), sizeof(us4oem_mmap_response));
+	}
+
+	// Result: us4oem_stats
+	Us4OemBatch& readStats() {
+		return add(US4OEM_WIN32_IOCTL_READ_STATS, nullptr, 0, sizeof(us4oem_stats));
+	}
+
+	// Result: the sequence with the values read, see registerResults
+	Us4OemBatch& registerAccess(const Us4OemRegisterSequence& sequence) {
+		unsigned long length = (unsigned long)sequence.buffer.size();
+		return add(US4OEM_WIN32_IOCTL_REGISTER_ACCESS, sequence.buffer.data(), length, length);
+	}
+
+	// Adds any batchable IOCTL; outputLength bytes are reserved for its response.
+	Us4OemBatch& add(unsigned long ioctlCode, const void* input, unsigned long inputLength, unsigned long outputLength) {
+		if (offsets.size() >= US4OEM_BATCH_MAX_COMMANDS) {
+			throw std::length_error("Too many commands in a batch");
+		}
+
+		size_t offset = buffer.size();
+		buffer.resize(offset + US4OEM_BATCH_COMMAND_SIZE(inputLength, outputLength), 0);
+
+		us4oem_batch_command* cmd = command(offset);
+		cmd->ioctl = ioctlCode;
+		cmd->input_length = inputLength;
+		cmd->output_length = outputLength;
+		cmd->status = US4OEM_BATCH_STATUS_NOT_RUN;
+		if (inputLength > 0) {
+			std::memcpy(buffer.data() + offset + sizeof(us4oem_batch_command), input, inputLength);
+		}
+
+		offsets.push_back(offset);
+		header()->command_count = (unsigned long)offsets.size();
+		header()->total_length = buffer.size();
+		return *this;
+	}
+
+	size_t size() const {
+		return offsets.size();
+	}
+
+	// Whether any of the commands is the given IOCTL
+	bool contains(unsigned long ioctlCode) const {
+		return std::any_of(offsets.begin(), offsets.end(), [&](size_t offset) { return command(offset)->ioctl == ioctlCode; });
+	}
+
+	// Number of commands the driver ran in the last submission.
+	unsigned long executed() const {
+		return header()->executed;
+	}
+
+	// True if every command of the last submission succeeded.
+	bool succeeded() const {
+		return us4oemStatusSucceeded(header()->status) && header()->executed == offsets.size();
+	}
+
+	// Status (NTSTATUS) of a command, US4OEM_BATCH_STATUS_NOT_RUN if it was skipped.
+	long status(size_t index) const {
+		return command(offsets.at(index))->status;
+	}
+
+	bool succeeded(size_t index) const {
+		return us4oemStatusSucceeded(status(index));
+	}
+
+	// Runs the commands one call at a time, filling in the results the way the driver does for a submitted batch.
+	// call runs a single command and returns its status (NTSTATUS, negative if it failed):
+	//   long call(unsigned long ioctlCode, void* input, unsigned long inputLength, void* output,
+	//       unsigned long outputLength, unsigned long& bytesReturned)
+	// Returns true if all of them succeeded.
+	template<class Call>
+	bool runEach(Call&& call) {
+		header()->executed = 0;
+		header()->status = 0;
+
+		for (size_t offset : offsets) {
+			command(offset)->status = US4OEM_BATCH_STATUS_NOT_RUN;
+			command(offset)->bytes_returned = 0;
+		}
+
+		for (size_t offset : offsets) {
+			us4oem_batch_command* cmd = command(offset);
+			unsigned char* input = buffer.data() + offset + sizeof(us4oem_batch_command);
+			unsigned char* output = input + US4OEM_BATCH_ALIGN(cmd->input_length);
+			unsigned long bytesReturned = 0;
+
+			cmd->status = call(cmd->ioctl,
+				cmd->input_length > 0 ? input : nullptr, cmd->input_length,
+				cmd->output_length > 0 ? output : nullptr, cmd->output_length,
+				bytesReturned);
+			cmd->bytes_returned = us4oemStatusSucceeded(cmd->status) ? std::min(bytesReturned, cmd->output_length) : 0;
+			header()->executed++;
+
+			if (!us4oemStatusSucceeded(cmd->status)) {
+				if (us4oemStatusSucceeded(header()->status)) {
+					header()->status = cmd->status;
+				}
+				if (!(header()->flags & US4OEM_BATCH_FLAG_CONTINUE_ON_ERROR)) {
+					break;
+				}
+			}
+		}
+
+		return succeeded();
+	}
+
+	// Response of a command. Throws if the command failed or returned less than sizeof(T).
+	template<class T>
+	T output(size_t index) const {
+		const us4oem_batch_command* cmd = command(offsets.at(index));
+		if (!us4oemStatusSucceeded(cmd->status)) {
+			throw std::runtime_error("Batched command failed: " + std::to_string(cmd->status));
+		}
+		if (cmd->bytes_returned < sizeof(T)) {
+			throw std::runtime_error("Batched command returned less data than expected");
+		}
+
+		T value;
+		std::memcpy(&value, buffer.data() + offsets[index] + sizeof(us4oem_batch_command)
+			+ US4OEM_BATCH_ALIGN(cmd->input_length), sizeof(T));
+		return value;
+	}
+
+	// Copies the results of a registerAccess command back into the sequence it was made from, so they can be read
+	// with Us4OemRegisterSequence::value. Throws if the command failed.
+	void registerResults(size_t index, Us4OemRegisterSequence& sequence) const {
+		const us4oem_batch_command* cmd = command(offsets.at(index));
+		if (cmd->ioctl != US4OEM_WIN32_IOCTL_REGISTER_ACCESS || cmd->input_length != sequence.buffer.size()) {
+			throw std::invalid_argument("Not the register access command of this sequence");
+		}
+		if (!us4oemStatusSucceeded(cmd->status) || cmd->bytes_returned < sequence.buffer.size()) {
+			throw std::runtime_error("Batched register access failed: " + std::to_string(cmd->status));
+		}
+
+		std::memcpy(sequence.buffer.data(), buffer.data() + offsets[index] + sizeof(us4oem_batch_command)
+			+ US4OEM_BATCH_ALIGN(cmd->input_length), sequence.buffer.size());
+	}
+
+private:
+	friend class Us4OemDevice;
+
+	us4oem_batch_header* header() {
+		return reinterpret_cast<us4oem_batch_header*>(buffer.data());
+	}
+
+	const us4oem_batch_header* header() const {
+		return reinterpret_cast<const us4oem_batch_header*>(buffer.data());
+	}
+
+	us4oem_batch_command* command(size_t offset) {
+		return reinterpret_cast<us4oem_batch_command*>(buffer.data() + offset);
+	}
+
+	const us4oem_batch_command* command(size_t offset) const {
+		return reinterpret_cast<const us4oem_batch_command*>(buffer.data() + offset);
+	}
+
+	// Header followed by the commands, exactly as the driver expects it; results are written back in place.
+	// Commands are 8-byte sized, so they stay aligned as long as the vector's storage is.
+	std::vector<unsigned char> buffer;
+	std::vector<size_t> offsets; // Offset of each command in the buffer
+};
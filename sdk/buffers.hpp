@@ -0,0 +1,336 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "sg.hpp"
+#include "error.hpp"
+#include "common.hpp"
+
+// The device's file handle, shared by the device and everything allocated through it. The file is only closed once
+// the device is closed and the last buffer or mapping made through it is gone, so releasing them never hits a stale
+// (or worse, reused) handle. Note this also means a sticky-mode close only releases the buffers after that.
+using Us4OemFileRef = std::shared_ptr<void>;
+
+// Base of the owning types below: one object in the driver (us4oem_handle), released when this goes away.
+// Move-only. Nothing here throws on release, so the destructors never do.
+class Us4OemDriverObject {
+public:
+	Us4OemDriverObject(const Us4OemDriverObject&) = delete;
+	Us4OemDriverObject& operator=(const Us4OemDriverObject&) = delete;
+
+	// US4OEM_INVALID_HANDLE once released, or if the driver's handle table was full
+	us4oem_handle handle() const { return driverHandle; }
+
+	// Whether this still owns something in the driver
+	explicit operator bool() const { return file != nullptr; }
+
+protected:
+	Us4OemDriverObject() = default;
+	Us4OemDriverObject(Us4OemFileRef file, us4oem_handle handle) : file(std::move(file)), driverHandle(handle) {}
+
+	Us4OemDriverObject(Us4OemDriverObject&& other) noexcept :
+		file(std::move(other.file)),
+		driverHandle(std::exchange(other.driverHandle, US4OEM_INVALID_HANDLE)) {}
+
+	// Derived classes release their own state first, see their release()
+	Us4OemDriverObject& operator=(Us4OemDriverObject&& other) noexcept {
+		releaseHandle();
+		file = std::move(other.file);
+		driverHandle = std::exchange(other.driverHandle, US4OEM_INVALID_HANDLE);
+		return *this;
+	}
+
+	~Us4OemDriverObject() {
+		releaseHandle();
+	}
+
+	// Releases the object by its handle. Returns false if the driver refused, e.g. because a sticky-mode close
+	// or DEALLOCATE_ALL_DMA_BUFFERS already released it.
+	bool releaseHandle() noexcept {
+		bool released = true;
+
+		if (file && driverHandle != US4OEM_INVALID_HANDLE) {
+			released = ioctlNoThrow(US4OEM_WIN32_IOCTL_RELEASE_HANDLE, &driverHandle, sizeof(driverHandle), nullptr, 0);
+		}
+
+		file.reset();
+		driverHandle = US4OEM_INVALID_HANDLE;
+		return released;
+	}
+
+	// Forgets the object without releasing it
+	us4oem_handle detach() noexcept {
+		file.reset();
+		return std::exchange(driverHandle, US4OEM_INVALID_HANDLE);
+	}
+
+	bool ioctlNoThrow(unsigned long ioctlCode, void* input, unsigned long inputLength, void* output, unsigned long outputLength) const noexcept {
+		DWORD bytesReturned = 0;
+		return DeviceIoControl(file.get(), ioctlCode, input, inputLength, output, outputLength, &bytesReturned, NULL) != FALSE;
+	}
+
+	Us4OemFileRef file;
+	us4oem_handle driverHandle = US4OEM_INVALID_HANDLE;
+};
+
+// A BAR or DMA buffer mapped into this process, unmapped when this goes away.
+class Us4OemMapping : public Us4OemDriverObject {
+public:
+	Us4OemMapping() = default;
+	Us4OemMapping(Us4OemFileRef file, const us4oem_mmap_response& response) :
+		Us4OemDriverObject(std::move(file), response.handle),
+		mappedAddress(response.address),
+		mappedLength(response.length_mapped) {}
+
+	Us4OemMapping(Us4OemMapping&& other) noexcept :
+		Us4OemDriverObject(std::move(other)),
+		mappedAddress(std::exchange(other.mappedAddress, nullptr)),
+		mappedLength(std::exchange(other.mappedLength, 0)) {}
+
+	Us4OemMapping& operator=(Us4OemMapping&& other) noexcept {
+		if (this != &other) {
+			release();
+			Us4OemDriverObject::operator=(std::move(other));
+			mappedAddress = std::exchange(other.mappedAddress, nullptr);
+			mappedLength = std::exchange(other.mappedLength, 0);
+		}
+		return *this;
+	}
+
+	// Maps a DMA buffer by its handle (or by VA, if it has none)
+	static Us4OemMapping mapDma(const Us4OemFileRef& file, us4oem_handle handle, void* va) {
+		auto mapping = tryMapDma(file, handle, va);
+		if (!mapping) {
+			throw Us4OemException(mapping.error());
+		}
+		return std::move(*mapping);
+	}
+
+	// mapDma() without exceptions. If at isn't NULL, the buffer is mapped there or not at all
+	// (US4OEM_CAPABILITY_MMAP_AT_ADDRESS); ERROR_INVALID_ADDRESS means the range is taken.
+	static Us4OemResult<Us4OemMapping> tryMapDma(const Us4OemFileRef& file, us4oem_handle handle, void* va, void* at = nullptr) noexcept {
+		us4oem_mmap_argument arg = {};
+		arg.area = MMAP_AREA_DMA;
+		arg.va = va;
+		arg.handle = handle;
+		arg.address = at;
+
+		us4oem_mmap_response response = {};
+		DWORD bytesReturned = 0;
+
+		if (!DeviceIoControl(file.get(), US4OEM_WIN32_IOCTL_MMAP, &arg, sizeof(arg), &response, sizeof(response), &bytesReturned, NULL)) {
+			return std::unexpected(Us4OemError::lastError("Mapping a DMA buffer"));
+		}
+		if (response.address == NULL) {
+			return std::unexpected(Us4OemError::fromWin32(ERROR_NOT_ENOUGH_MEMORY, "Mapping a DMA buffer"));
+		}
+
+		return Us4OemMapping(file, response);
+	}
+
+	// Unmaps now rather than on destruction. Mappings without a handle stay mapped until the process exits.
+	bool release() noexcept {
+		mappedAddress = nullptr;
+		mappedLength = 0;
+		return releaseHandle();
+	}
+
+	void* address() const { return mappedAddress; }
+	size_t length() const { return mappedLength; }
+
+	template<typename T>
+	T* as() const { return static_cast<T*>(mappedAddress); }
+
+private:
+	void* mappedAddress = nullptr;
+	size_t mappedLength = 0;
+};
+
+// A contiguous DMA buffer, deallocated when this goes away. The mapping into this process is made on first use
+// and kept, so mapping it again costs nothing.
+class Us4OemDmaBuffer : public Us4OemDriverObject {
+public:
+	Us4OemDmaBuffer() = default;
+	Us4OemDmaBuffer(Us4OemFileRef file, const us4oem_dma_contiguous_buffer_response& response, unsigned long length) :
+		Us4OemDriverObject(std::move(file), response.handle),
+		bufferVa(response.va),
+		bufferPa(response.pa),
+		bufferLength(length) {}
+
+	Us4OemDmaBuffer(Us4OemDmaBuffer&& other) noexcept :
+		Us4OemDriverObject(std::move(other)),
+		bufferVa(std::exchange(other.bufferVa, nullptr)),
+		bufferPa(std::exchange(other.bufferPa, 0)),
+		bufferLength(std::exchange(other.bufferLength, 0)),
+		mapping(std::move(other.mapping)) {
+		other.mapping.reset();
+	}
+
+	Us4OemDmaBuffer& operator=(Us4OemDmaBuffer&& other) noexcept {
+		if (this != &other) {
+			release();
+			Us4OemDriverObject::operator=(std::move(other));
+			bufferVa = std::exchange(other.bufferVa, nullptr);
+			bufferPa = std::exchange(other.bufferPa, 0);
+			bufferLength = std::exchange(other.bufferLength, 0);
+			mapping = std::move(other.mapping);
+			other.mapping.reset();
+		}
+		return *this;
+	}
+
+	~Us4OemDmaBuffer() {
+		release();
+	}
+
+	// Unmaps and deallocates now rather than on destruction
+	bool release() noexcept {
+		mapping.reset();
+
+		// Without a handle (the driver's table was full) it has to go by PA
+		if (file && driverHandle == US4OEM_INVALID_HANDLE && bufferPa != 0) {
+			bool released = ioctlNoThrow(US4OEM_WIN32_IOCTL_DEALLOCATE_DMA_CONTIGIOUS_BUFFER, &bufferPa, sizeof(bufferPa), nullptr, 0);
+			file.reset();
+			bufferPa = 0;
+			return released;
+		}
+
+		bufferPa = 0;
+		return releaseHandle();
+	}
+
+	// Maps the buffer into this process, once
+	const Us4OemMapping& map() {
+		if (!mapping) {
+			if (!file) {
+				throw std::logic_error("DMA buffer already released");
+			}
+			mapping = Us4OemMapping::mapDma(file, driverHandle, bufferVa);
+		}
+		return *mapping;
+	}
+
+	void* va() const { return bufferVa; } // Kernel VA, see map() for one that's usable here
+	unsigned long long pa() const { return bufferPa; }
+	unsigned long length() const { return bufferLength; }
+
+private:
+	void* bufferVa = nullptr;
+	unsigned long long bufferPa = 0;
+	unsigned long bufferLength = 0;
+	std::optional<Us4OemMapping> mapping;
+};
+
+// A scatter-gather DMA buffer (at most US4OEM_DMA_SG_MAX_SIZE), deallocated when this goes away. Mapped like
+// Us4OemDmaBuffer.
+class Us4OemSgBuffer : public Us4OemDriverObject {
+public:
+	Us4OemSgBuffer() = default;
+	Us4OemSgBuffer(Us4OemFileRef file, us4oem_handle handle, Us4OemDmaSgDescription description) :
+		Us4OemDriverObject(std::move(file), handle),
+		sg(std::move(description)) {}
+
+	Us4OemSgBuffer(Us4OemSgBuffer&& other) noexcept :
+		Us4OemDriverObject(std::move(other)),
+		sg(std::move(other.sg)),
+		mapping(std::move(other.mapping)) {
+		other.sg = {};
+		other.mapping.reset();
+	}
+
+	Us4OemSgBuffer& operator=(Us4OemSgBuffer&& other) noexcept {
+		if (this != &other) {
+			release();
+			Us4OemDriverObject::operator=(std::move(other));
+			sg = std::move(other.sg);
+			mapping = std::move(other.mapping);
+			other.sg = {};
+			other.mapping.reset();
+		}
+		return *this;
+	}
+
+	~Us4OemSgBuffer() {
+		release();
+	}
+
+	// Unmaps and deallocates now rather than on destruction
+	bool release() noexcept {
+		mapping.reset();
+
+		// Without a handle (the driver's table was full) it has to go by VA
+		if (file && driverHandle == US4OEM_INVALID_HANDLE && sg.va != nullptr) {
+			bool released = ioctlNoThrow(US4OEM_WIN32_IOCTL_DEALLOCATE_DMA_SG_BUFFER, &sg.va, sizeof(sg.va), nullptr, 0);
+			file.reset();
+			sg.va = nullptr;
+			return released;
+		}
+
+		sg.va = nullptr;
+		return releaseHandle();
+	}
+
+	// Maps the buffer into this process, once
+	const Us4OemMapping& map() {
+		if (!mapping) {
+			if (!file) {
+				throw std::logic_error("DMA buffer already released");
+			}
+			mapping = Us4OemMapping::mapDma(file, driverHandle, sg.va);
+		}
+		return *mapping;
+	}
+
+	// Leaves the buffer allocated but stops owning it, so it outlives this process through a lease (see
+	// Us4OemDevice::setLease). Unmapped here. Returns the handle to take it over by.
+	us4oem_handle detach() noexcept {
+		mapping.reset();
+		sg = {};
+		return Us4OemDriverObject::detach();
+	}
+
+	const Us4OemDmaSgDescription& description() const { return sg; }
+	void* va() const { return sg.va; } // Kernel VA, see map() for one that's usable here
+	size_t length() const { return sg.length; }
+	const std::vector<Us4OemDmaSgChunk>& chunks() const { return sg.chunks; }
+	Us4OemDmaSgIndex index() const { return Us4OemDmaSgIndex(sg); } // Offset to PA lookups, built on every call
+
+private:
+	Us4OemDmaSgDescription sg = {};
+	std::optional<Us4OemMapping> mapping;
+};
+
+// Scatter-gather buffers mapped back to back into one range of the process, so an allocation that had to be split
+// into several buffers (see Us4OemDevice::allocSgBuffers) reads as one flat array. Nothing is copied; each buffer
+// is its own mapping, unmapped when the view goes away. Made by Us4OemDevice::mapContiguous.
+class Us4OemContiguousView {
+public:
+	Us4OemContiguousView() = default;
+	Us4OemContiguousView(std::vector<Us4OemMapping> segments) : segments(std::move(segments)) {}
+
+	void* data() const { return segments.empty() ? nullptr : segments.front().address(); }
+
+	size_t length() const {
+		size_t total = 0;
+		for (const auto& segment : segments) {
+			total += segment.length();
+		}
+		return total;
+	}
+
+	template<typename T>
+	T* as() const { return static_cast<T*>(data()); }
+
+	// The mappings of the buffers, in order; each one starts where the previous one ends
+	const std::vector<Us4OemMapping>& getSegments() const { return segments; }
+
+	// Unmaps now rather than on destruction
+	void release() noexcept { segments.clear(); }
+
+private:
+	std::vector<Us4OemMapping> segments;
+};
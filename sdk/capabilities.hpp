@@ -0,0 +1,97 @@
+#pragma once
+
+#include "common.hpp"
+
+// Optional features and limits of the driver, as returned by Us4OemDevice::getCapabilities.
+// Drivers that predate US4OEM_WIN32_IOCTL_GET_CAPABILITIES report no optional features and the limits
+// from the headers the SDK was built with.
+class Us4OemCapabilities {
+public:
+	Us4OemCapabilities() {
+		raw.size = 0;
+		raw.features = 0;
+		raw.max_dma_contig_size = 0xFFFFFFFF;
+		raw.max_dma_sg_size = US4OEM_DMA_SG_MAX_SIZE;
+		raw.max_sg_chunks = 0; // Unknown
+		raw.page_size = 4 * KiB;
+		raw.max_batch_commands = US4OEM_BATCH_MAX_COMMANDS;
+		raw.max_reg_ops = US4OEM_REG_MAX_OPS;
+		raw.numa_node = US4OEM_NUMA_NODE_UNKNOWN;
+	}
+
+	Us4OemCapabilities(const us4oem_capabilities& capabilities) : raw(capabilities) {}
+
+	// True if the driver reported its capabilities, false if they were assumed for an older driver
+	bool isReported() const {
+		return raw.size != 0;
+	}
+
+	// True if all of the given US4OEM_CAPABILITY_* flags are set
+	bool has(unsigned long long features) const {
+		return (raw.features & features) == features;
+	}
+
+	unsigned long long maxDmaContigSize() const { return raw.max_dma_contig_size; }
+	unsigned long long maxDmaSgSize() const { return raw.max_dma_sg_size; }
+	unsigned long maxSgChunks() const { return raw.max_sg_chunks; } // 0 if unknown
+	unsigned long pageSize() const { return raw.page_size; }
+	unsigned long largePageSize() const { return raw.large_page_size; } // 0 if not used
+	unsigned long msiVectorCount() const { return raw.msi_vector_count; }
+	unsigned long maxBatchCommands() const { return raw.max_batch_commands; }
+	unsigned long maxRegisterOps() const { return raw.max_reg_ops; }
+	unsigned long numaNode() const { return raw.numa_node; } // US4OEM_NUMA_NODE_UNKNOWN if not known
+
+	std::string toString() const {
+		static const struct { unsigned long long flag; const char* name; } names[] = {
+			{ US4OEM_CAPABILITY_POLL_EX, "poll-ex" },
+			{ US4OEM_CAPABILITY_IRQ_MODERATION, "irq-moderation" },
+			{ US4OEM_CAPABILITY_IRQ_AFFINITY, "irq-affinity" },
+			{ US4OEM_CAPABILITY_LATENCY_STATS, "latency-stats" },
+			{ US4OEM_CAPABILITY_IOCTL_STATS, "ioctl-stats" },
+			{ US4OEM_CAPABILITY_QUEUE_STATS, "queue-stats" },
+			{ US4OEM_CAPABILITY_BATCH, "batch" },
+			{ US4OEM_CAPABILITY_REGISTER_ACCESS, "register-access" },
+			{ US4OEM_CAPABILITY_MSI, "msi" },
+			{ US4OEM_CAPABILITY_NUMA_NODE, "numa-node" },
+			{ US4OEM_CAPABILITY_EVENT_RING, "event-ring" },
+			{ US4OEM_CAPABILITY_TEARDOWN, "teardown" },
+			{ US4OEM_CAPABILITY_SHARED_STATS, "shared-stats" },
+			{ US4OEM_CAPABILITY_EXTENDED_STATS, "extended-stats" },
+			{ US4OEM_CAPABILITY_HANDLES, "handles" },
+			{ US4OEM_CAPABILITY_MMAP_AT_ADDRESS, "mmap-at-address" },
+			{ US4OEM_CAPABILITY_LEASE, "lease" },
+		};
+
+		std::string features;
+		for (const auto& name : names) {
+			if (has(name.flag)) {
+				features += features.empty() ? name.name : std::string(" ") + name.name;
+			}
+		}
+
+		return std::format("  Reported: {}\n"
+			"  Features: {}\n"
+			"  Max Contiguous DMA Size: {:#x}\n"
+			"  Max SG DMA Size: {:#x}\n"
+			"  Max SG Chunks: {}\n"
+			"  Page Size: {:#x} (large: {:#x})\n"
+			"  MSI Vectors: {}\n"
+			"  Max Batch Commands: {}\n"
+			"  Max Register Operations: {}\n"
+			"  NUMA Node: {}",
+			isReported() ? "yes" : "no (driver too old)",
+			features.empty() ? std::string("none") : features,
+			raw.max_dma_contig_size,
+			raw.max_dma_sg_size,
+			raw.max_sg_chunks,
+			raw.page_size,
+			raw.large_page_size,
+			raw.msi_vector_count,
+			raw.max_batch_commands,
+			raw.max_reg_ops,
+			raw.numa_node == US4OEM_NUMA_NODE_UNKNOWN ? std::string("unknown") : std::to_string(raw.numa_node));
+	}
+
+private:
+	us4oem_capabilities raw = {};
+};
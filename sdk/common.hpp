@@ -11,7 +11,7 @@
 #include <setupapi.h>
 //#include <devpkey.h> // TODO: Use new property names
 
-#include "../us4oem/Us4OemAPI.h"
+#include "api.hpp"
 
 // Standard size units
 const size_t KiB = 1024;
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define US4OEM_TARGET(features)
+#else
+#include <cpuid.h>
+#define US4OEM_TARGET(features) __attribute__((target(features)))
+#endif
+
+// Copies out of DMA buffers. Scatter-gather buffers come from cached pool, and the memory manager keeps that (WB)
+// caching for the process's mapping; contiguous buffers are mapped uncached (UC). MOVNTDQA only streams from
+// write-combining memory, so on both it's a plain load: on WB the kernels are about as fast as memcpy, on UC
+// what helps is width, as every load is a bus transaction of its own and a 64-byte load needs a quarter of the
+// transactions of 16 bytes. The stores are non-temporal either way, so frames don't evict the destination's working
+// set. Only standard headers and intrinsics are used, so the kernels can be benchmarked on any x64 OS.
+
+enum class Us4OemCopyKernel {
+	Scalar, // memcpy
+	Sse41, // 16-byte loads (MOVNTDQA) and non-temporal stores
+	Avx2, // 32-byte
+	Avx512, // 64-byte
+};
+
+inline const char* us4oemCopyKernelName(Us4OemCopyKernel kernel) {
+	switch (kernel) {
+	case Us4OemCopyKernel::Sse41: return "SSE4.1";
+	case Us4OemCopyKernel::Avx2: return "AVX2";
+	case Us4OemCopyKernel::Avx512: return "AVX-512";
+	default: return "scalar";
+	}
+}
+
+// One copy, see Us4OemCopyEngine::copy
+struct Us4OemCopyResult {
+	size_t bytes = 0;
+	std::chrono::nanoseconds elapsed{ 0 };
+	Us4OemCopyKernel kernel = Us4OemCopyKernel::Scalar;
+	unsigned threads = 1;
+
+	double gibPerSecond() const {
+		double seconds = std::chrono::duration<double>(elapsed).count();
+		return seconds > 0 ? double(bytes) / double(1ull << 30) / seconds : 0.0;
+	}
+};
+
+inline void us4oemCpuid(int leaf, int subleaf, int regs[4]) {
+#ifdef _MSC_VER
+	__cpuidex(regs, leaf, subleaf);
+#else
+	unsigned a, b, c, d;
+	__cpuid_count(leaf, subleaf, a, b, c, d);
+	regs[0] = (int)a; regs[1] = (int)b; regs[2] = (int)c; regs[3] = (int)d;
+#endif
+}
+
+// XCR0, which says what register state the OS saves on context switches
+US4OEM_TARGET("xsave")
+inline unsigned long long us4oemXcr0() {
+	return _xgetbv(0);
+}
+
+// Copies the head (until src is aligned to Width) and returns how far it got
+template<size_t Width>
+inline size_t us4oemCopyAlignSource(unsigned char* dst, const unsigned char* src, size_t length) {
+	size_t head = (Width - (reinterpret_cast<uintptr_t>(src) & (Width - 1))) & (Width - 1);
+	head = std::min(head, length);
+	std::memcpy(dst, src, head);
+	return head;
+}
+
+US4OEM_TARGET("sse4.1")
+inline void us4oemCopySse41(void* destination, const void* source, size_t length) {
+	auto dst = static_cast<unsigned char*>(destination);
+	auto src = static_cast<const unsigned char*>(source);
+	size_t done = us4oemCopyAlignSource<16>(dst, src, length);
+	bool streamStores = ((reinterpret_cast<uintptr_t>(dst) + done) & 15) == 0;
+
+	// Four loads in flight fill a whole line before anything is stored
+	for (; done + 64 <= length; done += 64) {
+		__m128i* in = (__m128i*)(src + done);
+		__m128i a = _mm_stream_load_si128(in);
+		__m128i b = _mm_stream_load_si128(in + 1);
+		__m128i c = _mm_stream_load_si128(in + 2);
+		__m128i d = _mm_stream_load_si128(in + 3);
+		__m128i* out = (__m128i*)(dst + done);
+		if (streamStores) {
+			_mm_stream_si128(out, a); _mm_stream_si128(out + 1, b); _mm_stream_si128(out + 2, c); _mm_stream_si128(out + 3, d);
+		} else {
+			_mm_storeu_si128(out, a); _mm_storeu_si128(out + 1, b); _mm_storeu_si128(out + 2, c); _mm_storeu_si128(out + 3, d);
+		}
+	}
+
+	_mm_sfence();
+	std::memcpy(dst + done, src + done, length - done);
+}
+
+US4OEM_TARGET("avx2")
+inline void us4oemCopyAvx2(void* destination, const void* source, size_t length) {
+	auto dst = static_cast<unsigned char*>(destination);
+	auto src = static_cast<const unsigned char*>(source);
+	size_t done = us4oemCopyAlignSource<32>(dst, src, length);
+	bool streamStores = ((reinterpret_cast<uintptr_t>(dst) + done) & 31) == 0;
+
+	for (; done + 128 <= length; done += 128) {
+		__m256i* in = (__m256i*)(src + done);
+		__m256i a = _mm256_stream_load_si256(in);
+		__m256i b = _mm256_stream_load_si256(in + 1);
+		__m256i c = _mm256_stream_load_si256(in + 2);
+		__m256i d = _mm256_stream_load_si256(in + 3);
+		__m256i* out = (__m256i*)(dst + done);
+		if (streamStores) {
+			_mm256_stream_si256(out, a); _mm256_stream_si256(out + 1, b); _mm256_stream_si256(out + 2, c); _mm256_stream_si256(out + 3, d);
+		} else {
+			_mm256_storeu_si256(out, a); _mm256_storeu_si256(out + 1, b); _mm256_storeu_si256(out + 2, c); _mm256_storeu_si256(out + 3, d);
+		}
+	}
+
+	_mm_sfence();
+	_mm256_zeroupper();
+	std::memcpy(dst + done, src + done, length - done);
+}
+
+US4OEM_TARGET("avx512f")
+inline void us4oemCopyAvx512(void* destination, const void* source, size_t length) {
+	auto dst = static_cast<unsigned char*>(destination);
+	auto src = static_cast<const unsigned char*>(source);
+	size_t done = us4oemCopyAlignSource<64>(dst, src, length);
+	bool streamStores = ((reinterpret_cast<uintptr_t>(dst) + done) & 63) == 0;
+
+	for (; done + 256 <= length; done += 256) {
+		__m512i* in = (__m512i*)(src + done);
+		__m512i a = _mm512_stream_load_si512(in);
+		__m512i b = _mm512_stream_load_si512(in + 1);
+		__m512i c = _mm512_stream_load_si512(in + 2);
+		__m512i d = _mm512_stream_load_si512(in + 3);
+		__m512i* out = (__m512i*)(dst + done);
+		if (streamStores) {
+			_mm512_stream_si512(out, a); _mm512_stream_si512(out + 1, b); _mm512_stream_si512(out + 2, c); _mm512_stream_si512(out + 3, d);
+		} else {
+			_mm512_storeu_si512(out, a); _mm512_storeu_si512(out + 1, b); _mm512_storeu_si512(out + 2, c); _mm512_storeu_si512(out + 3, d);
+		}
+	}
+
+	_mm_sfence();
+	_mm256_zeroupper();
+	std::memcpy(dst + done, src + done, length - done);
+}
+
+// Copies with the fastest kernel the CPU (and OS) supports, optionally split across threads.
+class Us4OemCopyEngine {
+public:
+	// threads: most threads a copy is split across; minBytesPerThread: below this a thread isn't worth starting
+	explicit Us4OemCopyEngine(Us4OemCopyKernel kernel = best(), unsigned threads = 1, size_t minBytesPerThread = 4 * 1024 * 1024) :
+		kernel(supported(kernel) ? kernel : best()),
+		threads(std::max(threads, 1u)),
+		minBytesPerThread(std::max<size_t>(minBytesPerThread, 4096)) {}
+
+	static bool supported(Us4OemCopyKernel kernel) {
+		const Features& features = cpu();
+		switch (kernel) {
+		case Us4OemCopyKernel::Sse41: return features.sse41;
+		case Us4OemCopyKernel::Avx2: return features.avx2;
+		case Us4OemCopyKernel::Avx512: return features.avx512;
+		default: return true;
+		}
+	}
+
+	static Us4OemCopyKernel best() {
+		for (Us4OemCopyKernel kernel : { Us4OemCopyKernel::Avx512, Us4OemCopyKernel::Avx2, Us4OemCopyKernel::Sse41 }) {
+			if (supported(kernel)) {
+				return kernel;
+			}
+		}
+		return Us4OemCopyKernel::Scalar;
+	}
+
+	Us4OemCopyKernel getKernel() const {
+		return kernel;
+	}
+
+	// Copies length bytes, the areas must not overlap. Large copies are split into page-aligned parts, one per thread;
+	// the calling thread copies the first one.
+	Us4OemCopyResult copy(void* destination, const void* source, size_t length) const {
+		Us4OemCopyResult result;
+		result.bytes = length;
+		result.kernel = kernel;
+		result.threads = (unsigned)std::clamp<size_t>(length / minBytesPerThread, 1, threads);
+
+		auto start = std::chrono::steady_clock::now();
+
+		if (result.threads == 1) {
+			copyWith(kernel, destination, source, length);
+		} else {
+			// Parts are whole pages, so every part starts as aligned as the source
+			size_t part = ((length / result.threads) + 4095) & ~size_t(4095);
+			result.threads = (unsigned)((length + part - 1) / part);
+			std::vector<std::jthread> helpers;
+			helpers.reserve(result.threads - 1);
+
+			for (size_t offset = part; offset < length; offset += part) {
+				size_t partLength = std::min(part, length - offset);
+				helpers.emplace_back([this, destination, source, offset, partLength]() {
+					copyWith(kernel, static_cast<unsigned char*>(destination) + offset,
+						static_cast<const unsigned char*>(source) + offset, partLength);
+				});
+			}
+
+			copyWith(kernel, destination, source, std::min(part, length));
+			helpers.clear(); // Joins
+		}
+
+		result.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+		return result;
+	}
+
+	static void copyWith(Us4OemCopyKernel kernel, void* destination, const void* source, size_t length) {
+		switch (kernel) {
+		case Us4OemCopyKernel::Sse41:
+			us4oemCopySse41(destination, source, length);
+			break;
+		case Us4OemCopyKernel::Avx2:
+			us4oemCopyAvx2(destination, source, length);
+			break;
+		case Us4OemCopyKernel::Avx512:
+			us4oemCopyAvx512(destination, source, length);
+			break;
+		default:
+			std::memcpy(destination, source, length);
+			break;
+		}
+	}
+
+private:
+	struct Features {
+		bool sse41 = false;
+		bool avx2 = false;
+		bool avx512 = false;
+	};
+
+	// Read once
+	static const Features& cpu() {
+		static const Features features = []() {
+			Features f;
+			int regs[4];
+
+			us4oemCpuid(0, 0, regs);
+			int maxLeaf = regs[0];
+
+			us4oemCpuid(1, 0, regs);
+			f.sse41 = (regs[2] & (1 << 19)) != 0;
+			bool osxsave = (regs[2] & (1 << 27)) != 0;
+			bool avx = (regs[2] & (1 << 28)) != 0;
+
+			// The OS has to save the YMM (bits 1-2) and ZMM (bits 5-7) state too
+			unsigned long long xcr0 = osxsave ? us4oemXcr0() : 0;
+			bool ymm = avx && (xcr0 & 0x6) == 0x6;
+			bool zmm = ymm && (xcr0 & 0xE0) == 0xE0;
+
+			if (maxLeaf >= 7) {
+				us4oemCpuid(7, 0, regs);
+				f.avx2 = ymm && (regs[1] & (1 << 5)) != 0;
+				f.avx512 = zmm && (regs[1] & (1 << 16)) != 0;
+			}
+
+			return f;
+		}();
+
+		return features;
+	}
+
+	Us4OemCopyKernel kernel;
+	unsigned threads;
+	size_t minBytesPerThread;
+};
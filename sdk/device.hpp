@@ -1,7 +1,20 @@
 #pragma once
 
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+
 #include "devicelocation.hpp"
 #include "sg.hpp"
+#include "sglayout.hpp"
+#include "latency.hpp"
+#include "batch.hpp"
+#include "regsequence.hpp"
+#include "capabilities.hpp"
+#include "events.hpp"
+#include "buffers.hpp"
+#include "error.hpp"
 #include "common.hpp"
 
 // This is ~awful and unsafe~, but in the specific use below it's basically the only way to
@@ -14,6 +27,15 @@ concept NullablePtr = (std::is_pointer_v<T> || std::is_null_pointer_v<T>) && !st
 // only seem to use about ~4000 in worst case scenario so this gives us a good margin.
 const size_t US4OEM_SG_ALLOC_MAX_CHUNKS = 8192;
 
+// Result of Us4OemDevice::pollFor
+struct Us4OemPollResult {
+	unsigned long long consumed = 0; // IRQs consumed by the call, 0 if it timed out
+	unsigned long long remaining = 0; // IRQs still pending afterwards
+	Us4OemPollTimestamps timestamps;
+
+	bool timedOut() const { return consumed == 0; }
+};
+
 class Us4OemDevice {
 public:
 	Us4OemDevice(const Us4OemDeviceLocation& loc) :
@@ -38,7 +60,7 @@ public:
 		size_t lengthMapped; // Length of the mapped area
 	};
 
-	// Opens the device
+	// Opens the device and reads the driver's capabilities, see getCapabilities.
 	bool open() {
 		if (isHandleOpen) {
 			return true; // Already open
@@ -52,8 +74,13 @@ public:
 			0,
 			NULL);
 
-		
-		return isHandleOpen = deviceHandle != INVALID_HANDLE_VALUE;
+		isHandleOpen = deviceHandle != INVALID_HANDLE_VALUE;
+		if (isHandleOpen) {
+			file = Us4OemFileRef(deviceHandle, CloseHandle);
+			capabilities = readCapabilities();
+		}
+
+		return isHandleOpen;
 	}
 
 	bool isOpen() {
@@ -61,9 +88,10 @@ public:
 	}
 
 	// Closes the device handle.
+	// NOTE: Us4OemDmaBuffer, Us4OemSgBuffer and Us4OemMapping keep the file open until they're gone too.
 	void close() {
 		if (isHandleOpen) {
-			CloseHandle(deviceHandle);
+			file.reset();
 			deviceHandle = INVALID_HANDLE_VALUE;
 			isHandleOpen = false;
 		}
@@ -83,6 +111,12 @@ public:
 		return ((getDriverVersion() & UPPER_24_BITS) == (US4OEM_DRIVER_VERSION & UPPER_24_BITS));
 	}
 
+	// Optional features and limits of the driver, read once when the device is opened.
+	// The SDK uses these to pick the fastest way of doing things the driver supports.
+	const Us4OemCapabilities& getCapabilities() const {
+		return capabilities;
+	}
+
 	// Retrieves the driver version.
 	unsigned long getDriverVersion() {
 		us4oem_driver_info driverInfo = {};
@@ -111,63 +145,268 @@ public:
 			throw std::range_error("Only BAR 0 and 4 are supported!");
 		}
 
+		return unwrap(tryMapBar(bar));
+	}
+
+	Us4OemResult<MemoryMapping> tryMapBar(int bar) noexcept {
+		if (bar != 0 && bar != 4) {
+			return std::unexpected(Us4OemError::fromWin32(ERROR_INVALID_PARAMETER, "Mapping a BAR other than 0 or 4"));
+		}
+
 		us4oem_mmap_argument arg = {};
 		arg.area = (bar == 0) ? MMAP_AREA_BAR_0 : MMAP_AREA_BAR_4;
 		arg.length_limit = 0; // Map the whole area
 		// arg.va is ignored for BARs
 
-		us4oem_mmap_response response = {};
-		ioctl(US4OEM_WIN32_IOCTL_MMAP, &arg, &response);
-
-		if (response.address == NULL) {
-			throw std::runtime_error("Failed to map BAR " + std::to_string(bar));
-		}
-
-		return { response.address, response.length_mapped };
+		return tryMap(arg, "Mapping a BAR");
 	}
 
 	// Map DMA buffer to userspace.
 	MemoryMapping mapDmaBuf(void* va, unsigned long length_limit = 0) {
+		return unwrap(tryMapDmaBuf(va, length_limit));
+	}
+
+	Us4OemResult<MemoryMapping> tryMapDmaBuf(void* va, unsigned long length_limit = 0) noexcept {
 		us4oem_mmap_argument arg = {};
 		arg.area = MMAP_AREA_DMA;
 		arg.va = va;
 		arg.length_limit = length_limit;
 
-		us4oem_mmap_response response = {};
+		return tryMap(arg, "Mapping a DMA buffer");
+	}
+
+	// Map BAR 0/4 to userspace, unmapped when the returned mapping goes away.
+	Us4OemMapping mapBarOwned(int bar) {
+		if (bar != 0 && bar != 4) {
+			throw std::range_error("Only BAR 0 and 4 are supported!");
+		}
 
+		us4oem_mmap_argument arg = {};
+		arg.area = (bar == 0) ? MMAP_AREA_BAR_0 : MMAP_AREA_BAR_4;
+		arg.length_limit = 0; // Map the whole area
+
+		us4oem_mmap_response response = {};
 		ioctl(US4OEM_WIN32_IOCTL_MMAP, &arg, &response);
 
 		if (response.address == NULL) {
-			throw std::runtime_error("Failed to map DMA buffer");
+			throw std::runtime_error("Failed to map BAR " + std::to_string(bar));
 		}
 
-		return { response.address, response.length_mapped };
+		return Us4OemMapping(file, response);
 	}
 
-	// Read stats
+	// Read stats. Comes from the shared statistics page if the driver has one (no system call once it's mapped),
+	// otherwise from US4OEM_WIN32_IOCTL_READ_STATS.
 	Us4OemDeviceStats readStats() {
+		return unwrap(tryReadStats());
+	}
+
+	Us4OemResult<Us4OemDeviceStats> tryReadStats() noexcept {
+		if (capabilities.has(US4OEM_CAPABILITY_SHARED_STATS)) {
+			auto page = tryMapSharedStats();
+			if (!page) {
+				return std::unexpected(page.error());
+			}
+			return Us4OemDeviceStats((*page)->read());
+		}
+
 		us4oem_stats stats = {};
 
-		ioctl(US4OEM_WIN32_IOCTL_READ_STATS, nullptr, &stats);
+		auto result = tryIoctl(US4OEM_WIN32_IOCTL_READ_STATS, nullptr, &stats);
+		if (!result) {
+			return std::unexpected(result.error());
+		}
 
 		return Us4OemDeviceStats(stats);
 	}
 
+	// Maps the driver's statistics page read-only into the process. Mapped once, later calls return the same reader;
+	// the mapping stays valid after close() (the page lives as long as the device).
+	const Us4OemSharedStats& mapSharedStats() {
+		return *unwrap(tryMapSharedStats());
+	}
+
+	Us4OemResult<const Us4OemSharedStats*> tryMapSharedStats() noexcept {
+		if (!sharedStats) {
+			if (!capabilities.has(US4OEM_CAPABILITY_SHARED_STATS)) {
+				return std::unexpected(Us4OemError::fromWin32(ERROR_NOT_SUPPORTED, "Mapping the shared statistics page"));
+			}
+
+			us4oem_mmap_argument arg = {};
+			arg.area = MMAP_AREA_STATS;
+			arg.length_limit = 0; // The whole page
+
+			auto mapping = tryMap(arg, "Mapping the shared statistics page");
+			if (!mapping) {
+				return std::unexpected(mapping.error());
+			}
+
+			sharedStats.emplace(static_cast<const us4oem_shared_stats*>(mapping->address));
+		}
+
+		return &*sharedStats;
+	}
+
+	// Read the gauges and rates (bytes pinned and mapped, IRQ rate, polls in flight, per-IOCTL counts).
+	// Take two snapshots and use Us4OemExtendedStats::delta for rates over an interval.
+	Us4OemExtendedStats readExtendedStats() {
+		if (!capabilities.has(US4OEM_CAPABILITY_EXTENDED_STATS)) {
+			throw std::runtime_error("Extended statistics are not supported by the driver");
+		}
+
+		us4oem_extended_stats stats = {};
+
+		ioctl(US4OEM_WIN32_IOCTL_READ_EXTENDED_STATS, nullptr, &stats);
+
+		return Us4OemExtendedStats(stats);
+	}
+
+	// Read per-IOCTL call counts and handler times
+	Us4OemIoctlStats readIoctlStats() {
+		us4oem_ioctl_stats stats = {};
+
+		ioctl(US4OEM_WIN32_IOCTL_READ_IOCTL_STATS, nullptr, &stats);
+
+		return Us4OemIoctlStats(stats);
+	}
+
+	// Read request counts, depths and wait times of the driver's queues
+	Us4OemQueueStats readQueueStats() {
+		us4oem_queue_stats stats = {};
+
+		ioctl(US4OEM_WIN32_IOCTL_READ_QUEUE_STATS, nullptr, &stats);
+
+		return Us4OemQueueStats(stats);
+	}
+
+	// Selects the driver events to record from now on: US4OEM_EVENT_MASK() bits, US4OEM_EVENT_MASK_ALL for all of them,
+	// 0 to stop recording (the default). Recording is cheap enough to leave on, see readEvents.
+	bool setEventMask(unsigned long mask) {
+		if (!capabilities.has(US4OEM_CAPABILITY_EVENT_RING)) {
+			throw std::runtime_error("Event recording is not supported by the driver");
+		}
+
+		return ioctl(US4OEM_WIN32_IOCTL_SET_EVENT_MASK, &mask, nullptr);
+	}
+
+	// Reads the most recent events (up to US4OEM_EVENT_RING_SIZE per processor) recorded by the driver.
+	Us4OemEventTrace readEvents() {
+		if (!capabilities.has(US4OEM_CAPABILITY_EVENT_RING)) {
+			throw std::runtime_error("Event recording is not supported by the driver");
+		}
+
+		Us4OemEventTrace trace;
+		auto ring = std::make_unique<us4oem_event_ring>(); // A few KiB, keep it off the stack
+		unsigned long processorCount = 1; // Known after the first read
+
+		for (unsigned long processor = 0; processor < processorCount; processor++) {
+			us4oem_event_read_argument arg = {};
+			arg.processor = processor;
+
+			ioctl(US4OEM_WIN32_IOCTL_READ_EVENTS, &arg, ring.get());
+
+			processorCount = ring->processor_count;
+			trace.add(processor, *ring);
+		}
+
+		return trace;
+	}
+
 	// Polls the device for pending IRQs. Note: BLOCKS THREAD UNTIL AN IRQ IS RECEIVED, IF NONE ARE PENDING.
 	bool poll() {
-		return ioctl(US4OEM_WIN32_IOCTL_POLL, nullptr, nullptr);
+		unwrap(tryPoll());
+		return true;
+	}
+
+	Us4OemResult<void> tryPoll() noexcept {
+		return tryIoctl(US4OEM_WIN32_IOCTL_POLL, nullptr, nullptr);
+	}
+
+	// Same as poll(), but also returns the timestamps of the IRQ that completed it.
+	// Note: BLOCKS THREAD UNTIL AN IRQ IS RECEIVED, IF NONE ARE PENDING.
+	Us4OemPollTimestamps pollWithTimestamps() {
+		return unwrap(tryPollWithTimestamps());
+	}
+
+	Us4OemResult<Us4OemPollTimestamps> tryPollWithTimestamps() noexcept {
+		us4oem_poll_response response = {};
+
+		auto result = tryIoctl(US4OEM_WIN32_IOCTL_POLL, nullptr, &response);
+		if (!result) {
+			return std::unexpected(result.error());
+		}
+
+		LARGE_INTEGER wake;
+		QueryPerformanceCounter(&wake);
+
+		return Us4OemPollTimestamps(response, wake.QuadPart);
+	}
+
+	// Waits up to timeout for pending IRQs and consumes up to maxEvents of them (0 for all) in a single call.
+	// A zero timeout never blocks; timeouts of 2^32 us (~71 min) or longer wait forever.
+	// Timing out is not an error, check Us4OemPollResult::timedOut.
+	template<class Rep, class Period>
+	Us4OemPollResult pollFor(std::chrono::duration<Rep, Period> timeout, unsigned long maxEvents = 0) {
+		return unwrap(tryPollFor(timeout, maxEvents));
+	}
+
+	template<class Rep, class Period>
+	Us4OemResult<Us4OemPollResult> tryPollFor(std::chrono::duration<Rep, Period> timeout, unsigned long maxEvents = 0) noexcept {
+		if (!capabilities.has(US4OEM_CAPABILITY_POLL_EX)) {
+			return std::unexpected(Us4OemError::fromWin32(ERROR_NOT_SUPPORTED, "Polling with a timeout"));
+		}
+
+		auto timeoutUs = std::chrono::ceil<std::chrono::microseconds>(timeout).count();
+
+		us4oem_poll_ex_argument arg = {};
+		arg.timeout_us = timeoutUs >= US4OEM_POLL_TIMEOUT_INFINITE ?
+			US4OEM_POLL_TIMEOUT_INFINITE : static_cast<unsigned long>(std::max<decltype(timeoutUs)>(timeoutUs, 0));
+		arg.max_events = maxEvents;
+
+		us4oem_poll_ex_response response = {};
+		auto status = tryIoctl(US4OEM_WIN32_IOCTL_POLL_EX, &arg, &response);
+		if (!status) {
+			return std::unexpected(status.error());
+		}
+
+		LARGE_INTEGER wake;
+		QueryPerformanceCounter(&wake);
+
+		Us4OemPollResult result;
+		result.consumed = response.consumed;
+		result.remaining = response.remaining;
+		result.timestamps = Us4OemPollTimestamps(response.timestamps, wake.QuadPart);
+		return result;
+	}
+
+	// Read the driver's IRQ latency histograms
+	Us4OemLatencyReport readLatencyStats() {
+		us4oem_latency_stats stats = {};
+
+		ioctl(US4OEM_WIN32_IOCTL_READ_LATENCY_STATS, nullptr, &stats);
+
+		return Us4OemLatencyReport(stats);
 	}
 
 	// Non-blocking poll for pending IRQs. Returns true if an IRQ is pending, false otherwise.
+	// Throws on real failures only, such as the device being gone.
 	bool pollNonBlocking() {
-		try {
-			ioctl(US4OEM_WIN32_IOCTL_POLL_NONBLOCKING, nullptr, nullptr);
+		return unwrap(tryPollNonBlocking());
+	}
+
+	// Same as pollNonBlocking(), without exceptions. No IRQ pending is not an error.
+	Us4OemResult<bool> tryPollNonBlocking() noexcept {
+		auto result = tryIoctl(US4OEM_WIN32_IOCTL_POLL_NONBLOCKING, nullptr, nullptr);
+		if (result) {
 			return true; // IRQ is pending
 		}
-		catch (const std::runtime_error&) {
-			// TODO: Handle other errors
+
+		// The driver completes with STATUS_DEVICE_BUSY when nothing is pending
+		if (result.error().win32Error == ERROR_BUSY) {
 			return false;
 		}
+
+		return std::unexpected(result.error());
 	}
 
 	// Clears all pending IRQs. Note: this does not complete any poll requests.
@@ -175,24 +414,69 @@ public:
 		return ioctl<nullptr_t,nullptr_t>(US4OEM_WIN32_IOCTL_CLEAR_PENDING, nullptr, nullptr);
 	}
 
+	// Enables interrupt moderation: a blocking poll completes once maxIrqs IRQs are pending, or maxDelay after
+	// the first of them, and consumes all of them at once (see Us4OemPollTimestamps::coalesced).
+	// Pass US4OEM_IRQ_MODERATION_UNLIMITED as maxIrqs for a time limit only, or a zero maxDelay for a count limit only.
+	bool setIrqModeration(unsigned long maxIrqs, std::chrono::microseconds maxDelay) {
+		if (maxIrqs == US4OEM_IRQ_MODERATION_UNLIMITED && maxDelay.count() == 0) {
+			throw std::invalid_argument("IRQ moderation needs at least a count or a time limit");
+		}
+
+		us4oem_irq_moderation_argument arg = {};
+		arg.max_irqs = maxIrqs;
+		arg.max_delay_us = static_cast<unsigned long>(maxDelay.count());
+
+		return ioctl(US4OEM_WIN32_IOCTL_SET_IRQ_MODERATION, &arg, nullptr);
+	}
+
+	// Pins the interrupt DPC to a processor (US4OEM_PROCESSOR_ANY to un-pin it) and sets its importance
+	// (US4OEM_DPC_IMPORTANCE_*). Takes effect immediately.
+	bool setDpcAffinity(unsigned long targetProcessor, unsigned long importance = US4OEM_DPC_IMPORTANCE_MEDIUM) {
+		us4oem_irq_affinity_argument arg = {};
+		arg.flags = US4OEM_IRQ_AFFINITY_SET_DPC;
+		arg.dpc_target_processor = targetProcessor;
+		arg.dpc_importance = importance;
+
+		return ioctl(US4OEM_WIN32_IOCTL_SET_IRQ_AFFINITY, &arg, nullptr);
+	}
+
+	// Restricts the interrupt to the given processors (0 to let Windows decide).
+	// NOTE: stored in the registry, takes effect the next time the device is started (e.g. disabled and re-enabled).
+	bool setInterruptAffinity(unsigned long long processorMask) {
+		us4oem_irq_affinity_argument arg = {};
+		arg.flags = US4OEM_IRQ_AFFINITY_SET_INTERRUPT;
+		arg.interrupt_affinity = processorMask;
+
+		return ioctl(US4OEM_WIN32_IOCTL_SET_IRQ_AFFINITY, &arg, nullptr);
+	}
+
+	// Disables interrupt moderation, every blocking poll consumes a single IRQ again.
+	bool disableIrqModeration() {
+		return setIrqModeration(1, std::chrono::microseconds(0));
+	}
+
 	// Alloc contiguous DMA buffer.
 	VirtualAndPhysicalAddress allocDmaContig(unsigned long length) {
-		us4oem_dma_contiguous_buffer_response response = {};
-		us4oem_dma_allocation_argument arg = {};
-		arg.length = length;
-
-		ioctl(US4OEM_WIN32_IOCTL_ALLOCATE_DMA_CONTIGIOUS_BUFFER, &arg, &response);
+		return unwrap(tryAllocDmaContig(length));
+	}
 
-		if (response.va == NULL) {
-			throw std::runtime_error("Failed to allocate contiguous DMA buffer");
+	Us4OemResult<VirtualAndPhysicalAddress> tryAllocDmaContig(unsigned long length) noexcept {
+		auto response = tryAllocDmaContigRaw(length);
+		if (!response) {
+			return std::unexpected(response.error());
 		}
 
-		return { response.va, response.pa };
+		return VirtualAndPhysicalAddress{ response->va, response->pa };
 	}
 
 	// Dealloc contiguous DMA buffer.
 	bool deallocDmaContig(unsigned long long pa) {
-		return ioctl(US4OEM_WIN32_IOCTL_DEALLOCATE_DMA_CONTIGIOUS_BUFFER, &pa, nullptr);
+		unwrap(tryDeallocDmaContig(pa));
+		return true;
+	}
+
+	Us4OemResult<void> tryDeallocDmaContig(unsigned long long pa) noexcept {
+		return tryIoctl(US4OEM_WIN32_IOCTL_DEALLOCATE_DMA_CONTIGIOUS_BUFFER, &pa, nullptr);
 	}
 
 	// Allocates a scatter-gather DMA buffer.
@@ -201,20 +485,25 @@ public:
 	void allocDmaScatterGather(size_t length,
 		std::vector<Us4OemDmaSgDescription>& description) {
 
-		size_t requests_needed = (size_t)std::ceil((double)length / (double)US4OEM_DMA_SG_MAX_SIZE);
+		// Newer drivers tell us their limits, so the response buffer doesn't have to be bigger than needed
+		const unsigned long max_size = (unsigned long)std::min<unsigned long long>(capabilities.maxDmaSgSize(), US4OEM_DMA_SG_MAX_SIZE);
+		const unsigned long max_chunks = capabilities.maxSgChunks() != 0 ?
+			(unsigned long)std::min<size_t>(capabilities.maxSgChunks(), US4OEM_SG_ALLOC_MAX_CHUNKS) : (unsigned long)US4OEM_SG_ALLOC_MAX_CHUNKS;
+
+		size_t requests_needed = (size_t)std::ceil((double)length / (double)max_size);
 
 		description.reserve(requests_needed);
 
-		unsigned long needed_size = US4OEM_DMA_SG_RESPONSE_NEEDED_SIZE(US4OEM_SG_ALLOC_MAX_CHUNKS);
+		unsigned long needed_size = US4OEM_DMA_SG_RESPONSE_NEEDED_SIZE(max_chunks);
 
 		auto response = (us4oem_dma_scatter_gather_buffer_response*)malloc(needed_size);
 
 		for (size_t i = 0; i < requests_needed; i++) {
 			unsigned long chunk_length = i == requests_needed - 1 ?
-				(unsigned long)(length - (i * US4OEM_DMA_SG_MAX_SIZE)) : US4OEM_DMA_SG_MAX_SIZE;
+				(unsigned long)(length - (i * max_size)) : max_size;
 			us4oem_dma_allocation_argument arg = {};
 			arg.length = chunk_length;
-			arg.max_chunks = US4OEM_SG_ALLOC_MAX_CHUNKS;
+			arg.max_chunks = max_chunks;
 
 			// Use raw ioctl as the template can only deduce the size of const types.
 			try {
@@ -235,20 +524,7 @@ public:
 				return;
 			}
 
-			description.push_back(Us4OemDmaSgDescription());
-			auto& desc = description.back();
-			desc.va = response->va;
-
-			desc.chunks.reserve(response->chunk_count);
-
-			for (unsigned int j = 0; j < response->chunk_count; j++) {
-				desc.length += response->chunks[j].length;
-				desc.chunks.push_back({
-					desc.length, // VA offset from the top
-					response->chunks[j].pa,  // Physical address of the chunk
-					response->chunks[j].length // Length of the chunk
-					});
-			}
+			description.push_back(describeSg(*response));
 		}
 
 		return;
@@ -276,6 +552,163 @@ public:
 		return true;
 	}
 
+	// Allocates a contiguous DMA buffer, deallocated when the returned buffer goes away.
+	Us4OemDmaBuffer allocDmaBuffer(unsigned long length) {
+		return unwrap(tryAllocDmaBuffer(length));
+	}
+
+	Us4OemResult<Us4OemDmaBuffer> tryAllocDmaBuffer(unsigned long length) noexcept {
+		if (!capabilities.has(US4OEM_CAPABILITY_HANDLES)) {
+			return std::unexpected(Us4OemError::fromWin32(ERROR_NOT_SUPPORTED, "Allocating an owned DMA buffer"));
+		}
+
+		auto response = tryAllocDmaContigRaw(length);
+		if (!response) {
+			return std::unexpected(response.error());
+		}
+
+		return Us4OemDmaBuffer(file, *response, length);
+	}
+
+	// Allocates a single scatter-gather DMA buffer of at most US4OEM_DMA_SG_MAX_SIZE (or the driver's limit),
+	// deallocated when the returned buffer goes away.
+	Us4OemSgBuffer allocSgBuffer(unsigned long length) {
+		requireHandles();
+
+		const unsigned long max_chunks = capabilities.maxSgChunks() != 0 ?
+			(unsigned long)std::min<size_t>(capabilities.maxSgChunks(), US4OEM_SG_ALLOC_MAX_CHUNKS) : (unsigned long)US4OEM_SG_ALLOC_MAX_CHUNKS;
+		const unsigned long needed_size = US4OEM_DMA_SG_RESPONSE_NEEDED_SIZE(max_chunks);
+
+		std::vector<unsigned char> buffer(needed_size);
+		auto response = reinterpret_cast<us4oem_dma_scatter_gather_buffer_response*>(buffer.data());
+
+		us4oem_dma_allocation_argument arg = {};
+		arg.length = length;
+		arg.max_chunks = max_chunks;
+
+		ioctlRaw(US4OEM_WIN32_IOCTL_ALLOCATE_DMA_SG_BUFFER, &arg, sizeof(arg), response, needed_size);
+
+		if (response->chunk_count == 0) {
+			throw std::runtime_error("Failed to allocate scatter-gather DMA buffer");
+		}
+
+		return Us4OemSgBuffer(file, response->handle, describeSg(*response));
+	}
+
+	// Allocates scatter-gather DMA buffers, split the same way as allocDmaScatterGather.
+	// If one of the allocations fails, the ones made so far are released before throwing.
+	std::vector<Us4OemSgBuffer> allocSgBuffers(size_t length) {
+		const unsigned long max_size = (unsigned long)std::min<unsigned long long>(capabilities.maxDmaSgSize(), US4OEM_DMA_SG_MAX_SIZE);
+		const size_t requests_needed = (size_t)std::ceil((double)length / (double)max_size);
+
+		std::vector<Us4OemSgBuffer> buffers;
+		buffers.reserve(requests_needed);
+
+		for (size_t i = 0; i < requests_needed; i++) {
+			unsigned long chunk_length = i == requests_needed - 1 ?
+				(unsigned long)(length - (i * max_size)) : max_size;
+
+			buffers.push_back(allocSgBuffer(chunk_length));
+		}
+
+		return buffers;
+	}
+
+	// Keeps the DMA buffers for duration after the device is closed in sticky mode, so a restarted process can take
+	// them over with attachLease (or attachSgBuffers) instead of allocating again. token is chosen by the caller
+	// and needed to attach, e.g. a random number saved with the layout (see describeLayout). A zero token or
+	// duration clears the lease. Without sticky mode there's nothing to lease: the buffers outlive the process anyway.
+	bool setLease(unsigned long long token, std::chrono::milliseconds duration) {
+		if (!capabilities.has(US4OEM_CAPABILITY_LEASE)) {
+			throw std::runtime_error("Leases are not supported by the driver");
+		}
+		if (duration.count() < 0 || duration.count() > US4OEM_LEASE_MAX_DURATION_MS) {
+			throw std::invalid_argument("Lease duration out of range");
+		}
+
+		us4oem_lease_argument arg = {};
+		arg.token = token;
+		arg.duration_ms = (unsigned long)duration.count();
+
+		return ioctl(US4OEM_WIN32_IOCTL_SET_LEASE, &arg, nullptr);
+	}
+
+	// Takes over the buffers kept by a running lease. Returns false if there is none (it ran out, or the device
+	// wasn't closed with one set); throws if the token doesn't match.
+	bool attachLease(unsigned long long token) {
+		return unwrap(tryAttachLease(token));
+	}
+
+	Us4OemResult<bool> tryAttachLease(unsigned long long token) noexcept {
+		auto result = tryIoctl(US4OEM_WIN32_IOCTL_ATTACH_LEASE, &token, nullptr);
+		if (result) {
+			return true;
+		}
+
+		// STATUS_NOT_FOUND
+		if (result.error().win32Error == ERROR_NOT_FOUND) {
+			return false;
+		}
+
+		return std::unexpected(result.error());
+	}
+
+	// The layout of buffers from allocSgBuffers, to save before handing them over through a lease
+	Us4OemSgLayout describeLayout(const std::vector<Us4OemSgBuffer>& buffers, unsigned long long token, std::chrono::milliseconds lease) const {
+		Us4OemSgLayout layout;
+		layout.token = token;
+		std::tie(layout.pciBus, layout.pciDevice, layout.pciFunction) = location.pciOrder();
+		layout.leaseDurationMs = (uint32_t)lease.count();
+
+		for (const auto& buffer : buffers) {
+			layout.segments.push_back({ buffer.handle(), buffer.description() });
+		}
+
+		return layout;
+	}
+
+	// Takes over the buffers of a saved layout through its lease, and owns them again like allocSgBuffers does.
+	// Throws if the layout is of another device or the lease is gone, in which case the buffers need allocating.
+	std::vector<Us4OemSgBuffer> attachSgBuffers(const Us4OemSgLayout& layout) {
+		requireHandles();
+
+		if (std::make_tuple(layout.pciBus, layout.pciDevice, layout.pciFunction) != location.pciOrder()) {
+			throw std::runtime_error("The layout is of another device");
+		}
+		if (!attachLease(layout.token)) {
+			throw std::runtime_error("No lease to attach to, the buffers are gone");
+		}
+
+		std::vector<Us4OemSgBuffer> buffers;
+		buffers.reserve(layout.segments.size());
+
+		for (const auto& segment : layout.segments) {
+			buffers.emplace_back(file, segment.handle, segment.description);
+		}
+
+		return buffers;
+	}
+
+	// Maps scatter-gather buffers back to back into one range of the process, see Us4OemContiguousView.
+	// Every buffer but the last has to be a multiple of the allocation granularity (64 KiB) long, as the ones
+	// allocSgBuffers splits off are.
+	Us4OemContiguousView mapContiguous(const std::vector<Us4OemSgBuffer>& buffers) {
+		std::vector<ContiguousSegment> segments;
+		for (const auto& buffer : buffers) {
+			segments.push_back({ buffer.handle(), buffer.va(), buffer.length() });
+		}
+		return mapContiguousSegments(segments);
+	}
+
+	// Same, for buffers from allocDmaScatterGather
+	Us4OemContiguousView mapContiguous(const std::vector<Us4OemDmaSgDescription>& description) {
+		std::vector<ContiguousSegment> segments;
+		for (const auto& desc : description) {
+			segments.push_back({ US4OEM_INVALID_HANDLE, desc.va, desc.length });
+		}
+		return mapContiguousSegments(segments);
+	}
+
 	bool deallocAll() {
 		return ioctl(US4OEM_WIN32_IOCTL_DEALLOCATE_ALL_DMA_BUFFERS, nullptr, nullptr);
 	}
@@ -286,7 +719,75 @@ public:
 		return ioctl(US4OEM_WIN32_IOCTL_SET_STICKY_MODE, &status, nullptr);
 	}
 
+	// Sets how the driver releases DMA buffers. With asyncClose, closing the device in sticky mode returns right away
+	// and the buffers are released in the background. maxWorkers limits the threads releasing them in parallel,
+	// 0 for one per processor. Teardown timings are part of readStats.
+	bool setTeardownOptions(bool asyncClose, unsigned long maxWorkers = 0) {
+		if (!capabilities.has(US4OEM_CAPABILITY_TEARDOWN)) {
+			throw std::runtime_error("Teardown options are not supported by the driver");
+		}
+
+		us4oem_teardown_options options = {};
+		options.flags = asyncClose ? US4OEM_TEARDOWN_FLAG_ASYNC_CLOSE : 0;
+		options.max_workers = maxWorkers;
+
+		return ioctl(US4OEM_WIN32_IOCTL_SET_TEARDOWN_OPTIONS, &options, nullptr);
+	}
+
+	// Runs the register accesses of the sequence in a single call, without mapping the BARs.
+	// Returns true if all of them succeeded, read results are taken from the sequence afterwards.
+	bool runRegisterSequence(Us4OemRegisterSequence& sequence) {
+		if (!capabilities.has(US4OEM_CAPABILITY_REGISTER_ACCESS)) {
+			throw std::runtime_error("Register access is not supported by the driver, map the BAR instead");
+		}
+
+		unsigned long length = (unsigned long)sequence.buffer.size();
+
+		ioctlRaw(US4OEM_WIN32_IOCTL_REGISTER_ACCESS, sequence.buffer.data(), length, sequence.buffer.data(), length);
+
+		return sequence.succeeded();
+	}
+
+	// Runs all commands of the batch in a single call. Returns true if all of them succeeded,
+	// results of the individual commands are read from the batch afterwards.
+	// Drivers without batching run the commands one call at a time instead, with the same results.
+	bool submitBatch(Us4OemBatch& batch) {
+		if (!capabilities.has(US4OEM_CAPABILITY_BATCH)) {
+			return submitBatchSequentially(batch);
+		}
+
+		unsigned long length = (unsigned long)batch.buffer.size();
+
+		ioctlRaw(US4OEM_WIN32_IOCTL_SUBMIT_BATCH, batch.buffer.data(), length, batch.buffer.data(), length);
+
+		return batch.succeeded();
+	}
+
 private:
+	// Asks the driver for its capabilities; older drivers don't know the IOCTL, they get the defaults.
+	Us4OemCapabilities readCapabilities() {
+		us4oem_capabilities raw = {};
+
+		if (!tryIoctl(US4OEM_WIN32_IOCTL_GET_CAPABILITIES, nullptr, &raw)) {
+			return Us4OemCapabilities();
+		}
+
+		return Us4OemCapabilities(raw);
+	}
+
+	// Fallback of submitBatch, fills in the results the way the driver would.
+	bool submitBatchSequentially(Us4OemBatch& batch) {
+		return batch.runEach([this](unsigned long ioctlCode, void* input, unsigned long inputLength, void* output,
+			unsigned long outputLength, unsigned long& bytesReturned) {
+			DWORD returned = 0;
+			BOOL succeeded = DeviceIoControl(deviceHandle, ioctlCode, input, inputLength, output, outputLength, &returned, NULL);
+
+			// The Win32 error code wrapped in an NTSTATUS (FACILITY_NTWIN32), as the real status is lost by now
+			bytesReturned = returned;
+			return succeeded ? 0L : (long)(0xC0070000 | (GetLastError() & 0xFFFF));
+		});
+	}
+
 	// A wrapper^2 of the ioctl function
 	// This function allows us to omit the input/output buffer sizes, as it's: a) inconvenient, and 
 	// b) easy to mess up. 
@@ -303,26 +804,178 @@ private:
 		);
 	}
 
+	struct ContiguousSegment {
+		us4oem_handle handle;
+		void* va;
+		size_t length;
+	};
+
+	// The driver can only map into free address space, so this finds a free range, gives it back and maps the
+	// segments into it. Another thread may take part of the range in between; then it starts over elsewhere.
+	Us4OemContiguousView mapContiguousSegments(const std::vector<ContiguousSegment>& segments) {
+		if (!capabilities.has(US4OEM_CAPABILITY_MMAP_AT_ADDRESS)) {
+			throw std::runtime_error("Mapping at an address is not supported by the driver");
+		}
+
+		SYSTEM_INFO system = {};
+		GetSystemInfo(&system);
+
+		size_t total = 0;
+		for (size_t i = 0; i < segments.size(); i++) {
+			if (i + 1 < segments.size() && segments[i].length % system.dwAllocationGranularity != 0) {
+				throw std::invalid_argument(std::format("Buffer {} is not a multiple of the allocation granularity long", i));
+			}
+			total += segments[i].length;
+		}
+
+		if (total == 0) {
+			return Us4OemContiguousView();
+		}
+
+		const int MAX_ATTEMPTS = 8;
+		for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+			unsigned char* base = static_cast<unsigned char*>(VirtualAlloc(NULL, total, MEM_RESERVE, PAGE_NOACCESS));
+			if (base == NULL) {
+				throw Us4OemException(Us4OemError::lastError("Reserving address space"));
+			}
+			VirtualFree(base, 0, MEM_RELEASE);
+
+			std::vector<Us4OemMapping> mappings;
+			mappings.reserve(segments.size());
+			size_t offset = 0;
+
+			for (const auto& segment : segments) {
+				auto mapping = Us4OemMapping::tryMapDma(file, segment.handle, segment.va, base + offset);
+				if (!mapping) {
+					if (mapping.error().win32Error == ERROR_INVALID_ADDRESS) {
+						break; // Taken meanwhile, the mappings made so far go with the vector
+					}
+					throw Us4OemException(mapping.error());
+				}
+				if (mapping->length() != segment.length) {
+					throw std::runtime_error(std::format("Buffer mapped with {} bytes instead of {}", mapping->length(), segment.length));
+				}
+
+				offset += mapping->length();
+				mappings.push_back(std::move(*mapping));
+			}
+
+			if (mappings.size() == segments.size()) {
+				return Us4OemContiguousView(std::move(mappings));
+			}
+		}
+
+		throw Us4OemException(Us4OemError::fromWin32(ERROR_INVALID_ADDRESS, "Mapping buffers back to back"));
+	}
+
+	// Builds the SDK's description of a scatter-gather allocation from the driver's response.
+	static Us4OemDmaSgDescription describeSg(const us4oem_dma_scatter_gather_buffer_response& response) {
+		Us4OemDmaSgDescription desc = {};
+		desc.va = response.va;
+
+		desc.chunks.reserve(response.chunk_count);
+
+		for (unsigned int j = 0; j < response.chunk_count; j++) {
+			desc.chunks.push_back({
+				desc.length, // VA offset from the top, where the chunk starts
+				response.chunks[j].pa,  // Physical address of the chunk
+				response.chunks[j].length // Length of the chunk
+				});
+			desc.length += response.chunks[j].length;
+		}
+
+		return desc;
+	}
+
+	// The owning buffer types release by driver handle
+	void requireHandles() const {
+		if (!capabilities.has(US4OEM_CAPABILITY_HANDLES)) {
+			throw std::runtime_error("Driver handles are not supported by the driver");
+		}
+	}
+
 	// A "raw" C-like wrapper for DeviceIoControl to reduce boilerplate.
 	bool ioctlRaw(unsigned long ioctlCode, void* inputBuffer, unsigned long inputSize, void* outputBuffer, unsigned long outputSize) {
+		unwrap(tryIoctlRaw(ioctlCode, inputBuffer, inputSize, outputBuffer, outputSize));
+		return true;
+	}
+
+	// ioctl() without exceptions
+	template<typename A = nullptr_t, typename B = nullptr_t> requires (NullablePtr<A> && NullablePtr<B>)
+	Us4OemResult<void> tryIoctl(unsigned long ioctlCode, A inputBuffer, B outputBuffer) noexcept {
+		return tryIoctlRaw(ioctlCode,
+			inputBuffer,
+			std::is_null_pointer_v<A> ? 0 : sizeof(std::remove_pointer_t<A>),
+			outputBuffer,
+			std::is_null_pointer_v<B> ? 0 : sizeof(std::remove_pointer_t<B>)
+		);
+	}
+
+	// ioctlRaw() without exceptions; every other call to the driver ends up here.
+	Us4OemResult<void> tryIoctlRaw(unsigned long ioctlCode, void* inputBuffer, unsigned long inputSize, void* outputBuffer, unsigned long outputSize) noexcept {
 		if (!isHandleOpen) {
-			throw std::runtime_error("Device handle is not open");
+			return std::unexpected(Us4OemError::fromWin32(ERROR_INVALID_HANDLE, "DeviceIoControl (device not open)"));
 		}
 
-		bool status = DeviceIoControl(deviceHandle,
+		DWORD bytesReturned = 0;
+		if (!DeviceIoControl(deviceHandle,
 			ioctlCode,
 			inputBuffer, inputSize,
 			outputBuffer, outputSize,
-			NULL, NULL);
+			&bytesReturned, NULL)) {
+			return std::unexpected(Us4OemError::lastError());
+		}
 
-		if (!status) {
-			throw std::runtime_error("DeviceIoControl failed: " + std::to_string(GetLastError()));
+		return {};
+	}
+
+	// US4OEM_WIN32_IOCTL_MMAP; a NULL address is a failure even if the IOCTL succeeded
+	Us4OemResult<MemoryMapping> tryMap(us4oem_mmap_argument& arg, const char* operation) noexcept {
+		us4oem_mmap_response response = {};
+
+		auto result = tryIoctl(US4OEM_WIN32_IOCTL_MMAP, &arg, &response);
+		if (!result) {
+			return std::unexpected(result.error());
+		}
+		if (response.address == NULL) {
+			return std::unexpected(Us4OemError::fromWin32(ERROR_NOT_ENOUGH_MEMORY, operation));
 		}
 
-		return true;
+		return MemoryMapping{ response.address, response.length_mapped };
+	}
+
+	// US4OEM_WIN32_IOCTL_ALLOCATE_DMA_CONTIGIOUS_BUFFER; a NULL VA is a failure even if the IOCTL succeeded
+	Us4OemResult<us4oem_dma_contiguous_buffer_response> tryAllocDmaContigRaw(unsigned long length) noexcept {
+		us4oem_dma_contiguous_buffer_response response = {};
+		us4oem_dma_allocation_argument arg = {};
+		arg.length = length;
+
+		auto result = tryIoctl(US4OEM_WIN32_IOCTL_ALLOCATE_DMA_CONTIGIOUS_BUFFER, &arg, &response);
+		if (!result) {
+			return std::unexpected(result.error());
+		}
+		if (response.va == NULL) {
+			return std::unexpected(Us4OemError::fromWin32(ERROR_NOT_ENOUGH_MEMORY, "Allocating a contiguous DMA buffer"));
+		}
+
+		return response;
+	}
+
+	// The throwing API is this on top of the try* functions
+	template<class T>
+	static T unwrap(Us4OemResult<T>&& result) {
+		if (!result) {
+			throw Us4OemException(result.error());
+		}
+		if constexpr (!std::is_void_v<T>) {
+			return std::move(*result);
+		}
 	}
 
 	Us4OemDeviceLocation location;
 	HANDLE deviceHandle; // Win32 handle to the device
+	Us4OemFileRef file; // Owns deviceHandle, shared with the buffers and mappings allocated through the device
 	bool isHandleOpen; // Whether the device is open
+	Us4OemCapabilities capabilities; // Read on open()
+	std::optional<Us4OemSharedStats> sharedStats; // Mapped on first use, see mapSharedStats
 };
\ No newline at end of file
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <vector>
+
+#include "devicelocation.hpp"
+
+// The list of devices, rescanned only when it may have changed. Platform-independent: the scan is injected,
+// Us4OemDriverSdk passes one that uses SetupAPI and invalidates the cache from device interface notifications.
+//
+// invalidate() can be called from any thread (notification callbacks run on a thread pool). Lists handed out
+// are immutable snapshots, so a rescan never changes a list someone is still indexing.
+class Us4OemDeviceCache {
+public:
+	using Scanner = std::function<std::vector<Us4OemDeviceLocation>()>;
+	using DeviceList = std::shared_ptr<const std::vector<Us4OemDeviceLocation>>;
+
+	explicit Us4OemDeviceCache(Scanner scanner) : scanner(std::move(scanner)) {}
+
+	// Marks the list stale, the next devices() rescans
+	void invalidate() noexcept {
+		generation.fetch_add(1, std::memory_order_release);
+	}
+
+	// Bumped by every invalidate(); a changed value means the devices may have changed
+	unsigned long long getGeneration() const noexcept {
+		return generation.load(std::memory_order_acquire);
+	}
+
+	// Without notifications every call rescans, as there's no way to tell the list is still current
+	void setAlwaysRescan(bool rescan) noexcept {
+		alwaysRescan = rescan;
+	}
+
+	// The devices sorted by bus, device and function. Rescans first if the list was invalidated since the last scan.
+	DeviceList devices() {
+		std::lock_guard lock(mutex);
+
+		// Read the generation before scanning, so an invalidation during the scan triggers another one next time
+		unsigned long long current = getGeneration();
+		if (!list || alwaysRescan || current != scannedGeneration) {
+			list = std::make_shared<const std::vector<Us4OemDeviceLocation>>(sorted(scanner()));
+			scannedGeneration = current;
+		}
+
+		return list;
+	}
+
+	// Stable PCI order, so device indices don't depend on the order the system enumerates them in.
+	static std::vector<Us4OemDeviceLocation> sorted(const std::vector<Us4OemDeviceLocation>& locations) {
+		std::vector<size_t> order(locations.size());
+		std::iota(order.begin(), order.end(), 0);
+
+		std::stable_sort(order.begin(), order.end(), [&locations](size_t a, size_t b) {
+			return locations[a].pciOrder() < locations[b].pciOrder();
+		});
+
+		std::vector<Us4OemDeviceLocation> result;
+		result.reserve(locations.size());
+		for (size_t index : order) {
+			result.push_back(locations[index]);
+		}
+
+		return result;
+	}
+
+private:
+	Scanner scanner;
+	std::mutex mutex; // Serializes scans
+	std::atomic<unsigned long long> generation = 0;
+	unsigned long long scannedGeneration = 0; // Generation the list was scanned at
+	bool alwaysRescan = false;
+	DeviceList list;
+};
@@ -1,10 +1,13 @@
 #pragma once
 
-#include "common.hpp"
+#include <cstdint>
+#include <format>
+#include <string>
+#include <tuple>
 
 // Retrieves an unique identifier for the device.
 // Used to pick an appropriate device to communicate with.
-const class Us4OemDeviceLocation {
+class Us4OemDeviceLocation {
 public:
 	Us4OemDeviceLocation(uint32_t address, uint32_t bus, std::string path) :
 		Us4OemDeviceLocation(
@@ -23,6 +26,11 @@ public:
 		return device == other.device && function == other.function && bus == other.bus;
 	}
 
+	// (bus, device, function), for sorting devices in PCI order
+	std::tuple<uint32_t, uint16_t, uint16_t> pciOrder() const {
+		return { bus, device, function };
+	}
+
 	std::string toString() const {
 		return std::format("PCI Bus {} Device {} Function {}",
 			bus, device, function);
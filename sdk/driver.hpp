@@ -1,25 +1,41 @@
 #pragma once
 
+#include <cfgmgr32.h>
+
 #include "common.hpp"
+#include "devicecache.hpp"
 
 class Us4OemDriverSdk {
 public:
-	Us4OemDriverSdk() : deviceCount(0) {}
+	Us4OemDriverSdk() :
+		cache(std::make_unique<Us4OemDeviceCache>(&Us4OemDriverSdk::_scanDevices)),
+		deviceLocations(std::make_shared<const std::vector<Us4OemDeviceLocation>>()),
+		notification(nullptr, &CM_Unregister_Notification) {
+		_registerNotification();
+	}
 
-	// Triggers a device scan and returns the number of devices found.
+	// Returns the number of devices. Only rescans if a us4oem device interface arrived or was removed since the
+	// last call (or always, if the notification couldn't be registered).
+	// Devices are indexed in PCI order (bus, device, function), so the indices don't change between scans
+	// unless devices do.
 	size_t getDeviceCount() {
-		_scanDevices();
+		deviceLocations = cache->devices();
 
-		return deviceLocations.size();
+		return deviceLocations->size();
 	}
 
-	// Retrieves the device location for a given index.
+	// Retrieves the device location for a given index, from the list as of the last getDeviceCount().
 	// The index has to be less than the number of devices returned by GetDeviceCount().
 	Us4OemDeviceLocation getDeviceLocation(int index) {
-		if (index < 0 || index >= deviceLocations.size()) {
+		if (index < 0 || index >= deviceLocations->size()) {
 			throw std::out_of_range("Index out of range");
 		}
-		return deviceLocations[index];
+		return (*deviceLocations)[index];
+	}
+
+	// Changes whenever a us4oem device arrives or is removed; call getDeviceCount() again when it does.
+	unsigned long long getDeviceGeneration() const {
+		return cache->getGeneration();
 	}
 
 	// Return the KMD version this SDK was built against (aka which us4oemapi.h was included).
@@ -29,8 +45,31 @@ public:
 
 
 private:
-	bool _scanDevices() {
-		deviceLocations.clear();
+	// Invalidates the cache on device interface arrival and removal
+	void _registerNotification() {
+		CM_NOTIFY_FILTER filter = {};
+		filter.cbSize = sizeof(filter);
+		filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+		filter.u.DeviceInterface.ClassGuid = GUID_DEVINTERFACE_us4oem;
+
+		HCMNOTIFICATION handle = NULL;
+		if (CM_Register_Notification(&filter, cache.get(), &Us4OemDriverSdk::_onNotification, &handle) != CR_SUCCESS) {
+			cache->setAlwaysRescan(true);
+			return;
+		}
+
+		notification.reset(handle);
+	}
+
+	static DWORD CALLBACK _onNotification(HCMNOTIFICATION, PVOID context, CM_NOTIFY_ACTION action, PCM_NOTIFY_EVENT_DATA, DWORD) {
+		if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL || action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) {
+			static_cast<Us4OemDeviceCache*>(context)->invalidate();
+		}
+		return ERROR_SUCCESS;
+	}
+
+	static std::vector<Us4OemDeviceLocation> _scanDevices() {
+		std::vector<Us4OemDeviceLocation> deviceLocations;
 
 		// Retrieve the device information for all us4oem devices.
 		HDEVINFO devInfo = SetupDiGetClassDevs(
@@ -41,7 +80,7 @@ private:
 			DIGCF_PRESENT);
 
 		if (devInfo == INVALID_HANDLE_VALUE) {
-			return false; // Failed to get device info
+			return deviceLocations; // Failed to get device info
 		}
 
 		SP_DEVICE_INTERFACE_DATA deviceInterfaceData;
@@ -108,11 +147,14 @@ private:
 			deviceLocations.emplace_back(Us4OemDeviceLocation(address, busNumber, std::string(systemPathBuffer)));
 		}
 
-		deviceCount = deviceLocations.size();
+		SetupDiDestroyDeviceInfoList(devInfo);
 
-		return true;
+		return deviceLocations;
 	}
 
-	size_t deviceCount;
-	std::vector<Us4OemDeviceLocation> deviceLocations;
+	std::unique_ptr<Us4OemDeviceCache> cache; // Owned separately, the notification callback points to it
+	Us4OemDeviceCache::DeviceList deviceLocations; // As of the last getDeviceCount()
+
+	// Unregistered first on destruction (waits for running callbacks), before the cache goes away
+	std::unique_ptr<std::remove_pointer_t<HCMNOTIFICATION>, decltype(&CM_Unregister_Notification)> notification;
 };
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <expected>
+#include <stdexcept>
+
+#include "common.hpp"
+
+// Why a call to the driver failed. Cheap to make and copy: nothing is formatted until message() is called,
+// so the hot paths can return it by value.
+struct Us4OemError {
+	unsigned long win32Error = ERROR_SUCCESS; // GetLastError() of the failed call, or an ERROR_* the SDK picked
+	long status = 0; // NTSTATUS if the driver reported one (batches), otherwise win32Error wrapped in FACILITY_NTWIN32
+	const char* operation = "DeviceIoControl"; // What failed, a string literal
+
+	static Us4OemError fromWin32(unsigned long win32Error, const char* operation = "DeviceIoControl") {
+		return { win32Error, (long)(0xC0070000 | (win32Error & 0xFFFF)), operation };
+	}
+
+	// The error of the last failed Win32 call on this thread
+	static Us4OemError lastError(const char* operation = "DeviceIoControl") {
+		return fromWin32(GetLastError(), operation);
+	}
+
+	std::string message() const {
+		return std::string(operation) + " failed: " + std::to_string(win32Error);
+	}
+};
+
+// The result of the exception-free API of Us4OemDevice (the try* functions).
+template<class T>
+using Us4OemResult = std::expected<T, Us4OemError>;
+
+// Thrown by the throwing API of Us4OemDevice, which wraps the try* functions.
+// Still a std::runtime_error, so existing handlers keep working.
+class Us4OemException : public std::runtime_error {
+public:
+	explicit Us4OemException(const Us4OemError& error) : std::runtime_error(error.message()), error(error) {}
+
+	const Us4OemError error;
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <sstream>
+
+#include "common.hpp"
+
+// Events recorded by the driver's per-processor event rings, merged into a single timeline.
+// See Us4OemDevice::setEventMask and Us4OemDevice::readEvents.
+class Us4OemEventTrace {
+public:
+	struct Event {
+		unsigned long processor;
+		unsigned long long sequence; // Per processor
+		long long timestamp; // QPC
+		us4oem_event_type type;
+		unsigned long arg0;
+		unsigned long long arg1;
+	};
+
+	Us4OemEventTrace() {
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		qpcFrequency = frequency.QuadPart;
+	}
+
+	// Adds the events of one processor's ring, keeping the trace in timestamp order.
+	void add(unsigned long processor, const us4oem_event_ring& ring) {
+		for (unsigned long i = 0; i < ring.count && i < US4OEM_EVENT_RING_SIZE; i++) {
+			const us4oem_event& raw = ring.events[i];
+
+			// Sequences are consecutive unless the ring wrapped (or we raced the driver) since the previous read
+			if (i > 0 && raw.sequence != ring.events[i - 1].sequence + 1) {
+				lost += raw.sequence - ring.events[i - 1].sequence - 1;
+			}
+
+			events.push_back({ processor, raw.sequence, raw.timestamp, (us4oem_event_type)raw.type, raw.arg0, raw.arg1 });
+		}
+
+		std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) {
+			return a.timestamp < b.timestamp;
+		});
+	}
+
+	const std::vector<Event>& getEvents() const {
+		return events;
+	}
+
+	// Events that were overwritten between the ones returned
+	unsigned long long getLostCount() const {
+		return lost;
+	}
+
+	static const char* typeName(us4oem_event_type type) {
+		switch (type) {
+		case US4OEM_EVENT_ISR: return "isr";
+		case US4OEM_EVENT_DPC: return "dpc";
+		case US4OEM_EVENT_IOCTL: return "ioctl";
+		case US4OEM_EVENT_POLL_PARKED: return "poll-parked";
+		case US4OEM_EVENT_POLL_COMPLETED: return "poll-completed";
+		case US4OEM_EVENT_POLL_TIMEOUT: return "poll-timeout";
+		case US4OEM_EVENT_POLL_BUSY: return "poll-busy";
+		default: return "unknown";
+		}
+	}
+
+	// One event per line, with the time in microseconds since the first event
+	std::string toString() const {
+		std::ostringstream out;
+
+		for (const Event& event : events) {
+			double us = (double)(event.timestamp - events.front().timestamp) * 1e6 / (double)qpcFrequency;
+			out << std::format("{:>12.3f} us  cpu {:>3}  #{:<8} {:<15} {:#x} {:#x}\n",
+				us, event.processor, event.sequence, typeName(event.type), event.arg0, event.arg1);
+		}
+		out << std::format("{} events, {} lost", events.size(), lost);
+
+		return out.str();
+	}
+
+private:
+	std::vector<Event> events;
+	unsigned long long lost = 0;
+	long long qpcFrequency = 0;
+};
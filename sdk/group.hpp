@@ -0,0 +1,285 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "device.hpp"
+#include "driver.hpp"
+#include "stats.hpp"
+#include "common.hpp"
+
+// A thread that runs tasks for one device, in order. Once the device's NUMA node is known the thread is moved onto
+// that node, so everything the device's tasks allocate (the driver allocates DMA memory in the calling thread's
+// context, which prefers the thread's node) and touch lives next to the device.
+class Us4OemDeviceWorker {
+public:
+	Us4OemDeviceWorker() : thread([this](std::stop_token stop) { run(stop); }) {}
+
+	Us4OemDeviceWorker(const Us4OemDeviceWorker&) = delete;
+	Us4OemDeviceWorker& operator=(const Us4OemDeviceWorker&) = delete;
+
+	// Queues fn, the future has its result or exception
+	template<class F>
+	auto submit(F&& fn) -> std::future<std::invoke_result_t<F>> {
+		using R = std::invoke_result_t<F>;
+
+		// std::function has to be copyable, packaged_task isn't
+		auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(fn));
+		std::future<R> result = task->get_future();
+
+		{
+			std::lock_guard lock(mutex);
+			tasks.emplace_back([task]() { (*task)(); });
+		}
+		wake.notify_one();
+
+		return result;
+	}
+
+	// Restricts the calling thread to the processors of a NUMA node. Meant to be called from a task.
+	static bool pinCurrentThreadToNode(unsigned long node) {
+		GROUP_AFFINITY affinity = {};
+		if (node == US4OEM_NUMA_NODE_UNKNOWN || !GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) || affinity.Mask == 0) {
+			return false;
+		}
+
+		return SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL) != FALSE;
+	}
+
+private:
+	void run(std::stop_token stop) {
+		while (true) {
+			std::function<void()> task;
+			{
+				std::unique_lock lock(mutex);
+				if (!wake.wait(lock, stop, [this]() { return !tasks.empty(); })) {
+					return; // Stopping; nobody waits for whatever is still queued
+				}
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable_any wake;
+	std::deque<std::function<void()>> tasks;
+	std::jthread thread; // Last, so it starts after (and stops before) everything it uses
+};
+
+// One device that failed a group operation
+struct Us4OemGroupFailure {
+	size_t index; // Of the device in the group
+	std::string location;
+	std::string message;
+};
+
+// Thrown by the group operations if any device failed; the other devices completed the operation.
+class Us4OemGroupException : public std::runtime_error {
+public:
+	explicit Us4OemGroupException(std::vector<Us4OemGroupFailure> failures) :
+		std::runtime_error(describe(failures)),
+		failures(std::move(failures)) {}
+
+	const std::vector<Us4OemGroupFailure> failures;
+
+private:
+	static std::string describe(const std::vector<Us4OemGroupFailure>& failures) {
+		std::string message = std::format("{} device(s) failed:", failures.size());
+		for (const auto& failure : failures) {
+			message += std::format("\n  [{}] {}: {}", failure.index, failure.location, failure.message);
+		}
+		return message;
+	}
+};
+
+// Statistics of all devices of a group, see Us4OemDeviceGroup::readStats
+struct Us4OemGroupStats {
+	std::vector<Us4OemDeviceStats> devices; // In group order
+
+	size_t irqCount = 0;
+	size_t pendingIrqCount = 0;
+	size_t dmaContigAllocCount = 0;
+	size_t dmaSgAllocCount = 0;
+
+	std::string toString() const {
+		return std::format("  Devices: {}\n"
+			"  IRQ Count: {}\n"
+			"  Pending IRQ Count: {}\n"
+			"  Contiguous DMA Allocations: {}\n"
+			"  Scatter-gather DMA Allocations: {}",
+			devices.size(),
+			irqCount,
+			pendingIrqCount,
+			dmaContigAllocCount,
+			dmaSgAllocCount);
+	}
+};
+
+// A set of devices driven together. Every per-device step runs on that device's own worker (see
+// Us4OemDeviceWorker), so the steps of all devices run concurrently and a group operation takes as long as the
+// slowest device rather than the sum of all of them. Failures are collected from all devices and thrown
+// together as a Us4OemGroupException.
+class Us4OemDeviceGroup {
+public:
+	explicit Us4OemDeviceGroup(const std::vector<Us4OemDeviceLocation>& locations) :
+		nodes(locations.size(), US4OEM_NUMA_NODE_UNKNOWN) {
+		for (const auto& location : locations) {
+			devices.push_back(std::make_unique<Us4OemDevice>(location));
+			workers.push_back(std::make_unique<Us4OemDeviceWorker>());
+		}
+	}
+
+	// All the devices the SDK finds
+	explicit Us4OemDeviceGroup(Us4OemDriverSdk& sdk) : Us4OemDeviceGroup(allLocations(sdk)) {}
+
+	size_t size() const {
+		return devices.size();
+	}
+
+	Us4OemDevice& operator[](size_t index) {
+		return *devices.at(index);
+	}
+
+	// The device's NUMA node, US4OEM_NUMA_NODE_UNKNOWN before open() or if the driver doesn't know it
+	unsigned long numaNode(size_t index) const {
+		return nodes.at(index);
+	}
+
+	// Opens all devices, checks the driver version of each (unless requireCompatible is false) and moves each
+	// device's worker onto the device's NUMA node.
+	void open(bool requireCompatible = true) {
+		forEach([this, requireCompatible](Us4OemDevice& device, size_t index) {
+			if (!device.open()) {
+				throw std::runtime_error("Failed to open the device: " + std::to_string(GetLastError()));
+			}
+			if (requireCompatible && !device.isKmdCompatible()) {
+				throw std::runtime_error("Driver " + device.getDriverVersionString() + " is not compatible with the SDK");
+			}
+
+			const Us4OemCapabilities& capabilities = device.getCapabilities();
+			if (capabilities.has(US4OEM_CAPABILITY_NUMA_NODE)) {
+				nodes[index] = capabilities.numaNode();
+				Us4OemDeviceWorker::pinCurrentThreadToNode(nodes[index]);
+			}
+		});
+	}
+
+	void close() {
+		forEach([](Us4OemDevice& device, size_t) {
+			device.close();
+		});
+	}
+
+	// Maps a BAR of every device
+	std::vector<Us4OemDevice::MemoryMapping> mapBars(int bar) {
+		return transform([bar](Us4OemDevice& device, size_t) {
+			return device.mapBar(bar);
+		});
+	}
+
+	// Allocates a contiguous DMA buffer on every device. If any device fails, the buffers allocated on the
+	// others are released before throwing.
+	std::vector<Us4OemDmaBuffer> allocDmaBuffers(unsigned long length) {
+		return transform([length](Us4OemDevice& device, size_t) {
+			return device.allocDmaBuffer(length);
+		});
+	}
+
+	// Allocates scatter-gather DMA buffers of the given total length on every device, released like allocDmaBuffers
+	std::vector<std::vector<Us4OemSgBuffer>> allocSgBuffers(size_t length) {
+		return transform([length](Us4OemDevice& device, size_t) {
+			return device.allocSgBuffers(length);
+		});
+	}
+
+	Us4OemGroupStats readStats() {
+		Us4OemGroupStats stats;
+		stats.devices = transform([](Us4OemDevice& device, size_t) {
+			return device.readStats();
+		});
+
+		for (const auto& device : stats.devices) {
+			stats.irqCount += device.irqCount;
+			stats.pendingIrqCount += device.pendingIrqCount;
+			stats.dmaContigAllocCount += device.dmaContigAllocCount;
+			stats.dmaSgAllocCount += device.dmaSgAllocCount;
+		}
+
+		return stats;
+	}
+
+	// Runs fn(device, index) for every device on the device's worker, and waits for all of them.
+	void forEach(const std::function<void(Us4OemDevice&, size_t)>& fn) {
+		transform([&fn](Us4OemDevice& device, size_t index) {
+			fn(device, index);
+			return true;
+		});
+	}
+
+	// Like forEach, but collects what fn returns, in group order.
+	// Nothing is returned if any device fails; the results of the others are destroyed first.
+	template<class F>
+	auto transform(F&& fn) -> std::vector<std::invoke_result_t<F, Us4OemDevice&, size_t>> {
+		using R = std::invoke_result_t<F, Us4OemDevice&, size_t>;
+
+		std::vector<std::future<R>> futures;
+		futures.reserve(devices.size());
+
+		for (size_t i = 0; i < devices.size(); i++) {
+			Us4OemDevice* device = devices[i].get();
+			futures.push_back(workers[i]->submit([&fn, device, i]() { return fn(*device, i); }));
+		}
+
+		std::vector<std::optional<R>> results(devices.size());
+		std::vector<Us4OemGroupFailure> failures;
+
+		// Waits for every device, even after a failure, as the tasks reference fn
+		for (size_t i = 0; i < futures.size(); i++) {
+			try {
+				results[i].emplace(futures[i].get());
+			}
+			catch (const std::exception& e) {
+				failures.push_back({ i, devices[i]->getLocation().toString(), e.what() });
+			}
+		}
+
+		if (!failures.empty()) {
+			throw Us4OemGroupException(std::move(failures));
+		}
+
+		std::vector<R> values;
+		values.reserve(results.size());
+		for (auto& result : results) {
+			values.push_back(std::move(*result));
+		}
+
+		return values;
+	}
+
+private:
+	static std::vector<Us4OemDeviceLocation> allLocations(Us4OemDriverSdk& sdk) {
+		std::vector<Us4OemDeviceLocation> locations;
+		size_t count = sdk.getDeviceCount();
+
+		for (size_t i = 0; i < count; i++) {
+			locations.push_back(sdk.getDeviceLocation((int)i));
+		}
+
+		return locations;
+	}
+
+	std::vector<std::unique_ptr<Us4OemDevice>> devices;
+	std::vector<unsigned long> nodes; // Written by each device's worker in open()
+	std::vector<std::unique_ptr<Us4OemDeviceWorker>> workers; // After devices, so the workers stop first
+};
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <array>
+#include <format>
+#include <string>
+#include <vector>
+
+#include "api.hpp"
+
+// The slot of an IOCTL in the driver's dispatch table and in the per-IOCTL statistics: its function code, counted
+// from US4OEM_WIN32_IOCTL_BASE like the driver's US4OEM_IOCTL_INDEX. Codes that aren't ours give a slot past
+// US4OEM_IOCTL_STATS_SLOTS.
+inline unsigned long us4oemIoctlSlot(unsigned long ioctlCode) {
+	return ((ioctlCode >> 2) & 0xFFF) - US4OEM_WIN32_IOCTL_BASE;
+}
+
+// Rates and changes between two extended statistics snapshots, see Us4OemExtendedStats::delta.
+struct Us4OemStatsDelta {
+	double seconds; // Time between the snapshots
+
+	unsigned long long irqs;
+	double irqsPerSecond;
+
+	long long pinnedBytes; // Change in DMA memory, negative if buffers were freed
+	long long mappedBytes;
+
+	unsigned long long ioctls; // All codes together
+	double ioctlsPerSecond;
+	std::array<unsigned long long, US4OEM_IOCTL_STATS_SLOTS> ioctlCalls; // Per code, indexed like us4oem_ioctl_stats.ioctls
+
+	double ioctlRate(unsigned long ioctlCode) const {
+		unsigned long slot = us4oemIoctlSlot(ioctlCode);
+		return slot >= US4OEM_IOCTL_STATS_SLOTS || seconds <= 0 ? 0 : (double)ioctlCalls[slot] / seconds;
+	}
+
+	std::string toString() const {
+		return std::format("  Over {:.3f} s: {} IRQs ({:.1f}/s), {} IOCTLs ({:.1f}/s), pinned {:+} B, mapped {:+} B",
+			seconds, irqs, irqsPerSecond, ioctls, ioctlsPerSecond, pinnedBytes, mappedBytes);
+	}
+};
+
+// Gauges and totals for capacity planning, as returned by Us4OemDevice::readExtendedStats.
+// Each snapshot carries its own timestamp, so two of them give rates (see delta).
+class Us4OemExtendedStats {
+public:
+	Us4OemExtendedStats(const us4oem_extended_stats& raw) : raw(raw) {}
+
+	// IRQs per second from the driver's moving average of the time between them, 0 before the second IRQ
+	double irqRateEwma() const {
+		return raw.irq_interval_ewma_ticks <= 0 ? 0 : (double)raw.qpc_frequency / (double)raw.irq_interval_ewma_ticks;
+	}
+
+	// Mean number of chunks per scatter-gather buffer, given the number allocated (Us4OemDeviceStats::dmaSgAllocCount)
+	double meanSgChunks(size_t sgAllocCount) const {
+		return sgAllocCount == 0 ? 0 : (double)raw.dma_sg_chunks / (double)sgAllocCount;
+	}
+
+	// What changed since an earlier snapshot of the same device
+	Us4OemStatsDelta delta(const Us4OemExtendedStats& earlier) const {
+		Us4OemStatsDelta result = {};
+
+		result.seconds = raw.qpc_frequency == 0 ? 0 :
+			(double)(raw.timestamp - earlier.raw.timestamp) / (double)raw.qpc_frequency;
+		result.irqs = raw.irq_count - earlier.raw.irq_count;
+		result.pinnedBytes = (long long)(raw.bytes_pinned - earlier.raw.bytes_pinned);
+		result.mappedBytes = (long long)(raw.bytes_mapped - earlier.raw.bytes_mapped);
+
+		for (unsigned long i = 0; i < US4OEM_IOCTL_STATS_SLOTS; i++) {
+			result.ioctlCalls[i] = raw.ioctl_calls[i] - earlier.raw.ioctl_calls[i];
+			result.ioctls += result.ioctlCalls[i];
+		}
+
+		if (result.seconds > 0) {
+			result.irqsPerSecond = (double)result.irqs / result.seconds;
+			result.ioctlsPerSecond = (double)result.ioctls / result.seconds;
+		}
+		return result;
+	}
+
+	std::string toString() const {
+		return std::format("  IRQ Rate (moving average): {:.1f}/s\n"
+			"  Bytes Pinned: {} ({} contiguous, {} scatter-gather)\n"
+			"  Largest Contiguous Buffer: {}\n"
+			"  SG Chunks: {} (at most {} in one buffer)\n"
+			"  Bytes Mapped: {} in {} mappings\n"
+			"  Polls In Flight: {} (peak {})",
+			irqRateEwma(),
+			raw.bytes_pinned, raw.dma_contig_bytes, raw.dma_sg_bytes,
+			raw.dma_contig_max_bytes,
+			raw.dma_sg_chunks, raw.dma_sg_max_chunks,
+			raw.bytes_mapped, raw.map_count,
+			raw.polls_in_flight, raw.polls_in_flight_max);
+	}
+
+	// Note: public, the fields are documented in Us4OemAPI.h. Fields the driver doesn't know about are zeroed.
+	us4oem_extended_stats raw;
+};
+
+// Per-IOCTL call counts and handler times, as returned by Us4OemDevice::readIoctlStats.
+class Us4OemIoctlStats {
+public:
+	struct Entry {
+		unsigned long ioctlCode;
+		unsigned long long calls;
+		unsigned long long totalNs;
+		unsigned long long maxNs;
+
+		unsigned long long meanNs() const { return calls == 0 ? 0 : totalNs / calls; }
+	};
+
+	Us4OemIoctlStats(const us4oem_ioctl_stats& raw) : rejected(raw.rejected) {
+		for (unsigned long i = 0; i < US4OEM_IOCTL_STATS_SLOTS; i++) {
+			const us4oem_ioctl_call_stats& slot = raw.ioctls[i];
+			if (slot.calls == 0) {
+				continue;
+			}
+			entries.push_back({
+				CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + i, METHOD_BUFFERED, FILE_ANY_ACCESS),
+				slot.calls, slot.total_ns, slot.max_ns });
+		}
+	}
+
+	std::string toString() const {
+		std::string result = std::format("  Rejected: {}", rejected);
+		for (const Entry& entry : entries) {
+			result += std::format("\n  IOCTL {:#x}: {} calls, mean {} ns, max {} ns",
+				entry.ioctlCode, entry.calls, entry.meanNs(), entry.maxNs);
+		}
+		return result;
+	}
+
+	std::vector<Entry> entries; // Only IOCTLs that were called at least once
+	unsigned long long rejected; // Unsupported IOCTLs, buffers too small, etc.
+};
+
+class Us4OemQueueStats {
+public:
+	struct Entry {
+		unsigned long long requests;
+		unsigned long long depth; // Waiting right now
+		unsigned long long maxDepth;
+		unsigned long long totalWaitNs;
+		unsigned long long maxWaitNs;
+
+		unsigned long long meanWaitNs() const { return requests == 0 ? 0 : totalWaitNs / requests; }
+	};
+
+	Us4OemQueueStats(const us4oem_queue_stats& raw) {
+		for (unsigned long i = 0; i < US4OEM_QUEUE_COUNT; i++) {
+			const us4oem_queue_call_stats& queue = raw.queues[i];
+			queues[i] = { queue.requests, queue.depth, queue.max_depth, queue.total_wait_ns, queue.max_wait_ns };
+		}
+	}
+
+	static const char* queueName(us4oem_queue queue) {
+		switch (queue) {
+		case US4OEM_QUEUE_DEFAULT: return "Default";
+		case US4OEM_QUEUE_FAST: return "Fast";
+		case US4OEM_QUEUE_SEQUENTIAL: return "Sequential";
+		case US4OEM_QUEUE_PARKED: return "Parked polls";
+		default: return "Unknown";
+		}
+	}
+
+	std::string toString() const {
+		std::string result;
+		for (unsigned long i = 0; i < US4OEM_QUEUE_COUNT; i++) {
+			const Entry& entry = queues[i];
+			result += std::format("{}  {}: {} requests, depth {} (max {}), mean wait {} ns, max wait {} ns",
+				i == 0 ? "" : "\n", queueName((us4oem_queue)i), entry.requests, entry.depth, entry.maxDepth,
+				entry.meanWaitNs(), entry.maxWaitNs);
+		}
+		return result;
+	}
+
+	Entry queues[US4OEM_QUEUE_COUNT]; // Indexed by us4oem_queue
+};
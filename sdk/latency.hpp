@@ -0,0 +1,215 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <format>
+#include <istream>
+#include <iterator>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "api.hpp"
+
+// Timestamps of a single completed poll: what the driver recorded, plus when user-space woke up.
+// All values are QPC ticks; 0 means the driver did not record that stage.
+struct Us4OemPollTimestamps {
+	long long isr = 0; // ISR of the most recent IRQ
+	long long dpc = 0; // DPC of the most recent IRQ
+	long long completion = 0; // Driver completed the poll request
+	long long wake = 0; // DeviceIoControl returned in user-space
+	long long frequency = 0; // Ticks per second
+	unsigned long coalesced = 0; // IRQs consumed by the poll, > 1 only with interrupt moderation
+
+	Us4OemPollTimestamps() = default;
+
+	Us4OemPollTimestamps(const us4oem_poll_response& raw, long long wakeTimestamp) :
+		isr(raw.isr_timestamp),
+		dpc(raw.dpc_timestamp),
+		completion(raw.completion_timestamp),
+		wake(wakeTimestamp),
+		frequency(raw.qpc_frequency),
+		coalesced(raw.irq_coalesced) {}
+
+	// Stage durations in nanoseconds, or -1 if either end of the stage is missing.
+	long long isrToDpcNs() const { return stageNs(isr, dpc); }
+	long long dpcToCompletionNs() const { return stageNs(dpc, completion); }
+	long long completionToWakeNs() const { return stageNs(completion, wake); }
+	long long isrToWakeNs() const { return stageNs(isr, wake); }
+
+private:
+	long long stageNs(long long from, long long to) const {
+		if (from == 0 || to == 0 || to < from || frequency <= 0) {
+			return -1;
+		}
+		long long ticks = to - from;
+		return (ticks / frequency) * 1000000000LL + ((ticks % frequency) * 1000000000LL) / frequency;
+	}
+};
+
+// Wraps one of the driver's log2 latency histograms.
+class Us4OemLatencyHistogram {
+public:
+	Us4OemLatencyHistogram(const us4oem_latency_histogram& raw) :
+		buckets(std::begin(raw.buckets), std::end(raw.buckets)),
+		sampleCount(raw.sample_count),
+		totalNs(raw.total_ns),
+		maxNs(raw.max_ns) {}
+
+	// Upper bound (in ns) of the bucket containing the given percentile (0-100).
+	// Log2 buckets mean this can overestimate by up to 2x, but never underestimates (except in the last bucket).
+	unsigned long long percentileNs(double percentile) const {
+		if (sampleCount == 0) {
+			return 0;
+		}
+		unsigned long long target = (unsigned long long)std::ceil(sampleCount * percentile / 100.0);
+		target = std::max(target, 1ULL);
+
+		unsigned long long seen = 0;
+		for (size_t i = 0; i < buckets.size(); i++) {
+			seen += buckets[i];
+			if (seen >= target) {
+				return std::min((2ULL << i) - 1, maxNs);
+			}
+		}
+		return maxNs;
+	}
+
+	double meanNs() const {
+		return sampleCount ? (double)totalNs / (double)sampleCount : 0.0;
+	}
+
+	std::string toString() const {
+		return std::format("n={} mean={:.1f}us p50<={:.1f}us p99<={:.1f}us p99.9<={:.1f}us max={:.1f}us",
+			sampleCount,
+			meanNs() / 1000.0,
+			percentileNs(50.0) / 1000.0,
+			percentileNs(99.0) / 1000.0,
+			percentileNs(99.9) / 1000.0,
+			maxNs / 1000.0);
+	}
+
+	std::vector<unsigned long long> buckets; // buckets[i] counts samples in [2^i, 2^(i+1)) ns
+	unsigned long long sampleCount;
+	unsigned long long totalNs;
+	unsigned long long maxNs;
+};
+
+// The driver-side view of IRQ latency, see US4OEM_WIN32_IOCTL_READ_LATENCY_STATS.
+class Us4OemLatencyReport {
+public:
+	Us4OemLatencyReport(const us4oem_latency_stats& raw) :
+		isrToDpc(raw.isr_to_dpc),
+		dpcToCompletion(raw.dpc_to_completion),
+		completionToNextPoll(raw.completion_to_next_poll) {}
+
+	std::string toString() const {
+		return std::format("  ISR -> DPC: {}\n"
+			"  DPC -> completion: {}\n"
+			"  Completion -> next poll: {}",
+			isrToDpc.toString(),
+			dpcToCompletion.toString(),
+			completionToNextPoll.toString());
+	}
+
+	Us4OemLatencyHistogram isrToDpc;
+	Us4OemLatencyHistogram dpcToCompletion;
+	Us4OemLatencyHistogram completionToNextPoll;
+};
+
+// Collects per-poll timestamps and computes exact percentiles for each stage.
+// Recordings can be saved as CSV and replayed later (or on another machine) with loadCsv().
+class Us4OemLatencyRecorder {
+public:
+	struct Percentiles {
+		size_t count = 0;
+		long long p50 = 0;
+		long long p90 = 0;
+		long long p99 = 0;
+		long long p999 = 0;
+		long long max = 0;
+
+		std::string toString() const {
+			return std::format("n={} p50={:.1f}us p90={:.1f}us p99={:.1f}us p99.9={:.1f}us max={:.1f}us",
+				count, p50 / 1000.0, p90 / 1000.0, p99 / 1000.0, p999 / 1000.0, max / 1000.0);
+		}
+	};
+
+	void add(const Us4OemPollTimestamps& sample) {
+		samples.push_back(sample);
+	}
+
+	const std::vector<Us4OemPollTimestamps>& getSamples() const {
+		return samples;
+	}
+
+	Percentiles isrToDpc() const { return compute(&Us4OemPollTimestamps::isrToDpcNs); }
+	Percentiles dpcToCompletion() const { return compute(&Us4OemPollTimestamps::dpcToCompletionNs); }
+	Percentiles completionToWake() const { return compute(&Us4OemPollTimestamps::completionToWakeNs); }
+	Percentiles isrToWake() const { return compute(&Us4OemPollTimestamps::isrToWakeNs); }
+
+	std::string toString() const {
+		return std::format("  ISR -> DPC: {}\n"
+			"  DPC -> completion: {}\n"
+			"  Completion -> wake-up: {}\n"
+			"  ISR -> wake-up (total): {}",
+			isrToDpc().toString(),
+			dpcToCompletion().toString(),
+			completionToWake().toString(),
+			isrToWake().toString());
+	}
+
+	// One sample per line: isr,dpc,completion,wake,frequency
+	void saveCsv(std::ostream& out) const {
+		for (const auto& s : samples) {
+			out << s.isr << ',' << s.dpc << ',' << s.completion << ',' << s.wake << ',' << s.frequency << '\n';
+		}
+	}
+
+	// Appends samples saved with saveCsv(). Malformed lines are skipped.
+	void loadCsv(std::istream& in) {
+		std::string line;
+		while (std::getline(in, line)) {
+			std::replace(line.begin(), line.end(), ',', ' ');
+			std::istringstream fields(line);
+			Us4OemPollTimestamps s;
+			if (fields >> s.isr >> s.dpc >> s.completion >> s.wake >> s.frequency) {
+				samples.push_back(s);
+			}
+		}
+	}
+
+private:
+	Percentiles compute(long long (Us4OemPollTimestamps::*stage)() const) const {
+		std::vector<long long> values;
+		values.reserve(samples.size());
+		for (const auto& s : samples) {
+			long long v = (s.*stage)();
+			if (v >= 0) {
+				values.push_back(v);
+			}
+		}
+
+		Percentiles result;
+		result.count = values.size();
+		if (values.empty()) {
+			return result;
+		}
+
+		std::sort(values.begin(), values.end());
+		auto at = [&](double percentile) {
+			size_t index = (size_t)std::ceil(values.size() * percentile / 100.0);
+			return values[std::clamp<size_t>(index, 1, values.size()) - 1];
+		};
+
+		result.p50 = at(50.0);
+		result.p90 = at(90.0);
+		result.p99 = at(99.0);
+		result.p999 = at(99.9);
+		result.max = values.back();
+		return result;
+	}
+
+	std::vector<Us4OemPollTimestamps> samples;
+};
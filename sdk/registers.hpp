@@ -0,0 +1,240 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Compile-time description of the device's registers, and typed accessors over a mapped BAR.
+//
+//   using Id = Us4OemRegister<4, 0x0, uint32_t, Us4OemRegisterAccess::ReadOnly>;
+//   using Enable = Us4OemField<Control, 0, 1>;
+//
+//   Us4OemBar<4> bar4(d.mapBar(4));
+//   bar4.read<Id>();
+//   bar4.set<Enable>(1); // Read-modify-write of Control
+//
+// Offsets, widths, alignment and access modes are checked when the code is compiled; every access is a single
+// volatile load or store of the register's width. Only standard headers are used, so register code can be built
+// and checked anywhere against Us4OemRecordingBackend.
+
+enum class Us4OemRegisterAccess {
+	ReadOnly,
+	WriteOnly,
+	ReadWrite,
+};
+
+template<unsigned Bar, size_t Offset, class T = uint32_t, Us4OemRegisterAccess Access = Us4OemRegisterAccess::ReadWrite>
+struct Us4OemRegister {
+	static_assert(Bar == 0 || Bar == 4, "Only BAR 0 and 4 are mapped");
+	static_assert(std::is_same_v<T, uint8_t> || std::is_same_v<T, uint16_t> || std::is_same_v<T, uint32_t> || std::is_same_v<T, uint64_t>,
+		"Registers are 8, 16, 32 or 64 bits wide");
+	static_assert(Offset % sizeof(T) == 0, "Registers must be naturally aligned");
+
+	using value_type = T;
+	static constexpr unsigned bar = Bar;
+	static constexpr size_t offset = Offset;
+	static constexpr Us4OemRegisterAccess access = Access;
+	static constexpr bool readable = Access != Us4OemRegisterAccess::WriteOnly;
+	static constexpr bool writable = Access != Us4OemRegisterAccess::ReadOnly;
+};
+
+// Bits [Lsb, Lsb + Width) of a register
+template<class Register, unsigned Lsb, unsigned Width>
+struct Us4OemField {
+	using register_type = Register;
+	using value_type = typename Register::value_type;
+
+	static_assert(Width > 0 && Lsb + Width <= std::numeric_limits<value_type>::digits, "Field doesn't fit its register");
+
+	static constexpr unsigned lsb = Lsb;
+	static constexpr unsigned width = Width;
+	static constexpr value_type max = Width == std::numeric_limits<value_type>::digits ?
+		std::numeric_limits<value_type>::max() : (value_type)((value_type(1) << Width) - 1);
+	static constexpr value_type mask = (value_type)(max << Lsb);
+
+	static constexpr value_type extract(value_type raw) {
+		return (value_type)((raw & mask) >> Lsb);
+	}
+
+	// Bits outside the field are dropped
+	static constexpr value_type encode(value_type value) {
+		return (value_type)((value << Lsb) & mask);
+	}
+};
+
+// Count registers of the same kind at consecutive addresses, starting at First, for burst accesses
+template<class First, size_t Count>
+struct Us4OemRegisterBlock {
+	static_assert(Count > 0, "Empty register block");
+
+	using value_type = typename First::value_type;
+	using first = First;
+	static constexpr unsigned bar = First::bar;
+	static constexpr size_t offset = First::offset;
+	static constexpr size_t count = Count;
+	static constexpr size_t length = Count * sizeof(value_type);
+
+	template<size_t Index>
+	using at = Us4OemRegister<First::bar, First::offset + Index * sizeof(value_type), value_type, First::access>;
+};
+
+// Direct accesses to a mapped BAR
+class Us4OemMmioBackend {
+public:
+	Us4OemMmioBackend(void* base, size_t length) : base(static_cast<unsigned char*>(base)), length(length) {}
+
+	template<class T>
+	T read(size_t offset) const {
+		assert(offset + sizeof(T) <= length);
+		return *reinterpret_cast<volatile const T*>(base + offset);
+	}
+
+	template<class T>
+	void write(size_t offset, T value) const {
+		assert(offset + sizeof(T) <= length);
+		*reinterpret_cast<volatile T*>(base + offset) = value;
+	}
+
+private:
+	unsigned char* base;
+	size_t length;
+};
+
+// One access seen by Us4OemRecordingBackend
+struct Us4OemRegisterAccessRecord {
+	bool write;
+	size_t offset;
+	unsigned width; // Bytes
+	uint64_t value; // Read or written
+};
+
+// Registers backed by plain memory, logging every access in order. Registers never written read as 0 unless
+// preset with poke(). Copies share the same log and memory.
+class Us4OemRecordingBackend {
+public:
+	struct State {
+		std::vector<Us4OemRegisterAccessRecord> log;
+		std::unordered_map<size_t, uint64_t> memory;
+	};
+
+	explicit Us4OemRecordingBackend(State& state) : state(&state) {}
+
+	template<class T>
+	T read(size_t offset) const {
+		auto it = state->memory.find(offset);
+		T value = it == state->memory.end() ? T(0) : (T)it->second;
+		state->log.push_back({ false, offset, (unsigned)sizeof(T), value });
+		return value;
+	}
+
+	template<class T>
+	void write(size_t offset, T value) const {
+		state->memory[offset] = value;
+		state->log.push_back({ true, offset, (unsigned)sizeof(T), value });
+	}
+
+	// Sets a register's value without logging, e.g. what the hardware would report
+	void poke(size_t offset, uint64_t value) const {
+		state->memory[offset] = value;
+	}
+
+private:
+	State* state;
+};
+
+// Typed accessors for the registers of one BAR
+template<unsigned Bar, class Backend = Us4OemMmioBackend>
+class Us4OemBar {
+public:
+	explicit Us4OemBar(Backend backend) : backend(backend) {}
+
+	// Anything with the address and lengthMapped of a mapping, e.g. Us4OemDevice::MemoryMapping
+	template<class Mapping> requires requires(const Mapping& m) { m.address; m.lengthMapped; }
+	explicit Us4OemBar(const Mapping& mapping) : backend(mapping.address, mapping.lengthMapped) {}
+
+	template<class Register>
+	typename Register::value_type read() const {
+		checkBar<Register>();
+		static_assert(Register::readable, "Register is write-only");
+		return backend.template read<typename Register::value_type>(Register::offset);
+	}
+
+	template<class Register>
+	void write(typename Register::value_type value) const {
+		checkBar<Register>();
+		static_assert(Register::writable, "Register is read-only");
+		backend.template write<typename Register::value_type>(Register::offset, value);
+	}
+
+	template<class Field>
+	typename Field::value_type get() const {
+		return Field::extract(read<typename Field::register_type>());
+	}
+
+	// Read-modify-write of the field's register; bits of value outside the field are dropped
+	template<class Field>
+	void set(typename Field::value_type value) const {
+		setFields<Field>(value);
+	}
+
+	// set() with a value that's checked to fit the field when compiled
+	template<class Field, typename Field::value_type Value>
+	void set() const {
+		static_assert(Value <= Field::max, "Value doesn't fit the field");
+		setFields<Field>(Value);
+	}
+
+	// Several fields of the same register in a single read-modify-write
+	template<class... Fields>
+	void setFields(typename Fields::value_type... values) const {
+		static_assert(sizeof...(Fields) > 0, "No fields to set");
+		using Register = typename std::tuple_element_t<0, std::tuple<Fields...>>::register_type;
+		static_assert((std::is_same_v<typename Fields::register_type, Register> && ...), "Fields must be of the same register");
+		static_assert(Register::readable && Register::writable, "Read-modify-write needs a read-write register");
+
+		constexpr typename Register::value_type mask = (Fields::mask | ...);
+		typename Register::value_type raw = read<Register>();
+		raw = (typename Register::value_type)((raw & ~mask) | (Fields::encode(values) | ...));
+		write<Register>(raw);
+	}
+
+	// Writes the whole block in address order, one store per register
+	template<class Block>
+	void writeBlock(const typename Block::value_type (&values)[Block::count]) const {
+		checkBar<Block>();
+		static_assert(Block::first::writable, "Register block is read-only");
+		for (size_t i = 0; i < Block::count; i++) {
+			backend.template write<typename Block::value_type>(Block::offset + i * sizeof(typename Block::value_type), values[i]);
+		}
+	}
+
+	template<class Block>
+	void readBlock(typename Block::value_type (&values)[Block::count]) const {
+		checkBar<Block>();
+		static_assert(Block::first::readable, "Register block is write-only");
+		for (size_t i = 0; i < Block::count; i++) {
+			values[i] = backend.template read<typename Block::value_type>(Block::offset + i * sizeof(typename Block::value_type));
+		}
+	}
+
+private:
+	template<class Register>
+	static constexpr void checkBar() {
+		static_assert(Register::bar == Bar, "Register is in another BAR");
+	}
+
+	Backend backend;
+};
+
+// The registers the SDK itself knows about
+struct Us4OemBar4Registers {
+	using Id = Us4OemRegister<4, 0x0, uint32_t, Us4OemRegisterAccess::ReadOnly>; // 0x010000ED on QEMU
+
+	// QEMU's test device only: writing 1 to both asserts an IRQ
+	using QemuIrqTrigger = Us4OemRegisterBlock<Us4OemRegister<4, 0x60, uint32_t, Us4OemRegisterAccess::WriteOnly>, 2>;
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "api.hpp"
+
+// A sequence of BAR 0/4 register accesses executed by the driver in a single call, see
+// Us4OemDevice::runRegisterSequence. Works without mapping the BARs into the process.
+// Operations are numbered in the order they were added, starting at 0; read results are looked up by that index.
+//
+// Example:
+//   Us4OemRegisterSequence seq;
+//   seq.write(4, 0x100, 0x1)
+//      .poll(4, 0x104, 0x1, 0x1, 1000)
+//      .read(4, 0x108);
+//   device.runRegisterSequence(seq);
+//   unsigned long long status = seq.value(2);
+class Us4OemRegisterSequence {
+public:
+	Us4OemRegisterSequence() {
+		clear();
+	}
+
+	// Removes all operations.
+	void clear() {
+		buffer.assign(sizeof(us4oem_reg_access_header), 0);
+	}
+
+	Us4OemRegisterSequence& read(unsigned char bar, unsigned long long offset, unsigned char width = 4) {
+		return add(US4OEM_REG_OP_READ, bar, offset, width, 0, 0, 0);
+	}
+
+	Us4OemRegisterSequence& write(unsigned char bar, unsigned long long offset, unsigned long long value, unsigned char width = 4) {
+		return add(US4OEM_REG_OP_WRITE, bar, offset, width, value, 0, 0);
+	}
+
+	// Changes only the bits in mask to the ones in value. The result is the value before the change.
+	Us4OemRegisterSequence& modify(unsigned char bar, unsigned long long offset, unsigned long long mask, unsigned long long value,
+		unsigned char width = 4) {
+		return add(US4OEM_REG_OP_READ_MODIFY_WRITE, bar, offset, width, value, mask, 0);
+	}
+
+	// Waits until the bits in mask equal the ones in value; the sequence stops with a timeout error if they don't in time.
+	// The result is the last value read.
+	Us4OemRegisterSequence& poll(unsigned char bar, unsigned long long offset, unsigned long long mask, unsigned long long value,
+		unsigned long timeoutUs, unsigned char width = 4) {
+		return add(US4OEM_REG_OP_POLL, bar, offset, width, value, mask, timeoutUs);
+	}
+
+	size_t size() const {
+		return (buffer.size() - sizeof(us4oem_reg_access_header)) / sizeof(us4oem_reg_op);
+	}
+
+	// Number of operations that succeeded in the last run.
+	unsigned long executed() const {
+		return header()->executed;
+	}
+
+	// Status (NTSTATUS) of the operation that failed in the last run (at index executed()), 0 if none did.
+	long status() const {
+		return header()->status;
+	}
+
+	bool succeeded() const {
+		return us4oemStatusSucceeded(header()->status) && header()->executed == size();
+	}
+
+	// Result of an operation, see us4oem_reg_op_type. Throws if the operation didn't succeed.
+	unsigned long long value(size_t index) const {
+		if (index >= executed()) {
+			throw std::runtime_error("Register operation " + std::to_string(index) + " didn't succeed");
+		}
+		us4oem_reg_op op;
+		std::memcpy(&op, buffer.data() + US4OEM_REG_ACCESS_SIZE(index), sizeof(op));
+		return op.value;
+	}
+
+private:
+	friend class Us4OemDevice;
+	friend class Us4OemBatch;
+
+	Us4OemRegisterSequence& add(us4oem_reg_op_type type, unsigned char bar, unsigned long long offset, unsigned char width,
+		unsigned long long value, unsigned long long mask, unsigned long timeoutUs) {
+		if (size() >= US4OEM_REG_MAX_OPS) {
+			throw std::length_error("Too many register operations in a sequence");
+		}
+
+		us4oem_reg_op op = {};
+		op.bar = bar;
+		op.width = width;
+		op.op = (unsigned char)type;
+		op.timeout_us = timeoutUs;
+		op.offset = offset;
+		op.value = value;
+		op.mask = mask;
+		buffer.insert(buffer.end(), reinterpret_cast<unsigned char*>(&op), reinterpret_cast<unsigned char*>(&op) + sizeof(op));
+
+		header()->op_count = (unsigned long)size();
+		return *this;
+	}
+
+	us4oem_reg_access_header* header() {
+		return reinterpret_cast<us4oem_reg_access_header*>(buffer.data());
+	}
+
+	const us4oem_reg_access_header* header() const {
+		return reinterpret_cast<const us4oem_reg_access_header*>(buffer.data());
+	}
+
+	// Laid out exactly as the driver expects it: header, then the operations; results are written back in place
+	std::vector<unsigned char> buffer;
+};
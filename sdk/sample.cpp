@@ -2,17 +2,18 @@
 
 #include <iostream>
 #include <thread>
+#include <fstream>
+#include <random>
 
 const bool QEMU_TEST = false;
 
-bool qemuTriggerIrq(void* bar4) {
+bool qemuTriggerIrq(const Us4OemDevice::MemoryMapping& bar4) {
 	if (!QEMU_TEST) {
 		std::cerr << "QEMU test is disabled; cannot trigger IRQ." << std::endl;
 		return false;
 	}
 	// Assert an IRQ
-	((int*)bar4)[0x60 / sizeof(int)] = 0x01;
-	((int*)bar4)[0x64 / sizeof(int)] = 0x01;
+	Us4OemBar<4>(bar4).writeBlock<Us4OemBar4Registers::QemuIrqTrigger>({ 0x01, 0x01 });
 	Sleep(100); // Wait a bit for QEMU to trigger the IRQ, Windows to handle it, DPC to fire etc.
 	return true;
 }
@@ -82,6 +83,331 @@ void torture(const Us4OemDeviceLocation& location) {
 	// Close is handled by destructor
 }
 
+void latency(const Us4OemDeviceLocation& location, size_t samples) {
+	std::cout << std::endl << "========== IRQ latency on " << location.toString() << " ==========" << std::endl;
+
+	Us4OemDevice d(location);
+	if (!d.open()) {
+		std::cerr << "Failed to open." << std::endl;
+		return;
+	}
+
+	Us4OemDevice::MemoryMapping bar4 = QEMU_TEST ? d.mapBar(4) : Us4OemDevice::MemoryMapping{};
+
+	Us4OemLatencyRecorder recorder;
+	for (size_t i = 0; i < samples; i++) {
+		if (QEMU_TEST) {
+			qemuTriggerIrq(bar4);
+		}
+		recorder.add(d.pollWithTimestamps());
+	}
+
+	std::cout << "Measured from user-space (" << samples << " polls):" << std::endl << recorder.toString() << std::endl;
+	std::cout << "Driver histograms:" << std::endl << d.readLatencyStats().toString() << std::endl;
+
+	std::ofstream csv(std::format("latency_{}.csv", location.toString()));
+	recorder.saveCsv(csv);
+}
+
+// Compares issuing small commands one by one with submitting them as a batch
+void batch(const Us4OemDeviceLocation& location, size_t rounds) {
+	std::cout << std::endl << "========== Batch overhead on " << location.toString() << " ==========" << std::endl;
+
+	Us4OemDevice d(location);
+	if (!d.open()) {
+		std::cerr << "Failed to open." << std::endl;
+		return;
+	}
+
+	const size_t commandsPerRound = 16;
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < rounds; i++) {
+		for (size_t j = 0; j < commandsPerRound / 2; j++) {
+			d.pollClearPending();
+			d.readStats();
+		}
+	}
+	auto single = std::chrono::steady_clock::now() - start;
+
+	Us4OemBatch b;
+	for (size_t j = 0; j < commandsPerRound / 2; j++) {
+		b.pollClearPending().readStats();
+	}
+
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < rounds; i++) {
+		if (!d.submitBatch(b)) {
+			std::cerr << "Batch failed after " << b.executed() << " commands." << std::endl;
+			return;
+		}
+	}
+	auto batched = std::chrono::steady_clock::now() - start;
+
+	double commands = double(rounds * commandsPerRound);
+	std::cout << std::format("One by one: {:.2f} us per command",
+		std::chrono::duration<double, std::micro>(single).count() / commands) << std::endl;
+	std::cout << std::format("Batched ({} per batch): {:.2f} us per command",
+		commandsPerRound, std::chrono::duration<double, std::micro>(batched).count() / commands) << std::endl;
+}
+
+// Compares the cost of an empty non-blocking poll through the exception-free and the throwing API,
+// and through the throw/catch that pollNonBlocking used to do for every empty poll
+void bench(const Us4OemDeviceLocation& location, size_t rounds) {
+	std::cout << std::endl << "========== Poll overhead on " << location.toString() << " ==========" << std::endl;
+
+	Us4OemDevice d(location);
+	if (!d.open()) {
+		std::cerr << "Failed to open." << std::endl;
+		return;
+	}
+
+	d.pollClearPending(); // Every poll below should find nothing pending
+	size_t pending = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < rounds; i++) {
+		try {
+			if (!d.tryPollNonBlocking().value()) {
+				throw std::runtime_error("DeviceIoControl failed: " + std::to_string(ERROR_BUSY));
+			}
+			pending++;
+		}
+		catch (const std::runtime_error&) {
+		}
+	}
+	auto exceptions = std::chrono::steady_clock::now() - start;
+
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < rounds; i++) {
+		pending += d.pollNonBlocking() ? 1 : 0;
+	}
+	auto throwing = std::chrono::steady_clock::now() - start;
+
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < rounds; i++) {
+		auto result = d.tryPollNonBlocking();
+		pending += result && *result ? 1 : 0;
+	}
+	auto expected = std::chrono::steady_clock::now() - start;
+
+	auto perCall = [rounds](auto elapsed) {
+		return std::chrono::duration<double, std::nano>(elapsed).count() / double(rounds);
+	};
+
+	std::cout << std::format("Throw/catch per empty poll: {:.0f} ns per call", perCall(exceptions)) << std::endl;
+	std::cout << std::format("pollNonBlocking(): {:.0f} ns per call", perCall(throwing)) << std::endl;
+	std::cout << std::format("tryPollNonBlocking(): {:.0f} ns per call", perCall(expected)) << std::endl;
+	if (pending != 0) {
+		std::cout << pending << " polls found an IRQ pending, the numbers above are skewed." << std::endl;
+	}
+}
+
+// Copies with every kernel the CPU supports, from ordinary memory and (if there's a device) from a mapped DMA buffer
+void copyBench(Us4OemDriverSdk& sdk, size_t length) {
+	std::cout << std::endl << "========== Copy throughput ==========" << std::endl;
+
+	const unsigned threads = std::max(std::thread::hardware_concurrency() / 2, 1u);
+	std::vector<unsigned char> source(length, 0x5A);
+	std::vector<unsigned char> destination(length);
+
+	auto run = [&](const char* from, const void* src) {
+		for (auto kernel : { Us4OemCopyKernel::Scalar, Us4OemCopyKernel::Sse41, Us4OemCopyKernel::Avx2, Us4OemCopyKernel::Avx512 }) {
+			if (!Us4OemCopyEngine::supported(kernel)) {
+				continue;
+			}
+			for (unsigned t : { 1u, threads }) {
+				Us4OemCopyResult result = Us4OemCopyEngine(kernel, t).copy(destination.data(), src, length);
+				std::cout << std::format("{} {} x{}: {:.2f} GiB/s", from, us4oemCopyKernelName(kernel), result.threads, result.gibPerSecond()) << std::endl;
+			}
+		}
+	};
+
+	run("Memory", source.data());
+
+	if (sdk.getDeviceCount() == 0) {
+		return;
+	}
+
+	Us4OemDevice d(sdk.getDeviceLocation(0));
+	if (!d.open() || !d.getCapabilities().has(US4OEM_CAPABILITY_HANDLES)) {
+		return;
+	}
+
+	Us4OemDmaBuffer buffer = d.allocDmaBuffer((unsigned long)length);
+	run("DMA buffer", buffer.map().address());
+}
+
+// Times offset to physical address lookups and compact-format scans in a made-up scatter-gather buffer of the
+// given number of chunks, once with chunks of equal length and once with random lengths
+void sgIndexBench(size_t chunkCount) {
+	std::cout << std::endl << "========== Scatter-gather index ==========" << std::endl;
+
+	chunkCount = std::max<size_t>(chunkCount, 1);
+
+	std::mt19937_64 random(1);
+
+	for (bool uniform : { true, false }) {
+		Us4OemDmaSgDescription description = {};
+		for (size_t i = 0; i < chunkCount; i++) {
+			size_t length = uniform ? 64 * KiB : 4 * KiB * (1 + random() % 16);
+			description.chunks.push_back({ description.length, (random() % (1ull << 24)) << 12, length });
+			description.length += length;
+		}
+
+		Us4OemDmaSgIndex index(description);
+
+		std::vector<size_t> offsets(1000000);
+		for (auto& offset : offsets) {
+			offset = random() % description.length;
+		}
+
+		size_t checksum = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t offset : offsets) {
+			checksum += index.find(offset)->pa;
+		}
+		std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+		size_t runs = 0;
+		for (const auto& run : index.runs(0, description.length)) {
+			checksum += run.pa;
+			runs++;
+		}
+
+		std::cout << std::format("{} chunks ({}): {:.1f} ns per lookup, {} runs (checksum {:x})",
+			chunkCount, index.isUniform() ? "uniform" : "varied", elapsed.count() / (double)offsets.size(), runs, checksum) << std::endl;
+
+		Us4OemDmaSgCompact compact(description);
+		std::vector<uint64_t> pas(chunkCount);
+
+		start = std::chrono::steady_clock::now();
+		compact.decodePas(0, chunkCount, pas.data());
+		checksum += compact.runCount() + compact.physicalBounds().second;
+		elapsed = std::chrono::steady_clock::now() - start;
+
+		std::cout << std::format("  Compact: {} KiB instead of {} KiB, decoding and scanning took {:.0f} us (checksum {:x})",
+			compact.memoryUsage() / KiB, chunkCount * sizeof(Us4OemDmaSgChunk) / KiB, elapsed.count() / 1000, checksum + pas.back()) << std::endl;
+	}
+}
+
+// Hands scatter-gather buffers from one run to the next through a lease: a run takes over the buffers of the
+// layout saved at path if the lease is still running, otherwise it allocates them. Either way it saves the layout
+// and leaves the buffers to the lease.
+void lease(const Us4OemDeviceLocation& location, const std::string& path, std::chrono::seconds duration) {
+	std::cout << std::endl << "========== Lease ==========" << std::endl;
+
+	Us4OemDevice d(location);
+	if (!d.open() || !d.getCapabilities().has(US4OEM_CAPABILITY_LEASE)) {
+		std::cerr << "Leases are not supported by the driver" << std::endl;
+		return;
+	}
+
+	std::vector<Us4OemSgBuffer> buffers;
+	unsigned long long token = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	if (std::filesystem::exists(path)) {
+		try {
+			Us4OemSgLayout layout = Us4OemSgLayout::load(path);
+			buffers = d.attachSgBuffers(layout);
+			token = layout.token;
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Can't take the buffers over: " << e.what() << std::endl;
+		}
+	}
+
+	const char* how = "Took over";
+	if (buffers.empty()) {
+		std::random_device random;
+		token = ((unsigned long long)random() << 32 | random()) | 1; // Never 0, which clears the lease
+		buffers = d.allocSgBuffers(QEMU_TEST ? 256 * MiB : GiB * (size_t)22);
+		how = "Allocated";
+	}
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	Us4OemSgLayout layout = d.describeLayout(buffers, token, duration);
+	std::cout << std::format("{} {} buffers ({} MiB) in {:.1f} ms", how, buffers.size(), layout.totalLength() / MiB, elapsed.count()) << std::endl;
+
+	d.setStickyMode(true);
+	d.setLease(token, duration);
+	layout.save(path);
+	for (auto& buffer : buffers) {
+		buffer.detach();
+	}
+
+	std::cout << "Layout saved to " << path << ", run again within " << duration.count() << " s to take the buffers over" << std::endl;
+}
+
+// Opens, allocates on and maps all devices at once, and times each step
+void group(Us4OemDriverSdk& sdk) {
+	std::cout << std::endl << "========== Device group ==========" << std::endl;
+
+	Us4OemDeviceGroup g(sdk);
+	if (g.size() == 0) {
+		return;
+	}
+
+	auto timed = [](const char* step, auto&& fn) {
+		auto start = std::chrono::steady_clock::now();
+		fn();
+		std::cout << std::format("{}: {:.2f} ms", step,
+			std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()) << std::endl;
+	};
+
+	try {
+		timed("Open", [&]() { g.open(); });
+
+		for (size_t i = 0; i < g.size(); i++) {
+			unsigned long node = g.numaNode(i);
+			std::cout << g[i].getLocation().toString() << ": NUMA node "
+				<< (node == US4OEM_NUMA_NODE_UNKNOWN ? std::string("unknown") : std::to_string(node)) << std::endl;
+		}
+
+		std::vector<Us4OemDevice::MemoryMapping> bars;
+		timed("Map BAR 4", [&]() { bars = g.mapBars(4); });
+
+		std::vector<Us4OemDmaBuffer> buffers;
+		timed("Allocate 16 MiB", [&]() { buffers = g.allocDmaBuffers(16 * MiB); });
+
+		std::cout << g.readStats().toString() << std::endl;
+
+		timed("Release", [&]() { buffers.clear(); });
+	}
+	catch (const Us4OemGroupException& e) {
+		std::cerr << e.what() << std::endl;
+	}
+}
+
+// Records the driver's events around a few polls and prints them
+void events(const Us4OemDeviceLocation& location, size_t polls) {
+	std::cout << std::endl << "========== Driver events on " << location.toString() << " ==========" << std::endl;
+
+	Us4OemDevice d(location);
+	if (!d.open()) {
+		std::cerr << "Failed to open." << std::endl;
+		return;
+	}
+	if (!d.getCapabilities().has(US4OEM_CAPABILITY_EVENT_RING)) {
+		std::cerr << "Event recording is not supported by the driver." << std::endl;
+		return;
+	}
+
+	Us4OemDevice::MemoryMapping bar4 = QEMU_TEST ? d.mapBar(4) : Us4OemDevice::MemoryMapping{};
+
+	d.setEventMask(US4OEM_EVENT_MASK_ALL);
+	for (size_t i = 0; i < polls; i++) {
+		if (QEMU_TEST) {
+			qemuTriggerIrq(bar4);
+		}
+		d.pollFor(std::chrono::milliseconds(10));
+	}
+	d.setEventMask(0);
+
+	std::cout << d.readEvents().toString() << std::endl;
+}
+
 void test(const Us4OemDeviceLocation& location) {
 	std::cin.get();
 
@@ -109,6 +435,7 @@ void test(const Us4OemDeviceLocation& location) {
 		std::cerr << "KMD not compatible; not continuing." << std::endl;
 		return;
 	}
+	std::cout << "KMD capabilities: " << std::endl << d.getCapabilities().toString() << std::endl;
 
 	// Bar 0 mapping test
 	std::cout << std::endl << "====== BAR Mapping Test ======" << std::endl;
@@ -118,12 +445,33 @@ void test(const Us4OemDeviceLocation& location) {
 
 	// Bar 4 mapping test
 	auto bar4 = d.mapBar(4);
+	Us4OemBar<4> bar4Registers(bar4);
 	std::cout << "BAR 4 mapped at: 0x" << std::hex << bar4.address << " length: 0x" << bar4.lengthMapped << std::dec << std::endl;
-	std::cout << "  @ offset 0x0: 0x" << std::hex << *(unsigned int*)((char*)bar4.address + 0x0) << std::dec << std::endl;
+	std::cout << "  @ offset 0x0: 0x" << std::hex << bar4Registers.read<Us4OemBar4Registers::Id>() << std::dec << std::endl;
 	if (QEMU_TEST) {
 		// We are expecting 0x0 to be 0x0100_00ED on QEMU
-		if (*(unsigned int*)((char*)bar4.address + 0x0) != 0x010000ED) {
-			std::cerr << "Unexpected value at BAR 4 offset 0x0: 0x" << std::hex << *(unsigned int*)((char*)bar4.address + 0x0) << std::dec << std::endl;
+		if (bar4Registers.read<Us4OemBar4Registers::Id>() != 0x010000ED) {
+			std::cerr << "Unexpected value at BAR 4 offset 0x0: 0x" << std::hex << bar4Registers.read<Us4OemBar4Registers::Id>() << std::dec << std::endl;
+			return;
+		}
+	}
+
+	// Register access through the driver, without the mapping
+	std::cout << std::endl << "====== Register Access Test ======" << std::endl;
+	if (!d.getCapabilities().has(US4OEM_CAPABILITY_REGISTER_ACCESS)) {
+		std::cout << "Not supported by the driver, skipping" << std::endl;
+	} else {
+		Us4OemRegisterSequence registers;
+		registers.read(4, 0x0).read(0, 0x0);
+		if (!d.runRegisterSequence(registers)) {
+			std::cerr << "Register access failed after " << registers.executed() << " operations, status 0x"
+				<< std::hex << registers.status() << std::dec << std::endl;
+			return;
+		}
+		std::cout << "BAR 4 @ offset 0x0: 0x" << std::hex << registers.value(0)
+			<< ", BAR 0 @ offset 0x0: 0x" << registers.value(1) << std::dec << std::endl;
+		if (registers.value(0) != bar4Registers.read<Us4OemBar4Registers::Id>()) {
+			std::cerr << "Register access and the mapping disagree about BAR 4 offset 0x0" << std::endl;
 			return;
 		}
 	}
@@ -137,14 +485,14 @@ void test(const Us4OemDeviceLocation& location) {
 	// We can only test this in QEMU, as it simulates the IRQs.
 	if (QEMU_TEST) {
 		// Assert an IRQ
-		qemuTriggerIrq(bar4.address);
+		qemuTriggerIrq(bar4);
 
 		std::cout << "Polling for IRQ..." << std::endl;
 		d.poll();
 		std::cout << "IRQ received." << std::endl;
 
 		// Trigger another IRQ
-		qemuTriggerIrq(bar4.address);
+		qemuTriggerIrq(bar4);
 
 		// Test non-blocking poll
 		std::cout << "Polling for IRQ non-blocking..." << std::endl;
@@ -166,7 +514,7 @@ void test(const Us4OemDeviceLocation& location) {
 		}
 
 		// Create another IRQ, and clear pending IRQs
-		qemuTriggerIrq(bar4.address);
+		qemuTriggerIrq(bar4);
 
 		std::cout << "Clearing pending IRQs..." << std::endl;
 		d.pollClearPending();
@@ -352,6 +700,55 @@ void test(const Us4OemDeviceLocation& location) {
 		std::cerr << 
 			"Sticky mode works: no DMA contiguous buffer allocated after reopening the device." << std::endl;
 	}
+
+	// Per-IOCTL statistics for everything above
+	std::cout << std::endl << "====== IOCTL Stats ======" << std::endl;
+	std::cout << d.readIoctlStats().toString() << std::endl;
+
+	std::cout << std::endl << "====== Queue Stats ======" << std::endl;
+	std::cout << d.readQueueStats().toString() << std::endl;
+
+	if (d.getCapabilities().has(US4OEM_CAPABILITY_EXTENDED_STATS)) {
+		std::cout << std::endl << "====== Extended Stats ======" << std::endl;
+		Us4OemExtendedStats before = d.readExtendedStats();
+		std::cout << before.toString() << std::endl;
+
+		auto buffer = d.allocDmaContig(MiB);
+		for (int i = 0; i < 100; i++) {
+			d.pollNonBlocking();
+		}
+		d.deallocDmaContig(buffer.pa);
+
+		std::cout << d.readExtendedStats().delta(before).toString() << std::endl;
+	}
+
+	if (d.getCapabilities().has(US4OEM_CAPABILITY_HANDLES)) {
+		std::cout << std::endl << "====== Owned buffers ======" << std::endl;
+		{
+			Us4OemDmaBuffer contig = d.allocDmaBuffer(MiB);
+			std::vector<Us4OemSgBuffer> sg = d.allocSgBuffers(64 * MiB);
+
+			contig.map().as<unsigned char>()[0] = 0xAA;
+			for (auto& buffer : sg) {
+				std::fill_n(buffer.map().as<unsigned char>(), buffer.length(), (unsigned char)0x55);
+			}
+
+			std::cout << "Contiguous buffer PA 0x" << std::hex << contig.pa() << std::dec
+				<< ", handle 0x" << std::hex << contig.handle() << std::dec << std::endl;
+			std::cout << "Scatter-gather buffers: " << sg.size() << std::endl;
+
+			if (d.getCapabilities().has(US4OEM_CAPABILITY_MMAP_AT_ADDRESS)) {
+				Us4OemContiguousView view = d.mapContiguous(sg);
+				std::cout << "Contiguous view: " << view.length() << " bytes at 0x" << std::hex << view.data() << std::dec
+					<< (view.as<unsigned char>()[view.length() - 1] == 0x55 ? "" : ", unexpected contents") << std::endl;
+			}
+
+			Us4OemDmaBuffer moved = std::move(contig); // The moved-from buffer releases nothing
+			std::cout << "Moved buffer owns the allocation: " << (moved && !contig ? "yes" : "no") << std::endl;
+		} // Everything is unmapped and released here
+
+		std::cout << d.readExtendedStats().toString() << std::endl;
+	}
 }
 
 int main(int argc, char* argv[]) {
@@ -373,6 +770,14 @@ int main(int argc, char* argv[]) {
 		std::cout << "  " << argv[0] << " list" << std::endl << "    List all devices and exit" << std::endl;
 		std::cout << "  " << argv[0] << " test" << std::endl << "    Basic test of all the functions" << std::endl;
 		std::cout << "  " << argv[0] << " torture" << std::endl << "    Torture test for bugcheck hunting and looking for memory leaks (press enter to stop)" << std::endl;
+		std::cout << "  " << argv[0] << " latency [samples]" << std::endl << "    Measure IRQ latency over a number of polls (default 1000) and save the timestamps as CSV" << std::endl;
+		std::cout << "  " << argv[0] << " batch [rounds]" << std::endl << "    Compare the per-command overhead of single IOCTLs and batches (default 10000 rounds)" << std::endl;
+		std::cout << "  " << argv[0] << " events [polls]" << std::endl << "    Record the driver's events during a number of polls (default 16) and print them" << std::endl;
+		std::cout << "  " << argv[0] << " copy [MiB]" << std::endl << "    Measure the throughput of every copy kernel, from memory and from a DMA buffer (default 64 MiB)" << std::endl;
+		std::cout << "  " << argv[0] << " sgindex [chunks]" << std::endl << "    Time offset to physical address lookups and compact scans in a scatter-gather buffer of a number of chunks (default 1000000)" << std::endl;
+		std::cout << "  " << argv[0] << " lease [file] [seconds]" << std::endl << "    Take over the buffers of the layout in file (default us4oem.layout) or allocate them, then keep them for the next run (default 60 s)" << std::endl;
+		std::cout << "  " << argv[0] << " group" << std::endl << "    Open, allocate on and map all devices in parallel" << std::endl;
+		std::cout << "  " << argv[0] << " bench [rounds]" << std::endl << "    Compare the overhead of empty non-blocking polls with and without exceptions (default 100000 rounds)" << std::endl;
 
 		return 0;
 	}
@@ -419,6 +824,52 @@ int main(int argc, char* argv[]) {
 
 		return 0;
 
+	} else if (command == "latency") {
+		size_t samples = argc > 2 ? std::stoul(argv[2]) : 1000;
+
+		for (int i = 0; i < deviceCount; ++i) {
+			latency(sdk.getDeviceLocation(i), samples);
+		}
+
+	} else if (command == "batch") {
+		size_t rounds = argc > 2 ? std::stoul(argv[2]) : 10000;
+
+		for (int i = 0; i < deviceCount; ++i) {
+			batch(sdk.getDeviceLocation(i), rounds);
+		}
+
+	} else if (command == "copy") {
+		size_t length = (argc > 2 ? std::stoul(argv[2]) : 64) * MiB;
+		copyBench(sdk, length);
+
+	} else if (command == "sgindex") {
+		sgIndexBench(argc > 2 ? std::stoul(argv[2]) : 1000000);
+
+	} else if (command == "lease") {
+		std::string path = argc > 2 ? argv[2] : "us4oem.layout";
+		std::chrono::seconds duration(argc > 3 ? std::stoul(argv[3]) : 60);
+
+		if (deviceCount > 0) {
+			lease(sdk.getDeviceLocation(0), path, duration);
+		}
+
+	} else if (command == "group") {
+		group(sdk);
+
+	} else if (command == "bench") {
+		size_t rounds = argc > 2 ? std::stoul(argv[2]) : 100000;
+
+		for (int i = 0; i < deviceCount; ++i) {
+			bench(sdk.getDeviceLocation(i), rounds);
+		}
+
+	} else if (command == "events") {
+		size_t polls = argc > 2 ? std::stoul(argv[2]) : 16;
+
+		for (int i = 0; i < deviceCount; ++i) {
+			events(sdk.getDeviceLocation(i), polls);
+		}
+
 	} else if (command == "test") {
 
 		for (int i = 0; i < deviceCount; ++i) {
@@ -3,7 +3,19 @@
 // Headers local to this SDK
 #include "common.hpp"
 #include "stats.hpp"
+#include "latency.hpp"
+#include "batch.hpp"
+#include "error.hpp"
+#include "buffers.hpp"
+#include "copy.hpp"
+#include "regsequence.hpp"
+#include "registers.hpp"
+#include "capabilities.hpp"
+#include "events.hpp"
 #include "device.hpp"
 #include "devicelocation.hpp"
+#include "devicecache.hpp"
 #include "sg.hpp"
-#include "driver.hpp"
\ No newline at end of file
+#include "sglayout.hpp"
+#include "driver.hpp"
+#include "group.hpp"
\ No newline at end of file
@@ -1,10 +1,18 @@
 #pragma once
 
-#include "common.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 
 // This is the type that will be used to represent a scatter-gather chunk.
 struct Us4OemDmaSgChunk {
-	size_t vaOffset; // Offset from the top VA
+	size_t vaOffset; // Offset of the chunk's first byte from the top VA
 	size_t pa; // Physical address of the allocated buffer
 	size_t length; // Length of this chunk
 };
@@ -14,4 +22,380 @@ struct Us4OemDmaSgDescription {
 	void* va; // VA of the allocated buffer
 	size_t length; // Total length of all allocated chunks
 	std::vector<Us4OemDmaSgChunk> chunks; // The allocated chunks
-};
\ No newline at end of file
+};
+
+// Where a byte of a scatter-gather buffer is, see Us4OemDmaSgIndex::find
+struct Us4OemDmaSgLocation {
+	size_t chunk; // Index of the chunk the byte is in, among the chunks the index was built from (empty ones included)
+	size_t pa; // Physical address of the byte
+	size_t remaining; // Bytes from it to the end of the chunk
+};
+
+// A physically contiguous part of a range of a scatter-gather buffer, see Us4OemDmaSgIndex::runs
+struct Us4OemDmaSgRun {
+	size_t offset; // From the top VA
+	size_t pa;
+	size_t length;
+};
+
+// Maps offsets into a scatter-gather buffer to physical addresses. Lookups are a binary search over the chunk
+// start offsets, or a division when every chunk but the last has the same length (the common case, the driver
+// allocates in fixed-size chunks). The offsets are computed from the chunk lengths, so the index doesn't depend
+// on vaOffset. Only standard headers are used, so it can be built and checked on any OS.
+class Us4OemDmaSgIndex {
+public:
+	Us4OemDmaSgIndex() = default;
+
+	explicit Us4OemDmaSgIndex(const std::vector<Us4OemDmaSgChunk>& chunks) {
+		starts.reserve(chunks.size() + 1);
+		pas.reserve(chunks.size());
+		original.reserve(chunks.size());
+
+		size_t offset = 0;
+		for (size_t i = 0; i < chunks.size(); i++) {
+			const auto& chunk = chunks[i];
+			if (chunk.length == 0) {
+				continue; // Holds no bytes, and would break the search
+			}
+			original.push_back(i);
+			starts.push_back(offset);
+			pas.push_back(chunk.pa);
+			offset += chunk.length;
+		}
+		starts.push_back(offset); // End of the last chunk, so every chunk's length is starts[i + 1] - starts[i]
+
+		// Nothing skipped, so the indices are the same
+		if (original.size() == chunks.size()) {
+			original.clear();
+		}
+		original.shrink_to_fit();
+
+		// Uniform if all but the last chunk have the length of the first; the last one may be shorter
+		size_t count = pas.size();
+		if (count > 0) {
+			uniformLength = starts[1];
+			for (size_t i = 1; i < count; i++) {
+				size_t chunkLength = starts[i + 1] - starts[i];
+				if (chunkLength > uniformLength || (chunkLength != uniformLength && i + 1 < count)) {
+					uniformLength = 0;
+					break;
+				}
+			}
+		}
+	}
+
+	explicit Us4OemDmaSgIndex(const Us4OemDmaSgDescription& description) : Us4OemDmaSgIndex(description.chunks) {}
+
+	// Total length of the chunks
+	size_t length() const {
+		return starts.empty() ? 0 : starts.back();
+	}
+
+	// Non-empty chunks
+	size_t chunkCount() const {
+		return pas.size();
+	}
+
+	// Whether lookups are O(1)
+	bool isUniform() const {
+		return uniformLength != 0;
+	}
+
+	// The chunk holding the byte at offset and its physical address, nothing if offset is past the end
+	std::optional<Us4OemDmaSgLocation> find(size_t offset) const {
+		if (offset >= length()) {
+			return std::nullopt;
+		}
+
+		size_t chunk = chunkAt(offset);
+		size_t into = offset - starts[chunk];
+		return Us4OemDmaSgLocation{ original.empty() ? chunk : original[chunk], pas[chunk] + into, starts[chunk + 1] - offset };
+	}
+
+	// See runs()
+	class RunIterator {
+	public:
+		using iterator_category = std::input_iterator_tag;
+		using value_type = Us4OemDmaSgRun;
+		using difference_type = std::ptrdiff_t;
+		using pointer = const Us4OemDmaSgRun*;
+		using reference = const Us4OemDmaSgRun&;
+
+		RunIterator() = default;
+
+		reference operator*() const { return run; }
+		pointer operator->() const { return &run; }
+
+		RunIterator& operator++() {
+			next();
+			return *this;
+		}
+
+		RunIterator operator++(int) {
+			RunIterator previous = *this;
+			next();
+			return previous;
+		}
+
+		bool operator==(std::default_sentinel_t) const { return run.length == 0; }
+
+	private:
+		friend class Us4OemDmaSgIndex;
+
+		RunIterator(const Us4OemDmaSgIndex* index, size_t offset, size_t end) : index(index), end(end) {
+			if (offset < end) {
+				chunk = index->chunkAt(offset);
+				run.offset = offset;
+				next();
+			}
+		}
+
+		// Takes the run starting at run.offset + run.length, which is in chunk
+		void next() {
+			size_t offset = run.offset + run.length;
+			run = { offset, 0, 0 };
+			if (offset >= end) {
+				return;
+			}
+
+			const auto& starts = index->starts;
+			const auto& pas = index->pas;
+
+			run.pa = pas[chunk] + (offset - starts[chunk]);
+			size_t stop = std::min(end, starts[chunk + 1]);
+			chunk++;
+
+			while (stop < end && pas[chunk] == pas[chunk - 1] + (starts[chunk] - starts[chunk - 1])) {
+				stop = std::min(end, starts[chunk + 1]);
+				chunk++;
+			}
+
+			run.length = stop - offset;
+		}
+
+		const Us4OemDmaSgIndex* index = nullptr;
+		size_t chunk = 0; // Chunk the next run starts in
+		size_t end = 0;
+		Us4OemDmaSgRun run = {};
+	};
+
+	struct Runs {
+		RunIterator first;
+
+		RunIterator begin() const { return first; }
+		std::default_sentinel_t end() const { return {}; }
+	};
+
+	// The physically contiguous runs of [offset, offset + length), in order, for a range-based for. Adjacent chunks
+	// that are also adjacent in physical memory make a single run. The range is clipped to the buffer.
+	Runs runs(size_t offset, size_t length) const {
+		size_t total = this->length();
+		offset = std::min(offset, total);
+		size_t end = offset + std::min(length, total - offset);
+		return Runs{ RunIterator(this, offset, end) };
+	}
+
+private:
+	// offset must be in the buffer
+	size_t chunkAt(size_t offset) const {
+		if (uniformLength != 0) {
+			return offset / uniformLength;
+		}
+
+		// Last start that is <= offset
+		return (size_t)(std::upper_bound(starts.begin(), starts.end() - 1, offset) - starts.begin()) - 1;
+	}
+
+	std::vector<size_t> starts; // Offset of each chunk, plus the total length at the end
+	std::vector<size_t> pas; // Physical address of each chunk
+	size_t uniformLength = 0; // Length of every chunk but the last, 0 if they differ
+	std::vector<size_t> original; // Index in the chunks given of each one kept, empty if none were skipped
+};
+
+// The chunks of a scatter-gather buffer as separate arrays instead of a Us4OemDmaSgChunk each: the physical
+// addresses, as 32-bit page frame numbers when every chunk starts on a page below 16 TiB, and the lengths, which
+// are left out when all chunks but the last have the same length. A chunk takes 4 to 12 bytes instead of 24.
+// The scans are plain loops over the arrays without branches, which the compiler vectorizes.
+class Us4OemDmaSgCompact {
+public:
+	static constexpr unsigned pageShift = 12;
+
+	Us4OemDmaSgCompact() = default;
+
+	// pageFrames: store page frame numbers if the addresses allow it
+	explicit Us4OemDmaSgCompact(const Us4OemDmaSgDescription& description, bool pageFrames = true) :
+		baseVa(description.va),
+		count(description.chunks.size()) {
+		const auto& chunks = description.chunks;
+
+		// Page frames if every chunk is page-aligned and its frame number fits 32 bits
+		framed = pageFrames;
+		for (const auto& chunk : chunks) {
+			framed = framed && (chunk.pa & ((size_t(1) << pageShift) - 1)) == 0 &&
+				(chunk.pa >> pageShift) <= std::numeric_limits<uint32_t>::max();
+		}
+
+		if (framed) {
+			frames.reserve(count);
+			for (const auto& chunk : chunks) {
+				frames.push_back((uint32_t)(chunk.pa >> pageShift));
+			}
+		} else {
+			addresses.reserve(count);
+			for (const auto& chunk : chunks) {
+				addresses.push_back(chunk.pa);
+			}
+		}
+
+		// Uniform like Us4OemDmaSgIndex: all but the last chunk as long as the first, the last one no longer
+		bool uniform = count > 0;
+		for (size_t i = 1; uniform && i < count; i++) {
+			uniform = i + 1 < count ? chunks[i].length == chunks[0].length : chunks[i].length <= chunks[0].length;
+		}
+
+		if (uniform) {
+			uniformLength = chunks[0].length;
+			lastLength = chunks[count - 1].length;
+		} else {
+			lengths.reserve(count);
+			for (const auto& chunk : chunks) {
+				if (chunk.length > std::numeric_limits<uint32_t>::max()) {
+					throw std::length_error("Scatter-gather chunk longer than 4 GiB"); // A buffer is at most 2 GiB
+				}
+				lengths.push_back((uint32_t)chunk.length);
+			}
+		}
+
+		totalLength = 0;
+		for (const auto& chunk : chunks) {
+			totalLength += chunk.length;
+		}
+	}
+
+	Us4OemDmaSgDescription toDescription() const {
+		Us4OemDmaSgDescription description = {};
+		description.va = baseVa;
+		description.chunks.reserve(count);
+
+		for (size_t i = 0; i < count; i++) {
+			size_t length = chunkLength(i);
+			description.chunks.push_back({ description.length, pa(i), length });
+			description.length += length;
+		}
+
+		return description;
+	}
+
+	void* va() const { return baseVa; }
+	size_t length() const { return totalLength; }
+	size_t chunkCount() const { return count; }
+	bool isUniform() const { return count > 0 && lengths.empty(); }
+	bool hasPageFrames() const { return framed; }
+
+	size_t pa(size_t chunk) const {
+		return framed ? size_t(frames[chunk]) << pageShift : size_t(addresses[chunk]);
+	}
+
+	size_t chunkLength(size_t chunk) const {
+		if (!lengths.empty()) {
+			return lengths[chunk];
+		}
+		return chunk + 1 == count ? lastLength : uniformLength;
+	}
+
+	// Bytes taken by the arrays
+	size_t memoryUsage() const {
+		return frames.size() * sizeof(uint32_t) + addresses.size() * sizeof(uint64_t) + lengths.size() * sizeof(uint32_t);
+	}
+
+	// Writes the physical addresses of chunks [first, first + chunks) to out, e.g. to program descriptors
+	void decodePas(size_t first, size_t chunks, uint64_t* out) const {
+		withChunks([&](auto pa, auto) {
+			for (size_t i = 0; i < chunks; i++) {
+				out[i] = pa(first + i);
+			}
+		});
+	}
+
+	// The lowest physical address and the end of the highest chunk, e.g. to check a device can reach the buffer
+	std::pair<size_t, size_t> physicalBounds() const {
+		size_t lowest = std::numeric_limits<size_t>::max();
+		size_t highest = 0;
+
+		withChunks([&](auto pa, auto length) {
+			for (size_t i = 0; i < count; i++) {
+				size_t start = pa(i);
+				size_t end = start + length(i);
+				lowest = start < lowest ? start : lowest;
+				highest = end > highest ? end : highest;
+			}
+		});
+
+		return { count == 0 ? 0 : lowest, highest };
+	}
+
+	// Physically contiguous runs, the descriptors needed if adjacent chunks are merged
+	size_t runCount() const {
+		if (count == 0) {
+			return 0;
+		}
+
+		size_t breaks = 0;
+		withChunks([&](auto pa, auto length) {
+			for (size_t i = 1; i < count; i++) {
+				breaks += pa(i) != pa(i - 1) + length(i - 1);
+			}
+		});
+
+		return breaks + 1;
+	}
+
+	// The chunk holding physical address address, nothing if it isn't in the buffer
+	std::optional<size_t> findPa(size_t address) const {
+		// The lowest matching index, as a reduction so there is no early exit
+		size_t found = count;
+		withChunks([&](auto pa, auto length) {
+			for (size_t i = 0; i < count; i++) {
+				size_t hit = address - pa(i) < length(i) ? i : count; // Wraps around below the chunk
+				found = hit < found ? hit : found;
+			}
+		});
+
+		return found < count ? std::optional<size_t>(found) : std::nullopt;
+	}
+
+private:
+	// Calls fn with functions returning the physical address and the length of a chunk, one of each per storage,
+	// so the loops in fn are compiled for each combination without a branch in them
+	template<class F>
+	void withChunks(F&& fn) const {
+		size_t last = count - 1, tail = lastLength, uniform = uniformLength;
+
+		auto withLengths = [&](auto pa) {
+			if (lengths.empty()) {
+				fn(pa, [=](size_t i) { return i == last ? tail : uniform; });
+			} else {
+				const uint32_t* data = lengths.data();
+				fn(pa, [data](size_t i) { return size_t(data[i]); });
+			}
+		};
+
+		if (framed) {
+			const uint32_t* data = frames.data();
+			withLengths([data](size_t i) { return size_t(data[i]) << pageShift; });
+		} else {
+			const uint64_t* data = addresses.data();
+			withLengths([data](size_t i) { return size_t(data[i]); });
+		}
+	}
+
+	void* baseVa = nullptr;
+	size_t count = 0;
+	size_t totalLength = 0;
+	bool framed = false;
+	std::vector<uint32_t> frames; // Page frame numbers, if framed
+	std::vector<uint64_t> addresses; // Otherwise
+	std::vector<uint32_t> lengths; // Empty if uniform
+	size_t uniformLength = 0;
+	size_t lastLength = 0;
+};
@@ -0,0 +1,365 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "sg.hpp"
+
+// The layout of a scatter-gather allocation (the buffers' driver handles, kernel VAs and chunks), saved to a file so
+// a restarted process can take the buffers over instead of allocating and pinning them again, see
+// Us4OemDevice::attachSgBuffers. Only standard headers are used, so files can be written and checked on any OS.
+//
+// File format, version 1. Little-endian, every field naturally aligned, so a mapped file can be read in place
+// (Us4OemSgLayoutView):
+//
+//   0   char[8]  magic "US4SGLAY"
+//   8   u32      version
+//   12  u32      header size (64)
+//   16  u64      file size
+//   24  u64      owner token, the lease token the buffers are attached by
+//   32  u32      PCI bus of the device
+//   36  u16      PCI device
+//   38  u16      PCI function
+//   40  u32      segment count
+//   44  u32      lease duration in ms
+//   48  u64      total length of all segments
+//   56  u64      checksum of the whole file but this field, see us4oemSgLayoutChecksum
+//   64  segment table, 64 bytes per segment (one per scatter-gather buffer):
+//       0 u64 driver handle, 8 u64 kernel VA, 16 u64 length, 24 u64 chunk count, 32 u64 file offset of the chunks,
+//       40 u64 chunk length if all but the last chunk have it (the last one is whatever is left), otherwise 0
+//       48 u64[2] reserved, 0
+//   Then the chunks of each segment: u64 physical address, followed by u64 length unless the segment's chunk
+//   length is set.
+
+// Thrown when a layout file can't be read, written or is invalid
+class Us4OemSgLayoutError : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+// One buffer of an allocation
+struct Us4OemSgLayoutSegment {
+	uint64_t handle; // us4oem_handle
+	Us4OemDmaSgDescription description;
+};
+
+inline constexpr char us4oemSgLayoutMagic[8] = { 'U', 'S', '4', 'S', 'G', 'L', 'A', 'Y' };
+inline constexpr uint32_t us4oemSgLayoutVersion = 1;
+inline constexpr size_t us4oemSgLayoutHeaderSize = 64;
+inline constexpr size_t us4oemSgLayoutSegmentSize = 64;
+
+inline uint64_t us4oemSgLayoutLoad(const unsigned char* at, size_t bytes) {
+	if constexpr (std::endian::native == std::endian::little) {
+		uint64_t value = 0;
+		std::memcpy(&value, at, bytes);
+		return value;
+	}
+
+	uint64_t value = 0;
+	for (size_t i = 0; i < bytes; i++) {
+		value |= uint64_t(at[i]) << (8 * i);
+	}
+	return value;
+}
+
+inline void us4oemSgLayoutStore(unsigned char* at, uint64_t value, size_t bytes) {
+	if constexpr (std::endian::native == std::endian::little) {
+		std::memcpy(at, &value, bytes);
+		return;
+	}
+
+	for (size_t i = 0; i < bytes; i++) {
+		at[i] = (unsigned char)(value >> (8 * i));
+	}
+}
+
+// FNV-1a over 64-bit words rather than bytes, fast enough for the millions of chunks of a large allocation.
+// Skips the checksum field itself; size is a multiple of 8 in any valid file.
+inline uint64_t us4oemSgLayoutChecksum(const unsigned char* file, size_t size) {
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (size_t i = 0; i + 8 <= size; i += 8) {
+		if (i != 56) {
+			hash = (hash ^ us4oemSgLayoutLoad(file + i, 8)) * 0x100000001B3ull;
+		}
+	}
+	return hash;
+}
+
+// Reads a layout file in place, e.g. from a mapping of it. Everything is checked when it's constructed, so the
+// accessors don't; the data has to outlive the view.
+class Us4OemSgLayoutView {
+public:
+	// verifyChecksum: skip for speed if the file is known to be intact
+	Us4OemSgLayoutView(const void* data, size_t size, bool verifyChecksum = true) :
+		base(static_cast<const unsigned char*>(data)), size(size) {
+		if (size < us4oemSgLayoutHeaderSize || std::memcmp(base, us4oemSgLayoutMagic, sizeof(us4oemSgLayoutMagic)) != 0) {
+			throw Us4OemSgLayoutError("Not a scatter-gather layout file");
+		}
+		if (field(8, 4) != us4oemSgLayoutVersion || field(12, 4) != us4oemSgLayoutHeaderSize) {
+			throw Us4OemSgLayoutError("Unsupported scatter-gather layout version " + std::to_string(field(8, 4)));
+		}
+		if (field(16, 8) != size || size % 8 != 0) {
+			throw Us4OemSgLayoutError("Scatter-gather layout file is truncated");
+		}
+		if (verifyChecksum && us4oemSgLayoutChecksum(base, size) != field(56, 8)) {
+			throw Us4OemSgLayoutError("Scatter-gather layout file is corrupt");
+		}
+
+		uint64_t segments = segmentCount();
+		if (segments > (size - us4oemSgLayoutHeaderSize) / us4oemSgLayoutSegmentSize) {
+			throw Us4OemSgLayoutError("Scatter-gather layout file is truncated");
+		}
+
+		uint64_t total = 0;
+		for (size_t i = 0; i < segments; i++) {
+			checkSegment(i);
+			total += segmentLength(i);
+		}
+		if (total != totalLength()) {
+			throw Us4OemSgLayoutError("Scatter-gather layout segments don't add up");
+		}
+	}
+
+	uint64_t token() const { return field(24, 8); }
+	uint32_t pciBus() const { return (uint32_t)field(32, 4); }
+	uint16_t pciDevice() const { return (uint16_t)field(36, 2); }
+	uint16_t pciFunction() const { return (uint16_t)field(38, 2); }
+	size_t segmentCount() const { return (size_t)field(40, 4); }
+	uint32_t leaseDurationMs() const { return (uint32_t)field(44, 4); }
+	uint64_t totalLength() const { return field(48, 8); }
+
+	uint64_t segmentHandle(size_t segment) const { return segmentField(segment, 0); }
+	void* segmentVa(size_t segment) const { return reinterpret_cast<void*>((uintptr_t)segmentField(segment, 8)); }
+	uint64_t segmentLength(size_t segment) const { return segmentField(segment, 16); }
+	size_t chunkCount(size_t segment) const { return (size_t)segmentField(segment, 24); }
+
+	uint64_t chunkPa(size_t segment, size_t chunk) const {
+		return us4oemSgLayoutLoad(chunkAt(segment, chunk), 8);
+	}
+
+	uint64_t chunkLength(size_t segment, size_t chunk) const {
+		uint64_t uniform = segmentField(segment, 40);
+		if (uniform == 0) {
+			return us4oemSgLayoutLoad(chunkAt(segment, chunk) + 8, 8);
+		}
+		return chunk + 1 == chunkCount(segment) ? segmentLength(segment) - uniform * (chunkCount(segment) - 1) : uniform;
+	}
+
+	Us4OemDmaSgDescription description(size_t segment) const {
+		Us4OemDmaSgDescription description = {};
+		description.va = segmentVa(segment);
+
+		size_t chunks = chunkCount(segment);
+		uint64_t uniform = segmentField(segment, 40);
+		const unsigned char* at = chunkAt(segment, 0);
+		description.chunks.resize(chunks);
+
+		for (size_t i = 0; i < chunks; i++) {
+			size_t length = (size_t)(uniform == 0 ? us4oemSgLayoutLoad(at + 8, 8) : i + 1 < chunks ? uniform : segmentLength(segment) - description.length);
+			description.chunks[i] = { description.length, (size_t)us4oemSgLayoutLoad(at, 8), length };
+			description.length += length;
+			at += uniform == 0 ? 16 : 8;
+		}
+
+		return description;
+	}
+
+private:
+	uint64_t field(size_t offset, size_t bytes) const {
+		return us4oemSgLayoutLoad(base + offset, bytes);
+	}
+
+	uint64_t segmentField(size_t segment, size_t offset) const {
+		return field(us4oemSgLayoutHeaderSize + segment * us4oemSgLayoutSegmentSize + offset, 8);
+	}
+
+	const unsigned char* chunkAt(size_t segment, size_t chunk) const {
+		size_t stride = segmentField(segment, 40) == 0 ? 16 : 8;
+		return base + segmentField(segment, 32) + chunk * stride;
+	}
+
+	void checkSegment(size_t segment) const {
+		uint64_t chunks = segmentField(segment, 24);
+		uint64_t offset = segmentField(segment, 32);
+		uint64_t uniform = segmentField(segment, 40);
+		uint64_t length = segmentLength(segment);
+		uint64_t stride = uniform == 0 ? 16 : 8;
+		uint64_t tableEnd = us4oemSgLayoutHeaderSize + segmentCount() * us4oemSgLayoutSegmentSize;
+
+		if (offset % 8 != 0 || offset < tableEnd || offset > size || chunks > (size - offset) / stride) {
+			throw Us4OemSgLayoutError("Scatter-gather layout chunks are out of the file");
+		}
+
+		if (uniform != 0) {
+			// All but the last chunk are uniform long, the last one is 1 to uniform bytes
+			if (chunks == 0 || length == 0 || (length - 1) / uniform != chunks - 1) {
+				throw Us4OemSgLayoutError("Scatter-gather layout chunk lengths don't add up");
+			}
+			return;
+		}
+
+		uint64_t total = 0;
+		const unsigned char* at = base + offset;
+		for (size_t i = 0; i < chunks; i++, at += 16) {
+			total += us4oemSgLayoutLoad(at + 8, 8);
+		}
+		if (total != length) {
+			throw Us4OemSgLayoutError("Scatter-gather layout chunk lengths don't add up");
+		}
+	}
+
+	const unsigned char* base;
+	size_t size;
+};
+
+// A layout in memory, to build and save one or to load one to attach by. See the file format above.
+class Us4OemSgLayout {
+public:
+	uint64_t token = 0;
+	uint32_t pciBus = 0;
+	uint16_t pciDevice = 0;
+	uint16_t pciFunction = 0;
+	uint32_t leaseDurationMs = 0;
+	std::vector<Us4OemSgLayoutSegment> segments;
+
+	uint64_t totalLength() const {
+		uint64_t total = 0;
+		for (const auto& segment : segments) {
+			total += segment.description.length;
+		}
+		return total;
+	}
+
+	std::vector<unsigned char> serialize() const {
+		// Chunk lengths are left out of segments where they're uniform
+		std::vector<uint64_t> uniformLengths;
+		size_t size = us4oemSgLayoutHeaderSize + segments.size() * us4oemSgLayoutSegmentSize;
+		for (const auto& segment : segments) {
+			uniformLengths.push_back(uniformLength(segment.description));
+			size += segment.description.chunks.size() * (uniformLengths.back() == 0 ? 16 : 8);
+		}
+
+		std::vector<unsigned char> file(size, 0);
+		unsigned char* out = file.data();
+
+		std::memcpy(out, us4oemSgLayoutMagic, sizeof(us4oemSgLayoutMagic));
+		us4oemSgLayoutStore(out + 8, us4oemSgLayoutVersion, 4);
+		us4oemSgLayoutStore(out + 12, us4oemSgLayoutHeaderSize, 4);
+		us4oemSgLayoutStore(out + 16, size, 8);
+		us4oemSgLayoutStore(out + 24, token, 8);
+		us4oemSgLayoutStore(out + 32, pciBus, 4);
+		us4oemSgLayoutStore(out + 36, pciDevice, 2);
+		us4oemSgLayoutStore(out + 38, pciFunction, 2);
+		us4oemSgLayoutStore(out + 40, segments.size(), 4);
+		us4oemSgLayoutStore(out + 44, leaseDurationMs, 4);
+		us4oemSgLayoutStore(out + 48, totalLength(), 8);
+
+		size_t chunksOffset = us4oemSgLayoutHeaderSize + segments.size() * us4oemSgLayoutSegmentSize;
+		for (size_t i = 0; i < segments.size(); i++) {
+			const Us4OemDmaSgDescription& description = segments[i].description;
+			unsigned char* entry = out + us4oemSgLayoutHeaderSize + i * us4oemSgLayoutSegmentSize;
+
+			us4oemSgLayoutStore(entry, segments[i].handle, 8);
+			us4oemSgLayoutStore(entry + 8, (uint64_t)reinterpret_cast<uintptr_t>(description.va), 8);
+			us4oemSgLayoutStore(entry + 16, description.length, 8);
+			us4oemSgLayoutStore(entry + 24, description.chunks.size(), 8);
+			us4oemSgLayoutStore(entry + 32, chunksOffset, 8);
+			us4oemSgLayoutStore(entry + 40, uniformLengths[i], 8);
+
+			for (const auto& chunk : description.chunks) {
+				us4oemSgLayoutStore(out + chunksOffset, chunk.pa, 8);
+				chunksOffset += 8;
+				if (uniformLengths[i] == 0) {
+					us4oemSgLayoutStore(out + chunksOffset, chunk.length, 8);
+					chunksOffset += 8;
+				}
+			}
+		}
+
+		us4oemSgLayoutStore(out + 56, us4oemSgLayoutChecksum(out, size), 8);
+		return file;
+	}
+
+	static Us4OemSgLayout parse(const Us4OemSgLayoutView& view) {
+		Us4OemSgLayout layout;
+		layout.token = view.token();
+		layout.pciBus = view.pciBus();
+		layout.pciDevice = view.pciDevice();
+		layout.pciFunction = view.pciFunction();
+		layout.leaseDurationMs = view.leaseDurationMs();
+
+		layout.segments.reserve(view.segmentCount());
+		for (size_t i = 0; i < view.segmentCount(); i++) {
+			layout.segments.push_back({ view.segmentHandle(i), view.description(i) });
+		}
+
+		return layout;
+	}
+
+	static Us4OemSgLayout parse(const std::vector<unsigned char>& file) {
+		return parse(Us4OemSgLayoutView(file.data(), file.size()));
+	}
+
+	// Writes a temporary file next to path and renames it over path, so a crash never leaves half a layout behind
+	void save(const std::filesystem::path& path) const {
+		std::vector<unsigned char> file = serialize();
+		std::filesystem::path temporary = path;
+		temporary += ".tmp";
+
+		{
+			std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+			out.write(reinterpret_cast<const char*>(file.data()), (std::streamsize)file.size());
+			out.flush();
+			if (!out) {
+				throw Us4OemSgLayoutError("Failed to write " + temporary.string());
+			}
+		}
+
+		std::error_code error;
+		std::filesystem::rename(temporary, path, error);
+		if (error) {
+			throw Us4OemSgLayoutError("Failed to replace " + path.string() + ": " + error.message());
+		}
+	}
+
+	static Us4OemSgLayout load(const std::filesystem::path& path) {
+		std::ifstream in(path, std::ios::binary | std::ios::ate);
+		if (!in) {
+			throw Us4OemSgLayoutError("Failed to open " + path.string());
+		}
+
+		std::vector<unsigned char> file((size_t)in.tellg());
+		in.seekg(0);
+		in.read(reinterpret_cast<char*>(file.data()), (std::streamsize)file.size());
+		if (!in) {
+			throw Us4OemSgLayoutError("Failed to read " + path.string());
+		}
+
+		return parse(file);
+	}
+
+private:
+	// The length of all but the last chunk if they share it and the last one isn't longer, otherwise 0
+	static uint64_t uniformLength(const Us4OemDmaSgDescription& description) {
+		const auto& chunks = description.chunks;
+		if (chunks.empty() || chunks[0].length == 0) {
+			return 0;
+		}
+
+		for (size_t i = 1; i < chunks.size(); i++) {
+			bool last = i + 1 == chunks.size();
+			if (last ? chunks[i].length > chunks[0].length || chunks[i].length == 0 : chunks[i].length != chunks[0].length) {
+				return 0;
+			}
+		}
+
+		return chunks[0].length;
+	}
+};
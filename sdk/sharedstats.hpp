@@ -0,0 +1,68 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include "api.hpp"
+
+// Reader of the driver's shared statistics page (us4oem_shared_stats), mapped read-only into the process by
+// Us4OemDevice::mapSharedStats. Reading takes no system call. The page is a seqlock written only by the driver:
+// a read is retried while an update is in progress or if one happened during the copy.
+class Us4OemSharedStats {
+public:
+	explicit Us4OemSharedStats(const us4oem_shared_stats* page) : page(page) {}
+
+	// A consistent snapshot of the statistics. Fields the driver doesn't know about are left zeroed.
+	us4oem_stats read() const {
+		us4oem_stats stats = {};
+		long long timestamp;
+
+		while (!tryRead(stats, timestamp, 1)) {
+			// The driver is in the middle of an update, which it does at DISPATCH_LEVEL, so it won't be long
+		}
+		return stats;
+	}
+
+	// Like read, but gives up after the given number of attempts, each of which the driver may have torn by
+	// updating the page at the same time. Also returns the QPC of the update the snapshot came from.
+	bool tryRead(us4oem_stats& stats, long long& timestamp, unsigned attempts) const {
+		size_t size = std::min<size_t>(page->size, sizeof(us4oem_stats));
+
+		for (unsigned attempt = 0; attempt < attempts; attempt++) {
+			unsigned long long before = sequence();
+			if (before & 1) {
+				continue;
+			}
+
+			std::memcpy(&stats, (const void*)&page->stats, size);
+			timestamp = page->publish_timestamp;
+
+			// The copy must be done before the sequence is read again
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (sequence() == before) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// QPC of the most recent update
+	long long publishTimestamp() const {
+		us4oem_stats stats = {};
+		long long timestamp;
+
+		while (!tryRead(stats, timestamp, 1)) {
+		}
+		return timestamp;
+	}
+
+private:
+	unsigned long long sequence() const {
+		unsigned long long value = page->sequence; // volatile
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return value;
+	}
+
+	const us4oem_shared_stats* page;
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <utility>
+
+#include "api.hpp"
+#include "batch.hpp"
+
+// Stands in for the driver when running batches, without a device or the Windows SDK: a few of the batchable IOCTLs
+// are carried out on in-memory state, with the driver's buffer checks and statuses. Each user/kernel transition costs
+// a fixed, configurable time, spent busy waiting, so submitting commands one call at a time can be compared with
+// submitting them as a batch.
+//
+// Example:
+//   Us4OemSimulatedDevice device(std::chrono::microseconds(2));
+//   Us4OemBatch batch;
+//   batch.allocDmaContig(4096).readStats();
+//   device.submitBatch(batch);
+class Us4OemSimulatedDevice {
+public:
+	// As in ntstatus.h
+	static constexpr long statusSuccess = 0;
+	static constexpr long statusInvalidParameter = (long)0xC000000D;
+	static constexpr long statusInvalidDeviceRequest = (long)0xC0000010;
+	static constexpr long statusBufferTooSmall = (long)0xC0000023;
+	static constexpr long statusIoTimeout = (long)0xC00000B5;
+	static constexpr long statusNotFound = (long)0xC0000225;
+
+	explicit Us4OemSimulatedDevice(std::chrono::nanoseconds transitionCost = std::chrono::nanoseconds(0)) :
+		transitionCost(transitionCost) {}
+
+	// Runs the whole batch in one transition, like US4OEM_WIN32_IOCTL_SUBMIT_BATCH. Throws for a batch the driver
+	// rejects as a whole, one that maps or releases handles as well as allocating or freeing DMA buffers.
+	bool submitBatch(Us4OemBatch& batch) {
+		transition();
+
+		bool callerContext = batch.contains(US4OEM_WIN32_IOCTL_MMAP) || batch.contains(US4OEM_WIN32_IOCTL_RELEASE_HANDLE);
+		bool sequential = false;
+		for (unsigned long ioctlCode : { US4OEM_WIN32_IOCTL_ALLOCATE_DMA_CONTIGIOUS_BUFFER, US4OEM_WIN32_IOCTL_ALLOCATE_DMA_SG_BUFFER,
+			US4OEM_WIN32_IOCTL_DEALLOCATE_DMA_CONTIGIOUS_BUFFER, US4OEM_WIN32_IOCTL_DEALLOCATE_DMA_SG_BUFFER,
+			US4OEM_WIN32_IOCTL_DEALLOCATE_ALL_DMA_BUFFERS, US4OEM_WIN32_IOCTL_ATTACH_LEASE }) {
+			sequential = sequential || batch.contains(ioctlCode);
+		}
+		if (callerContext && sequential) {
+			throw std::invalid_argument("A batch can't map or release handles and allocate or free DMA buffers too");
+		}
+
+		return batch.runEach([this](unsigned long ioctlCode, void* input, unsigned long inputLength, void* output,
+			unsigned long outputLength, unsigned long& bytesReturned) {
+			return dispatch(ioctlCode, input, inputLength, output, outputLength, bytesReturned);
+		});
+	}
+
+	// Runs the batch one transition per command, like Us4OemDevice does for drivers without batching
+	bool submitEach(Us4OemBatch& batch) {
+		return batch.runEach([this](unsigned long ioctlCode, void* input, unsigned long inputLength, void* output,
+			unsigned long outputLength, unsigned long& bytesReturned) {
+			transition();
+			return dispatch(ioctlCode, input, inputLength, output, outputLength, bytesReturned);
+		});
+	}
+
+	// An IRQ, for US4OEM_WIN32_IOCTL_CLEAR_PENDING and the statistics
+	void raiseIrq() {
+		irqCount++;
+		pendingIrqs++;
+	}
+
+	size_t pendingIrqCount() const {
+		return pendingIrqs;
+	}
+
+	size_t contiguousBufferCount() const {
+		return contiguousBuffers.size();
+	}
+
+	bool stickyMode() const {
+		return sticky;
+	}
+
+	unsigned long long transitions() const {
+		return transitionCount;
+	}
+
+	// The simulated BAR 0/4 registers, for US4OEM_WIN32_IOCTL_REGISTER_ACCESS. All of them read 0 until written.
+	unsigned long long registerValue(unsigned char bar, unsigned long long offset) const {
+		auto reg = registers.find({ bar, offset });
+		return reg == registers.end() ? 0 : reg->second;
+	}
+
+	void setRegister(unsigned char bar, unsigned long long offset, unsigned long long value) {
+		registers[{ bar, offset }] = value;
+	}
+
+private:
+	void transition() {
+		transitionCount++;
+		auto end = std::chrono::steady_clock::now() + transitionCost;
+		while (std::chrono::steady_clock::now() < end) {
+		}
+	}
+
+	// One command, with the driver's buffer size checks. IOCTLs that aren't simulated fail like unbatchable ones.
+	long dispatch(unsigned long ioctlCode, void* input, unsigned long inputLength, void* output, unsigned long outputLength,
+		unsigned long& bytesReturned) {
+		bytesReturned = 0;
+
+		switch (ioctlCode) {
+		case US4OEM_WIN32_IOCTL_CLEAR_PENDING:
+			pendingIrqs = 0;
+			return statusSuccess;
+
+		case US4OEM_WIN32_IOCTL_SET_STICKY_MODE:
+			if (inputLength < sizeof(bool)) {
+				return statusBufferTooSmall;
+			}
+			sticky = *static_cast<const bool*>(input);
+			return statusSuccess;
+
+		case US4OEM_WIN32_IOCTL_SET_IRQ_MODERATION:
+			return inputLength < sizeof(us4oem_irq_moderation_argument) ? statusBufferTooSmall : statusSuccess;
+
+		case US4OEM_WIN32_IOCTL_ALLOCATE_DMA_CONTIGIOUS_BUFFER: {
+			if (inputLength < sizeof(us4oem_dma_allocation_argument) || outputLength < sizeof(us4oem_dma_contiguous_buffer_response)) {
+				return statusBufferTooSmall;
+			}
+			const us4oem_dma_allocation_argument* arg = static_cast<const us4oem_dma_allocation_argument*>(input);
+			if (arg->length == 0) {
+				return statusInvalidParameter;
+			}
+
+			us4oem_dma_contiguous_buffer_response response = {};
+			response.pa = nextPa;
+			response.handle = nextHandle++;
+			nextPa += (arg->length + 0xFFF) & ~0xFFFull;
+			contiguousBuffers[response.pa] = response.handle;
+			contiguousAllocCount++;
+
+			std::memcpy(output, &response, sizeof(response));
+			bytesReturned = sizeof(response);
+			return statusSuccess;
+		}
+
+		case US4OEM_WIN32_IOCTL_DEALLOCATE_DMA_CONTIGIOUS_BUFFER: {
+			if (inputLength < sizeof(unsigned long long)) {
+				return statusBufferTooSmall;
+			}
+			if (contiguousBuffers.erase(*static_cast<const unsigned long long*>(input)) == 0) {
+				return statusNotFound;
+			}
+			contiguousFreeCount++;
+			return statusSuccess;
+		}
+
+		case US4OEM_WIN32_IOCTL_RELEASE_HANDLE: {
+			if (inputLength < sizeof(us4oem_handle)) {
+				return statusBufferTooSmall;
+			}
+			us4oem_handle handle = *static_cast<const us4oem_handle*>(input);
+			for (auto buffer = contiguousBuffers.begin(); buffer != contiguousBuffers.end(); ++buffer) {
+				if (buffer->second == handle) {
+					contiguousBuffers.erase(buffer);
+					contiguousFreeCount++;
+					return statusSuccess;
+				}
+			}
+			return statusNotFound;
+		}
+
+		case US4OEM_WIN32_IOCTL_DEALLOCATE_ALL_DMA_BUFFERS:
+			contiguousFreeCount += contiguousBuffers.size();
+			contiguousBuffers.clear();
+			return statusSuccess;
+
+		case US4OEM_WIN32_IOCTL_REGISTER_ACCESS:
+			return registerAccess(input, inputLength, output, outputLength, bytesReturned);
+
+		case US4OEM_WIN32_IOCTL_READ_STATS: {
+			if (outputLength < US4OEM_STATS_MIN_SIZE) {
+				return statusBufferTooSmall;
+			}
+			us4oem_stats stats = {};
+			stats.irq_count = irqCount;
+			stats.irq_pending_count = pendingIrqs;
+			stats.dma_contig_alloc_count = contiguousAllocCount;
+			stats.dma_contig_free_count = contiguousFreeCount;
+			stats.dpc_target_processor = US4OEM_PROCESSOR_ANY;
+
+			bytesReturned = std::min<unsigned long>(outputLength, sizeof(stats));
+			std::memcpy(output, &stats, bytesReturned);
+			return statusSuccess;
+		}
+
+		default:
+			return statusInvalidDeviceRequest; // Not batchable, or not simulated
+		}
+	}
+
+	// As the driver runs it: on a copy of the input in the output buffer, until the first failed operation. Registers
+	// are 8 bytes wide whatever the width, and a poll that doesn't match right away times out.
+	long registerAccess(void* input, unsigned long inputLength, void* output, unsigned long outputLength,
+		unsigned long& bytesReturned) {
+		if (inputLength < sizeof(us4oem_reg_access_header) || outputLength < sizeof(us4oem_reg_access_header)) {
+			return statusBufferTooSmall;
+		}
+		unsigned long opCount = static_cast<const us4oem_reg_access_header*>(input)->op_count;
+		if (opCount > US4OEM_REG_MAX_OPS || inputLength < US4OEM_REG_ACCESS_SIZE(opCount) ||
+			outputLength < US4OEM_REG_ACCESS_SIZE(opCount)) {
+			return statusInvalidParameter;
+		}
+
+		if (output != input) {
+			std::memcpy(output, input, US4OEM_REG_ACCESS_SIZE(opCount));
+		}
+		us4oem_reg_access_header* header = static_cast<us4oem_reg_access_header*>(output);
+		us4oem_reg_op* ops = reinterpret_cast<us4oem_reg_op*>(header + 1);
+		header->executed = 0;
+		header->status = statusSuccess;
+
+		for (unsigned long i = 0; i < opCount; i++) {
+			us4oem_reg_op& op = ops[i];
+			long status = statusSuccess;
+
+			if ((op.bar != 0 && op.bar != 4) || (op.width != 1 && op.width != 2 && op.width != 4 && op.width != 8) ||
+				(op.offset & (op.width - 1)) != 0) {
+				status = statusInvalidParameter;
+			} else {
+				unsigned long long& reg = registers[{ op.bar, op.offset }];
+				switch (op.op) {
+				case US4OEM_REG_OP_READ:
+					op.value = reg;
+					break;
+				case US4OEM_REG_OP_WRITE:
+					reg = op.value;
+					break;
+				case US4OEM_REG_OP_READ_MODIFY_WRITE: {
+					unsigned long long previous = reg;
+					reg = (previous & ~op.mask) | (op.value & op.mask);
+					op.value = previous;
+					break;
+				}
+				case US4OEM_REG_OP_POLL:
+					status = (reg & op.mask) == (op.value & op.mask) ? statusSuccess : statusIoTimeout;
+					op.value = reg;
+					break;
+				default:
+					status = statusInvalidParameter;
+					break;
+				}
+			}
+
+			if (!us4oemStatusSucceeded(status)) {
+				header->status = status;
+				break;
+			}
+			header->executed++;
+		}
+
+		bytesReturned = US4OEM_REG_ACCESS_SIZE(opCount);
+		return statusSuccess;
+	}
+
+	std::chrono::nanoseconds transitionCost;
+	unsigned long long transitionCount = 0;
+
+	size_t irqCount = 0;
+	size_t pendingIrqs = 0;
+	bool sticky = false;
+
+	std::map<unsigned long long, us4oem_handle> contiguousBuffers; // PA -> handle
+	size_t contiguousAllocCount = 0;
+	size_t contiguousFreeCount = 0;
+	unsigned long long nextPa = 0x10000000;
+	us4oem_handle nextHandle = 1;
+
+	std::map<std::pair<unsigned char, unsigned long long>, unsigned long long> registers; // (BAR, offset) -> value
+};
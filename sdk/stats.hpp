@@ -1,6 +1,8 @@
 #pragma once
 
 #include "common.hpp"
+#include "ioctlstats.hpp"
+#include "sharedstats.hpp"
 
 class Us4OemDeviceStats {
 public:
@@ -11,7 +13,18 @@ public:
 		dmaContigFreeCount(raw.dma_contig_free_count),
 		dmaSgAllocCount(raw.dma_sg_alloc_count),
 		dmaSgFreeCount(raw.dma_sg_free_count),
-		fileOpenCount(raw.file_open_count) {
+		fileOpenCount(raw.file_open_count),
+		irqAffinity(raw.irq_affinity),
+		irqAffinityGroup(raw.irq_affinity_group),
+		dpcTargetProcessor(raw.dpc_target_processor),
+		dpcImportance(raw.dpc_importance),
+		teardownCount(raw.teardown_count),
+		teardownBufferCount(raw.teardown_buffer_count),
+		teardownTicks(raw.teardown_ticks),
+		teardownMaxTicks(raw.teardown_max_ticks),
+		teardownLastTicks(raw.teardown_last_ticks),
+		teardownLastWorkers(raw.teardown_last_workers),
+		teardownPending(raw.teardown_pending) {
 	}
 
 	std::string toString() const {
@@ -21,14 +34,30 @@ public:
 			"  Contiguous DMA Frees: {}\n"
 			"  SG DMA Allocations: {}\n"
 			"  SG DMA Frees: {}\n"
-			"  File Open Count: {}",
+			"  File Open Count: {}\n"
+			"  IRQ Affinity: group {}, mask {:#x}\n"
+			"  DPC Target Processor: {}\n"
+			"  DPC Importance: {}\n"
+			"  DMA Teardowns: {} ({} buffers, {:.3f} ms total, {:.3f} ms max, {} pending)\n"
+			"  Last DMA Teardown: {:.3f} ms on {} threads",
 			irqCount,
 			pendingIrqCount,
 			dmaContigAllocCount,
 			dmaContigFreeCount,
 			dmaSgAllocCount,
 			dmaSgFreeCount,
-			fileOpenCount);
+			fileOpenCount,
+			irqAffinityGroup,
+			irqAffinity,
+			dpcTargetProcessor == US4OEM_PROCESSOR_ANY ? std::string("any") : std::to_string(dpcTargetProcessor),
+			dpcImportance,
+			teardownCount,
+			teardownBufferCount,
+			ticksToMs(teardownTicks),
+			ticksToMs(teardownMaxTicks),
+			teardownPending,
+			ticksToMs(teardownLastTicks),
+			teardownLastWorkers);
 	}
 
 	// Note: public, as this is more of a struct than a class.
@@ -41,4 +70,25 @@ public:
 	size_t dmaSgFreeCount; // Number of scatter-gather DMA buffers freed total
 
 	size_t fileOpenCount; // Number of times the device char device has been opened to be used by a client
-};
\ No newline at end of file
+
+	unsigned long long irqAffinity; // Processors the interrupt is delivered to, within irqAffinityGroup
+	unsigned short irqAffinityGroup;
+	unsigned long dpcTargetProcessor; // US4OEM_PROCESSOR_ANY if the DPC isn't pinned
+	unsigned long dpcImportance; // US4OEM_DPC_IMPORTANCE_*
+
+	// DMA teardowns (close in sticky mode, deallocateAll, device removal); times are QPC ticks. 0 for older drivers.
+	unsigned long long teardownCount;
+	unsigned long long teardownBufferCount;
+	long long teardownTicks;
+	long long teardownMaxTicks;
+	long long teardownLastTicks;
+	unsigned long teardownLastWorkers;
+	unsigned long teardownPending; // Asynchronous teardowns still running
+
+private:
+	static double ticksToMs(long long ticks) {
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		return (double)ticks * 1e3 / (double)frequency.QuadPart;
+	}
+};
@@ -0,0 +1,220 @@
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+#include "../sdk/batch.hpp"
+#include "../sdk/simulator.hpp"
+#include "benchmark.hpp"
+#include "check.hpp"
+
+// Us4OemBatch before it's submitted, and run by the simulated driver
+
+US4OEM_TEST(batchCommandsStartNotRun) {
+	Us4OemBatch batch;
+	batch.pollClearPending()
+		.allocDmaContig(4096)
+		.readStats();
+
+	US4OEM_CHECK(batch.size() == 3);
+	US4OEM_CHECK(batch.executed() == 0);
+	US4OEM_CHECK(!batch.succeeded());
+	for (size_t i = 0; i < batch.size(); i++) {
+		US4OEM_CHECK(batch.status(i) == US4OEM_BATCH_STATUS_NOT_RUN);
+		US4OEM_CHECK(!batch.succeeded(i));
+	}
+
+	// Nothing ran, so there is no response to read
+	US4OEM_CHECK_THROWS(std::runtime_error, batch.output<us4oem_dma_contiguous_buffer_response>(1));
+	US4OEM_CHECK_THROWS(std::out_of_range, batch.status(3));
+}
+
+US4OEM_TEST(batchIsLimitedToTheDriversMaximum) {
+	Us4OemBatch batch;
+	for (size_t i = 0; i < US4OEM_BATCH_MAX_COMMANDS; i++) {
+		batch.pollClearPending();
+	}
+
+	US4OEM_CHECK_THROWS(std::length_error, batch.pollClearPending());
+	US4OEM_CHECK(batch.size() == US4OEM_BATCH_MAX_COMMANDS);
+
+	batch.clear();
+	US4OEM_CHECK(batch.size() == 0);
+	batch.pollClearPending();
+	US4OEM_CHECK(batch.size() == 1);
+}
+
+US4OEM_TEST(batchEmptySucceeds) {
+	// No commands, so nothing can fail; submitting it is a no-op for the driver
+	Us4OemBatch batch;
+	US4OEM_CHECK(batch.succeeded());
+}
+
+US4OEM_TEST(batchSimulatedResults) {
+	Us4OemSimulatedDevice device;
+	device.raiseIrq();
+	device.raiseIrq();
+
+	Us4OemBatch batch;
+	batch.allocDmaContig(4096)
+		.allocDmaContig(8192)
+		.pollClearPending()
+		.setStickyMode(true)
+		.readStats();
+
+	US4OEM_CHECK(device.submitBatch(batch));
+	US4OEM_CHECK(device.transitions() == 1);
+	US4OEM_CHECK(batch.executed() == 5);
+
+	us4oem_dma_contiguous_buffer_response first = batch.output<us4oem_dma_contiguous_buffer_response>(0);
+	us4oem_dma_contiguous_buffer_response second = batch.output<us4oem_dma_contiguous_buffer_response>(1);
+	US4OEM_CHECK(first.pa != second.pa && first.handle != second.handle);
+	US4OEM_CHECK(device.contiguousBufferCount() == 2 && device.pendingIrqCount() == 0 && device.stickyMode());
+
+	// Commands without a response return nothing, the statistics see the commands before them
+	US4OEM_CHECK_THROWS(std::runtime_error, batch.output<unsigned long long>(2));
+	us4oem_stats stats = batch.output<us4oem_stats>(4);
+	US4OEM_CHECK(stats.irq_count == 2 && stats.irq_pending_count == 0 && stats.dma_contig_alloc_count == 2);
+
+	// The same batch object can be cleared and reused
+	batch.clear();
+	batch.deallocDmaContig(first.pa);
+	US4OEM_CHECK(device.submitBatch(batch));
+	US4OEM_CHECK(device.contiguousBufferCount() == 1);
+
+	// Handles are released in the calling thread, allocations on the driver's sequential queue, so a batch can't
+	// do both; the driver fails the whole batch
+	batch.clear();
+	batch.releaseHandle(second.handle)
+		.allocDmaContig(4096);
+	US4OEM_CHECK_THROWS(std::invalid_argument, device.submitBatch(batch));
+	US4OEM_CHECK(batch.executed() == 0 && device.contiguousBufferCount() == 1);
+
+	batch.clear();
+	batch.releaseHandle(second.handle)
+		.readStats();
+	US4OEM_CHECK(device.submitBatch(batch));
+	US4OEM_CHECK(device.contiguousBufferCount() == 0);
+}
+
+US4OEM_TEST(batchSimulatedStopsAtTheFirstFailure) {
+	Us4OemSimulatedDevice device;
+
+	Us4OemBatch batch;
+	batch.allocDmaContig(4096)
+		.deallocDmaContig(0x1234) // Not allocated
+		.allocDmaContig(4096);
+
+	US4OEM_CHECK(!device.submitBatch(batch));
+	US4OEM_CHECK(batch.executed() == 2);
+	US4OEM_CHECK(batch.succeeded(0));
+	US4OEM_CHECK(batch.status(1) == Us4OemSimulatedDevice::statusNotFound);
+	US4OEM_CHECK(batch.status(2) == US4OEM_BATCH_STATUS_NOT_RUN);
+	US4OEM_CHECK(device.contiguousBufferCount() == 1);
+
+	// Resubmitted with continueOnError, the rest runs and the first failure is still reported
+	batch.continueOnError();
+	US4OEM_CHECK(!device.submitBatch(batch));
+	US4OEM_CHECK(batch.executed() == 3);
+	US4OEM_CHECK(batch.succeeded(2));
+	US4OEM_CHECK(device.contiguousBufferCount() == 3);
+
+	// Commands the driver doesn't batch, and responses that don't fit
+	batch.clear();
+	batch.add(US4OEM_WIN32_IOCTL_POLL, nullptr, 0, 0)
+		.add(US4OEM_WIN32_IOCTL_READ_STATS, nullptr, 0, 8)
+		.continueOnError();
+	US4OEM_CHECK(!device.submitBatch(batch));
+	US4OEM_CHECK(batch.status(0) == Us4OemSimulatedDevice::statusInvalidDeviceRequest);
+	US4OEM_CHECK(batch.status(1) == Us4OemSimulatedDevice::statusBufferTooSmall);
+}
+
+// Register reads come back in the command's output, which in a batch is separate from the input
+US4OEM_TEST(batchSimulatedRegisterReadBack) {
+	Us4OemSimulatedDevice device;
+	device.setRegister(4, 0x14, 0xA5);
+
+	Us4OemRegisterSequence sequence;
+	sequence.read(4, 0x14)
+		.write(4, 0x18, 0x3)
+		.modify(4, 0x14, 0x0F, 0x0C)
+		.read(4, 0x14);
+
+	Us4OemBatch batch;
+	batch.pollClearPending()
+		.registerAccess(sequence)
+		.readStats();
+	US4OEM_CHECK(device.submitBatch(batch));
+
+	batch.registerResults(1, sequence);
+	US4OEM_CHECK(sequence.succeeded());
+	US4OEM_CHECK(sequence.value(0) == 0xA5);
+	US4OEM_CHECK(sequence.value(2) == 0xA5);
+	US4OEM_CHECK(sequence.value(3) == 0xAC);
+	US4OEM_CHECK(device.registerValue(4, 0x18) == 0x3);
+	US4OEM_CHECK_THROWS(std::invalid_argument, batch.registerResults(0, sequence));
+
+	// A failed operation is reported in the results, the command itself succeeds
+	sequence.clear();
+	sequence.read(4, 0x14)
+		.poll(4, 0x18, 0x1, 0x0, 0)
+		.read(4, 0x18);
+	batch.clear();
+	batch.registerAccess(sequence);
+	US4OEM_CHECK(device.submitBatch(batch));
+	batch.registerResults(0, sequence);
+	US4OEM_CHECK(!sequence.succeeded());
+	US4OEM_CHECK(sequence.executed() == 1 && sequence.status() == Us4OemSimulatedDevice::statusIoTimeout);
+	US4OEM_CHECK(sequence.value(0) == 0xAC);
+}
+
+US4OEM_TEST(batchSimulatedOneCallEach) {
+	Us4OemSimulatedDevice batched;
+	Us4OemSimulatedDevice each;
+
+	Us4OemBatch batch;
+	batch.allocDmaContig(4096)
+		.deallocDmaContig(0x1234)
+		.readStats()
+		.continueOnError();
+
+	US4OEM_CHECK(!batched.submitBatch(batch));
+	Us4OemBatch copy = batch;
+	US4OEM_CHECK(!each.submitEach(copy));
+
+	// The same results, one transition per command instead of one for all of them
+	US4OEM_CHECK(batched.transitions() == 1 && each.transitions() == 3);
+	for (size_t i = 0; i < batch.size(); i++) {
+		US4OEM_CHECK(batch.status(i) == copy.status(i));
+	}
+	US4OEM_CHECK(batch.output<us4oem_stats>(2).dma_contig_alloc_count == copy.output<us4oem_stats>(2).dma_contig_alloc_count);
+}
+
+// Per-call against batched submission of the same commands, with a simulated cost per user/kernel transition:
+//   tests --benchmark batchSubmission [transition ns]
+// The default is about what an IOCTL round trip costs on a desktop machine; the difference between the two is what
+// a batch saves, whatever the commands themselves take.
+US4OEM_BENCHMARK(batchSubmission) {
+	long long transitionNs = arguments.empty() ? 1500 : std::stoll(arguments[0]);
+	std::printf("Transition: %lld ns\n", transitionNs);
+	std::printf("%10s %14s %14s %10s\n", "commands", "per call [us]", "batched [us]", "speedup");
+
+	for (size_t commands : { 1, 2, 4, 8, 16, 64 }) {
+		Us4OemSimulatedDevice device{ std::chrono::nanoseconds(transitionNs) };
+
+		// Buffer setup between acquisitions: allocate and free again, so the device's state doesn't grow
+		Us4OemBatch batch;
+		for (size_t i = 0; i < commands; i++) {
+			if (i % 2 == 0) {
+				batch.allocDmaContig(4096);
+			}
+			else {
+				batch.deallocAll();
+			}
+		}
+
+		double each = us4oemBenchmarkNs(200, [&]() { us4oemBenchmarkKeep(device.submitEach(batch)); });
+		double batched = us4oemBenchmarkNs(200, [&]() { us4oemBenchmarkKeep(device.submitBatch(batch)); });
+		std::printf("%10zu %14.2f %14.2f %9.1fx\n", commands, each / 1e3, batched / 1e3, each / batched);
+	}
+}
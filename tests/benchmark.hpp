@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Benchmarks, registered like the tests but only run by main.cpp with --benchmark. Each prints its own results;
+// the command line arguments after the name filter are passed on, e.g. the files a benchmark replays.
+//
+//   US4OEM_BENCHMARK(sgIndexFind) {
+//       double ns = us4oemBenchmarkNs(1000000, [&]() { us4oemBenchmarkKeep(index.find(offset)); });
+//   }
+
+struct Us4OemBenchmark {
+	const char* name;
+	void (*run)(const std::vector<std::string>& arguments);
+};
+
+inline std::vector<Us4OemBenchmark>& us4oemBenchmarks() {
+	static std::vector<Us4OemBenchmark> benchmarks;
+	return benchmarks;
+}
+
+struct Us4OemBenchmarkRegistration {
+	Us4OemBenchmarkRegistration(const char* name, void (*run)(const std::vector<std::string>&)) {
+		us4oemBenchmarks().push_back({ name, run });
+	}
+};
+
+#define US4OEM_BENCHMARK(Name) \
+	static void Name([[maybe_unused]] const std::vector<std::string>& arguments); \
+	static Us4OemBenchmarkRegistration Name##Registration(#Name, Name); \
+	static void Name([[maybe_unused]] const std::vector<std::string>& arguments)
+
+// Makes the compiler compute value even though nothing reads it
+template<class T>
+inline void us4oemBenchmarkKeep(const T& value) {
+#ifdef _MSC_VER
+	static const void* volatile sink;
+	sink = &value;
+	_ReadWriteBarrier();
+#else
+	asm volatile("" : : "r"(&value) : "memory");
+#endif
+}
+
+// Nanoseconds per call of fn: the best of a few rounds of iterations calls each, so a round that was preempted
+// doesn't count
+template<class F>
+double us4oemBenchmarkNs(size_t iterations, F&& fn) {
+	double best = 0;
+	for (int round = 0; round < 5; round++) {
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < iterations; i++) {
+			fn();
+		}
+		std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+		double ns = elapsed.count() / (double)std::max<size_t>(iterations, 1);
+		best = round == 0 ? ns : std::min(best, ns);
+	}
+	return best;
+}
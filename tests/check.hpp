@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// A minimal test harness, so the tests need nothing but the standard library. Each test is a function registered
+// with US4OEM_TEST; a failed US4OEM_CHECK ends the test and is reported by main.cpp, the other tests still run.
+//
+//   US4OEM_TEST(sgIndexFindsChunks) {
+//       US4OEM_CHECK(index.find(0)->chunk == 0);
+//   }
+
+struct Us4OemTest {
+	const char* name;
+	void (*run)();
+};
+
+inline std::vector<Us4OemTest>& us4oemTests() {
+	static std::vector<Us4OemTest> tests;
+	return tests;
+}
+
+struct Us4OemTestRegistration {
+	Us4OemTestRegistration(const char* name, void (*run)()) {
+		us4oemTests().push_back({ name, run });
+	}
+};
+
+// Thrown by a failed check, with where it failed and what
+class Us4OemCheckFailure : public std::runtime_error {
+public:
+	Us4OemCheckFailure(const char* file, int line, const char* what) :
+		std::runtime_error(std::string(file) + ":" + std::to_string(line) + ": " + what) {}
+};
+
+#define US4OEM_TEST(Name) \
+	static void Name(); \
+	static Us4OemTestRegistration Name##Registration(#Name, Name); \
+	static void Name()
+
+#define US4OEM_CHECK(Condition) \
+	do { \
+		if (!(Condition)) { \
+			throw Us4OemCheckFailure(__FILE__, __LINE__, #Condition); \
+		} \
+	} while (0)
+
+// Checks that Expression throws Exception (or something derived from it)
+#define US4OEM_CHECK_THROWS(Exception, Expression) \
+	do { \
+		bool thrown = false; \
+		try { \
+			(void)(Expression); \
+		} catch (const Exception&) { \
+			thrown = true; \
+		} \
+		if (!thrown) { \
+			throw Us4OemCheckFailure(__FILE__, __LINE__, #Expression " didn't throw " #Exception); \
+		} \
+	} while (0)
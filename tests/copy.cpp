@@ -0,0 +1,82 @@
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "../sdk/copy.hpp"
+#include "check.hpp"
+
+// The copy kernels against memcpy, at every alignment of source and destination. Kernels the CPU doesn't support
+// are skipped.
+
+static const Us4OemCopyKernel us4oemTestKernels[] = {
+	Us4OemCopyKernel::Scalar,
+	Us4OemCopyKernel::Sse41,
+	Us4OemCopyKernel::Avx2,
+	Us4OemCopyKernel::Avx512,
+};
+
+// Copies length bytes from srcOffset to dstOffset with the kernel, and checks the result against memcpy,
+// including that nothing around the destination was touched
+static bool us4oemTestCopy(Us4OemCopyKernel kernel, size_t srcOffset, size_t dstOffset, size_t length) {
+	const size_t guard = 64;
+	std::vector<unsigned char> source(srcOffset + length + guard);
+	std::vector<unsigned char> actual(dstOffset + length + 2 * guard, 0xCC);
+	for (size_t i = 0; i < source.size(); i++) {
+		source[i] = (unsigned char)(i * 131 + 7);
+	}
+
+	std::vector<unsigned char> expected = actual;
+	std::memcpy(expected.data() + guard + dstOffset, source.data() + srcOffset, length);
+
+	Us4OemCopyEngine::copyWith(kernel, actual.data() + guard + dstOffset, source.data() + srcOffset, length);
+	return actual == expected;
+}
+
+US4OEM_TEST(copyKernelsAtEveryAlignment) {
+	// Below, at and above one loop iteration (4 registers) of each kernel, with heads and tails of every length
+	const size_t lengths[] = { 0, 1, 15, 16, 17, 63, 64, 65, 127, 128, 129, 255, 256, 257, 1000, 4096 + 13 };
+
+	for (Us4OemCopyKernel kernel : us4oemTestKernels) {
+		if (!Us4OemCopyEngine::supported(kernel)) {
+			continue;
+		}
+
+		for (size_t length : lengths) {
+			for (size_t srcOffset = 0; srcOffset < 64; srcOffset++) {
+				for (size_t dstOffset = 0; dstOffset < 64; dstOffset += 7) {
+					US4OEM_CHECK(us4oemTestCopy(kernel, srcOffset, dstOffset, length));
+				}
+				// Destination as aligned as the source, where the kernels use streaming stores
+				US4OEM_CHECK(us4oemTestCopy(kernel, srcOffset, srcOffset, length));
+			}
+		}
+	}
+}
+
+US4OEM_TEST(copyBestKernelIsSupported) {
+	US4OEM_CHECK(Us4OemCopyEngine::supported(Us4OemCopyEngine::best()));
+	US4OEM_CHECK(Us4OemCopyEngine::supported(Us4OemCopyKernel::Scalar));
+
+	// An unsupported kernel falls back to the best one
+	for (Us4OemCopyKernel kernel : us4oemTestKernels) {
+		Us4OemCopyEngine engine(kernel);
+		US4OEM_CHECK(engine.getKernel() == (Us4OemCopyEngine::supported(kernel) ? kernel : Us4OemCopyEngine::best()));
+	}
+}
+
+US4OEM_TEST(copySplitAcrossThreads) {
+	// Parts are whole pages; an odd length and an unaligned source leave a ragged last part
+	const size_t length = 5 * 4096 + 77;
+	std::vector<unsigned char> source(length + 3);
+	std::vector<unsigned char> destination(length, 0);
+	for (size_t i = 0; i < source.size(); i++) {
+		source[i] = (unsigned char)(i * 17 + 3);
+	}
+
+	Us4OemCopyEngine engine(Us4OemCopyEngine::best(), 4, 4096);
+	Us4OemCopyResult result = engine.copy(destination.data(), source.data() + 3, length);
+
+	US4OEM_CHECK(result.threads > 1 && result.threads <= 4);
+	US4OEM_CHECK(result.bytes == length);
+	US4OEM_CHECK(std::memcmp(destination.data(), source.data() + 3, length) == 0);
+}
@@ -0,0 +1,131 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "../sdk/devicecache.hpp"
+#include "check.hpp"
+
+// Us4OemDeviceCache with an injected scan in place of SetupAPI
+
+// A scan that counts how often it ran and returns whatever is in devices at the time. Us4OemDeviceLocation can't be
+// assigned, so devices is only ever added to.
+struct TestScanner {
+	std::vector<Us4OemDeviceLocation> devices;
+	std::atomic<int> scans = 0;
+	std::function<void()> during; // Called in the middle of a scan
+
+	Us4OemDeviceCache::Scanner scanner() {
+		return [this]() {
+			scans++;
+			if (during) {
+				during();
+			}
+			return devices;
+		};
+	}
+};
+
+static Us4OemDeviceLocation us4oemTestLocation(uint32_t bus, uint16_t device, uint16_t function, const char* path = "") {
+	return Us4OemDeviceLocation(device, function, bus, path);
+}
+
+US4OEM_TEST(deviceCacheSortsInPciOrder) {
+	std::vector<Us4OemDeviceLocation> locations = {
+		us4oemTestLocation(3, 0, 0),
+		us4oemTestLocation(1, 2, 0),
+		us4oemTestLocation(1, 0, 1, "first"),
+		us4oemTestLocation(1, 0, 0),
+		us4oemTestLocation(1, 0, 1, "second"), // Same address, keeps its place after "first"
+	};
+
+	std::vector<Us4OemDeviceLocation> sorted = Us4OemDeviceCache::sorted(locations);
+	US4OEM_CHECK(sorted.size() == 5);
+	US4OEM_CHECK(sorted[0] == us4oemTestLocation(1, 0, 0));
+	US4OEM_CHECK(sorted[1].getSystemPath().ends_with("first"));
+	US4OEM_CHECK(sorted[2].getSystemPath().ends_with("second"));
+	US4OEM_CHECK(sorted[3] == us4oemTestLocation(1, 2, 0));
+	US4OEM_CHECK(sorted[4] == us4oemTestLocation(3, 0, 0));
+}
+
+US4OEM_TEST(deviceCacheScansOnlyWhenInvalidated) {
+	TestScanner scan;
+	scan.devices.push_back(us4oemTestLocation(1, 0, 0));
+	Us4OemDeviceCache cache(scan.scanner());
+
+	Us4OemDeviceCache::DeviceList first = cache.devices();
+	US4OEM_CHECK(cache.devices() == first);
+	US4OEM_CHECK(scan.scans == 1);
+
+	// A device arrives; the list handed out before stays as it was
+	scan.devices.push_back(us4oemTestLocation(2, 0, 0));
+	unsigned long long generation = cache.getGeneration();
+	cache.invalidate();
+	US4OEM_CHECK(cache.getGeneration() != generation);
+
+	Us4OemDeviceCache::DeviceList second = cache.devices();
+	US4OEM_CHECK(scan.scans == 2);
+	US4OEM_CHECK(first->size() == 1);
+	US4OEM_CHECK(second->size() == 2);
+}
+
+US4OEM_TEST(deviceCacheAlwaysRescansWithoutNotifications) {
+	TestScanner scan;
+	Us4OemDeviceCache cache(scan.scanner());
+	cache.setAlwaysRescan(true);
+
+	cache.devices();
+	cache.devices();
+	US4OEM_CHECK(scan.scans == 2);
+}
+
+US4OEM_TEST(deviceCacheRescansAfterAnInvalidationDuringTheScan) {
+	TestScanner scan;
+	Us4OemDeviceCache cache(scan.scanner());
+
+	// The notification comes in while the first scan is running, so what it found may already be stale
+	bool invalidated = false;
+	scan.during = [&]() {
+		if (!invalidated) {
+			invalidated = true;
+			cache.invalidate();
+		}
+	};
+
+	cache.devices();
+	cache.devices();
+	US4OEM_CHECK(scan.scans == 2);
+	cache.devices();
+	US4OEM_CHECK(scan.scans == 2);
+}
+
+US4OEM_TEST(deviceCacheInvalidatesFromOtherThreads) {
+	TestScanner scan;
+	scan.devices.push_back(us4oemTestLocation(1, 0, 0));
+	scan.devices.push_back(us4oemTestLocation(2, 0, 0));
+	Us4OemDeviceCache cache(scan.scanner());
+
+	std::vector<std::thread> threads;
+	std::atomic<bool> wrongSize = false;
+	for (int t = 0; t < 4; t++) {
+		threads.emplace_back([&cache, &wrongSize, t]() {
+			for (int i = 0; i < 2000; i++) {
+				if (t % 2 == 0) {
+					cache.invalidate();
+				} else if (cache.devices()->size() != 2) {
+					wrongSize = true;
+				}
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	US4OEM_CHECK(!wrongSize);
+
+	// Whatever the interleaving, the last invalidation is seen by the next call
+	cache.invalidate();
+	int scans = scan.scans;
+	cache.devices();
+	US4OEM_CHECK(scan.scans == scans + 1);
+}
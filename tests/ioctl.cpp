@@ -0,0 +1,90 @@
+#include <algorithm>
+#include <iterator>
+
+#include "../sdk/ioctlstats.hpp"
+#include "check.hpp"
+
+// The IOCTL codes against the driver's dispatch table and the per-IOCTL statistics. The table's entries are
+// checked when the driver is compiled (US4OEM_IOCTL_ENTRY); this checks what clients see of it.
+
+static const unsigned long ioctlCodes[] = {
+	US4OEM_WIN32_IOCTL_GET_DRIVER_INFO,
+	US4OEM_WIN32_IOCTL_MMAP,
+	US4OEM_WIN32_IOCTL_READ_STATS,
+	US4OEM_WIN32_IOCTL_POLL,
+	US4OEM_WIN32_IOCTL_POLL_NONBLOCKING,
+	US4OEM_WIN32_IOCTL_CLEAR_PENDING,
+	US4OEM_WIN32_IOCTL_ALLOCATE_DMA_CONTIGIOUS_BUFFER,
+	US4OEM_WIN32_IOCTL_ALLOCATE_DMA_SG_BUFFER,
+	US4OEM_WIN32_IOCTL_DEALLOCATE_DMA_CONTIGIOUS_BUFFER,
+	US4OEM_WIN32_IOCTL_DEALLOCATE_DMA_SG_BUFFER,
+	US4OEM_WIN32_IOCTL_DEALLOCATE_ALL_DMA_BUFFERS,
+	US4OEM_WIN32_IOCTL_SET_STICKY_MODE,
+	US4OEM_WIN32_IOCTL_READ_LATENCY_STATS,
+	US4OEM_WIN32_IOCTL_SET_IRQ_MODERATION,
+	US4OEM_WIN32_IOCTL_POLL_EX,
+	US4OEM_WIN32_IOCTL_SET_IRQ_AFFINITY,
+	US4OEM_WIN32_IOCTL_READ_IOCTL_STATS,
+	US4OEM_WIN32_IOCTL_SUBMIT_BATCH,
+	US4OEM_WIN32_IOCTL_READ_QUEUE_STATS,
+	US4OEM_WIN32_IOCTL_REGISTER_ACCESS,
+	US4OEM_WIN32_IOCTL_GET_CAPABILITIES,
+	US4OEM_WIN32_IOCTL_READ_EVENTS,
+	US4OEM_WIN32_IOCTL_SET_EVENT_MASK,
+	US4OEM_WIN32_IOCTL_SET_TEARDOWN_OPTIONS,
+	US4OEM_WIN32_IOCTL_READ_EXTENDED_STATS,
+	US4OEM_WIN32_IOCTL_RELEASE_HANDLE,
+	US4OEM_WIN32_IOCTL_SET_LEASE,
+	US4OEM_WIN32_IOCTL_ATTACH_LEASE,
+};
+
+US4OEM_TEST(ioctlCodesHaveSlotsOfTheirOwn) {
+	bool taken[US4OEM_IOCTL_STATS_SLOTS] = {};
+
+	for (unsigned long code : ioctlCodes) {
+		unsigned long slot = us4oemIoctlSlot(code);
+		US4OEM_CHECK(slot < US4OEM_IOCTL_STATS_SLOTS);
+		US4OEM_CHECK(!taken[slot]);
+		taken[slot] = true;
+
+		// The table only takes buffered IOCTLs, and the code must be rebuilt from the slot alone
+		US4OEM_CHECK((code & 3) == METHOD_BUFFERED);
+		US4OEM_CHECK(code == CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + slot, METHOD_BUFFERED, FILE_ANY_ACCESS));
+	}
+
+	// Slots are handed out in order, so the table has no holes
+	US4OEM_CHECK(std::all_of(taken, taken + std::size(ioctlCodes), [](bool t) { return t; }));
+}
+
+US4OEM_TEST(ioctlStatsListCalledIoctlsByCode) {
+	us4oem_ioctl_stats raw = {};
+	raw.ioctls[us4oemIoctlSlot(US4OEM_WIN32_IOCTL_POLL)] = { 4, 4000, 2500 };
+	raw.ioctls[us4oemIoctlSlot(US4OEM_WIN32_IOCTL_ATTACH_LEASE)] = { 1, 700, 700 };
+	raw.rejected = 3;
+
+	Us4OemIoctlStats stats(raw);
+	US4OEM_CHECK(stats.entries.size() == 2);
+	US4OEM_CHECK(stats.entries[0].ioctlCode == US4OEM_WIN32_IOCTL_POLL);
+	US4OEM_CHECK(stats.entries[0].calls == 4 && stats.entries[0].meanNs() == 1000 && stats.entries[0].maxNs == 2500);
+	US4OEM_CHECK(stats.entries[1].ioctlCode == US4OEM_WIN32_IOCTL_ATTACH_LEASE);
+	US4OEM_CHECK(stats.rejected == 3);
+}
+
+US4OEM_TEST(ioctlRatesBySlot) {
+	us4oem_extended_stats earlier = {};
+	earlier.qpc_frequency = 1000;
+	earlier.timestamp = 1000;
+	earlier.ioctl_calls[us4oemIoctlSlot(US4OEM_WIN32_IOCTL_POLL)] = 10;
+
+	us4oem_extended_stats later = earlier;
+	later.timestamp = 3000; // 2 s later
+	later.ioctl_calls[us4oemIoctlSlot(US4OEM_WIN32_IOCTL_POLL)] = 30;
+	later.ioctl_calls[us4oemIoctlSlot(US4OEM_WIN32_IOCTL_MMAP)] = 4;
+
+	Us4OemStatsDelta delta = Us4OemExtendedStats(later).delta(Us4OemExtendedStats(earlier));
+	US4OEM_CHECK(delta.seconds == 2.0);
+	US4OEM_CHECK(delta.ioctls == 24);
+	US4OEM_CHECK(delta.ioctlRate(US4OEM_WIN32_IOCTL_POLL) == 10.0);
+	US4OEM_CHECK(delta.ioctlRate(US4OEM_WIN32_IOCTL_MMAP) == 2.0);
+	US4OEM_CHECK(delta.ioctlRate(CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)) == 0.0); // Not ours
+}
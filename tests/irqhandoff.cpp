@@ -0,0 +1,247 @@
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+
+// The driver's IRQ handoff (us4oem/IrqHandoff.h) run by threads standing in for the DPC and the poll handlers, with
+// the parked queue modelled by a locked slot. Every IRQ raised must end up taken by exactly one poll, cleared, or
+// still pending.
+
+// Reads sometimes yield, so other threads get in between a read and the compare-exchange that depends on it even on
+// a single CPU
+template<class T>
+static T us4oemTestPreempted(T value) {
+	static thread_local unsigned reads;
+	if (++reads % 4 == 0) {
+		std::this_thread::yield();
+	}
+	return value;
+}
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define __IRQ_HANDOFF_READ64(target) us4oemTestPreempted(_InterlockedCompareExchange64((target), 0, 0))
+#define __IRQ_HANDOFF_INCREMENT64(target) _InterlockedIncrement64(target)
+#define __IRQ_HANDOFF_EXCHANGE64(target, value) _InterlockedExchange64((target), (value))
+#define __IRQ_HANDOFF_COMPARE_EXCHANGE64(target, value, comparand) _InterlockedCompareExchange64((target), (value), (comparand))
+#define __IRQ_HANDOFF_READ(target) _InterlockedCompareExchange((target), 0, 0)
+#define __IRQ_HANDOFF_EXCHANGE(target, value) _InterlockedExchange((target), (value))
+#define __IRQ_HANDOFF_COMPARE_EXCHANGE(target, value, comparand) _InterlockedCompareExchange((target), (value), (comparand))
+#else
+#define __IRQ_HANDOFF_READ64(target) us4oemTestPreempted(__atomic_load_n((target), __ATOMIC_SEQ_CST))
+#define __IRQ_HANDOFF_INCREMENT64(target) __atomic_add_fetch((target), 1, __ATOMIC_SEQ_CST)
+#define __IRQ_HANDOFF_EXCHANGE64(target, value) __atomic_exchange_n((target), (value), __ATOMIC_SEQ_CST)
+#define __IRQ_HANDOFF_COMPARE_EXCHANGE64(target, value, comparand) __sync_val_compare_and_swap((target), (comparand), (value))
+#define __IRQ_HANDOFF_READ(target) __atomic_load_n((target), __ATOMIC_SEQ_CST)
+#define __IRQ_HANDOFF_EXCHANGE(target, value) __atomic_exchange_n((target), (value), __ATOMIC_SEQ_CST)
+#define __IRQ_HANDOFF_COMPARE_EXCHANGE(target, value, comparand) __sync_val_compare_and_swap((target), (comparand), (value))
+#endif
+#define __IRQ_HANDOFF_ATOMICS
+
+#include "../us4oem/IrqHandoff.h"
+
+struct Us4OemTestPoll {
+	long long maxEvents = 1;
+	std::atomic<long long> consumed{ 0 };
+	std::atomic<int> completions{ 0 };
+};
+
+struct Us4OemTestDevice {
+	volatile long long pending = 0;
+	volatile long waiting = 0;
+
+	std::mutex lock;
+	Us4OemTestPoll* parked = nullptr;
+
+	std::atomic<long long> raised{ 0 };
+	std::atomic<long long> taken{ 0 };
+	std::atomic<long long> handedOff{ 0 };
+	std::atomic<long long> cleared{ 0 };
+	std::atomic<int> badCompletions{ 0 };
+
+	static int ready(void* context) {
+		return __IRQ_HANDOFF_READ64(&static_cast<Us4OemTestDevice*>(context)->pending) > 0;
+	}
+
+	static void* takeWaiter(void* context) {
+		Us4OemTestDevice* device = static_cast<Us4OemTestDevice*>(context);
+		if (!us4oemIrqWaiterPresent(&device->waiting)) {
+			return nullptr;
+		}
+
+		std::lock_guard<std::mutex> guard(device->lock);
+		return std::exchange(device->parked, nullptr);
+	}
+
+	static long long consume(void* context, void* request) {
+		Us4OemTestDevice* device = static_cast<Us4OemTestDevice*>(context);
+		return us4oemIrqPendingTake(&device->pending, static_cast<Us4OemTestPoll*>(request)->maxEvents);
+	}
+
+	static void complete(void* context, void* request, long long consumed) {
+		Us4OemTestDevice* device = static_cast<Us4OemTestDevice*>(context);
+		Us4OemTestPoll* poll = static_cast<Us4OemTestPoll*>(request);
+
+		device->taken += consumed;
+		device->handedOff += consumed;
+		us4oemIrqWaiterRelease(&device->waiting);
+		poll->consumed = consumed;
+		if (poll->completions++ != 0) {
+			device->badCompletions++;
+		}
+	}
+
+	static int requeue(void* context, void* request) {
+		Us4OemTestDevice* device = static_cast<Us4OemTestDevice*>(context);
+		std::lock_guard<std::mutex> guard(device->lock);
+		device->parked = static_cast<Us4OemTestPoll*>(request);
+		return 1;
+	}
+
+	static constexpr US4OEM_IRQ_HANDOFF_OPS ops = { ready, takeWaiter, consume, complete, requeue };
+
+	// The DPC
+	void interrupt() {
+		us4oemIrqPendingRaise(&pending);
+		raised++;
+		us4oemIrqHandoffService(&ops, this);
+	}
+
+	// A poll that doesn't wait
+	void tryPoll(long long maxEvents) {
+		taken += us4oemIrqPendingTake(&pending, maxEvents);
+	}
+
+	void clear() {
+		cleared += us4oemIrqPendingClear(&pending);
+	}
+
+	// A blocking poll that gives up after timeout, as the driver's poll timer does. Returns the IRQs it got,
+	// -1 if another poll was already waiting. step is called between the steps of parking, with their number.
+	template<class F>
+	long long poll(long long maxEvents, std::chrono::steady_clock::duration timeout, F&& step) {
+		step(0);
+		long long consumed = us4oemIrqPendingTake(&pending, maxEvents);
+		if (consumed > 0) {
+			taken += consumed;
+			return consumed;
+		}
+
+		step(1);
+		if (!us4oemIrqWaiterClaim(&waiting)) {
+			return -1;
+		}
+
+		step(2);
+		Us4OemTestPoll request;
+		request.maxEvents = maxEvents;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			parked = &request;
+		}
+
+		step(3);
+		us4oemIrqHandoffService(&ops, this);
+		step(4);
+
+		auto deadline = std::chrono::steady_clock::now() + timeout;
+		while (request.completions == 0) {
+			if (std::chrono::steady_clock::now() >= deadline) {
+				// Timed out, unless the request is out of the queue being completed (or requeued) right now
+				std::unique_lock<std::mutex> guard(lock);
+				if (parked == &request) {
+					parked = nullptr;
+					guard.unlock();
+					us4oemIrqWaiterRelease(&waiting);
+					return 0;
+				}
+			}
+			std::this_thread::yield();
+		}
+
+		return request.consumed;
+	}
+};
+
+// An IRQ counted at each step of a poll parking: wherever it comes, the poll must get it rather than wait for the
+// next one
+US4OEM_TEST(irqHandoffIrqWhileParking) {
+	for (int irqStep = 0; irqStep <= 4; irqStep++) {
+		Us4OemTestDevice device;
+		long long consumed = device.poll(1, std::chrono::milliseconds(100), [&](int step) {
+			if (step == irqStep) {
+				device.interrupt();
+			}
+		});
+
+		US4OEM_CHECK(consumed == 1);
+		US4OEM_CHECK(device.pending == 0 && device.waiting == 0 && device.parked == nullptr);
+		US4OEM_CHECK(device.badCompletions == 0);
+	}
+
+	// Only one poll can wait, the next one is turned away until the first is completed
+	Us4OemTestDevice device;
+	long long second = 0;
+	long long first = device.poll(1, std::chrono::milliseconds(100), [&](int step) {
+		if (step == 4) {
+			second = device.poll(1, std::chrono::milliseconds(100), [](int) {});
+			device.interrupt();
+		}
+	});
+	US4OEM_CHECK(first == 1 && second == -1);
+	US4OEM_CHECK(device.poll(1, std::chrono::milliseconds(1), [](int) {}) == 0);
+}
+
+// DPCs against blocking, non-blocking, and clearing consumers at once
+US4OEM_TEST(irqHandoffStress) {
+	Us4OemTestDevice device;
+	std::atomic<bool> stop{ false };
+	std::vector<std::thread> threads;
+
+	for (int i = 0; i < 2; i++) {
+		threads.emplace_back([&]() {
+			for (int n = 0; n < 50000; n++) {
+				device.interrupt();
+				if (n % 8 == 0) {
+					std::this_thread::yield(); // Let the consumers in between IRQs even on a single CPU
+				}
+			}
+		});
+	}
+	for (long long maxEvents : { 1, 0, 4 }) {
+		threads.emplace_back([&, maxEvents]() {
+			while (!stop) {
+				device.poll(maxEvents, std::chrono::microseconds(200), [](int) {});
+			}
+		});
+	}
+	threads.emplace_back([&]() {
+		while (!stop) {
+			device.tryPoll(2);
+		}
+	});
+	threads.emplace_back([&]() {
+		while (!stop) {
+			device.clear();
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	});
+
+	threads[0].join();
+	threads[1].join();
+	stop = true;
+	for (size_t i = 2; i < threads.size(); i++) {
+		threads[i].join();
+	}
+
+	US4OEM_CHECK(device.raised == 100000);
+	US4OEM_CHECK(device.pending >= 0);
+	US4OEM_CHECK(device.raised == device.taken + device.cleared + device.pending);
+	US4OEM_CHECK(device.badCompletions == 0);
+	US4OEM_CHECK(device.waiting == 0 && device.parked == nullptr);
+	US4OEM_CHECK(device.handedOff > 0); // Some IRQs did reach a parked poll
+}
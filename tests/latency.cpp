@@ -0,0 +1,176 @@
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+#include "../sdk/latency.hpp"
+#include "benchmark.hpp"
+#include "check.hpp"
+
+// Us4OemPollTimestamps, Us4OemLatencyHistogram and Us4OemLatencyRecorder, on made-up timestamps. The latencyReplay
+// benchmark replays recordings saved by the sample's 'latency' command.
+
+US4OEM_TEST(latencyStagesInNanoseconds) {
+	us4oem_poll_response raw = {};
+	raw.isr_timestamp = 1000;
+	raw.dpc_timestamp = 1100;
+	raw.completion_timestamp = 1150;
+	raw.qpc_frequency = 10000000; // 100 ns ticks
+
+	Us4OemPollTimestamps timestamps(raw, 1400);
+	US4OEM_CHECK(timestamps.isrToDpcNs() == 10000);
+	US4OEM_CHECK(timestamps.dpcToCompletionNs() == 5000);
+	US4OEM_CHECK(timestamps.completionToWakeNs() == 25000);
+	US4OEM_CHECK(timestamps.isrToWakeNs() == 40000);
+}
+
+US4OEM_TEST(latencyMissingStagesAreNegative) {
+	us4oem_poll_response raw = {};
+	raw.dpc_timestamp = 1100;
+	raw.completion_timestamp = 1000; // Before the DPC, e.g. a stale timestamp
+	raw.qpc_frequency = 10000000;
+
+	Us4OemPollTimestamps timestamps(raw, 2000);
+	US4OEM_CHECK(timestamps.isrToDpcNs() == -1);
+	US4OEM_CHECK(timestamps.dpcToCompletionNs() == -1);
+	US4OEM_CHECK(timestamps.isrToWakeNs() == -1);
+
+	raw.qpc_frequency = 0;
+	US4OEM_CHECK(Us4OemPollTimestamps(raw, 2000).completionToWakeNs() == -1);
+}
+
+US4OEM_TEST(latencyLongStagesDontOverflow) {
+	us4oem_poll_response raw = {};
+	raw.isr_timestamp = 1;
+	raw.dpc_timestamp = 1 + 3000000000LL * 3600; // An hour at 3 GHz, which overflows if multiplied by 10^9 first
+	raw.qpc_frequency = 3000000000LL;
+
+	US4OEM_CHECK(Us4OemPollTimestamps(raw, 0).isrToDpcNs() == 3600LL * 1000000000LL);
+}
+
+US4OEM_TEST(latencyHistogramPercentiles) {
+	us4oem_latency_histogram raw = {};
+	raw.buckets[6] = 99; // [64, 128) ns
+	raw.buckets[20] = 1;
+	raw.sample_count = 100;
+	raw.total_ns = 99 * 100 + 1500000;
+	raw.max_ns = 1500000;
+
+	Us4OemLatencyHistogram histogram(raw);
+	US4OEM_CHECK(histogram.percentileNs(50.0) == 127);
+	US4OEM_CHECK(histogram.percentileNs(99.0) == 127);
+	US4OEM_CHECK(histogram.percentileNs(99.9) == 1500000); // The bucket goes up to 2^21 - 1, the max is lower
+	US4OEM_CHECK(histogram.meanNs() == (99.0 * 100 + 1500000) / 100);
+
+	US4OEM_CHECK(Us4OemLatencyHistogram(us4oem_latency_histogram{}).percentileNs(50.0) == 0);
+}
+
+US4OEM_TEST(latencyRecorderPercentilesAreExact) {
+	Us4OemLatencyRecorder recorder;
+	for (long long i = 1; i <= 1000; i++) {
+		Us4OemPollTimestamps sample;
+		sample.isr = 1000;
+		sample.dpc = 1000 + i; // 1 to 1000 ns
+		sample.frequency = 1000000000;
+		recorder.add(sample);
+	}
+
+	Us4OemLatencyRecorder::Percentiles percentiles = recorder.isrToDpc();
+	US4OEM_CHECK(percentiles.count == 1000);
+	US4OEM_CHECK(percentiles.p50 == 500);
+	US4OEM_CHECK(percentiles.p90 == 900);
+	US4OEM_CHECK(percentiles.p99 == 990);
+	US4OEM_CHECK(percentiles.p999 == 999);
+	US4OEM_CHECK(percentiles.max == 1000);
+
+	// No wake-up timestamps, so the stage has no samples
+	US4OEM_CHECK(recorder.completionToWake().count == 0);
+}
+
+US4OEM_TEST(latencyRecorderCsvRoundTrip) {
+	Us4OemLatencyRecorder recorder;
+	Us4OemPollTimestamps sample;
+	sample.isr = 10;
+	sample.dpc = 20;
+	sample.completion = 30;
+	sample.wake = 45;
+	sample.frequency = 1000;
+	recorder.add(sample);
+	sample.wake = 0;
+	recorder.add(sample);
+
+	std::stringstream csv;
+	recorder.saveCsv(csv);
+	csv << "not,a,sample\n";
+
+	Us4OemLatencyRecorder replayed;
+	replayed.loadCsv(csv);
+
+	const auto& samples = replayed.getSamples();
+	US4OEM_CHECK(samples.size() == 2);
+	US4OEM_CHECK(samples[0].isr == 10 && samples[0].dpc == 20 && samples[0].completion == 30);
+	US4OEM_CHECK(samples[0].wake == 45 && samples[0].frequency == 1000);
+	US4OEM_CHECK(samples[1].wake == 0);
+	US4OEM_CHECK(replayed.isrToWake().count == 1);
+}
+
+// A recording like the sample's 'latency' command saves, one poll per millisecond at a 10 MHz QPC. Stages take a few
+// microseconds, with a long tail.
+static std::string us4oemTestRecording(size_t polls) {
+	std::mt19937 random(2026);
+	std::lognormal_distribution<double> isrToDpc(std::log(20.0), 0.6); // In ticks
+	std::lognormal_distribution<double> dpcToCompletion(std::log(10.0), 0.4);
+	std::lognormal_distribution<double> completionToWake(std::log(40.0), 0.8);
+
+	Us4OemLatencyRecorder recorder;
+	for (size_t i = 0; i < polls; i++) {
+		Us4OemPollTimestamps sample;
+		sample.frequency = 10000000;
+		sample.isr = 1000 + (long long)i * 10000;
+		sample.dpc = sample.isr + (long long)isrToDpc(random);
+		sample.completion = sample.dpc + (long long)dpcToCompletion(random);
+		sample.wake = sample.completion + (long long)completionToWake(random);
+		recorder.add(sample);
+	}
+
+	std::ostringstream csv;
+	recorder.saveCsv(csv);
+	return csv.str();
+}
+
+// Replays the CSV files given, or a made-up recording without any: the stage percentiles, and how long loading and
+// computing them takes
+US4OEM_BENCHMARK(latencyReplay) {
+	std::vector<std::pair<std::string, std::string>> recordings; // Name and contents
+	for (const std::string& path : arguments) {
+		std::ifstream in(path);
+		if (!in) {
+			throw std::runtime_error("Failed to open " + path);
+		}
+		std::ostringstream contents;
+		contents << in.rdbuf();
+		recordings.push_back({ path, contents.str() });
+	}
+	if (recordings.empty()) {
+		recordings.push_back({ "made-up recording", us4oemTestRecording(100000) });
+	}
+
+	for (const auto& [name, contents] : recordings) {
+		Us4OemLatencyRecorder recorder;
+		std::istringstream in(contents);
+		auto start = std::chrono::steady_clock::now();
+		recorder.loadCsv(in);
+		std::chrono::duration<double, std::nano> loading = std::chrono::steady_clock::now() - start;
+
+		size_t samples = recorder.getSamples().size();
+		double computing = us4oemBenchmarkNs(1, [&]() { us4oemBenchmarkKeep(recorder.isrToWake()); });
+
+		std::cout << name << ": " << samples << " polls" << std::endl << recorder.toString() << std::endl;
+		if (samples > 0) {
+			std::cout << std::format("Loading: {:.1f} ns per poll, percentiles of a stage: {:.1f} ns per poll",
+				loading.count() / samples, computing / samples) << std::endl;
+		}
+	}
+}
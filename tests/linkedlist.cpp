@@ -0,0 +1,251 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "benchmark.hpp"
+#include "check.hpp"
+
+// The driver's LinkedList.h, with its memory management on top of malloc/free. The pool counts what's live, so the
+// tests can tell which operations free their entries.
+
+struct Us4OemTestPool {
+	size_t entrySize;
+	long live; // Entries allocated and not freed yet
+	bool failNext; // Makes the next allocation fail, like an empty lookaside list in low memory
+};
+
+static void* us4oemTestPoolAlloc(Us4OemTestPool& pool, size_t size) {
+	US4OEM_CHECK(size == pool.entrySize);
+	if (pool.failNext) {
+		pool.failNext = false;
+		return nullptr;
+	}
+	pool.live++;
+	return std::malloc(size);
+}
+
+static void us4oemTestPoolFree(Us4OemTestPool& pool, void* ptr, size_t size) {
+	US4OEM_CHECK(size == pool.entrySize);
+	pool.live--;
+	std::free(ptr);
+}
+
+#define __LINKED_LIST_POOL_TYPE Us4OemTestPool
+#define __LINKED_LIST_POOL_INIT(pool, size) ((pool) = Us4OemTestPool{ (size), 0, false }, 0)
+#define __LINKED_LIST_POOL_DELETE(pool) US4OEM_CHECK((pool).live == 0)
+#define __LINKED_LIST_ALLOC(pool, size) us4oemTestPoolAlloc((pool), (size))
+#define __LINKED_LIST_FREE(pool, ptr, size) us4oemTestPoolFree((pool), (ptr), (size))
+#define __LINKED_LIST_ZERO(ptr, size) std::memset((ptr), 0, (size))
+#define __LINKED_LIST_MM
+
+#include "../us4oem/LinkedList.h"
+
+typedef struct _TEST_ITEM {
+	int value;
+	char padding[20];
+} TEST_ITEM;
+
+USE_IN_LINKED_LISTS(TEST_ITEM)
+
+struct TestOwner {
+	LINKED_LIST_POINTERS(TEST_ITEM, Items)
+};
+
+static TEST_ITEM* push(TestOwner& owner, int value) {
+	TEST_ITEM* item = LINKED_LIST_NEW(TEST_ITEM, owner.Items);
+	US4OEM_CHECK(item != nullptr);
+	item->value = value;
+	LINKED_LIST_PUSH(TEST_ITEM, owner.Items, item);
+	return item;
+}
+
+// The values front to back, checking the back links on the way
+static std::vector<int> values(const TestOwner& owner) {
+	std::vector<int> result;
+	TEST_ITEM_LIST_ENTRY* previous = nullptr;
+
+	LINKED_LIST_FOR_EACH(TEST_ITEM, owner.Items, entry) {
+		US4OEM_CHECK(entry->Prev == previous);
+		US4OEM_CHECK(entry->Item == &entry->Storage);
+		result.push_back(entry->Item->value);
+		previous = entry;
+	}
+
+	US4OEM_CHECK(LINKED_LIST_TAIL(TEST_ITEM, owner.Items) == previous);
+	return result;
+}
+
+static TEST_ITEM_LIST_ENTRY* find(const TestOwner& owner, int value) {
+	LINKED_LIST_FOR_EACH(TEST_ITEM, owner.Items, entry) {
+		if (entry->Item->value == value) {
+			return entry;
+		}
+	}
+	return nullptr;
+}
+
+US4OEM_TEST(linkedListPushesInOrder) {
+	TestOwner owner = {};
+	US4OEM_CHECK(LINKED_LIST_INITIALIZE(TEST_ITEM, owner.Items) == 0);
+	US4OEM_CHECK(values(owner).empty());
+
+	TEST_ITEM* first = push(owner, 1);
+	push(owner, 2);
+	push(owner, 3);
+
+	US4OEM_CHECK((values(owner) == std::vector<int>{ 1, 2, 3 }));
+	US4OEM_CHECK(LINKED_LIST_HEAD(TEST_ITEM, owner.Items) == LINKED_LIST_ENTRY_OF(TEST_ITEM, first));
+	US4OEM_CHECK(owner.ItemsPool.live == 3);
+
+	LINKED_LIST_CLEAR(TEST_ITEM, owner.Items);
+	US4OEM_CHECK(values(owner).empty());
+	LINKED_LIST_DELETE(TEST_ITEM, owner.Items);
+}
+
+US4OEM_TEST(linkedListNewItemsAreZeroed) {
+	TestOwner owner = {};
+	LINKED_LIST_INITIALIZE(TEST_ITEM, owner.Items);
+
+	// Reuse of a freed entry must not leak its old contents
+	TEST_ITEM* item = LINKED_LIST_NEW(TEST_ITEM, owner.Items);
+	std::memset(item, 0xAB, sizeof(*item));
+	LINKED_LIST_DISCARD(TEST_ITEM, owner.Items, item);
+
+	item = LINKED_LIST_NEW(TEST_ITEM, owner.Items);
+	TEST_ITEM zero = {};
+	US4OEM_CHECK(std::memcmp(item, &zero, sizeof(zero)) == 0);
+	LINKED_LIST_DISCARD(TEST_ITEM, owner.Items, item);
+
+	LINKED_LIST_DELETE(TEST_ITEM, owner.Items);
+}
+
+US4OEM_TEST(linkedListNewFailsCleanly) {
+	TestOwner owner = {};
+	LINKED_LIST_INITIALIZE(TEST_ITEM, owner.Items);
+	push(owner, 1);
+
+	owner.ItemsPool.failNext = true;
+	US4OEM_CHECK(LINKED_LIST_NEW(TEST_ITEM, owner.Items) == nullptr);
+	US4OEM_CHECK((values(owner) == std::vector<int>{ 1 }));
+
+	LINKED_LIST_CLEAR(TEST_ITEM, owner.Items);
+	LINKED_LIST_DELETE(TEST_ITEM, owner.Items);
+}
+
+US4OEM_TEST(linkedListRemovesAnywhere) {
+	TestOwner owner = {};
+	LINKED_LIST_INITIALIZE(TEST_ITEM, owner.Items);
+	for (int i = 1; i <= 5; i++) {
+		push(owner, i);
+	}
+
+	TEST_ITEM_LIST_ENTRY* entry = find(owner, 3);
+	LINKED_LIST_REMOVE(TEST_ITEM, owner.Items, entry);
+	US4OEM_CHECK((values(owner) == std::vector<int>{ 1, 2, 4, 5 }));
+
+	entry = find(owner, 1);
+	LINKED_LIST_REMOVE(TEST_ITEM, owner.Items, entry);
+	US4OEM_CHECK((values(owner) == std::vector<int>{ 2, 4, 5 }));
+
+	entry = find(owner, 5);
+	LINKED_LIST_REMOVE(TEST_ITEM, owner.Items, entry);
+	US4OEM_CHECK((values(owner) == std::vector<int>{ 2, 4 }));
+	US4OEM_CHECK(owner.ItemsPool.live == 2);
+
+	// Down to nothing, and usable again after that
+	entry = find(owner, 2);
+	LINKED_LIST_REMOVE(TEST_ITEM, owner.Items, entry);
+	entry = find(owner, 4);
+	LINKED_LIST_REMOVE(TEST_ITEM, owner.Items, entry);
+	US4OEM_CHECK(LINKED_LIST_HEAD(TEST_ITEM, owner.Items) == nullptr);
+	US4OEM_CHECK(values(owner).empty());
+
+	push(owner, 6);
+	US4OEM_CHECK((values(owner) == std::vector<int>{ 6 }));
+
+	LINKED_LIST_CLEAR(TEST_ITEM, owner.Items);
+	LINKED_LIST_DELETE(TEST_ITEM, owner.Items);
+}
+
+US4OEM_TEST(linkedListUnlinkKeepsTheEntry) {
+	// How the teardown takes buffers off the list and releases them after the lock is dropped
+	TestOwner owner = {};
+	LINKED_LIST_INITIALIZE(TEST_ITEM, owner.Items);
+	for (int i = 1; i <= 4; i++) {
+		push(owner, i);
+	}
+
+	std::vector<TEST_ITEM_LIST_ENTRY*> detached;
+	TEST_ITEM_LIST_ENTRY* entry = LINKED_LIST_HEAD(TEST_ITEM, owner.Items);
+	while (entry != nullptr) {
+		TEST_ITEM_LIST_ENTRY* next = entry->Next;
+		if (entry->Item->value % 2 == 0) {
+			LINKED_LIST_UNLINK(TEST_ITEM, owner.Items, entry);
+			detached.push_back(entry);
+		}
+		entry = next;
+	}
+
+	US4OEM_CHECK((values(owner) == std::vector<int>{ 1, 3 }));
+	US4OEM_CHECK(owner.ItemsPool.live == 4);
+
+	// Still allocated and intact, and can go back on the list
+	US4OEM_CHECK(detached.size() == 2 && detached[0]->Item->value == 2 && detached[1]->Item->value == 4);
+	LINKED_LIST_PUSH(TEST_ITEM, owner.Items, detached[1]->Item);
+	US4OEM_CHECK((values(owner) == std::vector<int>{ 1, 3, 4 }));
+
+	LINKED_LIST_DISCARD(TEST_ITEM, owner.Items, detached[0]->Item);
+	LINKED_LIST_CLEAR(TEST_ITEM, owner.Items);
+	LINKED_LIST_DELETE(TEST_ITEM, owner.Items);
+}
+
+US4OEM_TEST(linkedListUnlinksTheOnlyEntry) {
+	TestOwner owner = {};
+	LINKED_LIST_INITIALIZE(TEST_ITEM, owner.Items);
+	TEST_ITEM* item = push(owner, 1);
+
+	TEST_ITEM_LIST_ENTRY* entry = LINKED_LIST_ENTRY_OF(TEST_ITEM, item);
+	LINKED_LIST_UNLINK(TEST_ITEM, owner.Items, entry);
+	US4OEM_CHECK(LINKED_LIST_HEAD(TEST_ITEM, owner.Items) == nullptr);
+	US4OEM_CHECK(LINKED_LIST_TAIL(TEST_ITEM, owner.Items) == nullptr);
+
+	LINKED_LIST_DISCARD(TEST_ITEM, owner.Items, item);
+	LINKED_LIST_DELETE(TEST_ITEM, owner.Items);
+}
+
+// A full walk of lists of N entries, as a lookup by a key that isn't there (or the teardown) does:
+//   tests --benchmark linkedListTraversal [entries]
+// With the entries in cached memory the cost per entry is a dependent load or two; the driver's lookaside lists
+// are cached too, unlike the non-cached allocations they replaced.
+US4OEM_BENCHMARK(linkedListTraversal) {
+	std::vector<size_t> counts = { 16, 256, 4096, 65536 };
+	if (!arguments.empty()) {
+		counts = { std::stoul(arguments[0]) };
+	}
+	std::printf("%10s %14s %14s\n", "entries", "walk [ns]", "entry [ns]");
+
+	for (size_t count : counts) {
+		TestOwner owner = {};
+		LINKED_LIST_INITIALIZE(TEST_ITEM, owner.Items);
+		for (size_t i = 0; i < count; i++) {
+			push(owner, (int)i);
+		}
+
+		double ns = us4oemBenchmarkNs(std::max<size_t>(1, 4000000 / count), [&]() {
+			TEST_ITEM_LIST_ENTRY* found = nullptr;
+			LINKED_LIST_FOR_EACH(TEST_ITEM, owner.Items, entry) {
+				if (entry->Item->value == -1) {
+					found = entry;
+					break;
+				}
+			}
+			us4oemBenchmarkKeep(found);
+		});
+		std::printf("%10zu %14.1f %14.2f\n", count, ns, ns / (double)count);
+
+		LINKED_LIST_CLEAR(TEST_ITEM, owner.Items);
+		LINKED_LIST_DELETE(TEST_ITEM, owner.Items);
+	}
+}
@@ -0,0 +1,66 @@
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "benchmark.hpp"
+#include "check.hpp"
+
+// Runs every registered test, or those whose name contains the first argument. Returns the number of failures.
+//   tests [filter]
+//
+// With --benchmark, runs the benchmarks instead, passing them the arguments after the filter:
+//   tests --benchmark latencyReplay recording.csv
+//
+// Test files that don't include the SDK's common.hpp (which needs the Windows SDK) also build elsewhere, e.g.
+//   g++ -std=c++20 -O2 main.cpp sg.cpp
+static int us4oemRunBenchmarks(int argc, char** argv) {
+	const char* filter = argc > 2 ? argv[2] : "";
+	std::vector<std::string> arguments(argv + std::min(argc, 3), argv + argc);
+	int failed = 0;
+
+	for (const Us4OemBenchmark& benchmark : us4oemBenchmarks()) {
+		if (std::strstr(benchmark.name, filter) == nullptr) {
+			continue;
+		}
+
+		std::cout << "========== " << benchmark.name << " ==========" << std::endl;
+		try {
+			benchmark.run(arguments);
+		} catch (const std::exception& e) {
+			failed++;
+			std::cout << "[FAILED] " << benchmark.name << ": " << e.what() << std::endl;
+		}
+	}
+
+	return failed;
+}
+
+int main(int argc, char** argv) {
+	if (argc > 1 && std::strcmp(argv[1], "--benchmark") == 0) {
+		return us4oemRunBenchmarks(argc, argv);
+	}
+
+	const char* filter = argc > 1 ? argv[1] : "";
+	int run = 0;
+	int failed = 0;
+
+	for (const Us4OemTest& test : us4oemTests()) {
+		if (std::strstr(test.name, filter) == nullptr) {
+			continue;
+		}
+
+		run++;
+		try {
+			test.run();
+			std::cout << "[  OK  ] " << test.name << std::endl;
+		} catch (const std::exception& e) {
+			failed++;
+			std::cout << "[FAILED] " << test.name << ": " << e.what() << std::endl;
+		}
+	}
+
+	std::cout << run - failed << " of " << run << " tests passed" << std::endl;
+	return failed;
+}
@@ -0,0 +1,117 @@
+#include <cstdint>
+#include <cstring>
+
+#include "../sdk/registers.hpp"
+#include "check.hpp"
+
+// The register map and Us4OemBar over the recording backend and over plain memory. What the compiler rejects
+// (wrong BAR, misaligned offsets, writes to read-only registers) can't be checked at run time.
+
+// Made-up registers
+using Control = Us4OemRegister<4, 0x10, uint32_t>;
+using Enable = Us4OemField<Control, 0, 1>;
+using Mode = Us4OemField<Control, 4, 3>;
+using Divider = Us4OemField<Control, 16, 16>;
+using Status = Us4OemRegister<4, 0x14, uint32_t, Us4OemRegisterAccess::ReadOnly>;
+using Ready = Us4OemField<Status, 31, 1>;
+using Doorbell = Us4OemRegister<4, 0x18, uint16_t, Us4OemRegisterAccess::WriteOnly>;
+using Counter = Us4OemRegister<4, 0x20, uint64_t, Us4OemRegisterAccess::ReadOnly>;
+using Whole = Us4OemField<Counter, 0, 64>;
+using Coefficients = Us4OemRegisterBlock<Us4OemRegister<4, 0x40, uint32_t>, 4>;
+
+using RecordingBar = Us4OemBar<4, Us4OemRecordingBackend>;
+
+static_assert(Enable::mask == 0x1 && Mode::mask == 0x70 && Divider::mask == 0xFFFF0000);
+static_assert(Whole::max == UINT64_MAX && Whole::mask == UINT64_MAX);
+static_assert(Mode::encode(0xF) == 0x70); // Bits outside the field are dropped
+static_assert(Mode::extract(0xFFFFFF5F) == 0x5);
+static_assert(Coefficients::at<3>::offset == 0x4C && Coefficients::length == 16);
+
+US4OEM_TEST(registersReadAndWriteAtTheirWidth) {
+	Us4OemRecordingBackend::State state;
+	RecordingBar bar{ Us4OemRecordingBackend(state) };
+	Us4OemRecordingBackend(state).poke(Counter::offset, 0x123456789ABCDEF0ull);
+
+	US4OEM_CHECK(bar.read<Counter>() == 0x123456789ABCDEF0ull);
+	bar.write<Doorbell>(0xBEEF);
+
+	US4OEM_CHECK(state.log.size() == 2);
+	US4OEM_CHECK(!state.log[0].write && state.log[0].offset == 0x20 && state.log[0].width == 8);
+	US4OEM_CHECK(state.log[1].write && state.log[1].offset == 0x18 && state.log[1].width == 2 && state.log[1].value == 0xBEEF);
+}
+
+US4OEM_TEST(registersSetFieldsInOneReadModifyWrite) {
+	Us4OemRecordingBackend::State state;
+	RecordingBar bar{ Us4OemRecordingBackend(state) };
+	Us4OemRecordingBackend(state).poke(Control::offset, 0xAAAA0F0E);
+
+	bar.setFields<Enable, Mode, Divider>(1, 5, 0x1234);
+
+	US4OEM_CHECK(state.log.size() == 2);
+	US4OEM_CHECK(!state.log[0].write && state.log[0].offset == Control::offset);
+	US4OEM_CHECK(state.log[1].write && state.log[1].value == 0x12340F5F); // Bits outside the fields are kept
+
+	US4OEM_CHECK(bar.get<Mode>() == 5);
+	US4OEM_CHECK(bar.get<Divider>() == 0x1234);
+
+	bar.set<Mode, 2>();
+	US4OEM_CHECK(bar.read<Control>() == 0x12340F2F);
+	bar.set<Enable>(0xFE); // Only the field's bit is written
+	US4OEM_CHECK(bar.get<Enable>() == 0);
+}
+
+US4OEM_TEST(registersReadOnlyFields) {
+	Us4OemRecordingBackend::State state;
+	RecordingBar bar{ Us4OemRecordingBackend(state) };
+
+	US4OEM_CHECK(bar.get<Ready>() == 0);
+	Us4OemRecordingBackend(state).poke(Status::offset, 0x80000000);
+	US4OEM_CHECK(bar.get<Ready>() == 1);
+	US4OEM_CHECK(bar.get<Whole>() == 0);
+}
+
+US4OEM_TEST(registersBlocksInAddressOrder) {
+	Us4OemRecordingBackend::State state;
+	RecordingBar bar{ Us4OemRecordingBackend(state) };
+
+	bar.writeBlock<Coefficients>({ 1, 2, 3, 4 });
+	US4OEM_CHECK(state.log.size() == 4);
+	for (size_t i = 0; i < 4; i++) {
+		US4OEM_CHECK(state.log[i].write && state.log[i].offset == 0x40 + 4 * i && state.log[i].value == i + 1);
+	}
+
+	uint32_t values[4] = {};
+	bar.readBlock<Coefficients>(values);
+	US4OEM_CHECK(values[0] == 1 && values[3] == 4);
+	US4OEM_CHECK(bar.read<Coefficients::at<2>>() == 3);
+}
+
+US4OEM_TEST(registersOverMemory) {
+	// Us4OemMmioBackend on an ordinary buffer standing in for a mapped BAR
+	alignas(8) unsigned char memory[0x80] = {};
+	Us4OemBar<4> bar{ Us4OemMmioBackend(memory, sizeof(memory)) };
+
+	bar.write<Control>(0x00010001);
+	bar.set<Mode>(7);
+	uint32_t control;
+	std::memcpy(&control, memory + Control::offset, sizeof(control));
+	US4OEM_CHECK(control == 0x00010071);
+
+	bar.write<Doorbell>(0xFFFF);
+	US4OEM_CHECK(memory[0x18] == 0xFF && memory[0x19] == 0xFF && memory[0x1A] == 0);
+
+	uint64_t counter = 0x0102030405060708ull;
+	std::memcpy(memory + Counter::offset, &counter, sizeof(counter));
+	US4OEM_CHECK(bar.read<Counter>() == counter);
+}
+
+US4OEM_TEST(registersSdkMap) {
+	// What the sample uses to trigger an IRQ on QEMU
+	Us4OemRecordingBackend::State state;
+	Us4OemBar<4, Us4OemRecordingBackend> bar{ Us4OemRecordingBackend(state) };
+
+	bar.writeBlock<Us4OemBar4Registers::QemuIrqTrigger>({ 0x01, 0x01 });
+	US4OEM_CHECK(state.log.size() == 2);
+	US4OEM_CHECK(state.log[0].offset == 0x60 && state.log[1].offset == 0x64);
+	US4OEM_CHECK(bar.read<Us4OemBar4Registers::Id>() == 0);
+}
@@ -0,0 +1,298 @@
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "../sdk/sg.hpp"
+#include "check.hpp"
+
+// Us4OemDmaSgIndex and Us4OemDmaSgCompact against a linear scan of the chunks they were built from
+
+// Chunks of the given lengths, laid out back to back from vaOffset 0, at physical addresses from pas
+static std::vector<Us4OemDmaSgChunk> us4oemTestChunks(const std::vector<size_t>& lengths, const std::vector<size_t>& pas) {
+	std::vector<Us4OemDmaSgChunk> chunks;
+	size_t offset = 0;
+	for (size_t i = 0; i < lengths.size(); i++) {
+		chunks.push_back({ offset, pas[i], lengths[i] });
+		offset += lengths[i];
+	}
+	return chunks;
+}
+
+// What find should return, by walking the chunks
+static std::optional<Us4OemDmaSgLocation> us4oemTestFind(const std::vector<Us4OemDmaSgChunk>& chunks, size_t offset) {
+	size_t start = 0;
+	for (size_t i = 0; i < chunks.size(); i++) {
+		if (offset < start + chunks[i].length) {
+			return Us4OemDmaSgLocation{ i, chunks[i].pa + (offset - start), start + chunks[i].length - offset };
+		}
+		start += chunks[i].length;
+	}
+	return std::nullopt;
+}
+
+static bool us4oemTestSameLocation(const std::optional<Us4OemDmaSgLocation>& a, const std::optional<Us4OemDmaSgLocation>& b) {
+	if (!a || !b) {
+		return !a && !b;
+	}
+	return a->chunk == b->chunk && a->pa == b->pa && a->remaining == b->remaining;
+}
+
+// Checks every offset of the buffer and one past it
+static void us4oemTestFindEverywhere(const std::vector<Us4OemDmaSgChunk>& chunks) {
+	Us4OemDmaSgIndex index(chunks);
+	for (size_t offset = 0; offset <= index.length(); offset++) {
+		US4OEM_CHECK(us4oemTestSameLocation(index.find(offset), us4oemTestFind(chunks, offset)));
+	}
+}
+
+// Checks the runs of [offset, offset + length) cover it in order, each physically contiguous, and that no two
+// consecutive runs could have been merged
+static void us4oemTestRuns(const Us4OemDmaSgIndex& index, size_t offset, size_t length) {
+	size_t expected = std::min(offset, index.length());
+	size_t end = expected + std::min(length, index.length() - expected);
+	std::optional<Us4OemDmaSgRun> previous;
+
+	for (const Us4OemDmaSgRun& run : index.runs(offset, length)) {
+		US4OEM_CHECK(run.offset == expected && run.length > 0);
+		for (size_t i = 0; i < run.length; i++) {
+			US4OEM_CHECK(index.find(run.offset + i)->pa == run.pa + i);
+		}
+		US4OEM_CHECK(!previous || previous->pa + previous->length != run.pa);
+
+		expected += run.length;
+		previous = run;
+	}
+
+	US4OEM_CHECK(expected == end);
+}
+
+US4OEM_TEST(sgIndexUniform) {
+	// How the driver allocates: fixed-size chunks, the last one shorter
+	std::vector<Us4OemDmaSgChunk> chunks = us4oemTestChunks({ 64, 64, 64, 40 }, { 0x10000, 0x30000, 0x20000, 0x50000 });
+	Us4OemDmaSgIndex index(chunks);
+
+	US4OEM_CHECK(index.isUniform());
+	US4OEM_CHECK(index.chunkCount() == 4);
+	US4OEM_CHECK(index.length() == 232);
+	US4OEM_CHECK(index.find(64)->chunk == 1 && index.find(64)->pa == 0x30000);
+	US4OEM_CHECK(index.find(231)->remaining == 1);
+	US4OEM_CHECK(!index.find(232));
+
+	us4oemTestFindEverywhere(chunks);
+}
+
+US4OEM_TEST(sgIndexNonUniform) {
+	// A first chunk shorter than the rest, and a last one longer, both make the index fall back to the search
+	std::vector<std::vector<size_t>> layouts = {
+		{ 32, 64, 64 },
+		{ 64, 64, 100 },
+		{ 7, 300, 1, 1, 90, 4096 },
+	};
+
+	for (const auto& lengths : layouts) {
+		std::vector<size_t> pas;
+		for (size_t i = 0; i < lengths.size(); i++) {
+			pas.push_back(0x100000 * (lengths.size() - i));
+		}
+
+		std::vector<Us4OemDmaSgChunk> chunks = us4oemTestChunks(lengths, pas);
+		US4OEM_CHECK(!Us4OemDmaSgIndex(chunks).isUniform());
+		us4oemTestFindEverywhere(chunks);
+	}
+}
+
+US4OEM_TEST(sgIndexEmptyChunksKeepTheirIndices) {
+	// Empty chunks hold no bytes, but find reports chunk indices into the list the index was built from
+	std::vector<Us4OemDmaSgChunk> chunks = us4oemTestChunks({ 0, 64, 0, 0, 64, 30, 0 }, { 0x1000, 0x2000, 0x3000, 0x4000, 0x5000, 0x6000, 0x7000 });
+	Us4OemDmaSgIndex index(chunks);
+
+	US4OEM_CHECK(index.isUniform()); // The empty ones don't count
+	US4OEM_CHECK(index.chunkCount() == 3);
+	US4OEM_CHECK(index.find(0)->chunk == 1);
+	US4OEM_CHECK(index.find(64)->chunk == 4 && index.find(64)->pa == 0x5000);
+	US4OEM_CHECK(index.find(128)->chunk == 5);
+	us4oemTestFindEverywhere(chunks);
+
+	chunks = us4oemTestChunks({ 10, 0, 20, 5 }, { 0x1000, 0x2000, 0x3000, 0x4000 });
+	US4OEM_CHECK(!Us4OemDmaSgIndex(chunks).isUniform());
+	us4oemTestFindEverywhere(chunks);
+}
+
+US4OEM_TEST(sgIndexEmpty) {
+	for (const Us4OemDmaSgIndex& index : { Us4OemDmaSgIndex(), Us4OemDmaSgIndex(us4oemTestChunks({ 0, 0 }, { 0x1000, 0x2000 })) }) {
+		US4OEM_CHECK(index.length() == 0 && index.chunkCount() == 0 && !index.isUniform());
+		US4OEM_CHECK(!index.find(0));
+		US4OEM_CHECK(index.runs(0, 100).begin() == std::default_sentinel);
+	}
+}
+
+US4OEM_TEST(sgIndexRunsMergeAdjacentChunks) {
+	// Chunks 0-2 are back to back in physical memory, 3 isn't, 4 follows 3, and the empty one between them is skipped
+	std::vector<Us4OemDmaSgChunk> chunks = us4oemTestChunks({ 16, 16, 16, 16, 0, 16 }, { 0x1000, 0x1010, 0x1020, 0x9000, 0x5000, 0x9010 });
+	Us4OemDmaSgIndex index(chunks);
+
+	std::vector<Us4OemDmaSgRun> runs;
+	for (const Us4OemDmaSgRun& run : index.runs(0, index.length())) {
+		runs.push_back(run);
+	}
+	US4OEM_CHECK(runs.size() == 2);
+	US4OEM_CHECK(runs[0].offset == 0 && runs[0].pa == 0x1000 && runs[0].length == 48);
+	US4OEM_CHECK(runs[1].offset == 48 && runs[1].pa == 0x9000 && runs[1].length == 32);
+
+	// Starting and ending inside chunks, and clipped to the buffer
+	for (size_t offset = 0; offset <= index.length() + 1; offset++) {
+		for (size_t length = 0; length <= index.length() + 1; length++) {
+			us4oemTestRuns(index, offset, length);
+		}
+	}
+}
+
+US4OEM_TEST(sgIndexRandomLayouts) {
+	std::mt19937 random(12345);
+
+	for (int layout = 0; layout < 200; layout++) {
+		size_t count = random() % 12;
+		bool uniform = random() % 2 == 0;
+		size_t chunkLength = 1 + random() % 64;
+
+		std::vector<size_t> lengths, pas;
+		size_t pa = 0x100000;
+		for (size_t i = 0; i < count; i++) {
+			lengths.push_back(uniform ? (i + 1 == count ? 1 + random() % chunkLength : chunkLength) : random() % 64);
+			// Often right after the previous chunk, so some runs merge
+			pa = random() % 3 == 0 ? 0x100000 * (1 + random() % 64) : pa;
+			pas.push_back(pa);
+			pa += lengths.back();
+		}
+
+		std::vector<Us4OemDmaSgChunk> chunks = us4oemTestChunks(lengths, pas);
+		Us4OemDmaSgIndex index(chunks);
+		US4OEM_CHECK(!uniform || count == 0 || index.isUniform());
+
+		us4oemTestFindEverywhere(chunks);
+		us4oemTestRuns(index, 0, index.length());
+		us4oemTestRuns(index, index.length() / 3, index.length() / 2);
+	}
+}
+
+// Checks the compact form gives back the chunks and answers like a scan over them
+static void us4oemTestCompact(const std::vector<Us4OemDmaSgChunk>& chunks, bool pageFrames) {
+	Us4OemDmaSgDescription description = { (void*)0x7F0000, 0, chunks };
+	for (const auto& chunk : chunks) {
+		description.length += chunk.length;
+	}
+
+	Us4OemDmaSgCompact compact(description, pageFrames);
+	US4OEM_CHECK(compact.va() == description.va);
+	US4OEM_CHECK(compact.length() == description.length);
+	US4OEM_CHECK(compact.chunkCount() == chunks.size());
+
+	Us4OemDmaSgDescription back = compact.toDescription();
+	US4OEM_CHECK(back.va == description.va && back.length == description.length && back.chunks.size() == chunks.size());
+	for (size_t i = 0; i < chunks.size(); i++) {
+		US4OEM_CHECK(back.chunks[i].vaOffset == chunks[i].vaOffset);
+		US4OEM_CHECK(back.chunks[i].pa == chunks[i].pa && compact.pa(i) == chunks[i].pa);
+		US4OEM_CHECK(back.chunks[i].length == chunks[i].length && compact.chunkLength(i) == chunks[i].length);
+	}
+
+	std::vector<uint64_t> pas(chunks.size());
+	compact.decodePas(0, chunks.size(), pas.data());
+	for (size_t i = 0; i < chunks.size(); i++) {
+		US4OEM_CHECK(pas[i] == chunks[i].pa);
+	}
+
+	size_t lowest = chunks.empty() ? 0 : SIZE_MAX, highest = 0, runs = chunks.empty() ? 0 : 1;
+	for (size_t i = 0; i < chunks.size(); i++) {
+		lowest = std::min(lowest, chunks[i].pa);
+		highest = std::max(highest, chunks[i].pa + chunks[i].length);
+		runs += i > 0 && chunks[i].pa != chunks[i - 1].pa + chunks[i - 1].length;
+	}
+	US4OEM_CHECK((compact.physicalBounds() == std::pair<size_t, size_t>(lowest, highest)));
+	US4OEM_CHECK(compact.runCount() == runs);
+
+	// Every byte of every chunk, and the addresses just outside them
+	for (size_t i = 0; i < chunks.size(); i++) {
+		for (size_t address : { chunks[i].pa - 1, chunks[i].pa, chunks[i].pa + chunks[i].length - 1, chunks[i].pa + chunks[i].length }) {
+			std::optional<size_t> expected;
+			for (size_t j = 0; j < chunks.size() && !expected; j++) {
+				if (address >= chunks[j].pa && address - chunks[j].pa < chunks[j].length) {
+					expected = j;
+				}
+			}
+			US4OEM_CHECK(compact.findPa(address) == expected);
+		}
+	}
+}
+
+US4OEM_TEST(sgCompactUniformPageFrames) {
+	std::vector<Us4OemDmaSgChunk> chunks = us4oemTestChunks({ 0x10000, 0x10000, 0x10000, 0x3000 }, { 0x40000, 0x50000, 0x200000, 0xFFFFFFFF000 });
+	Us4OemDmaSgCompact compact(Us4OemDmaSgDescription{ nullptr, 0x33000, chunks });
+
+	US4OEM_CHECK(compact.hasPageFrames() && compact.isUniform());
+	US4OEM_CHECK(compact.memoryUsage() == 4 * sizeof(uint32_t)); // Only the frame numbers
+	us4oemTestCompact(chunks, true);
+}
+
+US4OEM_TEST(sgCompactFallsBackToAddresses) {
+	// Not page-aligned, or a frame number past 32 bits (16 TiB and up)
+	std::vector<std::vector<Us4OemDmaSgChunk>> layouts = {
+		us4oemTestChunks({ 0x1000, 0x1000 }, { 0x40000, 0x50800 }),
+		us4oemTestChunks({ 0x1000, 0x1000 }, { 0x40000, size_t(1) << 44 }),
+	};
+
+	for (const auto& chunks : layouts) {
+		Us4OemDmaSgCompact compact(Us4OemDmaSgDescription{ nullptr, 0x2000, chunks });
+		US4OEM_CHECK(!compact.hasPageFrames());
+		us4oemTestCompact(chunks, true);
+	}
+
+	// Or not asked for
+	std::vector<Us4OemDmaSgChunk> chunks = us4oemTestChunks({ 0x1000 }, { 0x40000 });
+	US4OEM_CHECK(!Us4OemDmaSgCompact(Us4OemDmaSgDescription{ nullptr, 0x1000, chunks }, false).hasPageFrames());
+	us4oemTestCompact(chunks, false);
+}
+
+US4OEM_TEST(sgCompactNonUniformAndEmptyChunks) {
+	std::vector<std::vector<size_t>> layouts = {
+		{ 0x1000, 0x2000, 0x1000 },
+		{ 0x2000, 0x2000, 0x3000 }, // Last one longer
+		{ 0x1000, 0, 0x1000 }, // Empty chunks are kept as they are, unlike in the index
+		{ 0 },
+		{},
+	};
+
+	for (const auto& lengths : layouts) {
+		std::vector<size_t> pas;
+		for (size_t i = 0; i < lengths.size(); i++) {
+			pas.push_back(0x100000 + 0x1000 * i * i);
+		}
+		std::vector<Us4OemDmaSgChunk> chunks = us4oemTestChunks(lengths, pas);
+		us4oemTestCompact(chunks, true);
+		us4oemTestCompact(chunks, false);
+	}
+
+	Us4OemDmaSgCompact empty(Us4OemDmaSgDescription{});
+	US4OEM_CHECK(empty.chunkCount() == 0 && !empty.isUniform() && empty.runCount() == 0 && !empty.findPa(0));
+	US4OEM_CHECK((empty.physicalBounds() == std::pair<size_t, size_t>(0, 0)));
+}
+
+US4OEM_TEST(sgCompactRandomLayouts) {
+	std::mt19937 random(54321);
+
+	for (int layout = 0; layout < 200; layout++) {
+		size_t count = random() % 12;
+		bool uniform = random() % 2 == 0;
+		size_t pages = 1 + random() % 4;
+
+		std::vector<size_t> lengths, pas;
+		size_t pa = 0x100000;
+		for (size_t i = 0; i < count; i++) {
+			lengths.push_back(0x1000 * (uniform ? (i + 1 == count ? 1 + random() % pages : pages) : random() % 4));
+			pa = random() % 3 == 0 ? 0x100000 * (1 + random() % 64) + 0x800 * (random() % 2) : pa;
+			pas.push_back(pa);
+			pa += lengths.back();
+		}
+
+		us4oemTestCompact(us4oemTestChunks(lengths, pas), random() % 2 == 0);
+	}
+}
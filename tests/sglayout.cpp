@@ -0,0 +1,189 @@
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+#include "../sdk/sglayout.hpp"
+#include "check.hpp"
+
+// The scatter-gather layout file: round trips through memory and a file, and the checks on what is read
+
+static Us4OemDmaSgDescription us4oemTestDescription(uintptr_t va, const std::vector<size_t>& lengths, size_t pa) {
+	Us4OemDmaSgDescription description = { reinterpret_cast<void*>(va), 0, {} };
+	for (size_t length : lengths) {
+		description.chunks.push_back({ description.length, pa, length });
+		description.length += length;
+		pa += 0x100000;
+	}
+	return description;
+}
+
+// Three buffers: uniform chunks with a short last one, chunks of any length, and one without chunks
+static Us4OemSgLayout us4oemTestLayout() {
+	Us4OemSgLayout layout;
+	layout.token = 0x1122334455667788ull;
+	layout.pciBus = 0x3A;
+	layout.pciDevice = 2;
+	layout.pciFunction = 1;
+	layout.leaseDurationMs = 30000;
+	layout.segments.push_back({ 7, us4oemTestDescription(0xFFFF800000000000ull, { 0x10000, 0x10000, 0x10000, 0x800 }, 0x40000000) });
+	layout.segments.push_back({ 8, us4oemTestDescription(0xFFFF800010000000ull, { 0x2000, 0x1000, 0x3000 }, 0x80000000) });
+	layout.segments.push_back({ 9, us4oemTestDescription(0, {}, 0) });
+	return layout;
+}
+
+static bool us4oemTestSameLayout(const Us4OemSgLayout& a, const Us4OemSgLayout& b) {
+	if (a.token != b.token || a.pciBus != b.pciBus || a.pciDevice != b.pciDevice || a.pciFunction != b.pciFunction ||
+		a.leaseDurationMs != b.leaseDurationMs || a.segments.size() != b.segments.size()) {
+		return false;
+	}
+
+	for (size_t i = 0; i < a.segments.size(); i++) {
+		const Us4OemDmaSgDescription& x = a.segments[i].description;
+		const Us4OemDmaSgDescription& y = b.segments[i].description;
+		if (a.segments[i].handle != b.segments[i].handle || x.va != y.va || x.length != y.length || x.chunks.size() != y.chunks.size()) {
+			return false;
+		}
+		for (size_t c = 0; c < x.chunks.size(); c++) {
+			if (x.chunks[c].vaOffset != y.chunks[c].vaOffset || x.chunks[c].pa != y.chunks[c].pa || x.chunks[c].length != y.chunks[c].length) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Fixes up the checksum after a change, so the checks behind it are reached
+static void us4oemTestSeal(std::vector<unsigned char>& file) {
+	us4oemSgLayoutStore(file.data() + 56, us4oemSgLayoutChecksum(file.data(), file.size()), 8);
+}
+
+static size_t us4oemTestSegmentField(size_t segment, size_t offset) {
+	return us4oemSgLayoutHeaderSize + segment * us4oemSgLayoutSegmentSize + offset;
+}
+
+US4OEM_TEST(sgLayoutRoundTrip) {
+	Us4OemSgLayout layout = us4oemTestLayout();
+	std::vector<unsigned char> file = layout.serialize();
+
+	// The uniform segment stores addresses only, the other one addresses and lengths
+	US4OEM_CHECK(file.size() == 64 + 3 * 64 + 4 * 8 + 3 * 16);
+	US4OEM_CHECK(us4oemSgLayoutLoad(file.data() + us4oemTestSegmentField(0, 40), 8) == 0x10000);
+	US4OEM_CHECK(us4oemSgLayoutLoad(file.data() + us4oemTestSegmentField(1, 40), 8) == 0);
+
+	US4OEM_CHECK(us4oemTestSameLayout(Us4OemSgLayout::parse(file), layout));
+
+	Us4OemSgLayoutView view(file.data(), file.size());
+	US4OEM_CHECK(view.totalLength() == layout.totalLength());
+	US4OEM_CHECK(view.segmentCount() == 3);
+	US4OEM_CHECK(view.chunkLength(0, 3) == 0x800 && view.chunkLength(1, 2) == 0x3000);
+	US4OEM_CHECK(view.chunkPa(1, 1) == 0x80100000);
+	US4OEM_CHECK(view.chunkCount(2) == 0);
+
+	Us4OemSgLayout empty;
+	US4OEM_CHECK(us4oemTestSameLayout(Us4OemSgLayout::parse(empty.serialize()), empty));
+}
+
+US4OEM_TEST(sgLayoutRejectsBadHeaders) {
+	const std::vector<unsigned char> good = us4oemTestLayout().serialize();
+
+	auto rejected = [](std::vector<unsigned char> file) {
+		US4OEM_CHECK_THROWS(Us4OemSgLayoutError, Us4OemSgLayoutView(file.data(), file.size()));
+	};
+
+	std::vector<unsigned char> file = good;
+	file[0] = 'X';
+	rejected(file);
+
+	file = good;
+	us4oemSgLayoutStore(file.data() + 8, us4oemSgLayoutVersion + 1, 4);
+	us4oemTestSeal(file);
+	rejected(file);
+
+	file = good;
+	us4oemSgLayoutStore(file.data() + 12, 128, 4);
+	us4oemTestSeal(file);
+	rejected(file);
+
+	// Cut short, or the size field not matching
+	file = good;
+	file.resize(file.size() - 8);
+	rejected(file);
+	rejected(std::vector<unsigned char>(good.begin(), good.begin() + 32));
+
+	file = good;
+	us4oemSgLayoutStore(file.data() + 16, good.size() + 8, 8);
+	file.resize(good.size() + 8);
+	us4oemTestSeal(file);
+	US4OEM_CHECK(Us4OemSgLayoutView(file.data(), file.size()).segmentCount() == 3); // Trailing space is allowed
+
+	// More segments than the file has room for
+	file = good;
+	us4oemSgLayoutStore(file.data() + 40, 1000, 4);
+	us4oemTestSeal(file);
+	rejected(file);
+}
+
+US4OEM_TEST(sgLayoutRejectsCorruption) {
+	const std::vector<unsigned char> good = us4oemTestLayout().serialize();
+
+	// A flipped bit in a chunk address is only caught by the checksum
+	std::vector<unsigned char> file = good;
+	file[file.size() - 14] ^= 0x10; // Third chunk of the second segment
+	US4OEM_CHECK_THROWS(Us4OemSgLayoutError, Us4OemSgLayoutView(file.data(), file.size()));
+	US4OEM_CHECK(Us4OemSgLayoutView(file.data(), file.size(), false).chunkPa(1, 2) == 0x80300000);
+
+	auto rejected = [](std::vector<unsigned char> file) {
+		us4oemTestSeal(file);
+		US4OEM_CHECK_THROWS(Us4OemSgLayoutError, Us4OemSgLayoutView(file.data(), file.size()));
+	};
+
+	// Totals that don't add up
+	file = good;
+	us4oemSgLayoutStore(file.data() + 48, 1, 8);
+	rejected(file);
+
+	file = good;
+	us4oemSgLayoutStore(file.data() + us4oemTestSegmentField(1, 16), 0x5000, 8);
+	us4oemSgLayoutStore(file.data() + 48, us4oemTestLayout().totalLength() - 0x1000, 8);
+	rejected(file);
+
+	// A uniform segment whose length needs another chunk
+	file = good;
+	us4oemSgLayoutStore(file.data() + us4oemTestSegmentField(0, 16), 0x40001, 8);
+	us4oemSgLayoutStore(file.data() + 48, us4oemTestLayout().totalLength() + 0xF801, 8);
+	rejected(file);
+
+	// Chunks out of the file, inside the segment table, or misaligned
+	for (uint64_t offset : { good.size(), good.size() + 4096, (size_t)64, good.size() - 4 }) {
+		file = good;
+		us4oemSgLayoutStore(file.data() + us4oemTestSegmentField(1, 32), offset, 8);
+		rejected(file);
+	}
+
+	file = good;
+	us4oemSgLayoutStore(file.data() + us4oemTestSegmentField(1, 24), 1000, 8);
+	rejected(file);
+}
+
+US4OEM_TEST(sgLayoutSaveAndLoad) {
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "us4oem-sglayout-test.bin";
+	std::filesystem::remove(path);
+
+	Us4OemSgLayout layout = us4oemTestLayout();
+	layout.save(path);
+	US4OEM_CHECK(us4oemTestSameLayout(Us4OemSgLayout::load(path), layout));
+
+	// Saving again replaces the file and leaves no temporary behind
+	layout.segments.pop_back();
+	layout.save(path);
+	US4OEM_CHECK(us4oemTestSameLayout(Us4OemSgLayout::load(path), layout));
+	US4OEM_CHECK(!std::filesystem::exists(path.string() + ".tmp"));
+
+	// A truncated file
+	std::filesystem::resize_file(path, 100);
+	US4OEM_CHECK_THROWS(Us4OemSgLayoutError, Us4OemSgLayout::load(path));
+
+	std::filesystem::remove(path);
+	US4OEM_CHECK_THROWS(Us4OemSgLayoutError, Us4OemSgLayout::load(path));
+}
@@ -0,0 +1,105 @@
+#include <atomic>
+#include <cstddef>
+#include <thread>
+
+#include "../sdk/sharedstats.hpp"
+#include "check.hpp"
+
+// Us4OemSharedStats against a writer that updates the page the way the driver's us4oemStatsPublish does
+
+// One update: every counter and the timestamp get the same value, so a torn read shows up as a mix
+static void us4oemTestPublish(us4oem_shared_stats& page, unsigned long long value) {
+	unsigned long long sequence = page.sequence;
+
+	page.sequence = sequence + 1;
+	std::atomic_thread_fence(std::memory_order_seq_cst); // The driver's InterlockedExchange64 is a full barrier
+
+	page.stats.irq_count = (size_t)value;
+	page.stats.dma_sg_alloc_count = (size_t)value;
+	page.stats.teardown_count = value;
+	page.stats.teardown_pending = (unsigned long)value;
+	page.publish_timestamp = (long long)value;
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	page.sequence = sequence + 2;
+}
+
+static bool us4oemTestConsistent(const us4oem_stats& stats, long long timestamp) {
+	return stats.irq_count == (size_t)timestamp &&
+		stats.dma_sg_alloc_count == (size_t)timestamp &&
+		stats.teardown_count == (unsigned long long)timestamp &&
+		stats.teardown_pending == (unsigned long)timestamp;
+}
+
+US4OEM_TEST(sharedStatsReadsAreNeverTorn) {
+	alignas(64) static us4oem_shared_stats page = {};
+	page.size = sizeof(us4oem_stats);
+	us4oemTestPublish(page, 1);
+
+	std::atomic<bool> stop = false;
+	std::atomic<bool> started = false;
+	std::thread writer([&]() {
+		for (unsigned long long value = 2; !stop.load(std::memory_order_relaxed); value++) {
+			us4oemTestPublish(page, value);
+			started.store(true, std::memory_order_relaxed);
+		}
+	});
+
+	// On a single CPU the reads could otherwise all be done before the writer gets to run
+	while (!started) {
+		std::this_thread::yield();
+	}
+
+	Us4OemSharedStats reader(&page);
+	long long previous = 0;
+	bool torn = false, backwards = false;
+
+	for (int i = 0; i < 200000; i++) {
+		us4oem_stats stats = {};
+		long long timestamp = 0;
+		if (!reader.tryRead(stats, timestamp, 1000)) {
+			continue; // Can happen with a writer that never lets up; the driver's publishes are far apart
+		}
+
+		torn = torn || !us4oemTestConsistent(stats, timestamp);
+		backwards = backwards || timestamp < previous;
+		previous = timestamp;
+	}
+
+	stop = true;
+	writer.join();
+
+	US4OEM_CHECK(!torn);
+	US4OEM_CHECK(!backwards);
+	US4OEM_CHECK(previous > 1); // Saw the writer's updates at all
+
+	us4oem_stats stats = reader.read();
+	US4OEM_CHECK(us4oemTestConsistent(stats, reader.publishTimestamp()));
+}
+
+US4OEM_TEST(sharedStatsTryReadGivesUpDuringAnUpdate) {
+	us4oem_shared_stats page = {};
+	page.size = sizeof(us4oem_stats);
+	page.sequence = 7; // A publish that never finishes
+
+	us4oem_stats stats = {};
+	long long timestamp = 0;
+	US4OEM_CHECK(!Us4OemSharedStats(&page).tryRead(stats, timestamp, 100));
+
+	page.sequence = 8;
+	page.publish_timestamp = 42;
+	US4OEM_CHECK(Us4OemSharedStats(&page).tryRead(stats, timestamp, 1));
+	US4OEM_CHECK(timestamp == 42);
+}
+
+US4OEM_TEST(sharedStatsFromAnOlderDriver) {
+	// An older driver's us4oem_stats ends before the teardown fields; whatever is in the page after it isn't copied
+	us4oem_shared_stats page = {};
+	page.size = offsetof(us4oem_stats, teardown_count);
+	page.stats.irq_count = 5;
+	page.stats.teardown_count = 9;
+
+	us4oem_stats stats = Us4OemSharedStats(&page).read();
+	US4OEM_CHECK(stats.irq_count == 5);
+	US4OEM_CHECK(stats.teardown_count == 0);
+}
@@ -0,0 +1,149 @@
+#include "ioctl.h"
+#include "latency.h"
+#include "batch.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, us4oemIoctlSubmitBatch)
+#endif
+
+// The queue a batch runs on: the sequential queue if any of its commands belongs there, so batched allocations stay
+// ordered with the others, the default queue otherwise. *CallerContext tells whether any command maps or unmaps
+// memory and so has to run in the thread that sent the batch (US4OEM_IOCTL_FLAG_CALLER_CONTEXT). Commands that
+// don't fit in the buffer are left out; us4oemIoctlSubmitBatch rejects the batch for them anyway.
+// Not pageable, us4oemEvtIoDeviceControl calls it.
+us4oem_queue us4oemBatchQueue(WDFREQUEST Request, BOOLEAN* CallerContext) {
+    PVOID buffer;
+    size_t length;
+    us4oem_queue queue = US4OEM_QUEUE_DEFAULT;
+
+    *CallerContext = FALSE;
+
+    if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, sizeof(us4oem_batch_header), &buffer, &length))) {
+        return queue;
+    }
+
+    us4oem_batch_header* header = (us4oem_batch_header*)buffer;
+    size_t totalLength = min((size_t)header->total_length, length);
+    size_t offset = sizeof(us4oem_batch_header);
+
+    for (ULONG i = 0; i < header->command_count && i < US4OEM_BATCH_MAX_COMMANDS; i++) {
+        if (totalLength - offset < sizeof(us4oem_batch_command)) {
+            break;
+        }
+
+        us4oem_batch_command* command = (us4oem_batch_command*)((PUCHAR)buffer + offset);
+        size_t commandSize = US4OEM_BATCH_COMMAND_SIZE((size_t)command->input_length, (size_t)command->output_length);
+        if (totalLength - offset < commandSize) {
+            break;
+        }
+        offset += commandSize;
+
+        const IOCTL_HANDLER* handler = us4oemIoctlLookup(command->ioctl);
+        if (handler == NULL || !(handler->Flags & US4OEM_IOCTL_FLAG_BATCHABLE)) {
+            continue;
+        }
+        if (handler->Queue == US4OEM_QUEUE_SEQUENTIAL) {
+            queue = US4OEM_QUEUE_SEQUENTIAL;
+        }
+        if (handler->Flags & US4OEM_IOCTL_FLAG_CALLER_CONTEXT) {
+            *CallerContext = TRUE;
+        }
+    }
+
+    return queue;
+}
+
+NTSTATUS us4oemIoctlSubmitBatch(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(OutputBuffer);
+
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+
+    // METHOD_BUFFERED, so input and output are the same system buffer and the results can be written in place
+    us4oem_batch_header* header = (us4oem_batch_header*)InputBuffer;
+    size_t totalLength = (size_t)header->total_length;
+
+    if (header->command_count > US4OEM_BATCH_MAX_COMMANDS ||
+        totalLength < sizeof(us4oem_batch_header) ||
+        totalLength > InputBufferLength ||
+        totalLength > OutputBufferLength) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL,
+            "Invalid batch (%lu commands, %llu bytes, buffers %llu/%llu)",
+            header->command_count, header->total_length, (ULONGLONG)InputBufferLength, (ULONGLONG)OutputBufferLength);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PUCHAR buffer = (PUCHAR)InputBuffer;
+    size_t offset = sizeof(us4oem_batch_header);
+
+    // Validate the whole layout first, so a malformed batch doesn't run halfway
+    for (ULONG i = 0; i < header->command_count; i++) {
+        if (totalLength - offset < sizeof(us4oem_batch_command)) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        us4oem_batch_command* command = (us4oem_batch_command*)(buffer + offset);
+        size_t commandSize = US4OEM_BATCH_COMMAND_SIZE((size_t)command->input_length, (size_t)command->output_length);
+        if (totalLength - offset < commandSize) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "Batch command %lu overruns the buffer", i);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        command->status = US4OEM_BATCH_STATUS_NOT_RUN;
+        command->bytes_returned = 0;
+        offset += commandSize;
+    }
+
+    header->executed = 0;
+    header->status = STATUS_SUCCESS;
+
+    offset = sizeof(us4oem_batch_header);
+    for (ULONG i = 0; i < header->command_count; i++) {
+        us4oem_batch_command* command = (us4oem_batch_command*)(buffer + offset);
+        PUCHAR input = buffer + offset + sizeof(us4oem_batch_command);
+        PUCHAR output = input + US4OEM_BATCH_ALIGN(command->input_length);
+        offset += US4OEM_BATCH_COMMAND_SIZE((size_t)command->input_length, (size_t)command->output_length);
+
+        LONGLONG start = us4oemLatencyTimestamp();
+        const IOCTL_HANDLER* handler = us4oemIoctlLookup(command->ioctl);
+        NTSTATUS status;
+        size_t bytesReturned = 0;
+
+        if (handler == NULL || !(handler->Flags & US4OEM_IOCTL_FLAG_BATCHABLE)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "IoControlCode %d can't be batched", command->ioctl);
+            US4OEM_COUNTER_INCREMENT(deviceContext, IoctlRejectedCount);
+            status = STATUS_INVALID_DEVICE_REQUEST;
+        } else if (command->input_length < handler->InputBufferNeeded ||
+            command->output_length < handler->OutputBufferNeeded) {
+            US4OEM_COUNTER_INCREMENT(deviceContext, IoctlRejectedCount);
+            status = STATUS_BUFFER_TOO_SMALL;
+        } else {
+            status = handler->HandlerFunc(Device,
+                command->output_length > 0 ? output : NULL,
+                command->input_length > 0 ? input : NULL,
+                command->output_length, command->input_length,
+                &bytesReturned);
+            us4oemIoctlRecordCall(deviceContext, command->ioctl, start);
+        }
+
+        command->status = status;
+        command->bytes_returned = NT_SUCCESS(status) ? min(bytesReturned, (size_t)command->output_length) : 0;
+        header->executed++;
+
+        if (!NT_SUCCESS(status)) {
+            if (NT_SUCCESS(header->status)) {
+                header->status = status;
+            }
+            if (!(header->flags & US4OEM_BATCH_FLAG_CONTINUE_ON_ERROR)) {
+                break;
+            }
+        }
+    }
+
+    // The batch itself succeeded even if some commands didn't, the caller checks header->status
+    *BytesReturned = totalLength;
+    return STATUS_SUCCESS;
+}
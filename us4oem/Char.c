@@ -1,8 +1,10 @@
 #include "char.h"
+#include "ioctl.h"
 #include "char.tmh"
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, us4oemEvtDeviceFileCreate)
+#pragma alloc_text (PAGE, us4oemEvtFileCleanup)
 #pragma alloc_text (PAGE, us4oemEvtFileClose)
 #endif
 
@@ -13,16 +15,42 @@ us4oemEvtDeviceFileCreate(
 	_In_ WDFFILEOBJECT FileObject
 	)
 {
-	UNREFERENCED_PARAMETER(FileObject);
-
 	PAGED_CODE();
 
 	PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
-	deviceContext->Stats.file_open_count++;
+	PUS4OEM_FILE_CONTEXT fileContext = us4oemGetFileContext(FileObject);
+
+	// Runs in the opening thread
+	fileContext->Process = PsGetCurrentProcess();
+
+	WdfWaitLockAcquire(deviceContext->DmaLock, NULL);
+	InsertTailList(&deviceContext->OpenFiles, &fileContext->Link);
+	WdfWaitLockRelease(deviceContext->DmaLock);
+
+	US4OEM_COUNTER_INCREMENT(deviceContext, FileOpenCount);
+	us4oemStatsMarkDirty(deviceContext);
 
 	WdfRequestComplete(Request, STATUS_SUCCESS);
 }
 
+// The last handle to the file is closed, usually in (and otherwise on behalf of) the process that opened it;
+// this is also where a process that exits without unmapping ends up. Its mappings go with its last handle.
+VOID
+us4oemEvtFileCleanup(
+	_In_ WDFFILEOBJECT FileObject
+	)
+{
+	PAGED_CODE();
+
+	PUS4OEM_CONTEXT deviceContext = us4oemGetContext(WdfFileObjectGetDevice(FileObject));
+	PUS4OEM_FILE_CONTEXT fileContext = us4oemGetFileContext(FileObject);
+
+	WdfWaitLockAcquire(deviceContext->DmaLock, NULL);
+	RemoveEntryList(&fileContext->Link);
+	us4oemMemReleaseOrphanedMappings(deviceContext);
+	WdfWaitLockRelease(deviceContext->DmaLock);
+}
+
 VOID
 us4oemEvtFileClose(
 	_In_ WDFFILEOBJECT FileObject
@@ -33,41 +61,11 @@ us4oemEvtFileClose(
 	WDFDEVICE device = WdfFileObjectGetDevice(FileObject);
 	PUS4OEM_CONTEXT deviceContext = us4oemGetContext(device);
 
-	if (deviceContext->StickyMode) {
-		// Sticky mode enabled - clean buffers as soon as the file is closed
-		LINKED_LIST_FOR_EACH(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers, commonBuffer) {
-			if (commonBuffer->Item != NULL) {
-				WdfObjectDelete(*commonBuffer->Item);
-				deviceContext->Stats.dma_contig_free_count++;
-			}
-		}
-		LINKED_LIST_FOR_EACH(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory, commonBuffer) {
-			if (commonBuffer->Item != NULL) {
-				if (commonBuffer->Item->transaction != NULL) {
-					WdfObjectDelete(commonBuffer->Item->transaction);
-					commonBuffer->Item->transaction = NULL;
-				}
-				if (commonBuffer->Item->memory_locked) {
-					commonBuffer->Item->memory_locked = FALSE;
-					MmUnlockPages(commonBuffer->Item->mdl);
-				}
-				if (commonBuffer->Item->memory != NULL) {
-					WdfObjectDelete(commonBuffer->Item->memory);
-					commonBuffer->Item->memory = NULL;
-				}
-				if (commonBuffer->Item->mdl != NULL) {
-					IoFreeMdl(commonBuffer->Item->mdl);
-					commonBuffer->Item->mdl = NULL;
-				}
-				deviceContext->Stats.dma_sg_free_count++;
-			}
-		}
-
-		deviceContext->Stats.dma_sg_alloc_count = 0;
-		deviceContext->Stats.dma_contig_alloc_count = 0;
-
-		LINKED_LIST_CLEAR(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers);
-		LINKED_LIST_CLEAR(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory);
+	if (deviceContext->StickyMode && !us4oemLeaseStart(device)) {
+		// Sticky mode enabled - clean buffers as soon as the file is closed, in the background if asked to.
+		// With a lease they're kept until it runs out instead. Those of a lease that's already running aren't
+		// this client's, and are left to it.
+		us4oemDmaTeardown(device, US4OEM_TEARDOWN_UNLEASED, (deviceContext->TeardownFlags & US4OEM_TEARDOWN_FLAG_ASYNC_CLOSE) != 0);
 	}
 
 	TraceEvents(TRACE_LEVEL_INFORMATION,
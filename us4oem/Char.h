@@ -5,12 +5,24 @@
 #include <initguid.h>
 
 #include "us4oem.h"
+#include "stats.h"
 #include "queue.h"
 #include "trace.h"
+#include "teardown.h"
+#include "lease.h"
 
 EXTERN_C_START
 
+// Context of every open handle to the device
+typedef struct _US4OEM_FILE_CONTEXT {
+    LIST_ENTRY Link; // In the device's OpenFiles, under DmaLock
+    PEPROCESS Process; // The process that opened it
+} US4OEM_FILE_CONTEXT, *PUS4OEM_FILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(US4OEM_FILE_CONTEXT, us4oemGetFileContext)
+
 EVT_WDF_DEVICE_FILE_CREATE us4oemEvtDeviceFileCreate;
+EVT_WDF_FILE_CLEANUP us4oemEvtFileCleanup;
 EVT_WDF_FILE_CLOSE us4oemEvtFileClose;
 
 EXTERN_C_END
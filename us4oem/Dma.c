@@ -7,66 +7,89 @@
 #pragma alloc_text (PAGE, us4oemIoctlDeallocateAllDmaBuffers)
 #pragma alloc_text (PAGE, us4oemIoctlAllocateDmaScatterGatherBuffer)
 #pragma alloc_text (PAGE, us4oemIoctlDeallocateScatterGatherDmaBuffer)
+#pragma alloc_text (PAGE, us4oemDmaFreeContiguous)
+#pragma alloc_text (PAGE, us4oemDmaFreeScatterGather)
 #endif
 
-VOID us4oemIoctlDeallocateAllDmaBuffers(
-    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer
-) {
+// Releases a contiguous buffer that's still in the list, along with its mappings and list entry.
+// Its handle must be closed already. Called with DmaLock held.
+static VOID us4oemDmaRemoveContiguous(PUS4OEM_CONTEXT DeviceContext, LINKED_LIST_ENTRY_TYPE_FOR(WDFCOMMONBUFFER)* Entry) {
+    us4oemMemReleaseBufferMappings(DeviceContext, &us4oemGetCommonBufferContext(*Entry->Item)->Mappings);
+    us4oemDmaReleaseContiguous(DeviceContext, *Entry->Item);
+    US4OEM_COUNTER_INCREMENT(DeviceContext, DmaContigFreeCount);
+    US4OEM_COUNTER_DECREMENT(DeviceContext, DmaContigAllocCount);
+    LINKED_LIST_REMOVE(WDFCOMMONBUFFER, DeviceContext->DmaContiguousBuffers, Entry);
+}
+
+// Same for a scatter-gather buffer
+static VOID us4oemDmaRemoveScatterGather(PUS4OEM_CONTEXT DeviceContext, LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)* Entry) {
+    us4oemMemReleaseBufferMappings(DeviceContext, &Entry->Item->mappings);
+    us4oemDmaReleaseScatterGather(DeviceContext, Entry->Item);
+    US4OEM_COUNTER_INCREMENT(DeviceContext, DmaSgFreeCount);
+    US4OEM_COUNTER_DECREMENT(DeviceContext, DmaSgAllocCount);
+    LINKED_LIST_REMOVE(MEMORY_ALLOCATION, DeviceContext->DmaScatterGatherMemory, Entry);
+}
+
+NTSTATUS us4oemDmaFreeContiguous(PUS4OEM_CONTEXT DeviceContext, us4oem_handle Handle) {
     PAGED_CODE();
 
-    UNREFERENCED_PARAMETER(OutputBuffer);
-    UNREFERENCED_PARAMETER(InputBuffer);
+    WdfWaitLockAcquire(DeviceContext->DmaLock, NULL);
 
-    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    LINKED_LIST_ENTRY_TYPE_FOR(WDFCOMMONBUFFER)* entry = us4oemHandleClose(DeviceContext, Handle, US4OEM_HANDLE_TYPE_CONTIGUOUS);
+    if (entry == NULL) {
+        WdfWaitLockRelease(DeviceContext->DmaLock);
+        return STATUS_INVALID_HANDLE;
+    }
 
-    // Iterate over the linked list of common buffers and delete each one
-    LINKED_LIST_FOR_EACH(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers, commonBuffer) {
-        if (commonBuffer->Item != NULL) {
-            WdfObjectDelete(*commonBuffer->Item);
-            deviceContext->Stats.dma_contig_free_count++;
-        }
+    us4oemDmaRemoveContiguous(DeviceContext, entry);
+    WdfWaitLockRelease(DeviceContext->DmaLock);
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_IOCTL, "Deallocated contiguous DMA buffer with handle 0x%llx", Handle);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS us4oemDmaFreeScatterGather(PUS4OEM_CONTEXT DeviceContext, us4oem_handle Handle) {
+    PAGED_CODE();
+
+    WdfWaitLockAcquire(DeviceContext->DmaLock, NULL);
+
+    LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)* entry = us4oemHandleClose(DeviceContext, Handle, US4OEM_HANDLE_TYPE_SCATTER_GATHER);
+    if (entry == NULL) {
+        WdfWaitLockRelease(DeviceContext->DmaLock);
+        return STATUS_INVALID_HANDLE;
     }
 
-	// Iterate over the linked list of scatter-gather buffers and delete each one
-    LINKED_LIST_FOR_EACH(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory, commonBuffer) {
-        if (commonBuffer->Item != NULL) {
-            if (commonBuffer->Item->transaction != NULL) {
-                WdfObjectDelete(commonBuffer->Item->transaction);
-                commonBuffer->Item->transaction = NULL;
-            }
-            if (commonBuffer->Item->memory_locked) {
-                commonBuffer->Item->memory_locked = FALSE;
-                MmUnlockPages(commonBuffer->Item->mdl);
-            }
-            if (commonBuffer->Item->memory != NULL) {
-                WdfObjectDelete(commonBuffer->Item->memory);
-                commonBuffer->Item->memory = NULL;
-            }
-            if (commonBuffer->Item->mdl != NULL) {
-                IoFreeMdl(commonBuffer->Item->mdl);
-                commonBuffer->Item->mdl = NULL;
-			}
-            deviceContext->Stats.dma_sg_free_count++;
-        }
-	}
+    us4oemDmaRemoveScatterGather(DeviceContext, entry);
+    WdfWaitLockRelease(DeviceContext->DmaLock);
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_IOCTL, "Deallocated SG DMA buffer with handle 0x%llx", Handle);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS us4oemIoctlDeallocateAllDmaBuffers(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(BytesReturned);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    PAGED_CODE();
+
+    UNREFERENCED_PARAMETER(OutputBuffer);
+    UNREFERENCED_PARAMETER(InputBuffer);
 
-    deviceContext->Stats.dma_sg_alloc_count = 0;
-	deviceContext->Stats.dma_contig_alloc_count = 0;
+    // Buffers kept by a running lease aren't the caller's to release
+    us4oemDmaTeardown(Device, US4OEM_TEARDOWN_UNLEASED, FALSE);
 
-    // Clear the linked list
-#pragma warning(disable: 6387, justification: "I promise the NULL check is there and also I'd just like to say that MSVC sucks")
-    LINKED_LIST_CLEAR(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers);
-	LINKED_LIST_CLEAR(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory);
-#pragma warning(default: 6387)
     TraceEvents(TRACE_LEVEL_INFORMATION,
         TRACE_IOCTL,
         "Deallocated all DMA buffers");
-    WdfRequestComplete(Request, STATUS_SUCCESS);
+    return STATUS_SUCCESS;
 }
 
-VOID us4oemIoctlDeallocateScatterGatherDmaBuffer(
-    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer
+NTSTATUS us4oemIoctlDeallocateScatterGatherDmaBuffer(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
 ) {
+    UNREFERENCED_PARAMETER(BytesReturned);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
     PAGED_CODE();
 
     UNREFERENCED_PARAMETER(OutputBuffer);
@@ -74,51 +97,41 @@ VOID us4oemIoctlDeallocateScatterGatherDmaBuffer(
     void* va = (*(void**)(InputBuffer));
     PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
 
+    WdfWaitLockAcquire(deviceContext->DmaLock, NULL);
+
     // Iterate over the contiguous buffers until we find the one with the matching PA
     LINKED_LIST_FOR_EACH(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory, commonBuffer) {
         if (commonBuffer->Item != NULL &&
             WdfMemoryGetBuffer(commonBuffer->Item->memory, NULL) == va) {
 
             // Found the buffer, delete it
-            if (commonBuffer->Item->transaction != NULL) {
-                WdfObjectDelete(commonBuffer->Item->transaction);
-                commonBuffer->Item->transaction = NULL;
-            }
-            if (commonBuffer->Item->memory_locked) {
-                commonBuffer->Item->memory_locked = FALSE;
-                MmUnlockPages(commonBuffer->Item->mdl);
-            }
-            if (commonBuffer->Item->memory != NULL) {
-                WdfObjectDelete(commonBuffer->Item->memory);
-                commonBuffer->Item->memory = NULL;
-            }
-            if (commonBuffer->Item->mdl != NULL) {
-                IoFreeMdl(commonBuffer->Item->mdl);
-                commonBuffer->Item->mdl = NULL;
-            }
-            deviceContext->Stats.dma_sg_free_count++;
-            deviceContext->Stats.dma_sg_alloc_count--;
-            LINKED_LIST_REMOVE(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory, commonBuffer);
+            us4oemHandleClose(deviceContext, commonBuffer->Item->handle, US4OEM_HANDLE_TYPE_SCATTER_GATHER);
+            us4oemDmaRemoveScatterGather(deviceContext, commonBuffer);
+            WdfWaitLockRelease(deviceContext->DmaLock);
             TraceEvents(TRACE_LEVEL_INFORMATION,
                 TRACE_IOCTL,
                 "Deallocated SG DMA buffer with VA: 0x%p",
                 va);
-            WdfRequestComplete(Request, STATUS_SUCCESS);
-            return;
+            return STATUS_SUCCESS;
         }
     }
 
+    WdfWaitLockRelease(deviceContext->DmaLock);
+
     // Not found, complete with an error
     TraceEvents(TRACE_LEVEL_ERROR,
         TRACE_IOCTL,
         "Failed to find SG DMA buffer with VA: 0x%p",
         va);
-    WdfRequestComplete(Request, STATUS_NOT_FOUND);
+    return STATUS_NOT_FOUND;
 }
 
-VOID us4oemIoctlDeallocateContigousDmaBuffer(
-    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer
+NTSTATUS us4oemIoctlDeallocateContigousDmaBuffer(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
 ) {
+    UNREFERENCED_PARAMETER(BytesReturned);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
     PAGED_CODE();
 
     UNREFERENCED_PARAMETER(OutputBuffer);
@@ -126,36 +139,40 @@ VOID us4oemIoctlDeallocateContigousDmaBuffer(
     long long pa = *(unsigned long long*)InputBuffer;
     PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
 
+    WdfWaitLockAcquire(deviceContext->DmaLock, NULL);
+
     // Iterate over the contiguous buffers until we find the one with the matching PA
     LINKED_LIST_FOR_EACH(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers, commonBuffer) {
         if (commonBuffer->Item != NULL &&
             WdfCommonBufferGetAlignedLogicalAddress(*(commonBuffer->Item)).QuadPart == pa) {
             // Found the buffer, delete it
-            WdfObjectDelete(*commonBuffer->Item);
-            deviceContext->Stats.dma_contig_free_count++;
-            deviceContext->Stats.dma_contig_alloc_count--;
-            LINKED_LIST_REMOVE(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers, commonBuffer);
+            us4oemHandleClose(deviceContext, us4oemGetCommonBufferContext(*commonBuffer->Item)->Handle, US4OEM_HANDLE_TYPE_CONTIGUOUS);
+            us4oemDmaRemoveContiguous(deviceContext, commonBuffer);
+            WdfWaitLockRelease(deviceContext->DmaLock);
             TraceEvents(TRACE_LEVEL_INFORMATION,
                 TRACE_IOCTL,
                 "Deallocated contiguous DMA buffer with PA: 0x%llx",
                 pa);
-            WdfRequestComplete(Request, STATUS_SUCCESS);
-            return;
+            return STATUS_SUCCESS;
         }
     }
 
+    WdfWaitLockRelease(deviceContext->DmaLock);
+
     // Not found, complete with an error
     TraceEvents(TRACE_LEVEL_ERROR,
         TRACE_IOCTL,
         "Failed to find contiguous DMA buffer with PA: 0x%llx",
         pa);
-    WdfRequestComplete(Request, STATUS_NOT_FOUND);
+    return STATUS_NOT_FOUND;
 }
 
 typedef struct _us4oem_dma_program_context {
-    WDFREQUEST Request; // The request to complete
     PVOID OutputBuffer; // The output buffer for the response
+    size_t OutputBufferLength; // How much of it there is, at least US4OEM_DMA_SG_RESPONSE_NEEDED_SIZE(1)
     PVOID VA; // Virtual address of the DMA buffer
+    NTSTATUS Status; // Result of programming the DMA
+    size_t BytesReturned; // Number of bytes written to the output buffer
 } us4oem_dma_program_context;
 
 BOOLEAN us4oemProgramDma(
@@ -170,19 +187,22 @@ BOOLEAN us4oemProgramDma(
     UNREFERENCED_PARAMETER(Device);
 
     us4oem_dma_program_context* context = (us4oem_dma_program_context*)Context;
-
-    WDFREQUEST request = context->Request;
     us4oem_dma_scatter_gather_buffer_response* outputBuffer = (us4oem_dma_scatter_gather_buffer_response*)context->OutputBuffer;
 
-    // Get the input and output buffers from the request
-    if (request == NULL) {
-        WdfRequestComplete(request, STATUS_INVALID_PARAMETER);
+    // Check if the SgList is valid
+    if (SgList == NULL || SgList->NumberOfElements == 0) {
+        context->Status = STATUS_INVALID_PARAMETER;
         return FALSE;
     }
 
-    // Check if the SgList is valid
-    if (SgList == NULL || SgList->NumberOfElements == 0) {
-        WdfRequestComplete(request, STATUS_INVALID_PARAMETER);
+    // Every chunk must fit, the IOCTL only checked there's room for one. The caller gets the size it needs.
+    size_t needed = US4OEM_DMA_SG_RESPONSE_NEEDED_SIZE(SgList->NumberOfElements);
+    if (needed > context->OutputBufferLength) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "%lu chunks don't fit in the %llu byte output buffer",
+            SgList->NumberOfElements, (ULONG64)context->OutputBufferLength);
+        outputBuffer->chunk_count = SgList->NumberOfElements;
+        outputBuffer->length_used = needed;
+        context->Status = STATUS_BUFFER_TOO_SMALL;
         return FALSE;
     }
 
@@ -196,31 +216,24 @@ BOOLEAN us4oemProgramDma(
 
     // Set the response fields
     outputBuffer->chunk_count = SgList->NumberOfElements;
-    outputBuffer->length_used = US4OEM_DMA_SG_RESPONSE_NEEDED_SIZE(SgList->NumberOfElements);
+    outputBuffer->length_used = needed;
 	outputBuffer->va = context->VA; // The VA of the buffer is the one we allocated earlier
 
-    // Complete the request successfully
-
-    WdfRequestCompleteWithInformation(
-        request,
-        STATUS_SUCCESS,
-        outputBuffer->length_used
-    );
+    context->Status = STATUS_SUCCESS;
+    context->BytesReturned = outputBuffer->length_used;
     return TRUE;
 }
 
-VOID us4oemIoctlAllocateDmaScatterGatherBuffer(
-    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength
+NTSTATUS us4oemIoctlAllocateDmaScatterGatherBuffer(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
 ) {
     UNREFERENCED_PARAMETER(InputBufferLength);
-    UNREFERENCED_PARAMETER(OutputBufferLength);
 
     PAGED_CODE();
 
     us4oem_dma_allocation_argument* arg = (us4oem_dma_allocation_argument*)InputBuffer;
     if (arg == NULL || arg->length == 0) {
-        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
-        return;
+        return STATUS_INVALID_PARAMETER;
     }
 
     PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
@@ -230,7 +243,12 @@ VOID us4oemIoctlAllocateDmaScatterGatherBuffer(
         arg->max_chunks
 	);*/
 
-    MEMORY_ALLOCATION* allocation = MmAllocateNonCachedMemory(sizeof(MEMORY_ALLOCATION));
+    MEMORY_ALLOCATION* allocation = LINKED_LIST_NEW(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory);
+    if (allocation == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    InitializeListHead(&allocation->mappings);
+
     PVOID pBuffer;
 
     NTSTATUS status = WdfMemoryCreate(
@@ -243,9 +261,8 @@ VOID us4oemIoctlAllocateDmaScatterGatherBuffer(
 	);
 
     if (!NT_SUCCESS(status)) {
-		MmFreeNonCachedMemory(allocation, sizeof(MEMORY_ALLOCATION));
-        WdfRequestComplete(Request, status);
-        return;
+		LINKED_LIST_DISCARD(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory, allocation);
+        return status;
 	}
 
 	// Lock pages, allocate an MDL, and map the buffer
@@ -253,9 +270,8 @@ VOID us4oemIoctlAllocateDmaScatterGatherBuffer(
 
     if (allocation->mdl == NULL) {
 		WdfObjectDelete(allocation->memory);
-        MmFreeNonCachedMemory(allocation, sizeof(MEMORY_ALLOCATION));
-        WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
-        return;
+        LINKED_LIST_DISCARD(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory, allocation);
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
     __try {
@@ -267,9 +283,8 @@ VOID us4oemIoctlAllocateDmaScatterGatherBuffer(
             "MmProbeAndLockPages failed");
         IoFreeMdl(allocation->mdl);
         WdfObjectDelete(allocation->memory);
-        MmFreeNonCachedMemory(allocation, sizeof(MEMORY_ALLOCATION));
-        WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
-        return;
+        LINKED_LIST_DISCARD(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory, allocation);
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
     
 	// Create a DMA transaction
@@ -279,18 +294,20 @@ VOID us4oemIoctlAllocateDmaScatterGatherBuffer(
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_IOCTL,
             "WdfDmaTransactionCreate failed");
-        WdfRequestComplete(Request, status);
 		MmUnlockPages(allocation->mdl);
         IoFreeMdl(allocation->mdl);
         WdfObjectDelete(allocation->memory);
-        MmFreeNonCachedMemory(allocation, sizeof(MEMORY_ALLOCATION));
-        return;
+        LINKED_LIST_DISCARD(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory, allocation);
+        return status;
 	}
 
-	us4oem_dma_program_context* context = MmAllocateNonCachedMemory(sizeof(us4oem_dma_program_context));
-	context->Request = Request;
-	context->OutputBuffer = OutputBuffer;
-	context->VA = WdfMemoryGetBuffer(allocation->memory, NULL);
+	// Immediate execution runs the program callback before Execute returns,
+	// so the context can live on the stack
+	us4oem_dma_program_context context = { 0 };
+	context.OutputBuffer = OutputBuffer;
+	context.OutputBufferLength = OutputBufferLength;
+	context.VA = WdfMemoryGetBuffer(allocation->memory, NULL);
+	context.Status = STATUS_UNSUCCESSFUL;
 
     status = WdfDmaTransactionInitialize(
         allocation->transaction,
@@ -309,14 +326,16 @@ VOID us4oemIoctlAllocateDmaScatterGatherBuffer(
         MmUnlockPages(allocation->mdl);
         IoFreeMdl(allocation->mdl);
         WdfObjectDelete(allocation->memory);
-        MmFreeNonCachedMemory(allocation, sizeof(MEMORY_ALLOCATION));
-        WdfRequestComplete(Request, status);
-        return;
+        LINKED_LIST_DISCARD(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory, allocation);
+        return status;
     }
 
     WdfDmaTransactionSetImmediateExecution(allocation->transaction, TRUE);
 
-    status = WdfDmaTransactionExecute(allocation->transaction, context);
+    status = WdfDmaTransactionExecute(allocation->transaction, &context);
+    if (NT_SUCCESS(status)) {
+        status = context.Status;
+    }
 
     if (!NT_SUCCESS(status)) {
         TraceEvents(TRACE_LEVEL_ERROR,
@@ -326,34 +345,55 @@ VOID us4oemIoctlAllocateDmaScatterGatherBuffer(
         MmUnlockPages(allocation->mdl);
         IoFreeMdl(allocation->mdl);
         WdfObjectDelete(allocation->memory);
-        MmFreeNonCachedMemory(allocation, sizeof(MEMORY_ALLOCATION));
-        WdfRequestComplete(Request, status);
-        return;
+        LINKED_LIST_DISCARD(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory, allocation);
+        return status;
     }
 
-	// Push the memory into the linked list of scatter-gather buffers
+	// Push the memory into the linked list of scatter-gather buffers. Once the lock is dropped the buffer
+	// can be released by someone else, so it's counted before that.
+	WdfWaitLockAcquire(deviceContext->DmaLock, NULL);
 	LINKED_LIST_PUSH(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory, allocation);
-
-	// Increment the allocation count
-	deviceContext->Stats.dma_sg_alloc_count++;
-    return;
+	allocation->handle = us4oemHandleCreate(deviceContext, US4OEM_HANDLE_TYPE_SCATTER_GATHER,
+		LINKED_LIST_ENTRY_OF(MEMORY_ALLOCATION, allocation));
+	((us4oem_dma_scatter_gather_buffer_response*)OutputBuffer)->handle = allocation->handle;
+
+	// Increment the allocation count and the gauges
+	US4OEM_COUNTER_INCREMENT(deviceContext, DmaSgAllocCount);
+	allocation->length = arg->length;
+	allocation->chunk_count = ((us4oem_dma_scatter_gather_buffer_response*)OutputBuffer)->chunk_count;
+	US4OEM_COUNTER_ADD(deviceContext, DmaSgBytes, (LONG64)allocation->length);
+	US4OEM_COUNTER_ADD(deviceContext, DmaSgChunks, (LONG64)allocation->chunk_count);
+	us4oemCounterRaiseMax(&deviceContext->Counters.DmaSgMaxChunks, (LONG64)allocation->chunk_count);
+	WdfWaitLockRelease(deviceContext->DmaLock);
+
+    *BytesReturned = context.BytesReturned;
+    return STATUS_SUCCESS;
 }
 
-VOID us4oemIoctlAllocateDmaContiguousBuffer(
-    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer
+NTSTATUS us4oemIoctlAllocateDmaContiguousBuffer(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
 ) {
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
     PAGED_CODE();
 
     us4oem_dma_allocation_argument* arg = (us4oem_dma_allocation_argument*)InputBuffer;
 
     PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
 
-    // Allocate memory for the common buffer struct
-    WDFCOMMONBUFFER* commonBuffer = MmAllocateNonCachedMemory(sizeof(WDFCOMMONBUFFER));
+    // Allocate the list item for the common buffer handle
+    WDFCOMMONBUFFER* commonBuffer = LINKED_LIST_NEW(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers);
+    if (commonBuffer == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // The context holds the buffer's handle, for when it's deallocated by PA
+    WDF_OBJECT_ATTRIBUTES attributes;
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, US4OEM_COMMON_BUFFER_CONTEXT);
 
     NTSTATUS status = WdfCommonBufferCreate(deviceContext->DmaEnabler,
         arg->length,
-        WDF_NO_OBJECT_ATTRIBUTES,
+        &attributes,
         commonBuffer);
 
     if (!NT_SUCCESS(status)) {
@@ -361,9 +401,8 @@ VOID us4oemIoctlAllocateDmaContiguousBuffer(
             TRACE_IOCTL,
             "WdfCommonBufferCreate failed with status: %!STATUS!",
             status);
-        MmFreeNonCachedMemory(commonBuffer, sizeof(WDFCOMMONBUFFER));
-        WdfRequestComplete(Request, status);
-        return;
+        LINKED_LIST_DISCARD(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers, commonBuffer);
+        return status;
     }
 
     us4oem_dma_contiguous_buffer_response* response = (us4oem_dma_contiguous_buffer_response*)OutputBuffer;
@@ -375,10 +414,20 @@ VOID us4oemIoctlAllocateDmaContiguousBuffer(
     response->pa = (WdfCommonBufferGetAlignedLogicalAddress(
         *commonBuffer)).QuadPart;
 
-    // Store information about the allocated buffer in the device context
+    // Store information about the allocated buffer in the device context; counted before the lock is dropped,
+    // as it can be released by someone else from then on
+    WdfWaitLockAcquire(deviceContext->DmaLock, NULL);
     LINKED_LIST_PUSH(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers, commonBuffer);
-
-    deviceContext->Stats.dma_contig_alloc_count++;
-
-    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(us4oem_dma_contiguous_buffer_response));
+    response->handle = us4oemHandleCreate(deviceContext, US4OEM_HANDLE_TYPE_CONTIGUOUS,
+        LINKED_LIST_ENTRY_OF(WDFCOMMONBUFFER, commonBuffer));
+    us4oemGetCommonBufferContext(*commonBuffer)->Handle = response->handle;
+    InitializeListHead(&us4oemGetCommonBufferContext(*commonBuffer)->Mappings);
+
+    US4OEM_COUNTER_INCREMENT(deviceContext, DmaContigAllocCount);
+    US4OEM_COUNTER_ADD(deviceContext, DmaContigBytes, (LONG64)arg->length);
+    us4oemCounterRaiseMax(&deviceContext->Counters.DmaContigMaxBytes, (LONG64)arg->length);
+    WdfWaitLockRelease(deviceContext->DmaLock);
+
+    *BytesReturned = sizeof(us4oem_dma_contiguous_buffer_response);
+    return STATUS_SUCCESS;
 }
\ No newline at end of file
@@ -147,7 +147,8 @@ us4oemEvtDevicePrepareHardware(
 					
                 break;
             case CmResourceTypeInterrupt:
-                WDF_INTERRUPT_CONFIG_INIT(&interruptConfig, Us4OemInterruptIsr, Us4OemInterruptDpc);
+                // No WDF DPC, the ISR queues our own KDPC so its placement can be configured (see Interrupt.c)
+                WDF_INTERRUPT_CONFIG_INIT(&interruptConfig, Us4OemInterruptIsr, NULL);
 
                 interruptConfig.InterruptTranslated = WdfCmResourceListGetDescriptor(ResourcesTranslated, i);
                 interruptConfig.InterruptRaw = WdfCmResourceListGetDescriptor(Resources, i);
@@ -168,9 +169,27 @@ us4oemEvtDevicePrepareHardware(
         }
     }
 
+    // Must come after the interrupt is created, as it takes the interrupt lock
+    NTSTATUS status = us4oemInterruptInitializeDpc(Device);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "us4oemInterruptInitializeDpc failed %!STATUS!", status);
+        return status;
+    }
+
     return STATUS_SUCCESS;
 }
 
+// Stops the moderation and poll timeout timers and waits for their callbacks
+static VOID us4oemStopPollTimers(PUS4OEM_CONTEXT DeviceContext) {
+    if (DeviceContext->PollTimeoutTimer) {
+        WdfTimerStop(DeviceContext->PollTimeoutTimer, TRUE);
+    }
+    if (DeviceContext->ModerationTimer) {
+        WdfTimerStop(DeviceContext->ModerationTimer, TRUE);
+        InterlockedExchange(&DeviceContext->ModerationTimerArmed, 0);
+    }
+}
+
 NTSTATUS
 us4oemEvtDeviceReleaseHardware(
     IN  WDFDEVICE    Device,
@@ -185,52 +204,44 @@ us4oemEvtDeviceReleaseHardware(
 
     if (deviceContext->BarPciDma.MappedAddress) {
         MmUnmapIoSpace(deviceContext->BarPciDma.MappedAddress, deviceContext->BarPciDma.Length);
+        deviceContext->BarPciDma.MappedAddress = NULL;
+        deviceContext->BarPciDma.Length = 0;
     }
 
     if (deviceContext->BarUs4Oem.MappedAddress) {
         MmUnmapIoSpace(deviceContext->BarUs4Oem.MappedAddress, deviceContext->BarUs4Oem.Length);
+        deviceContext->BarUs4Oem.MappedAddress = NULL;
+        deviceContext->BarUs4Oem.Length = 0;
     }
 
-	// Deallocate all DMA buffers
-    LINKED_LIST_FOR_EACH(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers, commonBuffer) {
-        if (commonBuffer->Item != NULL) {
-            WdfObjectDelete(*commonBuffer->Item);
-            deviceContext->Stats.dma_contig_free_count++;
-        }
-    }
-    LINKED_LIST_FOR_EACH(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory, commonBuffer) {
-        if (commonBuffer->Item != NULL) {
-            if (commonBuffer->Item->transaction != NULL) {
-                WdfObjectDelete(commonBuffer->Item->transaction);
-                commonBuffer->Item->transaction = NULL;
-            }
-            if (commonBuffer->Item->memory_locked) {
-                commonBuffer->Item->memory_locked = FALSE;
-                MmUnlockPages(commonBuffer->Item->mdl);
-            }
-            if (commonBuffer->Item->memory != NULL) {
-                WdfObjectDelete(commonBuffer->Item->memory);
-                commonBuffer->Item->memory = NULL;
-            }
-            if (commonBuffer->Item->mdl != NULL) {
-                IoFreeMdl(commonBuffer->Item->mdl);
-                commonBuffer->Item->mdl = NULL;
-            }
-            deviceContext->Stats.dma_sg_free_count++;
+    // The framework disconnected the interrupt before calling us, so the ISR can't queue the DPC any more,
+    // but its last DPC might still be queued or running - and it can arm the moderation timer
+    KeRemoveQueueDpc(&deviceContext->InterruptDpc);
+    KeFlushQueuedDpcs();
+
+    // Now stop the timers and complete the parked poll. A timer callback that's running can take the parked
+    // request out and put it back, or re-arm the moderation timer for it, so repeat until nobody is waiting;
+    // without a waiter neither timer does anything, and no new poll can park as the queues are stopped.
+    for (;;) {
+        us4oemStopPollTimers(deviceContext);
+
+        WDFREQUEST pendingRequest;
+        while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(deviceContext->Queues[US4OEM_QUEUE_PARKED], &pendingRequest))) {
+            us4oemQueueLeave(deviceContext, US4OEM_QUEUE_PARKED, pendingRequest);
+            us4oemIrqWaiterRelease(&deviceContext->PollWaiting);
+            us4oemPollRequestComplete(deviceContext, pendingRequest, STATUS_DEVICE_REMOVED, 0);
         }
-	}
 
-    deviceContext->Stats.dma_sg_alloc_count = 0;
-    deviceContext->Stats.dma_contig_alloc_count = 0;
-
-    LINKED_LIST_CLEAR(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers);
-	LINKED_LIST_CLEAR(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory);
+        if (!us4oemIrqWaiterPresent(&deviceContext->PollWaiting)) {
+            us4oemStopPollTimers(deviceContext);
+            break;
+        }
+    }
 
-    // Clear the pending request
-    if (deviceContext->PendingRequest) {
-        WdfRequestComplete(deviceContext->PendingRequest, STATUS_DEVICE_REMOVED);
-        deviceContext->PendingRequest = NULL;
-	}
+	// Deallocate all DMA buffers, including the ones a close is still releasing in the background and leased ones
+    us4oemLeaseStop(deviceContext);
+    us4oemDmaTeardownDrain(deviceContext);
+    us4oemDmaTeardown(Device, US4OEM_TEARDOWN_ALL, FALSE);
 
 	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Device hardware released");
 
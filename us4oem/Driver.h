@@ -21,6 +21,7 @@ EXTERN_C_START
 DRIVER_INITIALIZE DriverEntry;
 EVT_WDF_DRIVER_DEVICE_ADD us4oemEvtDeviceAdd;
 EVT_WDF_OBJECT_CONTEXT_CLEANUP us4oemEvtDriverContextCleanup;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP us4oemEvtDeviceContextCleanup;
 EVT_WDF_DEVICE_PREPARE_HARDWARE us4oemEvtDevicePrepareHardware;
 EVT_WDF_DEVICE_RELEASE_HARDWARE us4oemEvtDeviceReleaseHardware;
 
@@ -0,0 +1,141 @@
+#include "ioctl.h"
+#include "events.h"
+#include "latency.h"
+#include "events.tmh"
+
+// us4oemEventWrite is called from the ISR and the DPC, so it stays resident
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, us4oemEventInitialize)
+#pragma alloc_text (PAGE, us4oemIoctlReadEvents)
+#pragma alloc_text (PAGE, us4oemIoctlSetEventMask)
+#endif
+
+NTSTATUS us4oemEventInitialize(WDFDEVICE Device) {
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    WDF_OBJECT_ATTRIBUTES attributes;
+    WDFMEMORY memory;
+    PVOID buffer;
+
+    // Processors can be hot-added, so size for the most there can ever be
+    ULONG count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    NTSTATUS status = WdfMemoryCreate(&attributes, NonPagedPoolNx, 'r4su', count * sizeof(US4OEM_EVENT_RING), &memory, &buffer);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "WdfMemoryCreate failed for %lu event rings %!STATUS!", count, status);
+        return status;
+    }
+
+    RtlZeroMemory(buffer, count * sizeof(US4OEM_EVENT_RING));
+    deviceContext->EventRings = (PUS4OEM_EVENT_RING)buffer;
+    deviceContext->EventRingCount = count;
+    deviceContext->EventMask = 0; // Nothing is recorded until asked for
+
+    return STATUS_SUCCESS;
+}
+
+VOID us4oemEventWrite(PUS4OEM_CONTEXT DeviceContext, us4oem_event_type Type, ULONG Arg0, ULONG64 Arg1) {
+    KIRQL irql = KeGetCurrentIrql();
+
+    // Stay on this processor until the record is complete. Whatever interrupts us here (the ISR) finishes
+    // its own record before we continue, so a slot is never written by two writers at once.
+    if (irql < DISPATCH_LEVEL) {
+        KeRaiseIrql(DISPATCH_LEVEL, &irql);
+    }
+
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+    if (processor < DeviceContext->EventRingCount) {
+        PUS4OEM_EVENT_RING ring = &DeviceContext->EventRings[processor];
+        LONG64 sequence = InterlockedIncrement64(&ring->Head);
+        us4oem_event* event = &ring->Events[(sequence - 1) & (US4OEM_EVENT_RING_SIZE - 1)];
+
+        // The slot reads as empty while it's being filled in, see us4oemIoctlReadEvents
+        InterlockedExchange64((volatile LONG64*)&event->sequence, 0);
+        event->timestamp = us4oemLatencyTimestamp();
+        event->type = (unsigned long)Type;
+        event->arg0 = Arg0;
+        event->arg1 = Arg1;
+        InterlockedExchange64((volatile LONG64*)&event->sequence, sequence);
+    }
+
+    if (irql < DISPATCH_LEVEL) {
+        KeLowerIrql(irql);
+    }
+}
+
+NTSTATUS us4oemIoctlReadEvents(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    us4oem_event_read_argument* arg = (us4oem_event_read_argument*)InputBuffer;
+    ULONG processor = arg->processor; // Same buffer as the output, read it before that's overwritten
+    us4oem_event_ring* output = (us4oem_event_ring*)OutputBuffer;
+
+    if (processor >= deviceContext->EventRingCount) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PUS4OEM_EVENT_RING ring = &deviceContext->EventRings[processor];
+    LONG64 head = ring->Head;
+    LONG64 first = head > US4OEM_EVENT_RING_SIZE ? head - US4OEM_EVENT_RING_SIZE : 0;
+    ULONG count = 0;
+
+    // Lock-free: the processor keeps recording while we copy, so a slot only counts if it holds the
+    // sequence we expect both before and after the copy. Anything overwritten meanwhile is skipped.
+    for (LONG64 sequence = first + 1; sequence <= head; sequence++) {
+        us4oem_event* slot = &ring->Events[(sequence - 1) & (US4OEM_EVENT_RING_SIZE - 1)];
+
+        if ((LONG64)slot->sequence != sequence) {
+            continue;
+        }
+        KeMemoryBarrier();
+        output->events[count] = *slot;
+        KeMemoryBarrier();
+        if ((LONG64)slot->sequence != sequence) {
+            continue;
+        }
+        output->events[count].sequence = (unsigned long long)sequence;
+        count++;
+    }
+
+    output->processor_count = deviceContext->EventRingCount;
+    output->event_mask = deviceContext->EventMask;
+    output->recorded = (unsigned long long)head;
+    output->count = count;
+    output->reserved = 0;
+
+    *BytesReturned = sizeof(us4oem_event_ring);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS us4oemIoctlSetEventMask(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(OutputBuffer);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(BytesReturned);
+
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    ULONG mask = *(ULONG*)InputBuffer;
+
+    if (mask & ~US4OEM_EVENT_MASK_ALL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    InterlockedExchange((volatile LONG*)&deviceContext->EventMask, (LONG)mask);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_IOCTL, "Event mask set to 0x%lx", mask);
+    return STATUS_SUCCESS;
+}
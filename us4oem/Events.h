@@ -0,0 +1,31 @@
+#pragma once
+
+#include <ntddk.h>
+#include <wdf.h>
+
+#include "us4oem.h"
+
+EXTERN_C_START
+
+// One processor's ring, see US4OEM_WIN32_IOCTL_READ_EVENTS.
+// Only ever written on its own processor, so the cache line holding Head is never shared between writers.
+typedef struct _US4OEM_EVENT_RING {
+	DECLSPEC_CACHEALIGN volatile LONG64 Head; // Events ever recorded; the next one gets sequence Head + 1
+	us4oem_event Events[US4OEM_EVENT_RING_SIZE];
+} US4OEM_EVENT_RING, *PUS4OEM_EVENT_RING;
+
+// Allocates a ring for every processor the system can have; the rings live as long as the device.
+NTSTATUS us4oemEventInitialize(WDFDEVICE Device);
+
+// Out of line part of us4oemEventRecord, don't call directly.
+VOID us4oemEventWrite(PUS4OEM_CONTEXT DeviceContext, us4oem_event_type Type, ULONG Arg0, ULONG64 Arg1);
+
+// Records an event in the current processor's ring. Safe at any IRQL, including from the ISR.
+// While the event type is masked out (the default) this is a single, well predicted branch.
+FORCEINLINE VOID us4oemEventRecord(PUS4OEM_CONTEXT DeviceContext, us4oem_event_type Type, ULONG Arg0, ULONG64 Arg1) {
+	if (DeviceContext->EventMask & US4OEM_EVENT_MASK(Type)) {
+		us4oemEventWrite(DeviceContext, Type, Arg0, Arg1);
+	}
+}
+
+EXTERN_C_END
@@ -0,0 +1,163 @@
+#include "ioctl.h"
+#include "handle.tmh"
+
+// The table is used from the teardown workers too, so only the setup and the IOCTL are pageable
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, us4oemHandleInitialize)
+#pragma alloc_text (PAGE, us4oemIoctlReleaseHandle)
+#endif
+
+#define US4OEM_HANDLE_INDEX(Handle) ((ULONG)((Handle) & 0xFFFFFFFF) - 1)
+#define US4OEM_HANDLE_GENERATION(Handle) ((ULONG)((Handle) >> 32))
+#define US4OEM_HANDLE_MAKE(Index, Generation) (((us4oem_handle)(Generation) << 32) | ((us4oem_handle)(Index) + 1))
+
+NTSTATUS us4oemHandleInitialize(WDFDEVICE Device) {
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    WDF_OBJECT_ATTRIBUTES attributes;
+    WDFMEMORY memory;
+    PUS4OEM_HANDLE_ENTRY table;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    NTSTATUS status = WdfSpinLockCreate(&attributes, &deviceContext->HandleLock);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "WdfSpinLockCreate failed for the handle table %!STATUS!", status);
+        return status;
+    }
+
+    status = WdfMemoryCreate(&attributes, NonPagedPoolNx, 'r4su',
+        US4OEM_MAX_HANDLES * sizeof(US4OEM_HANDLE_ENTRY), &memory, (PVOID*)&table);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "WdfMemoryCreate failed for the handle table %!STATUS!", status);
+        return status;
+    }
+
+    // Every slot starts out free, in order; generations start at 1 so no handle is ever 0
+    for (ULONG i = 0; i < US4OEM_MAX_HANDLES; i++) {
+        table[i].Object = NULL;
+        table[i].Generation = 1;
+        table[i].Type = US4OEM_HANDLE_TYPE_FREE;
+        table[i].NextFree = i + 2 <= US4OEM_MAX_HANDLES ? i + 2 : 0;
+    }
+
+    deviceContext->Handles = table;
+    deviceContext->HandleFreeHead = 1;
+    return STATUS_SUCCESS;
+}
+
+us4oem_handle us4oemHandleCreate(PUS4OEM_CONTEXT DeviceContext, US4OEM_HANDLE_TYPE Type, PVOID Object) {
+    us4oem_handle handle = US4OEM_INVALID_HANDLE;
+
+    if (DeviceContext->Handles == NULL) {
+        return handle;
+    }
+
+    WdfSpinLockAcquire(DeviceContext->HandleLock);
+    if (DeviceContext->HandleFreeHead != 0) {
+        ULONG index = DeviceContext->HandleFreeHead - 1;
+        PUS4OEM_HANDLE_ENTRY entry = &DeviceContext->Handles[index];
+
+        DeviceContext->HandleFreeHead = entry->NextFree;
+        entry->Object = Object;
+        entry->Type = Type;
+        entry->NextFree = 0;
+        handle = US4OEM_HANDLE_MAKE(index, entry->Generation);
+    }
+    WdfSpinLockRelease(DeviceContext->HandleLock);
+
+    if (handle == US4OEM_INVALID_HANDLE) {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DRIVER, "Handle table full, object %p gets no handle", Object);
+    }
+    return handle;
+}
+
+// The slot the handle refers to, if the handle is still valid. Call with the lock held.
+static PUS4OEM_HANDLE_ENTRY us4oemHandleFind(PUS4OEM_CONTEXT DeviceContext, us4oem_handle Handle) {
+    ULONG index = US4OEM_HANDLE_INDEX(Handle);
+
+    if (DeviceContext->Handles == NULL || index >= US4OEM_MAX_HANDLES) {
+        return NULL;
+    }
+
+    PUS4OEM_HANDLE_ENTRY entry = &DeviceContext->Handles[index];
+    if (entry->Type == US4OEM_HANDLE_TYPE_FREE || entry->Generation != US4OEM_HANDLE_GENERATION(Handle)) {
+        return NULL;
+    }
+    return entry;
+}
+
+PVOID us4oemHandleLookup(PUS4OEM_CONTEXT DeviceContext, us4oem_handle Handle, US4OEM_HANDLE_TYPE* Type) {
+    PVOID object = NULL;
+
+    *Type = US4OEM_HANDLE_TYPE_FREE;
+    if (DeviceContext->Handles == NULL) {
+        return NULL;
+    }
+
+    WdfSpinLockAcquire(DeviceContext->HandleLock);
+    PUS4OEM_HANDLE_ENTRY entry = us4oemHandleFind(DeviceContext, Handle);
+    if (entry != NULL) {
+        object = entry->Object;
+        *Type = entry->Type;
+    }
+    WdfSpinLockRelease(DeviceContext->HandleLock);
+
+    return object;
+}
+
+PVOID us4oemHandleClose(PUS4OEM_CONTEXT DeviceContext, us4oem_handle Handle, US4OEM_HANDLE_TYPE Type) {
+    PVOID object = NULL;
+
+    if (Handle == US4OEM_INVALID_HANDLE || DeviceContext->Handles == NULL) {
+        return NULL;
+    }
+
+    WdfSpinLockAcquire(DeviceContext->HandleLock);
+    PUS4OEM_HANDLE_ENTRY entry = us4oemHandleFind(DeviceContext, Handle);
+    if (entry != NULL && entry->Type == Type) {
+        object = entry->Object;
+
+        entry->Object = NULL;
+        entry->Type = US4OEM_HANDLE_TYPE_FREE;
+        entry->Generation = entry->Generation == MAXULONG ? 1 : entry->Generation + 1;
+        entry->NextFree = DeviceContext->HandleFreeHead;
+        DeviceContext->HandleFreeHead = US4OEM_HANDLE_INDEX(Handle) + 1;
+    }
+    WdfSpinLockRelease(DeviceContext->HandleLock);
+
+    return object;
+}
+
+NTSTATUS us4oemIoctlReleaseHandle(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(OutputBuffer);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(BytesReturned);
+
+    PAGED_CODE();
+
+    us4oem_handle handle = *(us4oem_handle*)InputBuffer;
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    US4OEM_HANDLE_TYPE type;
+
+    if (us4oemHandleLookup(deviceContext, handle, &type) == NULL) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "Invalid handle 0x%llx", handle);
+        return STATUS_INVALID_HANDLE;
+    }
+
+    switch (type) {
+    case US4OEM_HANDLE_TYPE_CONTIGUOUS:
+        return us4oemDmaFreeContiguous(deviceContext, handle);
+    case US4OEM_HANDLE_TYPE_SCATTER_GATHER:
+        return us4oemDmaFreeScatterGather(deviceContext, handle);
+    case US4OEM_HANDLE_TYPE_MAPPING:
+        return us4oemMemUnmap(deviceContext, handle);
+    default:
+        return STATUS_INVALID_HANDLE;
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <ntddk.h>
+#include <wdf.h>
+
+#include "us4oem.h"
+
+EXTERN_C_START
+
+// What a handle refers to, see us4oem_handle
+typedef enum _US4OEM_HANDLE_TYPE {
+    US4OEM_HANDLE_TYPE_FREE = 0,
+    US4OEM_HANDLE_TYPE_CONTIGUOUS = 1, // LINKED_LIST_ENTRY_TYPE_FOR(WDFCOMMONBUFFER)*
+    US4OEM_HANDLE_TYPE_SCATTER_GATHER = 2, // LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)*
+    US4OEM_HANDLE_TYPE_MAPPING = 3, // PUS4OEM_MAPPING
+} US4OEM_HANDLE_TYPE;
+
+// A slot of the handle table. A handle is the slot index + 1 in the low half and the slot's generation
+// in the high half; the generation changes whenever the slot is freed, so stale handles never match.
+typedef struct _US4OEM_HANDLE_ENTRY {
+    PVOID Object;
+    ULONG Generation;
+    US4OEM_HANDLE_TYPE Type;
+    ULONG NextFree; // Index + 1 of the next free slot, 0 for none; only meaningful while the slot is free
+} US4OEM_HANDLE_ENTRY, *PUS4OEM_HANDLE_ENTRY;
+
+// A DMA buffer or BAR mapped into a process, see US4OEM_WIN32_IOCTL_MMAP. Released by its handle, with the
+// buffer it maps, or once its process has no handle to the device open anymore (see us4oemEvtFileCleanup).
+typedef struct _US4OEM_MAPPING {
+    WDFMEMORY Memory; // Holds the mapping record itself
+    PMDL Mdl;
+    PVOID UserAddress;
+    ULONG Length;
+    PEPROCESS Process; // Referenced; the only process the mapping can be unmapped from by handle
+    us4oem_handle Handle;
+    LIST_ENTRY Link; // In the device's Mappings, under DmaLock
+    LIST_ENTRY BufferLink; // In the mapped DMA buffer's list of mappings, under DmaLock; empty for the BARs and statistics
+} US4OEM_MAPPING, *PUS4OEM_MAPPING;
+
+// Context of the contiguous DMA buffers, so freeing one by PA can close its handle too
+typedef struct _US4OEM_COMMON_BUFFER_CONTEXT {
+    us4oem_handle Handle;
+    LIST_ENTRY Mappings; // US4OEM_MAPPING.BufferLink, released before the buffer is
+    ULONG Lease; // Id of the lease keeping the buffer, 0 if none; see us4oemLeaseStart
+} US4OEM_COMMON_BUFFER_CONTEXT, *PUS4OEM_COMMON_BUFFER_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(US4OEM_COMMON_BUFFER_CONTEXT, us4oemGetCommonBufferContext)
+
+// Allocates the handle table (US4OEM_MAX_HANDLES slots); it lives as long as the device.
+NTSTATUS us4oemHandleInitialize(WDFDEVICE Device);
+
+// Returns a new handle for Object, or US4OEM_INVALID_HANDLE if the table is full.
+// All of these are constant time and safe at IRQL <= DISPATCH_LEVEL.
+us4oem_handle us4oemHandleCreate(PUS4OEM_CONTEXT DeviceContext, US4OEM_HANDLE_TYPE Type, PVOID Object);
+
+// Returns the object behind the handle and its type, or NULL if the handle isn't (or is no longer) valid.
+PVOID us4oemHandleLookup(PUS4OEM_CONTEXT DeviceContext, us4oem_handle Handle, US4OEM_HANDLE_TYPE* Type);
+
+// Frees the handle if it refers to an object of the given type, and returns the object; NULL otherwise.
+// Whoever closes the handle owns the object, so two threads releasing the same thing can't both get it.
+PVOID us4oemHandleClose(PUS4OEM_CONTEXT DeviceContext, us4oem_handle Handle, US4OEM_HANDLE_TYPE Type);
+
+EXTERN_C_END
@@ -1,28 +1,255 @@
 #include "interrupt.h"
 #include "interrupt.tmh"
 
-BOOLEAN Us4OemInterruptIsr(IN WDFINTERRUPT Interrupt, IN ULONG MessageID) {
-	UNREFERENCED_PARAMETER(MessageID);
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, us4oemInterruptInitializeDpc)
+#pragma alloc_text (PAGE, us4oemInterruptFillCapabilities)
+#pragma alloc_text (PAGE, us4oemIoctlSetIrqAffinity)
+#endif
 
+BOOLEAN Us4OemInterruptIsr(IN WDFINTERRUPT Interrupt, IN ULONG MessageID) {
 	// The IRQ basically functions as a signal for user-space to perform an action,
 	// so we don't need to do anything here other than queueing a DPC.
+	PUS4OEM_CONTEXT deviceContext = us4oemGetContext(WdfInterruptGetDevice(Interrupt));
+	deviceContext->LastIsrTimestamp = us4oemLatencyTimestamp();
+	us4oemEventRecord(deviceContext, US4OEM_EVENT_ISR, MessageID, 0);
 
-	WdfInterruptQueueDpcForIsr(Interrupt);
+	if (deviceContext->DpcReconfiguring) {
+		deviceContext->DpcDeferred = TRUE; // us4oemInterruptConfigureDpc queues the DPC once it's done
+	}
+	else {
+		KeInsertQueueDpc(&deviceContext->InterruptDpc, NULL, NULL);
+	}
 
 	return TRUE; // Indicate that the interrupt was handled
 }
 
-VOID Us4OemInterruptDpc(IN WDFINTERRUPT Interrupt, IN WDFOBJECT AssociatedObject) {
-	UNREFERENCED_PARAMETER(AssociatedObject);
-	
-	PUS4OEM_CONTEXT deviceContext = us4oemGetContext(WdfInterruptGetDevice(Interrupt));
-	deviceContext->Stats.irq_count++;
-	deviceContext->Stats.irq_pending_count++;
+VOID Us4OemInterruptDpc(IN PKDPC Dpc, IN PVOID DeferredContext, IN PVOID SystemArgument1, IN PVOID SystemArgument2) {
+	UNREFERENCED_PARAMETER(Dpc);
+	UNREFERENCED_PARAMETER(SystemArgument1);
+	UNREFERENCED_PARAMETER(SystemArgument2);
+
+	PUS4OEM_CONTEXT deviceContext = (PUS4OEM_CONTEXT)DeferredContext;
+
+	LONGLONG now = us4oemLatencyTimestamp();
+	LONGLONG previous = deviceContext->LastDpcTimestamp;
+	deviceContext->LastDpcTimestamp = now;
+
+	// Moving average of the time between IRQs with weight 1/8, only this DPC writes it
+	if (previous != 0) {
+		LONG64 ewma = deviceContext->Counters.IrqIntervalEwma;
+		LONG64 interval = now - previous;
+		InterlockedExchange64(&deviceContext->Counters.IrqIntervalEwma, ewma == 0 ? interval : ewma + (interval - ewma) / 8);
+	}
+	us4oemLatencyRecord(deviceContext, &deviceContext->Latency.isr_to_dpc, deviceContext->LastIsrTimestamp, now);
+
+	US4OEM_COUNTER_INCREMENT(deviceContext, IrqCount);
+	LONG64 pending = us4oemIrqPendingRaise(&deviceContext->Counters.IrqPendingCount);
+	if (pending == 1) {
+		deviceContext->ModerationBatchStart = now; // First IRQ of a new batch, see us4oemModerationReady
+	}
+	us4oemEventRecord(deviceContext, US4OEM_EVENT_DPC, (ULONG)pending, 0);
+
+	// If there is a pending request, complete it with success (unless moderation wants to wait for more IRQs)
+	us4oemServicePendingRequest(deviceContext);
+
+	us4oemStatsPublish(deviceContext);
+}
+
+// Sets the importance and target processor of the interrupt DPC. A KDPC must not be modified while it's queued or
+// running, and re-initializing it is the only way to un-pin it, so:
+// - under the interrupt lock, DpcReconfiguring keeps the ISR from queueing the DPC and a queued one is pulled out,
+// - KeFlushQueuedDpcs waits for one that's already running, so there are never two instances (the DPC is the only
+//   writer of LastDpcTimestamp and IrqIntervalEwma),
+// - then the KDPC is re-initialized, and queued again under the interrupt lock if it was pulled out or an IRQ came
+//   meanwhile.
+// Must be called at PASSIVE_LEVEL. Only one caller can change the DPC at a time, others get STATUS_DEVICE_BUSY.
+static NTSTATUS us4oemInterruptConfigureDpc(PUS4OEM_CONTEXT DeviceContext, ULONG TargetProcessor, ULONG Importance) {
+	PROCESSOR_NUMBER processor;
+
+	if (Importance > US4OEM_DPC_IMPORTANCE_MEDIUM_HIGH) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (TargetProcessor != US4OEM_PROCESSOR_ANY && !NT_SUCCESS(KeGetProcessorNumberFromIndex(TargetProcessor, &processor))) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (InterlockedCompareExchange(&DeviceContext->DpcReconfiguring, 1, 0) != 0) {
+		return STATUS_DEVICE_BUSY;
+	}
+
+	if (DeviceContext->Interrupt) {
+		WdfInterruptAcquireLock(DeviceContext->Interrupt);
+	}
+	BOOLEAN wasQueued = KeRemoveQueueDpc(&DeviceContext->InterruptDpc);
+	if (DeviceContext->Interrupt) {
+		WdfInterruptReleaseLock(DeviceContext->Interrupt);
+	}
+
+	KeFlushQueuedDpcs();
+
+	KeInitializeDpc(&DeviceContext->InterruptDpc, Us4OemInterruptDpc, DeviceContext);
+	KeSetImportanceDpc(&DeviceContext->InterruptDpc, (KDPC_IMPORTANCE)Importance);
+	if (TargetProcessor != US4OEM_PROCESSOR_ANY) {
+		KeSetTargetProcessorDpcEx(&DeviceContext->InterruptDpc, &processor);
+	}
+
+	DeviceContext->DpcTargetProcessor = TargetProcessor;
+	DeviceContext->DpcImportance = Importance;
+
+	if (DeviceContext->Interrupt) {
+		WdfInterruptAcquireLock(DeviceContext->Interrupt);
+	}
+	if (wasQueued || DeviceContext->DpcDeferred) {
+		KeInsertQueueDpc(&DeviceContext->InterruptDpc, NULL, NULL);
+	}
+	DeviceContext->DpcDeferred = FALSE;
+	InterlockedExchange(&DeviceContext->DpcReconfiguring, 0);
+	if (DeviceContext->Interrupt) {
+		WdfInterruptReleaseLock(DeviceContext->Interrupt);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+// Sets up the interrupt DPC, placed according to the DpcTargetProcessor and DpcImportance values
+// in the device's registry key (see us4oem.inf). Called from us4oemEvtDevicePrepareHardware.
+NTSTATUS us4oemInterruptInitializeDpc(WDFDEVICE Device) {
+	DECLARE_CONST_UNICODE_STRING(targetProcessorName, L"DpcTargetProcessor");
+	DECLARE_CONST_UNICODE_STRING(importanceName, L"DpcImportance");
+
+	PAGED_CODE();
+
+	PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+	ULONG targetProcessor = US4OEM_PROCESSOR_ANY;
+	ULONG importance = US4OEM_DPC_IMPORTANCE_MEDIUM;
 
-	// If there is a pending request, complete it with success
-	if (deviceContext->PendingRequest) {
-		WdfRequestComplete(deviceContext->PendingRequest, STATUS_SUCCESS);
-		deviceContext->PendingRequest = NULL; // Clear the pending request
-		deviceContext->Stats.irq_pending_count--;
+	WDFKEY key;
+	if (NT_SUCCESS(WdfDeviceOpenRegistryKey(Device, PLUGPLAY_REGKEY_DEVICE, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key))) {
+		// Both values are optional, missing ones keep the defaults
+		WdfRegistryQueryULong(key, &targetProcessorName, &targetProcessor);
+		WdfRegistryQueryULong(key, &importanceName, &importance);
+		WdfRegistryClose(key);
 	}
-}
\ No newline at end of file
+
+	NTSTATUS status = us4oemInterruptConfigureDpc(deviceContext, targetProcessor, importance);
+	if (!NT_SUCCESS(status)) {
+		// A bad registry value shouldn't keep the device from starting
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_DRIVER,
+			"Invalid DPC settings in registry (processor %lu, importance %lu), using defaults",
+			targetProcessor, importance);
+		status = us4oemInterruptConfigureDpc(deviceContext, US4OEM_PROCESSOR_ANY, US4OEM_DPC_IMPORTANCE_MEDIUM);
+	}
+
+	return status;
+}
+
+// Fills in the interrupt/DPC placement part of the statistics. Not pageable, us4oemStatsPublish calls it at DISPATCH_LEVEL.
+VOID us4oemInterruptFillAffinityStats(PUS4OEM_CONTEXT DeviceContext, us4oem_stats* Stats) {
+	Stats->irq_affinity = 0;
+	Stats->irq_affinity_group = 0;
+
+	if (DeviceContext->Interrupt) {
+		WDF_INTERRUPT_INFO info;
+		WDF_INTERRUPT_INFO_INIT(&info);
+		WdfInterruptGetInfo(DeviceContext->Interrupt, &info);
+
+		Stats->irq_affinity = info.TargetProcessorSet;
+		Stats->irq_affinity_group = info.Group;
+	}
+
+	Stats->dpc_target_processor = DeviceContext->DpcTargetProcessor;
+	Stats->dpc_importance = DeviceContext->DpcImportance;
+}
+
+// Fills in the interrupt part of the capabilities.
+VOID us4oemInterruptFillCapabilities(PUS4OEM_CONTEXT DeviceContext, us4oem_capabilities* Capabilities) {
+	PAGED_CODE();
+
+	Capabilities->msi_vector_count = 0;
+
+	if (DeviceContext->Interrupt) {
+		WDF_INTERRUPT_INFO info;
+		WDF_INTERRUPT_INFO_INIT(&info);
+		WdfInterruptGetInfo(DeviceContext->Interrupt, &info);
+
+		// Only a single interrupt object is ever connected, see us4oemEvtDevicePrepareHardware
+		if (info.MessageSignaled) {
+			Capabilities->msi_vector_count = 1;
+			Capabilities->features |= US4OEM_CAPABILITY_MSI;
+		}
+	}
+}
+
+// Stores the interrupt affinity in the device's "Interrupt Management\Affinity Policy" key, which the PnP manager
+// applies when assigning resources - there is no way to move a connected interrupt, so this takes effect on the
+// next device start. A zero mask goes back to the machine default policy.
+static NTSTATUS us4oemInterruptStoreAffinityPolicy(WDFDEVICE Device, KAFFINITY Affinity) {
+	DECLARE_CONST_UNICODE_STRING(policyKeyName, L"Interrupt Management\\Affinity Policy");
+	DECLARE_CONST_UNICODE_STRING(devicePolicyName, L"DevicePolicy");
+	DECLARE_CONST_UNICODE_STRING(assignmentSetName, L"AssignmentSetOverride");
+
+	WDFKEY deviceKey;
+	WDFKEY policyKey;
+
+	NTSTATUS status = WdfDeviceOpenRegistryKey(Device, PLUGPLAY_REGKEY_DEVICE, KEY_WRITE, WDF_NO_OBJECT_ATTRIBUTES, &deviceKey);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = WdfRegistryCreateKey(deviceKey, &policyKeyName, KEY_WRITE, REG_OPTION_NON_VOLATILE, NULL,
+		WDF_NO_OBJECT_ATTRIBUTES, &policyKey);
+	WdfRegistryClose(deviceKey);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (Affinity == 0) {
+		status = WdfRegistryAssignULong(policyKey, &devicePolicyName, IrqPolicyMachineDefault);
+		if (NT_SUCCESS(status)) {
+			WdfRegistryRemoveValue(policyKey, &assignmentSetName); // Might not be there, that's fine
+		}
+	}
+	else {
+		status = WdfRegistryAssignValue(policyKey, &assignmentSetName, REG_BINARY, sizeof(Affinity), &Affinity);
+		if (NT_SUCCESS(status)) {
+			status = WdfRegistryAssignULong(policyKey, &devicePolicyName, IrqPolicySpecifiedProcessors);
+		}
+	}
+
+	WdfRegistryClose(policyKey);
+	return status;
+}
+
+NTSTATUS us4oemIoctlSetIrqAffinity(
+	WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+	UNREFERENCED_PARAMETER(BytesReturned);
+	UNREFERENCED_PARAMETER(OutputBufferLength);
+	UNREFERENCED_PARAMETER(InputBufferLength);
+	UNREFERENCED_PARAMETER(OutputBuffer);
+
+	PAGED_CODE();
+
+	us4oem_irq_affinity_argument* arg = (us4oem_irq_affinity_argument*)InputBuffer;
+	PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+	NTSTATUS status = STATUS_SUCCESS;
+
+	if (arg->flags & US4OEM_IRQ_AFFINITY_SET_DPC) {
+		status = us4oemInterruptConfigureDpc(deviceContext, arg->dpc_target_processor, arg->dpc_importance);
+		if (!NT_SUCCESS(status)) {
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL,
+				"Invalid DPC settings (processor %lu, importance %lu)", arg->dpc_target_processor, arg->dpc_importance);
+			return status;
+		}
+	}
+
+	if (arg->flags & US4OEM_IRQ_AFFINITY_SET_INTERRUPT) {
+		status = us4oemInterruptStoreAffinityPolicy(Device, (KAFFINITY)arg->interrupt_affinity);
+		if (!NT_SUCCESS(status)) {
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "Failed to store interrupt affinity policy %!STATUS!", status);
+		}
+	}
+
+	return status;
+}
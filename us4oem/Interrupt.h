@@ -5,10 +5,14 @@
 
 #include "trace.h"
 #include "us4oem.h"
+#include "latency.h"
+#include "ioctl.h"
 
 EXTERN_C_START
 
 EVT_WDF_INTERRUPT_ISR Us4OemInterruptIsr;
-EVT_WDF_INTERRUPT_DPC Us4OemInterruptDpc;
+KDEFERRED_ROUTINE Us4OemInterruptDpc;
+
+NTSTATUS us4oemInterruptInitializeDpc(WDFDEVICE Device);
 
 EXTERN_C_END
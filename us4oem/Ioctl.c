@@ -1,101 +1,309 @@
 #include "ioctl.h"
+#include "latency.h"
 #include "ioctl.tmh"
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, us4oemIoctlGetDriverInfo)
 #pragma alloc_text (PAGE, us4oemIoctlReadStats)
 #pragma alloc_text (PAGE, us4oemIoctlSetStickyMode)
+#pragma alloc_text (PAGE, us4oemIoctlReadLatencyStats)
+#pragma alloc_text (PAGE, us4oemIoctlReadIoctlStats)
+#pragma alloc_text (PAGE, us4oemIoctlReadQueueStats)
+#pragma alloc_text (PAGE, us4oemIoctlGetCapabilities)
+#pragma alloc_text (PAGE, us4oemIoctlReadExtendedStats)
 #endif
 
-IOCTL_HANDLER handlers[] = {
-    {
+// Zero, or a compile error if Condition is false. C_ASSERT is a declaration and can't go inside an initializer,
+// so the table entries fold their checks into the slot index with this instead.
+#define US4OEM_IOCTL_CHECK(Condition) (0 * sizeof(char[(Condition) ? 1 : -1]))
+
+// What every entry must satisfy: it's METHOD_BUFFERED (the handlers and batches work on the system buffer), the
+// buffer sizes fit a request's ULONG lengths, it's handled in one of the queues requests are dispatched from,
+// a pageable handler is only called at PASSIVE_LEVEL, and one run in the caller's context is counted in the default queue.
+#define US4OEM_IOCTL_ENTRY_CHECKS(IoControlCode, InputBufferNeeded, OutputBufferNeeded, Flags, MaxIrql, Queue) ( \
+    US4OEM_IOCTL_CHECK(METHOD_FROM_CTL_CODE(IoControlCode) == METHOD_BUFFERED) + \
+    US4OEM_IOCTL_CHECK((InputBufferNeeded) <= MAXULONG && (OutputBufferNeeded) <= MAXULONG) + \
+    US4OEM_IOCTL_CHECK((Queue) == US4OEM_QUEUE_DEFAULT || (Queue) == US4OEM_QUEUE_FAST || (Queue) == US4OEM_QUEUE_SEQUENTIAL) + \
+    US4OEM_IOCTL_CHECK(!((Flags) & US4OEM_IOCTL_FLAG_PAGED) || (MaxIrql) == PASSIVE_LEVEL) + \
+    US4OEM_IOCTL_CHECK(!((Flags) & US4OEM_IOCTL_FLAG_CALLER_CONTEXT) || (Queue) == US4OEM_QUEUE_DEFAULT))
+
+// An IOCTL whose handler returns a status, see IOCTL_HANDLER_FUNC
+#define US4OEM_IOCTL_ENTRY(IoControlCode, InputBufferNeeded, OutputBufferNeeded, Handler, Flags, MaxIrql, Queue) \
+    [US4OEM_IOCTL_INDEX(IoControlCode) + \
+        US4OEM_IOCTL_ENTRY_CHECKS(IoControlCode, InputBufferNeeded, OutputBufferNeeded, Flags, MaxIrql, Queue)] = \
+    { IoControlCode, InputBufferNeeded, OutputBufferNeeded, Handler, NULL, Flags, MaxIrql, Queue }
+
+// An IOCTL whose handler completes the request itself, see IOCTL_HANDLER_FUNC_ASYNC. These can't be batched.
+#define US4OEM_IOCTL_ASYNC_ENTRY(IoControlCode, InputBufferNeeded, OutputBufferNeeded, Handler, Flags, MaxIrql, Queue) \
+    [US4OEM_IOCTL_INDEX(IoControlCode) + \
+        US4OEM_IOCTL_ENTRY_CHECKS(IoControlCode, InputBufferNeeded, OutputBufferNeeded, Flags, MaxIrql, Queue) + \
+        US4OEM_IOCTL_CHECK(!((Flags) & US4OEM_IOCTL_FLAG_BATCHABLE))] = \
+    { IoControlCode, InputBufferNeeded, OutputBufferNeeded, NULL, Handler, Flags, MaxIrql, Queue }
+
+// Indexed by US4OEM_IOCTL_INDEX, so dispatching is a single bounds-checked lookup.
+// The designated initializers keep every entry in its slot regardless of the order here, an IOCTL outside the
+// table doesn't compile, and each entry is checked by its macro when compiled. Having a synchronous and an
+// asynchronous macro means every entry has exactly one of the two handlers.
+static const IOCTL_HANDLER handlers[US4OEM_IOCTL_COUNT] = {
+    US4OEM_IOCTL_ENTRY(
         US4OEM_WIN32_IOCTL_GET_DRIVER_INFO,
         0, // No input buffer needed
         sizeof(us4oem_driver_info), // Output buffer size
-        us4oemIoctlGetDriverInfo
-    },
-    {
+        us4oemIoctlGetDriverInfo,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_DEFAULT),
+    US4OEM_IOCTL_ENTRY(
         US4OEM_WIN32_IOCTL_MMAP,
-        sizeof(us4oem_mmap_argument), // Input buffer size
+        US4OEM_MMAP_ARGUMENT_MIN_SIZE, // Input buffer size; us4oem_mmap_argument, or its older version without the address
         sizeof(us4oem_mmap_response), // Output buffer size
-        us4oemIoctlMmap
-    },
-    {
+        us4oemIoctlMmap,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE | US4OEM_IOCTL_FLAG_CALLER_CONTEXT, // Maps into the calling process
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_DEFAULT),
+    US4OEM_IOCTL_ENTRY(
         US4OEM_WIN32_IOCTL_READ_STATS,
         0, // No input buffer needed
-        sizeof(us4oem_stats), // Output buffer size
-        us4oemIoctlReadStats
-    },
-    {
+        US4OEM_STATS_MIN_SIZE, // Output buffer size; us4oem_stats, or its older, shorter version
+        us4oemIoctlReadStats,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_FAST),
+    US4OEM_IOCTL_ASYNC_ENTRY(
         US4OEM_WIN32_IOCTL_POLL,
         0, // No input buffer needed
-        0, // No output buffer needed
-        us4oemIoctlPoll
-    },
-    {
+        0, // Output buffer is optional (us4oem_poll_response)
+        us4oemIoctlPoll,
+        US4OEM_IOCTL_FLAG_FAST_PATH,
+        DISPATCH_LEVEL,
+        US4OEM_QUEUE_FAST),
+    US4OEM_IOCTL_ASYNC_ENTRY(
         US4OEM_WIN32_IOCTL_POLL_NONBLOCKING,
         0, // No input buffer needed
-        0, // No output buffer needed
-		us4oemIoctlPollNonBlocking
-    },
-    {
+        0, // Output buffer is optional (us4oem_poll_response)
+        us4oemIoctlPollNonBlocking,
+        US4OEM_IOCTL_FLAG_FAST_PATH,
+        DISPATCH_LEVEL,
+        US4OEM_QUEUE_FAST),
+    US4OEM_IOCTL_ENTRY(
         US4OEM_WIN32_IOCTL_CLEAR_PENDING,
         0, // No input buffer needed
         0, // No output buffer needed
-        us4oemIoctlClearPending
-    },
-    {
+        us4oemIoctlClearPending,
+        US4OEM_IOCTL_FLAG_BATCHABLE,
+        DISPATCH_LEVEL,
+        US4OEM_QUEUE_FAST),
+    US4OEM_IOCTL_ENTRY(
         US4OEM_WIN32_IOCTL_ALLOCATE_DMA_CONTIGIOUS_BUFFER,
-		sizeof(us4oem_dma_allocation_argument), // Input buffer size
-		sizeof(us4oem_dma_contiguous_buffer_response), // Output buffer size
-        us4oemIoctlAllocateDmaContiguousBuffer
-    },
-    {
+        sizeof(us4oem_dma_allocation_argument), // Input buffer size
+        sizeof(us4oem_dma_contiguous_buffer_response), // Output buffer size
+        us4oemIoctlAllocateDmaContiguousBuffer,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_SEQUENTIAL),
+    US4OEM_IOCTL_ENTRY(
         US4OEM_WIN32_IOCTL_DEALLOCATE_DMA_CONTIGIOUS_BUFFER,
-		sizeof(unsigned long long), // Input buffer size - PA of the allocated buffer
-		0, // No output buffer needed
-		us4oemIoctlDeallocateContigousDmaBuffer
-    },
-    {
+        sizeof(unsigned long long), // Input buffer size - PA of the allocated buffer
+        0, // No output buffer needed
+        us4oemIoctlDeallocateContigousDmaBuffer,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_SEQUENTIAL),
+    US4OEM_IOCTL_ENTRY(
         US4OEM_WIN32_IOCTL_ALLOCATE_DMA_SG_BUFFER,
         sizeof(us4oem_dma_allocation_argument), // Input buffer size
-		US4OEM_DMA_SG_RESPONSE_NEEDED_SIZE(1), // The size is checked dynamically, so just make sure we have enough space for the metadata at least
-        NULL, // Dynamic response size
-        us4oemIoctlAllocateDmaScatterGatherBuffer
-    },
-    {
+        US4OEM_DMA_SG_RESPONSE_NEEDED_SIZE(1), // The size is checked dynamically, so just make sure we have enough space for the metadata at least
+        us4oemIoctlAllocateDmaScatterGatherBuffer, // Dynamic response size
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_SEQUENTIAL),
+    US4OEM_IOCTL_ENTRY(
         US4OEM_WIN32_IOCTL_DEALLOCATE_DMA_SG_BUFFER,
         sizeof(void*), // Input buffer size - VA of the allocated buffer
         0, // No output buffer needed
-        us4oemIoctlDeallocateScatterGatherDmaBuffer
-    },
-    {
+        us4oemIoctlDeallocateScatterGatherDmaBuffer,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_SEQUENTIAL),
+    US4OEM_IOCTL_ENTRY(
         US4OEM_WIN32_IOCTL_DEALLOCATE_ALL_DMA_BUFFERS,
         0, // No input buffer needed
         0, // No output buffer needed
-        us4oemIoctlDeallocateAllDmaBuffers
-    },
-    {
+        us4oemIoctlDeallocateAllDmaBuffers,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_SEQUENTIAL),
+    US4OEM_IOCTL_ENTRY(
         US4OEM_WIN32_IOCTL_SET_STICKY_MODE,
-		sizeof(bool), // Bool indicating whether to enable sticky mode
-		0, // No output buffer needed
-		us4oemIoctlSetStickyMode
-    }
+        sizeof(bool), // Bool indicating whether to enable sticky mode
+        0, // No output buffer needed
+        us4oemIoctlSetStickyMode,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_DEFAULT),
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_READ_LATENCY_STATS,
+        0, // No input buffer needed
+        sizeof(us4oem_latency_stats), // Output buffer size
+        us4oemIoctlReadLatencyStats,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_FAST),
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_SET_IRQ_MODERATION,
+        sizeof(us4oem_irq_moderation_argument), // Input buffer size
+        0, // No output buffer needed
+        us4oemIoctlSetIrqModeration,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_FAST),
+    US4OEM_IOCTL_ASYNC_ENTRY(
+        US4OEM_WIN32_IOCTL_POLL_EX,
+        sizeof(us4oem_poll_ex_argument), // Input buffer size
+        sizeof(us4oem_poll_ex_response), // Output buffer size
+        us4oemIoctlPollEx,
+        US4OEM_IOCTL_FLAG_FAST_PATH,
+        DISPATCH_LEVEL,
+        US4OEM_QUEUE_FAST),
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_SET_IRQ_AFFINITY,
+        sizeof(us4oem_irq_affinity_argument), // Input buffer size
+        0, // No output buffer needed
+        us4oemIoctlSetIrqAffinity,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_DEFAULT),
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_READ_IOCTL_STATS,
+        0, // No input buffer needed
+        sizeof(us4oem_ioctl_stats), // Output buffer size
+        us4oemIoctlReadIoctlStats,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_FAST),
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_SUBMIT_BATCH,
+        sizeof(us4oem_batch_header), // Input buffer size, the commands follow the header
+        sizeof(us4oem_batch_header), // Output buffer size, the same buffer is used for the results
+        us4oemIoctlSubmitBatch,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_CALLER_CONTEXT, // Batches don't nest; the queue depends on the commands, see us4oemBatchQueue
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_DEFAULT),
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_READ_QUEUE_STATS,
+        0, // No input buffer needed
+        sizeof(us4oem_queue_stats), // Output buffer size
+        us4oemIoctlReadQueueStats,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_FAST),
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_REGISTER_ACCESS,
+        sizeof(us4oem_reg_access_header), // Input buffer size, the operations follow the header
+        sizeof(us4oem_reg_access_header), // Output buffer size, the same buffer is used for the results
+        us4oemIoctlRegisterAccess,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_DEFAULT), // Register polls may sleep, keep them off the fast queue
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_GET_CAPABILITIES,
+        0, // No input buffer needed
+        US4OEM_CAPABILITIES_MIN_SIZE, // Output buffer size; us4oem_capabilities, or a shorter (older) version of it
+        us4oemIoctlGetCapabilities,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_DEFAULT),
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_READ_EVENTS,
+        sizeof(us4oem_event_read_argument), // Input buffer size
+        sizeof(us4oem_event_ring), // Output buffer size
+        us4oemIoctlReadEvents,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_FAST), // Diagnostics, so it shouldn't wait behind an allocation
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_SET_EVENT_MASK,
+        sizeof(unsigned long), // Input buffer size
+        0, // No output buffer needed
+        us4oemIoctlSetEventMask,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_FAST),
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_SET_TEARDOWN_OPTIONS,
+        sizeof(us4oem_teardown_options), // Input buffer size
+        0, // No output buffer needed
+        us4oemIoctlSetTeardownOptions,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_DEFAULT),
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_READ_EXTENDED_STATS,
+        0, // No input buffer needed
+        US4OEM_EXTENDED_STATS_MIN_SIZE, // Output buffer size; us4oem_extended_stats, or a shorter (older) version of it
+        us4oemIoctlReadExtendedStats,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_FAST),
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_RELEASE_HANDLE,
+        sizeof(us4oem_handle), // Input buffer size
+        0, // No output buffer needed
+        us4oemIoctlReleaseHandle,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE | US4OEM_IOCTL_FLAG_CALLER_CONTEXT, // Unmaps from the calling process
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_DEFAULT),
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_SET_LEASE,
+        sizeof(us4oem_lease_argument), // Input buffer size
+        0, // No output buffer needed
+        us4oemIoctlSetLease,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_DEFAULT),
+    US4OEM_IOCTL_ENTRY(
+        US4OEM_WIN32_IOCTL_ATTACH_LEASE,
+        sizeof(unsigned long long), // Input buffer size
+        0, // No output buffer needed
+        us4oemIoctlAttachLease,
+        US4OEM_IOCTL_FLAG_PAGED | US4OEM_IOCTL_FLAG_BATCHABLE,
+        PASSIVE_LEVEL,
+        US4OEM_QUEUE_SEQUENTIAL), // Ordered with the allocations that follow it
 };
 
-PIOCTL_HANDLER us4oemGetIoctlHandler() {
-	return handlers;
+// Every IOCTL needs a statistics slot, see us4oem_ioctl_stats
+C_ASSERT(US4OEM_IOCTL_COUNT <= US4OEM_IOCTL_STATS_SLOTS);
+
+const IOCTL_HANDLER* us4oemIoctlLookup(ULONG IoControlCode) {
+    ULONG index = US4OEM_IOCTL_INDEX(IoControlCode);
+
+    // Function codes below the base wrap around to large indices, so this covers both ends.
+    // The full code comparison rejects empty slots and a wrong device type, method or access.
+    if (index >= US4OEM_IOCTL_COUNT || handlers[index].IoControlCode != IoControlCode) {
+        return NULL;
+    }
+    return &handlers[index];
 }
 
-ULONG us4oemGetIoctlHandlerCount() {
-	return sizeof(handlers) / sizeof(IOCTL_HANDLER);
+VOID us4oemIoctlRecordCall(PUS4OEM_CONTEXT DeviceContext, ULONG IoControlCode, LONGLONG Start) {
+    PUS4OEM_IOCTL_COUNTERS counters = &DeviceContext->IoctlCounters[US4OEM_IOCTL_INDEX(IoControlCode)];
+    LONG64 ticks = us4oemLatencyTimestamp() - Start;
+
+    InterlockedIncrement64(&counters->Calls);
+    InterlockedAdd64(&counters->Ticks, ticks);
+    us4oemCounterRaiseMax(&counters->MaxTicks, ticks);
+
+    // Whatever the handler changed shows up in the shared statistics page shortly, see us4oemStatsMarkDirty
+    us4oemStatsMarkDirty(DeviceContext);
 }
 
-VOID us4oemIoctlSetStickyMode(
-    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer
+NTSTATUS us4oemIoctlSetStickyMode(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
 ) {
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(BytesReturned);
     UNREFERENCED_PARAMETER(OutputBuffer);
-    UNREFERENCED_PARAMETER(Device);
 
     PAGED_CODE();
 
@@ -104,12 +312,14 @@ VOID us4oemIoctlSetStickyMode(
     PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
     deviceContext->StickyMode = stickyMode;
 
-    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, 0);
+    return STATUS_SUCCESS;
 }
 
-VOID us4oemIoctlGetDriverInfo(
-    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer
+NTSTATUS us4oemIoctlGetDriverInfo(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
 ) {
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
 	UNREFERENCED_PARAMETER(InputBuffer);
 	UNREFERENCED_PARAMETER(Device);
 
@@ -121,19 +331,210 @@ VOID us4oemIoctlGetDriverInfo(
 
 	RtlCopyBytes(driverInfo->name, US4OEM_DRIVER_INFO_STRING, sizeof(US4OEM_DRIVER_INFO_STRING));
 
-    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(us4oem_driver_info));
+    *BytesReturned = sizeof(us4oem_driver_info);
+    return STATUS_SUCCESS;
 }
 
-VOID us4oemIoctlReadStats(
-    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer
+NTSTATUS us4oemIoctlGetCapabilities(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
 ) {
+    UNREFERENCED_PARAMETER(InputBufferLength);
     UNREFERENCED_PARAMETER(InputBuffer);
 
     PAGED_CODE();
 
     PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    us4oem_capabilities capabilities;
+    USHORT numaNode;
+
+    RtlZeroMemory(&capabilities, sizeof(capabilities));
+    capabilities.version = US4OEM_CAPABILITIES_VERSION;
+    capabilities.driver_version = US4OEM_DRIVER_VERSION;
+    capabilities.features = US4OEM_CAPABILITY_POLL_EX |
+        US4OEM_CAPABILITY_IRQ_MODERATION |
+        US4OEM_CAPABILITY_IRQ_AFFINITY |
+        US4OEM_CAPABILITY_LATENCY_STATS |
+        US4OEM_CAPABILITY_IOCTL_STATS |
+        US4OEM_CAPABILITY_QUEUE_STATS |
+        US4OEM_CAPABILITY_BATCH |
+        US4OEM_CAPABILITY_REGISTER_ACCESS |
+        US4OEM_CAPABILITY_EVENT_RING |
+        US4OEM_CAPABILITY_TEARDOWN |
+        US4OEM_CAPABILITY_SHARED_STATS |
+        US4OEM_CAPABILITY_EXTENDED_STATS |
+        US4OEM_CAPABILITY_HANDLES |
+        US4OEM_CAPABILITY_MMAP_AT_ADDRESS |
+        US4OEM_CAPABILITY_LEASE;
+
+    capabilities.max_dma_contig_size = MAXULONG; // Only limited by the width of us4oem_dma_allocation_argument.length
+    capabilities.max_dma_sg_size = US4OEM_DMA_SG_MAX_SIZE;
+    capabilities.max_sg_chunks = (ULONG)min(WdfDmaEnablerGetMaximumScatterGatherElements(deviceContext->DmaEnabler), MAXULONG);
+    capabilities.page_size = PAGE_SIZE;
+    capabilities.large_page_size = 0; // DMA buffers are always allocated in small pages
+    capabilities.max_batch_commands = US4OEM_BATCH_MAX_COMMANDS;
+    capabilities.max_reg_ops = US4OEM_REG_MAX_OPS;
+
+    capabilities.numa_node = US4OEM_NUMA_NODE_UNKNOWN;
+    if (NT_SUCCESS(IoGetDeviceNumaNode(WdfDeviceWdmGetPhysicalDevice(Device), &numaNode))) {
+        capabilities.numa_node = numaNode;
+        capabilities.features |= US4OEM_CAPABILITY_NUMA_NODE;
+    }
+
+    us4oemInterruptFillCapabilities(deviceContext, &capabilities);
+
+    // Callers built against older headers get the part they know about
+    capabilities.size = (unsigned long)min(OutputBufferLength, sizeof(us4oem_capabilities));
+    RtlCopyMemory(OutputBuffer, &capabilities, capabilities.size);
+
+    *BytesReturned = capabilities.size;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS us4oemIoctlReadStats(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(InputBuffer);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    us4oem_stats* stats = (us4oem_stats*)OutputBuffer;
 
     // Copy the stats to the output buffer
-    RtlCopyMemory(OutputBuffer, &deviceContext->Stats, sizeof(us4oem_stats));
-    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(us4oem_stats));
-}
\ No newline at end of file
+    us4oemStatsSnapshot(deviceContext, stats);
+
+    // Callers built against older headers don't have room for the affinity and/or teardown fields
+    if (OutputBufferLength < US4OEM_STATS_AFFINITY_SIZE) {
+        *BytesReturned = US4OEM_STATS_MIN_SIZE;
+        return STATUS_SUCCESS;
+    }
+
+    us4oemInterruptFillAffinityStats(deviceContext, stats);
+    if (OutputBufferLength < sizeof(us4oem_stats)) {
+        *BytesReturned = US4OEM_STATS_AFFINITY_SIZE;
+        return STATUS_SUCCESS;
+    }
+
+    us4oemStatsSnapshotTeardown(deviceContext, stats);
+    *BytesReturned = sizeof(us4oem_stats);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS us4oemIoctlReadLatencyStats(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(InputBuffer);
+
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+
+    // Histograms are updated lock-free, so the copy might be off by a sample or two between fields
+    RtlCopyMemory(OutputBuffer, &deviceContext->Latency, sizeof(us4oem_latency_stats));
+    *BytesReturned = sizeof(us4oem_latency_stats);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS us4oemIoctlReadIoctlStats(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(InputBuffer);
+
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    us4oem_ioctl_stats* stats = (us4oem_ioctl_stats*)OutputBuffer;
+    ULONG64 frequency = (ULONG64)deviceContext->QpcFrequency.QuadPart;
+
+    RtlZeroMemory(stats, sizeof(us4oem_ioctl_stats));
+
+    // Like the other counters, each field is read atomically but the snapshot as a whole is not
+    for (ULONG i = 0; i < US4OEM_IOCTL_COUNT; i++) {
+        PUS4OEM_IOCTL_COUNTERS counters = &deviceContext->IoctlCounters[i];
+
+        stats->ioctls[i].calls = (unsigned long long)counters->Calls;
+        stats->ioctls[i].total_ns = us4oemLatencyTicksToNs((ULONG64)counters->Ticks, frequency);
+        stats->ioctls[i].max_ns = us4oemLatencyTicksToNs((ULONG64)counters->MaxTicks, frequency);
+    }
+    stats->rejected = (unsigned long long)US4OEM_COUNTER_READ(deviceContext, IoctlRejectedCount);
+
+    *BytesReturned = sizeof(us4oem_ioctl_stats);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS us4oemIoctlReadQueueStats(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(InputBuffer);
+
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    us4oem_queue_stats* stats = (us4oem_queue_stats*)OutputBuffer;
+    ULONG64 frequency = (ULONG64)deviceContext->QpcFrequency.QuadPart;
+
+    for (ULONG i = 0; i < US4OEM_QUEUE_COUNT; i++) {
+        PUS4OEM_QUEUE_COUNTERS counters = &deviceContext->QueueCounters[i];
+
+        stats->queues[i].requests = (unsigned long long)counters->Requests;
+        stats->queues[i].depth = (unsigned long long)max(counters->Depth, 0);
+        stats->queues[i].max_depth = (unsigned long long)counters->MaxDepth;
+        stats->queues[i].total_wait_ns = us4oemLatencyTicksToNs((ULONG64)counters->WaitTicks, frequency);
+        stats->queues[i].max_wait_ns = us4oemLatencyTicksToNs((ULONG64)counters->MaxWaitTicks, frequency);
+    }
+
+    *BytesReturned = sizeof(us4oem_queue_stats);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS us4oemIoctlReadExtendedStats(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(InputBuffer);
+
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    us4oem_extended_stats stats;
+
+    RtlZeroMemory(&stats, sizeof(stats));
+    stats.version = US4OEM_EXTENDED_STATS_VERSION;
+    stats.timestamp = us4oemLatencyTimestamp();
+    stats.qpc_frequency = deviceContext->QpcFrequency.QuadPart;
+
+    stats.irq_count = (unsigned long long)US4OEM_COUNTER_READ(deviceContext, IrqCount);
+    stats.irq_interval_ewma_ticks = US4OEM_COUNTER_READ(deviceContext, IrqIntervalEwma);
+    stats.last_irq_timestamp = deviceContext->LastDpcTimestamp;
+
+    stats.dma_contig_bytes = (unsigned long long)max(US4OEM_COUNTER_READ(deviceContext, DmaContigBytes), 0);
+    stats.dma_contig_max_bytes = (unsigned long long)US4OEM_COUNTER_READ(deviceContext, DmaContigMaxBytes);
+    stats.dma_sg_bytes = (unsigned long long)max(US4OEM_COUNTER_READ(deviceContext, DmaSgBytes), 0);
+    stats.dma_sg_chunks = (unsigned long long)max(US4OEM_COUNTER_READ(deviceContext, DmaSgChunks), 0);
+    stats.dma_sg_max_chunks = (unsigned long long)US4OEM_COUNTER_READ(deviceContext, DmaSgMaxChunks);
+    stats.bytes_pinned = stats.dma_contig_bytes + stats.dma_sg_bytes;
+
+    stats.bytes_mapped = (unsigned long long)US4OEM_COUNTER_READ(deviceContext, MappedBytes);
+    stats.map_count = (unsigned long long)US4OEM_COUNTER_READ(deviceContext, MapCount);
+
+    stats.polls_in_flight = (unsigned long long)max(US4OEM_COUNTER_READ(deviceContext, PollsInFlight), 0);
+    stats.polls_in_flight_max = (unsigned long long)US4OEM_COUNTER_READ(deviceContext, PollsInFlightMax);
+
+    for (ULONG i = 0; i < US4OEM_IOCTL_COUNT; i++) {
+        stats.ioctl_calls[i] = (unsigned long long)deviceContext->IoctlCounters[i].Calls;
+    }
+
+    // Callers built against older headers get the part they know about
+    stats.size = (unsigned long)min(OutputBufferLength, sizeof(us4oem_extended_stats));
+    RtlCopyMemory(OutputBuffer, &stats, stats.size);
+
+    *BytesReturned = stats.size;
+    return STATUS_SUCCESS;
+}
@@ -7,47 +7,128 @@
 #include <stdbool.h>
 
 #include "us4oem.h"
+#include "stats.h"
 #include "queue.h"
 #include "trace.h"
+#include "events.h"
+#include "teardown.h"
+#include "handle.h"
+#include "lease.h"
 
 EXTERN_C_START
 
-// IOCTL handler function prototype
-typedef VOID(IOCTL_HANDLER_FUNC)(WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer);
+// IOCTL handler function prototype. Handlers only work on the buffers and return a status, the caller then completes
+// the request with *BytesReturned bytes of output. Not being tied to a request is what lets them run as part of
+// a batch (see Batch.c), so use this unless the handler really has to hold on to the request.
+typedef NTSTATUS(IOCTL_HANDLER_FUNC)(WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned);
 
-// IOCTL handler function prototype with buffer sizes for dynamic response sizes; preferred over IOCTL_HANDLER_FUNC
-typedef VOID(IOCTL_HANDLER_FUNC_WITH_BUFFER_SIZES)(WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength);
+// IOCTL handler function prototype for IOCTLs that might have to wait (polls): the handler owns the request
+// and completes it itself, possibly later from another context.
+typedef VOID(IOCTL_HANDLER_FUNC_ASYNC)(WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength);
+
+// Position of an IOCTL in the dispatch table (and in us4oem_ioctl_stats): its function code relative to the base.
+#define US4OEM_IOCTL_INDEX(IoControlCode) ((((ULONG)(IoControlCode) >> 2) & 0xFFF) - US4OEM_WIN32_IOCTL_BASE)
+
+// Size of the dispatch table; keep this pointing at the IOCTL with the highest function code
+#define US4OEM_IOCTL_COUNT (US4OEM_IOCTL_INDEX(US4OEM_WIN32_IOCTL_ATTACH_LEASE) + 1)
+
+#define US4OEM_IOCTL_FLAG_PAGED 0x1 // Handler is pageable, MaxIrql must be PASSIVE_LEVEL
+#define US4OEM_IOCTL_FLAG_FAST_PATH 0x2 // Hot path (polls), skip the per-request tracing even where TraceHotPath is compiled in
+#define US4OEM_IOCTL_FLAG_BATCHABLE 0x4 // Can be submitted as part of US4OEM_WIN32_IOCTL_SUBMIT_BATCH; needs HandlerFunc
+#define US4OEM_IOCTL_FLAG_CALLER_CONTEXT 0x8 // Handled in the thread that sent it, see us4oemEvtIoInCallerContext; Queue must be US4OEM_QUEUE_DEFAULT
 
 // Struct for IOCTL handling
 typedef struct _IOCTL_HANDLER {
-	ULONG IoControlCode;
+	ULONG IoControlCode; // 0 for unused slots
 	size_t InputBufferNeeded;
 	size_t OutputBufferNeeded;
 	IOCTL_HANDLER_FUNC* HandlerFunc; // Function to handle the IOCTL
-	IOCTL_HANDLER_FUNC_WITH_BUFFER_SIZES* HandlerFuncWithBufferSizes; // Function to handle the IOCTL with buffer sizes
+	IOCTL_HANDLER_FUNC_ASYNC* AsyncHandlerFunc; // ...or, for IOCTLs that keep the request, this one
+	ULONG Flags; // US4OEM_IOCTL_FLAG_*
+	KIRQL MaxIrql; // Highest IRQL the handler can be called at
+	us4oem_queue Queue; // Queue the IOCTL is handled in, see us4oemQueueInitialize; never US4OEM_QUEUE_PARKED
 } IOCTL_HANDLER, *PIOCTL_HANDLER;
 
+// Attached to POLL_EX requests only, legacy poll requests have no context at all
+typedef struct _US4OEM_POLL_REQUEST_CONTEXT {
+	LONG64 MaxEvents; // Consume at most this many IRQs, 0 for all pending
+	LONGLONG Deadline; // QPC at which the request times out, 0 to wait forever
+} US4OEM_POLL_REQUEST_CONTEXT, *PUS4OEM_POLL_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(US4OEM_POLL_REQUEST_CONTEXT, us4oemGetPollRequestContext)
+
 // Defined in Ioctl.c
 IOCTL_HANDLER_FUNC us4oemIoctlGetDriverInfo;
 IOCTL_HANDLER_FUNC us4oemIoctlReadStats;
 IOCTL_HANDLER_FUNC us4oemIoctlSetStickyMode;
+IOCTL_HANDLER_FUNC us4oemIoctlReadLatencyStats;
+IOCTL_HANDLER_FUNC us4oemIoctlReadIoctlStats;
+IOCTL_HANDLER_FUNC us4oemIoctlReadQueueStats;
+IOCTL_HANDLER_FUNC us4oemIoctlGetCapabilities;
+IOCTL_HANDLER_FUNC us4oemIoctlReadExtendedStats;
 
 // Defined in Mem.c
 IOCTL_HANDLER_FUNC us4oemIoctlMmap;
+NTSTATUS us4oemMemUnmap(PUS4OEM_CONTEXT DeviceContext, us4oem_handle Handle);
+
+// Closes the handles of a DMA buffer's mappings and unmaps them, from whichever process they're in.
+// Must be done before the buffer is freed. Called with DmaLock held.
+VOID us4oemMemReleaseBufferMappings(PUS4OEM_CONTEXT DeviceContext, PLIST_ENTRY Mappings);
+
+// Same for every mapping of a process that no longer has a handle to the device open. Called with DmaLock held.
+VOID us4oemMemReleaseOrphanedMappings(PUS4OEM_CONTEXT DeviceContext);
 
 // Defined in Sync.c
-IOCTL_HANDLER_FUNC us4oemIoctlPoll;
-IOCTL_HANDLER_FUNC us4oemIoctlPollNonBlocking;
+IOCTL_HANDLER_FUNC_ASYNC us4oemIoctlPoll;
+IOCTL_HANDLER_FUNC_ASYNC us4oemIoctlPollNonBlocking;
+IOCTL_HANDLER_FUNC_ASYNC us4oemIoctlPollEx;
 IOCTL_HANDLER_FUNC us4oemIoctlClearPending;
+IOCTL_HANDLER_FUNC us4oemIoctlSetIrqModeration;
+EVT_WDF_TIMER us4oemEvtModerationTimer;
+EVT_WDF_TIMER us4oemEvtPollTimeoutTimer;
+VOID us4oemCompletePollRequest(PUS4OEM_CONTEXT DeviceContext, WDFREQUEST Request, LONG64 IrqsConsumed);
+VOID us4oemServicePendingRequest(PUS4OEM_CONTEXT DeviceContext);
+VOID us4oemPollRequestComplete(PUS4OEM_CONTEXT DeviceContext, WDFREQUEST Request, NTSTATUS Status, ULONG_PTR Information);
+
+// Defined in Interrupt.c
+IOCTL_HANDLER_FUNC us4oemIoctlSetIrqAffinity;
+VOID us4oemInterruptFillAffinityStats(PUS4OEM_CONTEXT DeviceContext, us4oem_stats* Stats);
+VOID us4oemInterruptFillCapabilities(PUS4OEM_CONTEXT DeviceContext, us4oem_capabilities* Capabilities);
 
 // Defined in Dma.c
 IOCTL_HANDLER_FUNC us4oemIoctlAllocateDmaContiguousBuffer;
 IOCTL_HANDLER_FUNC us4oemIoctlDeallocateContigousDmaBuffer;
 IOCTL_HANDLER_FUNC us4oemIoctlDeallocateAllDmaBuffers;
-IOCTL_HANDLER_FUNC_WITH_BUFFER_SIZES us4oemIoctlAllocateDmaScatterGatherBuffer;
+IOCTL_HANDLER_FUNC us4oemIoctlAllocateDmaScatterGatherBuffer;
 IOCTL_HANDLER_FUNC us4oemIoctlDeallocateScatterGatherDmaBuffer;
+NTSTATUS us4oemDmaFreeContiguous(PUS4OEM_CONTEXT DeviceContext, us4oem_handle Handle);
+NTSTATUS us4oemDmaFreeScatterGather(PUS4OEM_CONTEXT DeviceContext, us4oem_handle Handle);
+
+// Defined in Batch.c
+IOCTL_HANDLER_FUNC us4oemIoctlSubmitBatch;
+us4oem_queue us4oemBatchQueue(WDFREQUEST Request, BOOLEAN* CallerContext);
+
+// Defined in Reg.c
+IOCTL_HANDLER_FUNC us4oemIoctlRegisterAccess;
+
+// Defined in Events.c
+IOCTL_HANDLER_FUNC us4oemIoctlReadEvents;
+IOCTL_HANDLER_FUNC us4oemIoctlSetEventMask;
+
+// Defined in Teardown.c
+IOCTL_HANDLER_FUNC us4oemIoctlSetTeardownOptions;
+
+// Defined in Handle.c
+IOCTL_HANDLER_FUNC us4oemIoctlReleaseHandle;
+
+// Defined in Lease.c
+IOCTL_HANDLER_FUNC us4oemIoctlSetLease;
+IOCTL_HANDLER_FUNC us4oemIoctlAttachLease;
+
+// Returns the dispatch table entry for the IOCTL, or NULL if it's not supported. Constant time.
+const IOCTL_HANDLER* us4oemIoctlLookup(ULONG IoControlCode);
 
-PIOCTL_HANDLER us4oemGetIoctlHandler();
-ULONG us4oemGetIoctlHandlerCount();
+// Counts a call of the IOCTL and the time its handler took since Start (QPC)
+VOID us4oemIoctlRecordCall(PUS4OEM_CONTEXT DeviceContext, ULONG IoControlCode, LONGLONG Start);
 
 EXTERN_C_END
\ No newline at end of file
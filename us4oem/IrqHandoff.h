@@ -0,0 +1,118 @@
+#pragma once
+
+/*
+
+This header holds the lock-free part of handing IRQs from the DPC to poll requests. Two values are shared between
+the DPC, the poll handlers, IOCTL_CLEAR_PENDING and the poll timers, which all run in parallel:
+- The pending IRQ count. The DPC raises it, polls take IRQs from it with a compare-exchange, so it never goes below
+  zero and no two polls can take the same IRQ, and IOCTL_CLEAR_PENDING drops it to zero.
+- The waiter flag. It's set while a poll request is parked waiting for IRQs (or is being taken out of the parked
+  queue), and only one request can hold it at a time.
+
+us4oemIrqHandoffService hands pending IRQs to the parked request. It runs after each half of the handoff - the DPC
+after counting an IRQ, a poll after parking - so whichever comes second sees both, and an IRQ that arrives while a
+poll is on its way to park is never left waiting for the next one.
+
+The code is plain C: the interlocked operations below default to the kernel's, and the parked queue is reached
+through US4OEM_IRQ_HANDOFF_OPS, so the same handoff runs in the driver (see Sync.c) and in the user mode stress
+test (tests/irqhandoff.cpp).
+
+*/
+
+// Interlocked operations can be overriden by defining the macros below. All of them are full barriers.
+#ifndef __IRQ_HANDOFF_ATOMICS
+#define __IRQ_HANDOFF_READ64(target) (*(target))
+#define __IRQ_HANDOFF_INCREMENT64(target) InterlockedIncrement64(target)
+#define __IRQ_HANDOFF_EXCHANGE64(target, value) InterlockedExchange64((target), (value))
+#define __IRQ_HANDOFF_COMPARE_EXCHANGE64(target, value, comparand) InterlockedCompareExchange64((target), (value), (comparand))
+#define __IRQ_HANDOFF_READ(target) (*(target))
+#define __IRQ_HANDOFF_EXCHANGE(target, value) InterlockedExchange((target), (value))
+#define __IRQ_HANDOFF_COMPARE_EXCHANGE(target, value, comparand) InterlockedCompareExchange((target), (value), (comparand))
+#define __IRQ_HANDOFF_ATOMICS
+#endif
+
+// Counts an IRQ, returns the number pending including it.
+static __inline long long us4oemIrqPendingRaise(volatile long long* Pending) {
+    return __IRQ_HANDOFF_INCREMENT64(Pending);
+}
+
+// Takes up to Max pending IRQs (all of them if Max is 0), returns how many were taken.
+static __inline long long us4oemIrqPendingTake(volatile long long* Pending, long long Max) {
+    long long current = __IRQ_HANDOFF_READ64(Pending);
+
+    while (current > 0) {
+        long long taken = (Max == 0 || current < Max) ? current : Max;
+        long long previous = __IRQ_HANDOFF_COMPARE_EXCHANGE64(Pending, current - taken, current);
+        if (previous == current) {
+            return taken;
+        }
+        current = previous;
+    }
+
+    return 0;
+}
+
+// Drops every pending IRQ, returns how many there were.
+static __inline long long us4oemIrqPendingClear(volatile long long* Pending) {
+    return __IRQ_HANDOFF_EXCHANGE64(Pending, 0);
+}
+
+// Sets the waiter flag for a poll about to park. Returns 0 if another poll holds it.
+static __inline int us4oemIrqWaiterClaim(volatile long* Waiting) {
+    return __IRQ_HANDOFF_COMPARE_EXCHANGE(Waiting, 1, 0) == 0;
+}
+
+// Clears the waiter flag once its request left the parked queue for good, so the next poll can park.
+static __inline void us4oemIrqWaiterRelease(volatile long* Waiting) {
+    __IRQ_HANDOFF_EXCHANGE(Waiting, 0);
+}
+
+static __inline int us4oemIrqWaiterPresent(volatile long* Waiting) {
+    return __IRQ_HANDOFF_READ(Waiting) != 0;
+}
+
+// The parked queue, as us4oemIrqHandoffService sees it. Context is passed through, Request is whatever the queue
+// holds (a WDFREQUEST in the driver).
+typedef struct _US4OEM_IRQ_HANDOFF_OPS {
+    // Whether the pending IRQs should be handed to a waiter now, e.g. interrupt moderation may hold them back.
+    // Must be false while none are pending, as that's what ends the loop after a request was put back.
+    int (*Ready)(void* Context);
+
+    // Takes the parked request out of the queue, NULL if there is none or another CPU has it. The waiter flag stays
+    // set until the request is completed, so no other poll can park meanwhile.
+    void* (*TakeWaiter)(void* Context);
+
+    // Takes pending IRQs for the request (us4oemIrqPendingTake), returns how many
+    long long (*Consume)(void* Context, void* Request);
+
+    // Completes the request with the IRQs it took and releases the waiter flag
+    void (*Complete)(void* Context, void* Request, long long Consumed);
+
+    // Puts the request back into the queue. Returns 0 if it couldn't be, and was completed instead.
+    int (*Requeue)(void* Context, void* Request);
+} US4OEM_IRQ_HANDOFF_OPS;
+
+// Hands pending IRQs to the parked request, if there are both. Returns nonzero if it stopped because the pending
+// IRQs aren't ready for the waiter yet (see Ready), zero if the waiter got them or there was nobody to take it.
+static __inline int us4oemIrqHandoffService(const US4OEM_IRQ_HANDOFF_OPS* Ops, void* Context) {
+    while (Ops->Ready(Context)) {
+        void* request = Ops->TakeWaiter(Context);
+        if (request == NULL) {
+            return 0; // Nobody is waiting, or another CPU already took the request
+        }
+
+        long long consumed = Ops->Consume(Context, request);
+        if (consumed > 0) {
+            Ops->Complete(Context, request, consumed);
+            return 0;
+        }
+
+        // Someone else took the IRQs between our check and now (e.g. a non-blocking poll), so put the request
+        // back and check again, as another IRQ could have been counted while it was out of the queue.
+        if (!Ops->Requeue(Context, request)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
@@ -0,0 +1,30 @@
+#include "latency.h"
+#include "stats.h"
+#include "latency.tmh"
+
+VOID us4oemLatencyRecord(
+	_In_ PUS4OEM_CONTEXT DeviceContext,
+	_Inout_ us4oem_latency_histogram* Histogram,
+	_In_ LONGLONG Since,
+	_In_ LONGLONG Now
+) {
+	if (Since == 0 || Now < Since || DeviceContext->QpcFrequency.QuadPart <= 0) {
+		return;
+	}
+
+	ULONG64 ns = us4oemLatencyTicksToNs((ULONG64)(Now - Since), (ULONG64)DeviceContext->QpcFrequency.QuadPart);
+
+	ULONG bucket = 0;
+	if (ns != 0) {
+		_BitScanReverse64(&bucket, ns);
+	}
+	if (bucket >= US4OEM_LATENCY_HISTOGRAM_BUCKETS) {
+		bucket = US4OEM_LATENCY_HISTOGRAM_BUCKETS - 1;
+	}
+
+	InterlockedIncrement64((volatile LONG64*)&Histogram->buckets[bucket]);
+	InterlockedIncrement64((volatile LONG64*)&Histogram->sample_count);
+	InterlockedAdd64((volatile LONG64*)&Histogram->total_ns, (LONG64)ns);
+
+	us4oemCounterRaiseMax((volatile LONG64*)&Histogram->max_ns, (LONG64)ns);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <ntddk.h>
+#include <wdf.h>
+
+#include "us4oem.h"
+
+EXTERN_C_START
+
+// Returns the current QPC value; safe to call at any IRQL, including from the ISR.
+FORCEINLINE LONGLONG us4oemLatencyTimestamp() {
+	return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+// Converts QPC ticks to nanoseconds without overflowing for long intervals.
+FORCEINLINE ULONG64 us4oemLatencyTicksToNs(ULONG64 Ticks, ULONG64 Frequency) {
+	if (Frequency == 0) {
+		return 0;
+	}
+	return (Ticks / Frequency) * 1000000000ULL + ((Ticks % Frequency) * 1000000000ULL) / Frequency;
+}
+
+// Records a (Now - Since) sample into the histogram; no-op if Since was never recorded.
+// Lock-free, can be called concurrently from the DPC and IOCTL handlers.
+VOID us4oemLatencyRecord(
+	_In_ PUS4OEM_CONTEXT DeviceContext,
+	_Inout_ us4oem_latency_histogram* Histogram,
+	_In_ LONGLONG Since,
+	_In_ LONGLONG Now
+);
+
+EXTERN_C_END
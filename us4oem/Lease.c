@@ -0,0 +1,181 @@
+#include "ioctl.h"
+#include "lease.tmh"
+
+static EVT_WDF_TIMER us4oemEvtLeaseTimer;
+
+// The timer callback runs at PASSIVE_LEVEL in a system thread, so everything here is pageable
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, us4oemEvtLeaseTimer)
+#pragma alloc_text (PAGE, us4oemLeaseInitialize)
+#pragma alloc_text (PAGE, us4oemLeaseStart)
+#pragma alloc_text (PAGE, us4oemLeaseStop)
+#pragma alloc_text (PAGE, us4oemIoctlSetLease)
+#pragma alloc_text (PAGE, us4oemIoctlAttachLease)
+#endif
+
+NTSTATUS us4oemLeaseInitialize(WDFDEVICE Device) {
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    WDF_TIMER_CONFIG timerConfig;
+    WDF_OBJECT_ATTRIBUTES timerAttributes;
+
+    // The teardown has to run at PASSIVE_LEVEL; nothing else uses the timer, so no serialization
+    WDF_TIMER_CONFIG_INIT(&timerConfig, us4oemEvtLeaseTimer);
+    timerConfig.AutomaticSerialization = FALSE;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
+    timerAttributes.ParentObject = Device;
+    timerAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+    NTSTATUS status = WdfTimerCreate(&timerConfig, &timerAttributes, &deviceContext->LeaseTimer);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "WdfTimerCreate failed for the lease timer %!STATUS!", status);
+    }
+    return status;
+}
+
+// Stamps the buffers kept by lease From with lease To (0 to take them off a lease). Called with DmaLock held.
+static VOID us4oemLeaseStamp(PUS4OEM_CONTEXT DeviceContext, ULONG From, ULONG To) {
+    LINKED_LIST_FOR_EACH(WDFCOMMONBUFFER, DeviceContext->DmaContiguousBuffers, entry) {
+        PUS4OEM_COMMON_BUFFER_CONTEXT context = us4oemGetCommonBufferContext(*entry->Item);
+        if (context->Lease == From) {
+            context->Lease = To;
+        }
+    }
+    LINKED_LIST_FOR_EACH(MEMORY_ALLOCATION, DeviceContext->DmaScatterGatherMemory, entry) {
+        if (entry->Item->lease == From) {
+            entry->Item->lease = To;
+        }
+    }
+}
+
+static VOID us4oemEvtLeaseTimer(WDFTIMER Timer) {
+    PAGED_CODE();
+
+    WDFDEVICE device = (WDFDEVICE)WdfTimerGetParentObject(Timer);
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(device);
+
+    // Lost to an attach that came in just before. The id is taken under the lock, so a lease started right
+    // after this one ends (with a new id) keeps its buffers.
+    WdfWaitLockAcquire(deviceContext->DmaLock, NULL);
+    BOOLEAN expired = InterlockedExchange(&deviceContext->LeaseRunning, 0) != 0;
+    ULONG lease = deviceContext->LeaseId;
+    WdfWaitLockRelease(deviceContext->DmaLock);
+
+    if (!expired) {
+        return;
+    }
+
+    // Only what the lease kept; buffers allocated since are someone else's
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "Lease %lu ran out, releasing its DMA buffers", lease);
+    us4oemDmaTeardown(device, lease, FALSE);
+}
+
+BOOLEAN us4oemLeaseStart(WDFDEVICE Device) {
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    ULONG duration = deviceContext->LeaseDurationMs;
+
+    if (deviceContext->LeaseTimer == NULL || deviceContext->LeaseToken == 0 || duration == 0) {
+        return FALSE;
+    }
+
+    WdfWaitLockAcquire(deviceContext->DmaLock, NULL);
+
+    // One lease at a time: the buffers of a running one belong to a client that hasn't come back yet,
+    // the ones of this client go right away
+    if (InterlockedCompareExchange(&deviceContext->LeaseRunning, 0, 0) != 0) {
+        WdfWaitLockRelease(deviceContext->DmaLock);
+        return FALSE;
+    }
+
+    // The lease keeps what the device has now, ids skip the values us4oemDmaTeardown gives a meaning of their own
+    ULONG lease = deviceContext->LeaseId + 1;
+    if (lease == US4OEM_TEARDOWN_UNLEASED || lease == US4OEM_TEARDOWN_ALL) {
+        lease = 1;
+    }
+    deviceContext->LeaseId = lease;
+    us4oemLeaseStamp(deviceContext, US4OEM_TEARDOWN_UNLEASED, lease);
+
+    InterlockedExchange(&deviceContext->LeaseRunning, 1);
+    WdfTimerStart(deviceContext->LeaseTimer, WDF_REL_TIMEOUT_IN_MS(duration));
+
+    WdfWaitLockRelease(deviceContext->DmaLock);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "Keeping the DMA buffers for %lu ms (lease %lu)", duration, lease);
+    return TRUE;
+}
+
+VOID us4oemLeaseStop(PUS4OEM_CONTEXT DeviceContext) {
+    PAGED_CODE();
+
+    InterlockedExchange(&DeviceContext->LeaseRunning, 0);
+    if (DeviceContext->LeaseTimer != NULL) {
+        WdfTimerStop(DeviceContext->LeaseTimer, TRUE);
+    }
+}
+
+NTSTATUS us4oemIoctlSetLease(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(OutputBuffer);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(BytesReturned);
+
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    us4oem_lease_argument* arg = (us4oem_lease_argument*)InputBuffer;
+
+    if (arg->duration_ms > US4OEM_LEASE_MAX_DURATION_MS || arg->reserved != 0) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "Invalid lease (%lu ms)", arg->duration_ms);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Either both or neither, so a close never sees a token without a duration
+    BOOLEAN clear = arg->token == 0 || arg->duration_ms == 0;
+    deviceContext->LeaseDurationMs = clear ? 0 : arg->duration_ms;
+    InterlockedExchange64(&deviceContext->LeaseToken, clear ? 0 : (LONG64)arg->token);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS us4oemIoctlAttachLease(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(OutputBuffer);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(BytesReturned);
+
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    unsigned long long token = *(unsigned long long*)InputBuffer;
+
+    if (InterlockedCompareExchange(&deviceContext->LeaseRunning, 0, 0) == 0) {
+        return STATUS_NOT_FOUND;
+    }
+    if (token == 0 || (LONG64)token != InterlockedCompareExchange64(&deviceContext->LeaseToken, 0, 0)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "Wrong lease token");
+        return STATUS_ACCESS_DENIED;
+    }
+
+    // Whoever clears the flag decides: if the timer got there first, the buffers are already going.
+    // Otherwise they become the caller's like the ones it allocates itself.
+    WdfWaitLockAcquire(deviceContext->DmaLock, NULL);
+    if (InterlockedExchange(&deviceContext->LeaseRunning, 0) == 0) {
+        WdfWaitLockRelease(deviceContext->DmaLock);
+        return STATUS_NOT_FOUND;
+    }
+    us4oemLeaseStamp(deviceContext, deviceContext->LeaseId, US4OEM_TEARDOWN_UNLEASED);
+    WdfWaitLockRelease(deviceContext->DmaLock);
+
+    WdfTimerStop(deviceContext->LeaseTimer, FALSE);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_IOCTL, "Lease attached, the DMA buffers are kept");
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <ntddk.h>
+#include <wdf.h>
+
+#include "us4oem.h"
+
+EXTERN_C_START
+
+// Creates the lease timer; it lives as long as the device.
+NTSTATUS us4oemLeaseInitialize(WDFDEVICE Device);
+
+// Called on close in sticky mode instead of releasing the DMA buffers right away. Returns TRUE if a lease is set
+// and has started: the buffers the device has now are stamped with the lease's id, and are released when it runs
+// out unless someone attaches first. Returns FALSE if no lease is set or one is running already. PASSIVE_LEVEL only.
+BOOLEAN us4oemLeaseStart(WDFDEVICE Device);
+
+// Stops a running lease without releasing anything, and waits for an expiry in progress. Before the device goes away.
+VOID us4oemLeaseStop(PUS4OEM_CONTEXT DeviceContext);
+
+EXTERN_C_END
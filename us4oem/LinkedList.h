@@ -8,18 +8,28 @@ There were a few design considerations that led to this data structure:
 - One of the main users of this will be the list of DMA allocations, which might get long if we have a lot of them
   (which might be the case if we need to store a lot of data = a lot of scatter-gather buffers).
 - We should be able to really quickly push items to the end of the list.
-- The only case in which we will get items from the list is when we need to free them, so we don't need to particularly
-  optimize for that case.
+- Lists are walked on every lookup (mmap, deallocation) and on teardown, so walking them should stay in cache.
 
-The resulting structure is a simple two-way linked list with a head and a tail pointer. The structure allocates memory for each entry,
-and free()'s it when removing an item from the list. It also free()'s the item itself when removing it from the list.
+The resulting structure is a simple two-way linked list with a head and a tail pointer. Items are stored inside
+their list entry (one allocation per item, the item is right next to the links), and the entries come from a
+per-list pool of cached memory: a lookaside list in the driver, so allocating and freeing is usually a pop/push
+of a free list. Items are allocated with LINKED_LIST_NEW, filled in, and then linked with LINKED_LIST_PUSH,
+which can't fail. Removing an item from the list frees it.
+
+The container itself is plain C: only the memory management macros below are kernel-specific, so it can be
+built in user mode by defining them (e.g. on top of malloc/free).
 
 */
 
+#include <stddef.h>
+
 // Memory management can be overriden by defining the macros below
 #ifndef __LINKED_LIST_MM
-#define __LINKED_LIST_ALLOC(size) MmAllocateNonCachedMemory(size)
-#define __LINKED_LIST_FREE(ptr, size) MmFreeNonCachedMemory(ptr, size)
+#define __LINKED_LIST_POOL_TYPE LOOKASIDE_LIST_EX
+#define __LINKED_LIST_POOL_INIT(pool, size) ExInitializeLookasideListEx(&(pool), NULL, NULL, NonPagedPoolNx, 0, (size), 'r4su', 0)
+#define __LINKED_LIST_POOL_DELETE(pool) ExDeleteLookasideListEx(&(pool))
+#define __LINKED_LIST_ALLOC(pool, size) ExAllocateFromLookasideListEx(&(pool))
+#define __LINKED_LIST_FREE(pool, ptr, size) ExFreeToLookasideListEx(&(pool), (ptr))
 #define __LINKED_LIST_ZERO(ptr, size) RtlZeroMemory(ptr, size)
 #define __LINKED_LIST_MM
 #endif
@@ -28,18 +38,38 @@ and free()'s it when removing an item from the list. It also free()'s the item i
 #define LINKED_LIST_ENTRY_TYPE_FOR(Type) \
     Type##_LIST_ENTRY
 
-// Defines a type to store a linked list entry for a given type.
+// Defines a type to store a linked list entry for a given type, and the allocator for it.
+// Item always points at Storage; it's kept so that the loops can check and use entry->Item as before.
 #define USE_IN_LINKED_LISTS(Type) \
     typedef struct _##Type##_LIST_ENTRY { \
         struct _##Type##_LIST_ENTRY* Prev; \
         struct _##Type##_LIST_ENTRY* Next; \
         Type* Item; \
-    } Type##_LIST_ENTRY, *P##Type##_LIST_ENTRY;
+        Type Storage; \
+    } Type##_LIST_ENTRY, *P##Type##_LIST_ENTRY; \
+    static __inline Type* Type##_LIST_NEW(__LINKED_LIST_POOL_TYPE* Pool) { \
+        Type##_LIST_ENTRY* entry = (Type##_LIST_ENTRY*)__LINKED_LIST_ALLOC(*Pool, sizeof(Type##_LIST_ENTRY)); \
+        if (entry == NULL) { \
+            return NULL; \
+        } \
+        __LINKED_LIST_ZERO(entry, sizeof(Type##_LIST_ENTRY)); \
+        entry->Item = &entry->Storage; \
+        return entry->Item; \
+    }
 
 // Used in structs that will contain linked lists.
 #define LINKED_LIST_POINTERS(Type, Name) \
     Type##_LIST_ENTRY* Name##Head; \
-    Type##_LIST_ENTRY* Name##Tail;
+    Type##_LIST_ENTRY* Name##Tail; \
+    __LINKED_LIST_POOL_TYPE Name##Pool;
+
+// Sets up the list's pool, must be done before the first LINKED_LIST_NEW. Evaluates to an NTSTATUS.
+#define LINKED_LIST_INITIALIZE(Type, Where) \
+    __LINKED_LIST_POOL_INIT(Where##Pool, sizeof(Type##_LIST_ENTRY))
+
+// Tears down the list's pool. The list must be empty (see LINKED_LIST_CLEAR).
+#define LINKED_LIST_DELETE(Type, Where) \
+    __LINKED_LIST_POOL_DELETE(Where##Pool)
 
 // Used to get the head of a linked list.
 #define LINKED_LIST_HEAD(Type, Where) \
@@ -49,18 +79,26 @@ and free()'s it when removing an item from the list. It also free()'s the item i
 #define LINKED_LIST_TAIL(Type, Where) \
     (Where##Tail)
 
-// Pushes an item (Type*) to the end of a linked list (Type_LIST_ENTRY).
+// Used to get the list entry an item (Type*) from LINKED_LIST_NEW is stored in.
+#define LINKED_LIST_ENTRY_OF(Type, What) \
+    ((Type##_LIST_ENTRY*)((char*)(What) - offsetof(Type##_LIST_ENTRY, Storage)))
+
+// Allocates a zeroed item (Type*) that can be pushed to the list, NULL if out of memory.
+#define LINKED_LIST_NEW(Type, Where) \
+    Type##_LIST_NEW(&(Where##Pool))
+
+// Frees an item from LINKED_LIST_NEW that never made it into the list (e.g. on an error path).
+#define LINKED_LIST_DISCARD(Type, Where, What) \
+    __LINKED_LIST_FREE(Where##Pool, LINKED_LIST_ENTRY_OF(Type, What), sizeof(Type##_LIST_ENTRY))
+
+// Pushes an item (Type*, from LINKED_LIST_NEW) to the end of a linked list.
 // Note that WhereHead and WhereTail could both be NULL, in which case the item will be the first and only item in the list.
 #define LINKED_LIST_PUSH(Type, Where, What) \
     { \
-        Type##_LIST_ENTRY* entry = (Type##_LIST_ENTRY*)__LINKED_LIST_ALLOC(sizeof(Type##_LIST_ENTRY)); \
-        if (entry == NULL) { \
-            return; \
-        } \
-        __LINKED_LIST_ZERO(entry, sizeof(Type##_LIST_ENTRY)); \
-        entry->Item = What; \
+        Type##_LIST_ENTRY* entry = LINKED_LIST_ENTRY_OF(Type, What); \
         entry->Next = NULL; \
         if ((Where##Head) == NULL) { \
+            entry->Prev = NULL; \
             (Where##Head) = entry; \
             (Where##Tail) = entry; \
         } else { \
@@ -74,9 +112,9 @@ and free()'s it when removing an item from the list. It also free()'s the item i
 #define LINKED_LIST_FOR_EACH(Type, Where, Var) \
     for (Type##_LIST_ENTRY* Var = (Where##Head); Var != NULL; Var = Var->Next)
 
-// Removes an entry
+// Takes an entry out of the list without freeing it; its own Prev and Next are left as they were.
 // Note we need to check if we're removing the head or the tail, and update the pointers accordingly.
-#define LINKED_LIST_REMOVE(Type, Where, Entry) \
+#define LINKED_LIST_UNLINK(Type, Where, Entry) \
     { \
         if ((Entry)->Prev != NULL) { \
             (Entry)->Prev->Next = (Entry)->Next; \
@@ -88,8 +126,13 @@ and free()'s it when removing an item from the list. It also free()'s the item i
         } else { \
             (Where##Tail) = (Entry)->Prev; \
         } \
-        __LINKED_LIST_FREE((Entry)->Item, sizeof(Type)); \
-        __LINKED_LIST_FREE(Entry, sizeof(Type##_LIST_ENTRY)); \
+    }
+
+// Removes an entry and frees it, along with its item.
+#define LINKED_LIST_REMOVE(Type, Where, Entry) \
+    { \
+        LINKED_LIST_UNLINK(Type, Where, Entry) \
+        __LINKED_LIST_FREE(Where##Pool, Entry, sizeof(Type##_LIST_ENTRY)); \
     }
 
 // Clears the whole linked list, freeing all entries and items.
@@ -98,12 +141,9 @@ and free()'s it when removing an item from the list. It also free()'s the item i
         Type##_LIST_ENTRY* entry = (Where##Head); \
         while (entry != NULL) { \
             Type##_LIST_ENTRY* next = entry->Next; \
-            if (entry->Item) { \
-                __LINKED_LIST_FREE(entry->Item, sizeof(Type)); \
-            } \
-            __LINKED_LIST_FREE(entry, sizeof(Type##_LIST_ENTRY)); \
+            __LINKED_LIST_FREE(Where##Pool, entry, sizeof(Type##_LIST_ENTRY)); \
             entry = next; \
         } \
         (Where##Head) = NULL; \
         (Where##Tail) = NULL; \
-    }
\ No newline at end of file
+    }
@@ -1,110 +1,248 @@
 #include "ioctl.h"
+#include "char.h"
 #include "mem.tmh"
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, us4oemIoctlMmap)
+#pragma alloc_text (PAGE, us4oemMemUnmap)
+#pragma alloc_text (PAGE, us4oemMemReleaseBufferMappings)
+#pragma alloc_text (PAGE, us4oemMemReleaseOrphanedMappings)
 #endif
 
-VOID us4oemIoctlMmap(
-    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer
-) {
+// Finds the DMA buffer behind a handle from ALLOCATE_DMA_*, without walking the lists
+static NTSTATUS us4oemMemFindDmaByHandle(PUS4OEM_CONTEXT DeviceContext, us4oem_handle Handle, PVOID* Address, ULONG* Length, PLIST_ENTRY* Mappings) {
+    US4OEM_HANDLE_TYPE type;
+    PVOID object = us4oemHandleLookup(DeviceContext, Handle, &type);
+    size_t size = 0;
+
+    if (object != NULL && type == US4OEM_HANDLE_TYPE_CONTIGUOUS) {
+        WDFCOMMONBUFFER commonBuffer = *((LINKED_LIST_ENTRY_TYPE_FOR(WDFCOMMONBUFFER)*)object)->Item;
+        *Address = WdfCommonBufferGetAlignedVirtualAddress(commonBuffer);
+        *Length = (ULONG)WdfCommonBufferGetLength(commonBuffer);
+        *Mappings = &us4oemGetCommonBufferContext(commonBuffer)->Mappings;
+        return STATUS_SUCCESS;
+    }
+    if (object != NULL && type == US4OEM_HANDLE_TYPE_SCATTER_GATHER) {
+        MEMORY_ALLOCATION* allocation = ((LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)*)object)->Item;
+        *Address = WdfMemoryGetBuffer(allocation->memory, &size);
+        *Length = (ULONG)size;
+        *Mappings = &allocation->mappings;
+        return STATUS_SUCCESS;
+    }
+
+    TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "Handle 0x%llx is not a DMA buffer", Handle);
+    return STATUS_INVALID_HANDLE;
+}
+
+// Creates the record of a mapping about to be made in the current process, along with its handle.
+// NULL if the handle table is full: a mapping nobody can release must not be made at all.
+static PUS4OEM_MAPPING us4oemMemCreateMapping(WDFDEVICE Device) {
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    WDF_OBJECT_ATTRIBUTES attributes;
+    WDFMEMORY memory;
+    PUS4OEM_MAPPING mapping;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    if (!NT_SUCCESS(WdfMemoryCreate(&attributes, NonPagedPoolNx, 'r4su', sizeof(US4OEM_MAPPING), &memory, (PVOID*)&mapping))) {
+        return NULL;
+    }
+
+    RtlZeroMemory(mapping, sizeof(US4OEM_MAPPING));
+    mapping->Memory = memory;
+    mapping->Process = PsGetCurrentProcess();
+    InitializeListHead(&mapping->Link);
+    InitializeListHead(&mapping->BufferLink);
+
+    mapping->Handle = us4oemHandleCreate(deviceContext, US4OEM_HANDLE_TYPE_MAPPING, mapping);
+    if (mapping->Handle == US4OEM_INVALID_HANDLE) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "No free handle for a new mapping");
+        WdfObjectDelete(memory);
+        return NULL;
+    }
+
+    return mapping;
+}
+
+// Frees the record of a mapping that couldn't be made
+static VOID us4oemMemDiscardMapping(PUS4OEM_CONTEXT DeviceContext, PUS4OEM_MAPPING Mapping) {
+    us4oemHandleClose(DeviceContext, Mapping->Handle, US4OEM_HANDLE_TYPE_MAPPING);
+    WdfObjectDelete(Mapping->Memory);
+}
+
+// Unmaps a mapping whose handle is closed already and frees its record. The mapping doesn't have to belong to
+// the current process, its own is attached to for the unmap. Called with DmaLock held.
+static VOID us4oemMemReleaseMapping(PUS4OEM_CONTEXT DeviceContext, PUS4OEM_MAPPING Mapping) {
+    KAPC_STATE apcState;
+    BOOLEAN attached = FALSE;
+
+    RemoveEntryList(&Mapping->Link);
+    RemoveEntryList(&Mapping->BufferLink);
+
+    if (Mapping->Process != PsGetCurrentProcess()) {
+        KeStackAttachProcess(Mapping->Process, &apcState);
+        attached = TRUE;
+    }
+    MmUnmapLockedPages(Mapping->UserAddress, Mapping->Mdl);
+    if (attached) {
+        KeUnstackDetachProcess(&apcState);
+    }
+
+    IoFreeMdl(Mapping->Mdl);
+    ObDereferenceObject(Mapping->Process);
+    US4OEM_COUNTER_ADD(DeviceContext, MappedBytes, -(LONG64)Mapping->Length);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_IOCTL, "Unmapped %p (handle 0x%llx)", Mapping->UserAddress, Mapping->Handle);
+
+    WdfObjectDelete(Mapping->Memory);
+}
+
+VOID us4oemMemReleaseBufferMappings(PUS4OEM_CONTEXT DeviceContext, PLIST_ENTRY Mappings) {
     PAGED_CODE();
 
-    us4oem_mmap_argument arg = *(us4oem_mmap_argument*)InputBuffer;
+    while (!IsListEmpty(Mappings)) {
+        PUS4OEM_MAPPING mapping = CONTAINING_RECORD(Mappings->Flink, US4OEM_MAPPING, BufferLink);
 
-    if (arg.area > MMAP_AREA_MAX) {
+        us4oemHandleClose(DeviceContext, mapping->Handle, US4OEM_HANDLE_TYPE_MAPPING);
+        us4oemMemReleaseMapping(DeviceContext, mapping);
+    }
+}
+
+// TRUE if the process still has a handle to the device open
+static BOOLEAN us4oemMemProcessHasFile(PUS4OEM_CONTEXT DeviceContext, PEPROCESS Process) {
+    for (PLIST_ENTRY link = DeviceContext->OpenFiles.Flink; link != &DeviceContext->OpenFiles; link = link->Flink) {
+        if (CONTAINING_RECORD(link, US4OEM_FILE_CONTEXT, Link)->Process == Process) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+VOID us4oemMemReleaseOrphanedMappings(PUS4OEM_CONTEXT DeviceContext) {
+    PAGED_CODE();
+
+    PLIST_ENTRY link = DeviceContext->Mappings.Flink;
+    while (link != &DeviceContext->Mappings) {
+        PUS4OEM_MAPPING mapping = CONTAINING_RECORD(link, US4OEM_MAPPING, Link);
+        link = link->Flink;
+
+        if (!us4oemMemProcessHasFile(DeviceContext, mapping->Process)) {
+            us4oemHandleClose(DeviceContext, mapping->Handle, US4OEM_HANDLE_TYPE_MAPPING);
+            us4oemMemReleaseMapping(DeviceContext, mapping);
+        }
+    }
+}
+
+NTSTATUS us4oemMemUnmap(PUS4OEM_CONTEXT DeviceContext, us4oem_handle Handle) {
+    PAGED_CODE();
+
+    US4OEM_HANDLE_TYPE type;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    WdfWaitLockAcquire(DeviceContext->DmaLock, NULL);
+
+    PUS4OEM_MAPPING mapping = (PUS4OEM_MAPPING)us4oemHandleLookup(DeviceContext, Handle, &type);
+
+    if (mapping == NULL || type != US4OEM_HANDLE_TYPE_MAPPING) {
+        status = STATUS_INVALID_HANDLE;
+    } else if (mapping->Process != PsGetCurrentProcess()) {
+        // The address only means something in the process that made the mapping
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "Mapping 0x%llx belongs to another process", Handle);
+        status = STATUS_ACCESS_DENIED;
+    } else {
+        us4oemHandleClose(DeviceContext, Handle, US4OEM_HANDLE_TYPE_MAPPING);
+        us4oemMemReleaseMapping(DeviceContext, mapping);
+    }
+
+    WdfWaitLockRelease(DeviceContext->DmaLock);
+    return status;
+}
+
+// Finds the DMA buffer to map, by handle or (for older callers) by its VA. Called with DmaLock held.
+static NTSTATUS us4oemMemFindDma(PUS4OEM_CONTEXT DeviceContext, const us4oem_mmap_argument* Arg, PVOID* Address, ULONG* Length, PLIST_ENTRY* Mappings) {
+    if (Arg->handle != US4OEM_INVALID_HANDLE) {
+        return us4oemMemFindDmaByHandle(DeviceContext, Arg->handle, Address, Length, Mappings);
+    }
+
+    if (!Arg->va) {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_IOCTL,
-            "Area %d is out of range (0-%d)",
-            arg.area,
-            MMAP_AREA_MAX);
-        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
-        return;
+            "Virtual address for DMA area is NULL");
+        return STATUS_INVALID_PARAMETER;
     }
 
-    // Check if the bar index is valid and map the corresponding BAR to user-mode memory.
-    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
-
-    PVOID address = NULL;
+    // Try to find the DMA area by virtual address
+    PVOID address = Arg->va; // Use the virtual address provided by the user
     ULONG length = 0;
+    PLIST_ENTRY mappings = NULL;
 
-    switch (arg.area) {
-    case MMAP_AREA_BAR_0:
-        if (!deviceContext->BarPciDma.MappedAddress) {
-            WdfRequestComplete(Request, STATUS_DEVICE_UNREACHABLE);
+    BOOLEAN found = FALSE;
+    LINKED_LIST_FOR_EACH(WDFCOMMONBUFFER, DeviceContext->DmaContiguousBuffers, commonBuffer) {
+        if (found) {
+            break; // No need to continue if we already found it
         }
-        address = deviceContext->BarPciDma.MappedAddress;
-        length = deviceContext->BarPciDma.Length;
-        break;
-
-    case MMAP_AREA_BAR_4:
-        if (!deviceContext->BarUs4Oem.MappedAddress) {
-            WdfRequestComplete(Request, STATUS_DEVICE_UNREACHABLE);
+        if (commonBuffer->Item != NULL &&
+            WdfCommonBufferGetAlignedVirtualAddress(*commonBuffer->Item) == address) {
+            length = (ULONG)WdfCommonBufferGetLength(*commonBuffer->Item);
+            mappings = &us4oemGetCommonBufferContext(*commonBuffer->Item)->Mappings;
+            found = TRUE;
+            break;
         }
-        address = deviceContext->BarUs4Oem.MappedAddress;
-        length = deviceContext->BarUs4Oem.Length;
-        break;
-
-    case MMAP_AREA_DMA:
-        if (!arg.va) {
-            TraceEvents(TRACE_LEVEL_ERROR,
-                TRACE_IOCTL,
-                "Virtual address for DMA area is NULL");
-            WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
-            return;
+    }
+    LINKED_LIST_FOR_EACH(MEMORY_ALLOCATION, DeviceContext->DmaScatterGatherMemory, commonBuffer) {
+        if (found) {
+            break; // No need to continue if we already found it
         }
-
-		// Try to find the DMA area by virtual address
-		address = arg.va; // Use the virtual address provided by the user
-
-		BOOLEAN found = FALSE;
-        LINKED_LIST_FOR_EACH(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers, commonBuffer) {
-            if (found) {
-                break; // No need to continue if we already found it
-            }
-            if (commonBuffer->Item != NULL &&
-                WdfCommonBufferGetAlignedVirtualAddress(*commonBuffer->Item) == address) {
-                length = (ULONG)WdfCommonBufferGetLength(*commonBuffer->Item);
-				found = TRUE;
-                break;
-            }
-		}
-        LINKED_LIST_FOR_EACH(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory, commonBuffer) {
-            if (found) {
-                break; // No need to continue if we already found it
-			}
-            size_t size;
-            if (commonBuffer->Item != NULL &&
-                WdfMemoryGetBuffer(commonBuffer->Item->memory, &size) == address) {
-                length = (ULONG)size;
-                found = TRUE;
-                break;
-            }
+        size_t size;
+        if (commonBuffer->Item != NULL &&
+            WdfMemoryGetBuffer(commonBuffer->Item->memory, &size) == address) {
+            length = (ULONG)size;
+            mappings = &commonBuffer->Item->mappings;
+            found = TRUE;
+            break;
         }
+    }
 
-        if (length == 0) {
-            TraceEvents(TRACE_LEVEL_ERROR,
-                TRACE_IOCTL,
-                "Failed to find DMA area with VA %p",
-                address);
-            WdfRequestComplete(Request, STATUS_NOT_FOUND);
-            return;
-		}
-
-        break;
+    if (length == 0) {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_IOCTL,
+            "Failed to find DMA area with VA %p",
+            address);
+        return STATUS_NOT_FOUND;
     }
 
+    *Address = address;
+    *Length = length;
+    *Mappings = mappings;
+    return STATUS_SUCCESS;
+}
+
+// Maps Length bytes at Address (nonpaged) into the current process as asked for by Arg. BufferMappings is the list
+// of mappings of the DMA buffer at Address, NULL for the BARs and the statistics page. Called with DmaLock held.
+static NTSTATUS us4oemMemMap(
+    WDFDEVICE Device, const us4oem_mmap_argument* Arg, PVOID Address, ULONG Length, MEMORY_CACHING_TYPE CacheType, ULONG Priority,
+    PLIST_ENTRY BufferMappings, us4oem_mmap_response* Response
+) {
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+
     // To map the BAR to user-mode we need to:
     // - Build an MDL (MmBuildMdlForNonPagedPool)
     // - Map the MDL to user-mode memory (MmMapLockedPagesSpecifyCache)
 
-    if (length > arg.length_limit && arg.length_limit != 0) {
-        length = arg.length_limit; // Use the user-provided length limit
+    if (Length > Arg->length_limit && Arg->length_limit != 0) {
+        Length = Arg->length_limit; // Use the user-provided length limit
+    }
+
+    // The handle comes first, so a full table fails the request rather than leaving a mapping behind
+    PUS4OEM_MAPPING mapping = us4oemMemCreateMapping(Device);
+    if (mapping == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
     PMDL mdl = IoAllocateMdl(
-        address,
-        length,
+        Address,
+        Length,
         FALSE,
         FALSE,
         NULL
@@ -114,52 +252,175 @@ VOID us4oemIoctlMmap(
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_IOCTL,
             "IoAllocateMdl failed to allocate MDL for area %d",
-            arg.area);
-        WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
-        return;
+            Arg->area);
+        us4oemMemDiscardMapping(deviceContext, mapping);
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
     __try {
         MmBuildMdlForNonPagedPool(mdl);
     }
     __except (EXCEPTION_EXECUTE_HANDLER) {
         IoFreeMdl(mdl);
+        us4oemMemDiscardMapping(deviceContext, mapping);
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_IOCTL,
             "MmBuildMdlForNonPagedPool failed for area %d",
-            arg.area);
-        WdfRequestComplete(Request, STATUS_UNSUCCESSFUL);
-        return;
+            Arg->area);
+        return STATUS_UNSUCCESSFUL;
     }
 
-    PVOID mappedAddress = MmMapLockedPagesSpecifyCache(
-        mdl,
-        UserMode, // Map to user-mode
-        MmNonCached, // Non-cached mapping
-        NULL,
-        FALSE,
-        NormalPagePriority
-    );
+    // Mapping into user space raises an exception on failure rather than returning NULL,
+    // which is what happens when the requested address is taken
+    PVOID mappedAddress = NULL;
+    NTSTATUS mapStatus = STATUS_UNSUCCESSFUL;
+    __try {
+        mappedAddress = MmMapLockedPagesSpecifyCache(
+            mdl,
+            UserMode, // Map to user-mode
+            CacheType, // Non-cached, except for the statistics page
+            Arg->address, // NULL to let the system choose
+            FALSE,
+            Priority
+        );
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        mappedAddress = NULL;
+        mapStatus = GetExceptionCode();
+    }
 
     if (!mappedAddress) {
         IoFreeMdl(mdl);
+        us4oemMemDiscardMapping(deviceContext, mapping);
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_IOCTL,
-            "MmMapLockedPagesSpecifyCache failed for area %d",
-            arg.area);
-        WdfRequestComplete(Request, STATUS_UNSUCCESSFUL);
-        return;
+            "MmMapLockedPagesSpecifyCache failed for area %d at %p %!STATUS!",
+            Arg->area, Arg->address, mapStatus);
+        return Arg->address != NULL ? STATUS_CONFLICTING_ADDRESSES : STATUS_UNSUCCESSFUL;
+    }
+
+    // The system may round the requested address down; the caller asked for exactly this one
+    if (Arg->address != NULL && mappedAddress != Arg->address) {
+        MmUnmapLockedPages(mappedAddress, mdl);
+        IoFreeMdl(mdl);
+        us4oemMemDiscardMapping(deviceContext, mapping);
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_IOCTL,
+            "Area %d mapped at %p instead of %p, the address must be aligned to the allocation granularity",
+            Arg->area, mappedAddress, Arg->address);
+        return STATUS_MAPPED_ALIGNMENT;
+    }
+
+    // Released by its handle, along with the buffer, or once the process has closed the device
+    mapping->Mdl = mdl;
+    mapping->UserAddress = mappedAddress;
+    mapping->Length = Length;
+    ObReferenceObject(mapping->Process);
+    InsertTailList(&deviceContext->Mappings, &mapping->Link);
+    if (BufferMappings != NULL) {
+        InsertTailList(BufferMappings, &mapping->BufferLink);
     }
 
     // Copy the mapped address to the output buffer
-    ((us4oem_mmap_response*)OutputBuffer)->address = mappedAddress;
-    ((us4oem_mmap_response*)OutputBuffer)->length_mapped = length;
+    Response->address = mappedAddress;
+    Response->length_mapped = Length;
+    Response->handle = mapping->Handle;
+
+    // Goes down again when the mapping is released
+    US4OEM_COUNTER_ADD(deviceContext, MappedBytes, Length);
+    US4OEM_COUNTER_INCREMENT(deviceContext, MapCount);
 
     TraceEvents(TRACE_LEVEL_INFORMATION,
         TRACE_IOCTL,
         "area %d mapped to user-mode memory at address %p",
-        arg.area, mappedAddress);
+        Arg->area, mappedAddress);
+
+    return STATUS_SUCCESS;
+}
+
+// Runs in the caller's context (US4OEM_IOCTL_FLAG_CALLER_CONTEXT): the mapping is made in, and belongs to,
+// the process that sent the request.
+NTSTATUS us4oemIoctlMmap(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    PAGED_CODE();
+
+    // Older callers don't pass the address
+    us4oem_mmap_argument arg;
+    RtlZeroMemory(&arg, sizeof(arg));
+    RtlCopyMemory(&arg, InputBuffer, min(InputBufferLength, sizeof(arg)));
+
+    if (arg.area > MMAP_AREA_MAX) {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_IOCTL,
+            "Area %d is out of range (0-%d)",
+            arg.area,
+            MMAP_AREA_MAX);
+        return STATUS_INVALID_PARAMETER;
+    }
 
-    // TODO: (probably) a bunch of memory leaks that need to be handled properly
+    // Check if the bar index is valid and map the corresponding BAR to user-mode memory.
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+
+    PVOID address = NULL;
+    ULONG length = 0;
+    MEMORY_CACHING_TYPE cacheType = MmNonCached;
+    ULONG priority = NormalPagePriority;
+    PLIST_ENTRY bufferMappings = NULL;
+    NTSTATUS status;
+
+    switch (arg.area) {
+    case MMAP_AREA_BAR_0:
+        if (!deviceContext->BarPciDma.MappedAddress) {
+            return STATUS_DEVICE_UNREACHABLE;
+        }
+        address = deviceContext->BarPciDma.MappedAddress;
+        length = deviceContext->BarPciDma.Length;
+        break;
 
-    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(us4oem_mmap_response));
-}
\ No newline at end of file
+    case MMAP_AREA_BAR_4:
+        if (!deviceContext->BarUs4Oem.MappedAddress) {
+            return STATUS_DEVICE_UNREACHABLE;
+        }
+        address = deviceContext->BarUs4Oem.MappedAddress;
+        length = deviceContext->BarUs4Oem.Length;
+        break;
+
+    case MMAP_AREA_DMA:
+        // Held until the buffer is mapped, so it can't be released in between
+        WdfWaitLockAcquire(deviceContext->DmaLock, NULL);
+
+        status = us4oemMemFindDma(deviceContext, &arg, &address, &length, &bufferMappings);
+        if (NT_SUCCESS(status)) {
+            status = us4oemMemMap(Device, &arg, address, length, cacheType, priority, bufferMappings, (us4oem_mmap_response*)OutputBuffer);
+        }
+
+        WdfWaitLockRelease(deviceContext->DmaLock);
+
+        if (NT_SUCCESS(status)) {
+            *BytesReturned = sizeof(us4oem_mmap_response);
+        }
+        return status;
+
+    case MMAP_AREA_STATS:
+        if (!deviceContext->SharedStats) {
+            return STATUS_DEVICE_NOT_READY;
+        }
+        address = deviceContext->SharedStats;
+        length = PAGE_SIZE;
+
+        // Must match the driver's own (cached) mapping of the page, and clients only get to read it
+        cacheType = MmCached;
+        priority |= MdlMappingNoWrite;
+        break;
+    }
+
+    WdfWaitLockAcquire(deviceContext->DmaLock, NULL);
+    status = us4oemMemMap(Device, &arg, address, length, cacheType, priority, NULL, (us4oem_mmap_response*)OutputBuffer);
+    WdfWaitLockRelease(deviceContext->DmaLock);
+
+    if (NT_SUCCESS(status)) {
+        *BytesReturned = sizeof(us4oem_mmap_response);
+    }
+    return status;
+}
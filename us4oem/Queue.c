@@ -3,16 +3,45 @@
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, us4oemQueueInitialize)
-#pragma alloc_text (PAGE, us4oemEvtIoDeviceControl)
 #pragma alloc_text (PAGE, us4oemEvtIoStop)
 #endif
 
+// Creates one of the device's queues and tags it with its us4oem_queue id
+static NTSTATUS
+us4oemQueueCreate(
+    _In_ WDFDEVICE Device,
+    _In_ PWDF_IO_QUEUE_CONFIG QueueConfig,
+    _In_ us4oem_queue Queue
+    )
+{
+    WDF_OBJECT_ATTRIBUTES queueAttributes;
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    NTSTATUS status;
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&queueAttributes, QUEUE_CONTEXT);
+
+    status = WdfIoQueueCreate(
+                 Device,
+                 QueueConfig,
+                 &queueAttributes,
+                 &deviceContext->Queues[Queue]
+                 );
+
+    if(!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "WdfIoQueueCreate failed for queue %d %!STATUS!", (int)Queue, status);
+        return status;
+    }
+
+    QueueGetContext(deviceContext->Queues[Queue])->Queue = Queue;
+
+    return status;
+}
+
 NTSTATUS
 us4oemQueueInitialize(
     _In_ WDFDEVICE Device
     )
 {
-    WDFQUEUE queue;
     NTSTATUS status;
     WDF_IO_QUEUE_CONFIG queueConfig;
 
@@ -23,6 +52,10 @@ us4oemQueueInitialize(
     // configure-fowarded using WdfDeviceConfigureRequestDispatching to goto
     // other queues get dispatched here.
     //
+    // WdfDeviceConfigureRequestDispatching can only route by request type and every
+    // request here is an IOCTL, so the default queue looks at the IOCTL's entry in the
+    // dispatch table instead and forwards the request to the queue it belongs in.
+    //
     WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(
          &queueConfig,
         WdfIoQueueDispatchParallel
@@ -31,40 +64,75 @@ us4oemQueueInitialize(
     queueConfig.EvtIoDeviceControl = us4oemEvtIoDeviceControl;
     queueConfig.EvtIoStop = us4oemEvtIoStop;
 
-    status = WdfIoQueueCreate(
-                 Device,
-                 &queueConfig,
-                 WDF_NO_OBJECT_ATTRIBUTES,
-                 &queue
-                 );
+    status = us4oemQueueCreate(Device, &queueConfig, US4OEM_QUEUE_DEFAULT);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
 
-    if(!NT_SUCCESS(status)) {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "WdfIoQueueCreate failed %!STATUS!", status);
+    // Polls, statistics and IRQ control: parallel, and never stuck behind an allocation
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchParallel);
+    queueConfig.EvtIoDeviceControl = us4oemEvtIoDeviceControlForwarded;
+    queueConfig.EvtIoStop = us4oemEvtIoStop;
+
+    status = us4oemQueueCreate(Device, &queueConfig, US4OEM_QUEUE_FAST);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // DMA allocation and deallocation, one at a time, batched or not. The buffer lists themselves are guarded by
+    // DmaLock, as mappings and RELEASE_HANDLE get at them from the caller's thread (see us4oemEvtIoInCallerContext).
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchSequential);
+    queueConfig.EvtIoDeviceControl = us4oemEvtIoDeviceControlForwarded;
+    queueConfig.EvtIoStop = us4oemEvtIoStop;
+
+    status = us4oemQueueCreate(Device, &queueConfig, US4OEM_QUEUE_SEQUENTIAL);
+    if (!NT_SUCCESS(status)) {
         return status;
     }
 
+    // Blocking polls wait here for an IRQ. Not power managed, so a waiting poll doesn't hold up a power
+    // transition; being in a queue makes it cancelable, e.g. when the handle is closed.
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+    queueConfig.PowerManaged = WdfFalse;
+    queueConfig.EvtIoCanceledOnQueue = us4oemEvtParkedPollCanceled;
+
+    status = us4oemQueueCreate(Device, &queueConfig, US4OEM_QUEUE_PARKED);
+
     return status;
 }
 
-VOID
-us4oemEvtIoDeviceControl(
-    _In_ WDFQUEUE Queue,
-    _In_ WDFREQUEST Request,
-    _In_ size_t OutputBufferLength,
-    _In_ size_t InputBufferLength,
-    _In_ ULONG IoControlCode
+VOID us4oemQueueEnter(PUS4OEM_CONTEXT DeviceContext, us4oem_queue Queue, WDFREQUEST Request) {
+    PUS4OEM_QUEUE_COUNTERS counters = &DeviceContext->QueueCounters[Queue];
+
+    us4oemGetRequestContext(Request)->QueuedTimestamp = us4oemLatencyTimestamp();
+
+    InterlockedIncrement64(&counters->Requests);
+    us4oemCounterRaiseMax(&counters->MaxDepth, InterlockedIncrement64(&counters->Depth));
+}
+
+VOID us4oemQueueLeave(PUS4OEM_CONTEXT DeviceContext, us4oem_queue Queue, WDFREQUEST Request) {
+    PUS4OEM_QUEUE_COUNTERS counters = &DeviceContext->QueueCounters[Queue];
+    LONG64 ticks = us4oemLatencyTimestamp() - us4oemGetRequestContext(Request)->QueuedTimestamp;
+
+    InterlockedDecrement64(&counters->Depth);
+    InterlockedAdd64(&counters->WaitTicks, ticks);
+    us4oemCounterRaiseMax(&counters->MaxWaitTicks, ticks);
+}
+
+// Retrieves the buffers and runs the handler of an IOCTL that already passed us4oemCheckIoctl.
+static VOID us4oemDispatchIoctl(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    const IOCTL_HANDLER* Handler,
+    size_t OutputBufferLength,
+    size_t InputBufferLength
 )
 {
     PVOID OutputBuffer = NULL;
 	PVOID InputBuffer = NULL;
     NTSTATUS Status;
 
-    PAGED_CODE();
-
-    TraceEvents(TRACE_LEVEL_INFORMATION,
-        TRACE_QUEUE,
-        "%!FUNC! Queue 0x%p, Request 0x%p OutputBufferLength %d InputBufferLength %d IoControlCode %d",
-        Queue, Request, (int)OutputBufferLength, (int)InputBufferLength, IoControlCode);
+    LONGLONG start = us4oemLatencyTimestamp();
 
 	// Retrieve the output and input buffers if they are of non-zero length.
     if (OutputBufferLength > 0) {
@@ -91,39 +159,199 @@ us4oemEvtIoDeviceControl(
 		}
 	}
 
-	PIOCTL_HANDLER handlers = us4oemGetIoctlHandler();
-
-    for (size_t i = 0; i < us4oemGetIoctlHandlerCount(); i++) {
-        if (handlers[i].IoControlCode == IoControlCode) {
-            // Check if the input and output buffer sizes are sufficient
-            if (InputBufferLength < handlers[i].InputBufferNeeded ||
-                OutputBufferLength < handlers[i].OutputBufferNeeded) {
-                TraceEvents(TRACE_LEVEL_ERROR,
-                    TRACE_QUEUE,
-                    "Input/Output buffer size is insufficient for IoControlCode %d",
-                    IoControlCode);
-                WdfRequestComplete(Request, STATUS_BUFFER_TOO_SMALL);
-                return;
-            }
-
-            if (handlers[i].HandlerFuncWithBufferSizes) {
-                // If the handler uses dynamic buffer sizes, call it with the actual sizes
-                handlers[i].HandlerFuncWithBufferSizes(WdfIoQueueGetDevice(Queue), Request, OutputBuffer, InputBuffer, OutputBufferLength, InputBufferLength);
-			} else {
-                // Otherwise, just call the handler without buffer sizes
-                handlers[i].HandlerFunc(WdfIoQueueGetDevice(Queue), Request, OutputBuffer, InputBuffer);
-			}
+    if (Handler->AsyncHandlerFunc) {
+        // The handler completes the request itself, possibly later
+        Handler->AsyncHandlerFunc(Device, Request, OutputBuffer, InputBuffer, OutputBufferLength, InputBufferLength);
+        Status = STATUS_PENDING;
+    } else {
+        size_t bytesReturned = 0;
+        Status = Handler->HandlerFunc(Device, OutputBuffer, InputBuffer, OutputBufferLength, InputBufferLength, &bytesReturned);
+        WdfRequestCompleteWithInformation(Request, Status, NT_SUCCESS(Status) ? bytesReturned : 0);
+    }
+
+    us4oemEventRecord(us4oemGetContext(Device), US4OEM_EVENT_IOCTL, Handler->IoControlCode, (ULONG64)(LONG64)Status);
+
+    us4oemIoctlRecordCall(us4oemGetContext(Device), Handler->IoControlCode, start);
+}
+
+// Checks a request against its entry in the dispatch table (handler == NULL if it has none). Completes the request
+// and returns FALSE if it can't be handled.
+static BOOLEAN us4oemCheckIoctl(
+    PUS4OEM_CONTEXT DeviceContext,
+    WDFREQUEST Request,
+    const IOCTL_HANDLER* Handler,
+    size_t OutputBufferLength,
+    size_t InputBufferLength,
+    ULONG IoControlCode
+)
+{
+    if (Handler == NULL) {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_QUEUE,
+            "Unsupported IoControlCode %d",
+            IoControlCode);
+        US4OEM_COUNTER_INCREMENT(DeviceContext, IoctlRejectedCount);
+        WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
+        return FALSE;
+    }
+
+    if (!(Handler->Flags & US4OEM_IOCTL_FLAG_FAST_PATH)) {
+        TraceHotPath(TRACE_LEVEL_VERBOSE,
+            TRACE_QUEUE,
+            "%!FUNC! Request 0x%p OutputBufferLength %d InputBufferLength %d IoControlCode %d",
+            Request, (int)OutputBufferLength, (int)InputBufferLength, IoControlCode);
+    }
+
+    // Check if the input and output buffer sizes are sufficient
+    if (InputBufferLength < Handler->InputBufferNeeded ||
+        OutputBufferLength < Handler->OutputBufferNeeded) {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_QUEUE,
+            "Input/Output buffer size is insufficient for IoControlCode %d",
+            IoControlCode);
+        US4OEM_COUNTER_INCREMENT(DeviceContext, IoctlRejectedCount);
+        WdfRequestComplete(Request, STATUS_BUFFER_TOO_SMALL);
+        return FALSE;
+    }
+
+    // Requests coming from other drivers might arrive at raised IRQL
+    if (KeGetCurrentIrql() > Handler->MaxIrql) {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_QUEUE,
+            "IoControlCode %d can't be handled at IRQL %d",
+            IoControlCode, (int)KeGetCurrentIrql());
+        US4OEM_COUNTER_INCREMENT(DeviceContext, IoctlRejectedCount);
+        WdfRequestComplete(Request, STATUS_INVALID_DEVICE_STATE);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Sees every request before it's queued, in the thread that sent it. IOCTLs that map or unmap memory
+// (US4OEM_IOCTL_FLAG_CALLER_CONTEXT) are handled right here, as a mapping belongs to the process it's made in
+// and a queue can hand the request to any thread. Everything else goes on to the default queue.
+// A batch is handled here only if one of its commands maps or unmaps memory. Such a batch can't also hold commands
+// of the sequential queue, as it can't be in both places; it's rejected, see US4OEM_WIN32_IOCTL_SUBMIT_BATCH.
+VOID
+us4oemEvtIoInCallerContext(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+)
+{
+    WDF_REQUEST_PARAMETERS params;
+    NTSTATUS Status;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request, &params);
+
+    const IOCTL_HANDLER* handler = params.Type == WdfRequestTypeDeviceControl ?
+        us4oemIoctlLookup(params.Parameters.DeviceIoControl.IoControlCode) : NULL;
+    BOOLEAN callerContext = handler != NULL && (handler->Flags & US4OEM_IOCTL_FLAG_CALLER_CONTEXT);
 
+    if (handler != NULL && handler->IoControlCode == US4OEM_WIN32_IOCTL_SUBMIT_BATCH) {
+        if (us4oemBatchQueue(Request, &callerContext) == US4OEM_QUEUE_SEQUENTIAL && callerContext) {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "Batch mixes mappings with allocations");
+            US4OEM_COUNTER_INCREMENT(us4oemGetContext(Device), IoctlRejectedCount);
+            WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
             return;
         }
-	}
+    }
 
-    TraceEvents(TRACE_LEVEL_ERROR,
-        TRACE_QUEUE,
-        "Unsupported IoControlCode %d",
-        IoControlCode);
-    WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
-    return;
+    if (!callerContext) {
+        Status = WdfDeviceEnqueueRequest(Device, Request);
+        if (!NT_SUCCESS(Status)) {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "WdfDeviceEnqueueRequest failed, status=%!STATUS!",
+                Status);
+            WdfRequestComplete(Request, Status);
+        }
+        return;
+    }
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    size_t outputBufferLength = params.Parameters.DeviceIoControl.OutputBufferLength;
+    size_t inputBufferLength = params.Parameters.DeviceIoControl.InputBufferLength;
+
+    if (!us4oemCheckIoctl(deviceContext, Request, handler, outputBufferLength, inputBufferLength, handler->IoControlCode)) {
+        return;
+    }
+
+    // Counted as passing through the default queue, which is where it would have been handled otherwise
+    us4oemQueueEnter(deviceContext, US4OEM_QUEUE_DEFAULT, Request);
+    us4oemQueueLeave(deviceContext, US4OEM_QUEUE_DEFAULT, Request);
+
+    us4oemDispatchIoctl(Device, Request, handler, outputBufferLength, inputBufferLength);
+}
+
+// Entry point of every IOCTL not handled in us4oemEvtIoInCallerContext. Not pageable, the polls pass through
+// here on their way to the fast queue.
+VOID
+us4oemEvtIoDeviceControl(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+)
+{
+    NTSTATUS Status;
+
+    WDFDEVICE device = WdfIoQueueGetDevice(Queue);
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(device);
+    const IOCTL_HANDLER* handler = us4oemIoctlLookup(IoControlCode);
+
+    if (!us4oemCheckIoctl(deviceContext, Request, handler, OutputBufferLength, InputBufferLength, IoControlCode)) {
+        return;
+    }
+
+    // A batch goes where its commands belong, see us4oemBatchQueue
+    us4oem_queue queue = handler->Queue;
+    if (IoControlCode == US4OEM_WIN32_IOCTL_SUBMIT_BATCH) {
+        BOOLEAN callerContext;
+        queue = us4oemBatchQueue(Request, &callerContext);
+    }
+
+    if (queue != US4OEM_QUEUE_DEFAULT) {
+        us4oemQueueEnter(deviceContext, queue, Request);
+
+        Status = WdfRequestForwardToIoQueue(Request, deviceContext->Queues[queue]);
+        if (!NT_SUCCESS(Status)) {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "WdfRequestForwardToIoQueue failed for IoControlCode %d, status=%!STATUS!",
+                IoControlCode, Status);
+            us4oemQueueLeave(deviceContext, queue, Request);
+            WdfRequestComplete(Request, Status);
+        }
+        return;
+    }
+
+    us4oemQueueEnter(deviceContext, US4OEM_QUEUE_DEFAULT, Request);
+    us4oemQueueLeave(deviceContext, US4OEM_QUEUE_DEFAULT, Request);
+
+    us4oemDispatchIoctl(device, Request, handler, OutputBufferLength, InputBufferLength);
+}
+
+// Requests forwarded to the fast and sequential queues by us4oemEvtIoDeviceControl end up here
+VOID
+us4oemEvtIoDeviceControlForwarded(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+)
+{
+    WDFDEVICE device = WdfIoQueueGetDevice(Queue);
+
+    us4oemQueueLeave(us4oemGetContext(device), QueueGetContext(Queue)->Queue, Request);
+
+    // Already validated before forwarding, so this can't fail
+    us4oemDispatchIoctl(device, Request, us4oemIoctlLookup(IoControlCode), OutputBufferLength, InputBufferLength);
 }
 
 VOID
@@ -8,21 +8,47 @@ EXTERN_C_START
 //
 typedef struct _QUEUE_CONTEXT {
 
-    ULONG PrivateDeviceData;  // just a placeholder
+    us4oem_queue Queue; // Which of the device's queues this is
 
 } QUEUE_CONTEXT, *PQUEUE_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(QUEUE_CONTEXT, QueueGetContext)
 
+//
+// Attached to every request by the framework (see WdfDeviceInitSetRequestAttributes),
+// so it costs no extra allocation.
+//
+typedef struct _US4OEM_REQUEST_CONTEXT {
+
+    LONGLONG QueuedTimestamp; // QPC at which the request entered its current queue
+
+} US4OEM_REQUEST_CONTEXT, *PUS4OEM_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(US4OEM_REQUEST_CONTEXT, us4oemGetRequestContext)
+
 NTSTATUS
 us4oemQueueInitialize(
     _In_ WDFDEVICE Device
     );
 
+//
+// Queue statistics. Enter when a request is put in a queue, Leave when it's taken out
+// (handed to its handler, or completed while parked).
+//
+VOID us4oemQueueEnter(PUS4OEM_CONTEXT DeviceContext, us4oem_queue Queue, WDFREQUEST Request);
+VOID us4oemQueueLeave(PUS4OEM_CONTEXT DeviceContext, us4oem_queue Queue, WDFREQUEST Request);
+
+//
+// Runs before any queue sees a request, see us4oemEvtIoInCallerContext
+//
+EVT_WDF_IO_IN_CALLER_CONTEXT us4oemEvtIoInCallerContext;
+
 //
 // Events from the IoQueue object
 //
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL us4oemEvtIoDeviceControl;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL us4oemEvtIoDeviceControlForwarded;
 EVT_WDF_IO_QUEUE_IO_STOP us4oemEvtIoStop;
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE us4oemEvtParkedPollCanceled;
 
 EXTERN_C_END
@@ -0,0 +1,164 @@
+#include "ioctl.h"
+#include "latency.h"
+#include "reg.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, us4oemIoctlRegisterAccess)
+#endif
+
+// How long a poll spins before it starts sleeping between reads
+#define US4OEM_REG_POLL_SPIN_US 100
+#define US4OEM_REG_POLL_SLEEP_US 100
+
+static ULONG64 us4oemRegRead(PUCHAR Address, UCHAR Width) {
+    switch (Width) {
+    case 1: return READ_REGISTER_UCHAR((volatile UCHAR*)Address);
+    case 2: return READ_REGISTER_USHORT((volatile USHORT*)Address);
+    case 4: return READ_REGISTER_ULONG((volatile ULONG*)Address);
+    default: return READ_REGISTER_ULONG64((volatile ULONG64*)Address);
+    }
+}
+
+static VOID us4oemRegWrite(PUCHAR Address, UCHAR Width, ULONG64 Value) {
+    switch (Width) {
+    case 1: WRITE_REGISTER_UCHAR((volatile UCHAR*)Address, (UCHAR)Value); break;
+    case 2: WRITE_REGISTER_USHORT((volatile USHORT*)Address, (USHORT)Value); break;
+    case 4: WRITE_REGISTER_ULONG((volatile ULONG*)Address, (ULONG)Value); break;
+    default: WRITE_REGISTER_ULONG64((volatile ULONG64*)Address, Value); break;
+    }
+}
+
+// Returns the mapped address of the register an operation targets, or NULL if it's outside the BAR or misaligned.
+static PUCHAR us4oemRegAddress(PUS4OEM_CONTEXT DeviceContext, const us4oem_reg_op* Op) {
+    PBAR_INFO bar;
+
+    switch (Op->bar) {
+    case 0:
+        bar = &DeviceContext->BarPciDma;
+        break;
+    case 4:
+        bar = &DeviceContext->BarUs4Oem;
+        break;
+    default:
+        return NULL;
+    }
+
+    if (bar->MappedAddress == NULL ||
+        (Op->width != 1 && Op->width != 2 && Op->width != 4 && Op->width != 8) ||
+        (Op->offset & (Op->width - 1)) != 0 ||
+        Op->offset > bar->Length ||
+        bar->Length - Op->offset < Op->width) {
+        return NULL;
+    }
+
+    return (PUCHAR)bar->MappedAddress + Op->offset;
+}
+
+// Reads the register until the masked bits match, spinning briefly first and then sleeping between reads.
+static NTSTATUS us4oemRegPoll(PUS4OEM_CONTEXT DeviceContext, PUCHAR Address, us4oem_reg_op* Op) {
+    LONGLONG frequency = DeviceContext->QpcFrequency.QuadPart;
+    LONGLONG start = us4oemLatencyTimestamp();
+    LONGLONG deadline = start + (LONGLONG)Op->timeout_us * frequency / 1000000LL;
+    LONGLONG spinUntil = start + US4OEM_REG_POLL_SPIN_US * frequency / 1000000LL;
+
+    for (;;) {
+        ULONG64 value = us4oemRegRead(Address, Op->width);
+        LONGLONG now = us4oemLatencyTimestamp();
+
+        if ((value & Op->mask) == (Op->value & Op->mask)) {
+            Op->value = value;
+            return STATUS_SUCCESS;
+        }
+        if (now >= deadline) {
+            Op->value = value;
+            return STATUS_IO_TIMEOUT;
+        }
+
+        if (now < spinUntil) {
+            YieldProcessor();
+        } else {
+            LARGE_INTEGER interval;
+            interval.QuadPart = -10LL * US4OEM_REG_POLL_SLEEP_US; // Relative, in 100 ns units
+            KeDelayExecutionThread(KernelMode, FALSE, &interval);
+        }
+    }
+}
+
+NTSTATUS us4oemIoctlRegisterAccess(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+
+    ULONG opCount = ((us4oem_reg_access_header*)InputBuffer)->op_count;
+    if (opCount > US4OEM_REG_MAX_OPS ||
+        InputBufferLength < US4OEM_REG_ACCESS_SIZE(opCount) ||
+        OutputBufferLength < US4OEM_REG_ACCESS_SIZE(opCount)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "Invalid register access (%lu operations)", opCount);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // The operations run on a copy in the output buffer, which is where the results go. For a plain METHOD_BUFFERED
+    // request both are the same system buffer, in a batch the output follows the input.
+    if (OutputBuffer != InputBuffer) {
+        RtlCopyMemory(OutputBuffer, InputBuffer, US4OEM_REG_ACCESS_SIZE(opCount));
+    }
+
+    us4oem_reg_access_header* header = (us4oem_reg_access_header*)OutputBuffer;
+
+    us4oem_reg_op* ops = (us4oem_reg_op*)(header + 1);
+
+    header->executed = 0;
+    header->status = STATUS_SUCCESS;
+
+    for (ULONG i = 0; i < opCount; i++) {
+        us4oem_reg_op* op = &ops[i];
+        PUCHAR address = us4oemRegAddress(deviceContext, op);
+        NTSTATUS status = STATUS_SUCCESS;
+
+        if (address == NULL) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL,
+                "Register access %lu out of bounds (BAR %u, offset 0x%llx, width %u)", i, op->bar, op->offset, op->width);
+            status = STATUS_INVALID_PARAMETER;
+        } else {
+            switch (op->op) {
+            case US4OEM_REG_OP_READ:
+                op->value = us4oemRegRead(address, op->width);
+                break;
+
+            case US4OEM_REG_OP_WRITE:
+                us4oemRegWrite(address, op->width, op->value);
+                break;
+
+            case US4OEM_REG_OP_READ_MODIFY_WRITE: {
+                // Not atomic with respect to other clients writing the same register
+                ULONG64 previous = us4oemRegRead(address, op->width);
+                us4oemRegWrite(address, op->width, (previous & ~op->mask) | (op->value & op->mask));
+                op->value = previous;
+                break;
+            }
+
+            case US4OEM_REG_OP_POLL:
+                status = op->timeout_us > US4OEM_REG_POLL_MAX_TIMEOUT_US
+                    ? STATUS_INVALID_PARAMETER
+                    : us4oemRegPoll(deviceContext, address, op);
+                break;
+
+            default:
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+        }
+
+        if (!NT_SUCCESS(status)) {
+            header->status = status;
+            break;
+        }
+        header->executed++;
+    }
+
+    // Failed operations are reported in the header, the request itself succeeds so the results get copied back
+    *BytesReturned = US4OEM_REG_ACCESS_SIZE(opCount);
+    return STATUS_SUCCESS;
+}
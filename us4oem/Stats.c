@@ -0,0 +1,114 @@
+#include "ioctl.h"
+#include "latency.h"
+#include "stats.tmh"
+
+static EVT_WDF_TIMER us4oemEvtStatsTimer;
+
+// us4oemStatsPublish is called from the DPC, so it stays resident
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, us4oemStatsInitialize)
+#endif
+
+// Clients map the whole page, so nothing else may live in it
+C_ASSERT(sizeof(us4oem_shared_stats) <= PAGE_SIZE);
+
+NTSTATUS us4oemStatsInitialize(WDFDEVICE Device) {
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    WDF_OBJECT_ATTRIBUTES attributes;
+    WDFMEMORY memory;
+    PVOID buffer;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    // Pool allocations of a page or more are page aligned, so this is exactly one page
+    NTSTATUS status = WdfMemoryCreate(&attributes, NonPagedPoolNx, 'r4su', PAGE_SIZE, &memory, &buffer);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "WdfMemoryCreate failed for the shared statistics page %!STATUS!", status);
+        return status;
+    }
+
+    // Only ever publishes, which is safe against anything else running at the same time
+    WDF_TIMER_CONFIG timerConfig;
+    WDF_TIMER_CONFIG_INIT(&timerConfig, us4oemEvtStatsTimer);
+    timerConfig.AutomaticSerialization = FALSE;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    status = WdfTimerCreate(&timerConfig, &attributes, &deviceContext->StatsTimer);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "WdfTimerCreate failed for the statistics timer %!STATUS!", status);
+        return status;
+    }
+
+    RtlZeroMemory(buffer, PAGE_SIZE);
+    deviceContext->SharedStats = (us4oem_shared_stats*)buffer;
+    deviceContext->SharedStats->size = sizeof(us4oem_stats);
+
+    us4oemStatsPublish(deviceContext);
+    return STATUS_SUCCESS;
+}
+
+static VOID us4oemEvtStatsTimer(WDFTIMER Timer) {
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext((WDFDEVICE)WdfTimerGetParentObject(Timer));
+
+    // Disarm first: anything marked dirty from here on either makes this publish or arms the timer again
+    InterlockedExchange(&deviceContext->StatsTimerArmed, 0);
+    us4oemStatsPublish(deviceContext);
+}
+
+VOID us4oemStatsMarkDirty(PUS4OEM_CONTEXT DeviceContext) {
+    InterlockedExchange(&DeviceContext->SharedStatsDirty, 1);
+
+    // Armed once and left alone, so a steady stream of IOCTLs can't keep pushing the publish back
+    if (DeviceContext->StatsTimer != NULL && InterlockedCompareExchange(&DeviceContext->StatsTimerArmed, 1, 0) == 0) {
+        WdfTimerStart(DeviceContext->StatsTimer, WDF_REL_TIMEOUT_IN_MS(US4OEM_STATS_PUBLISH_DELAY_MS));
+    }
+}
+
+VOID us4oemStatsPublish(PUS4OEM_CONTEXT DeviceContext) {
+    us4oem_shared_stats* shared = DeviceContext->SharedStats;
+    KIRQL irql = KeGetCurrentIrql();
+
+    if (shared == NULL) {
+        return;
+    }
+
+    InterlockedExchange(&DeviceContext->SharedStatsDirty, 1);
+
+    // Readers spin while the sequence is odd, so the writer must not be preempted in between
+    if (irql < DISPATCH_LEVEL) {
+        KeRaiseIrql(DISPATCH_LEVEL, &irql);
+    }
+
+    while (InterlockedCompareExchange(&DeviceContext->SharedStatsPublishing, 1, 0) == 0) {
+        while (InterlockedExchange(&DeviceContext->SharedStatsDirty, 0) != 0) {
+            us4oem_stats stats;
+
+            // Snapshot first, so the page is only "being updated" for the copy
+            us4oemStatsSnapshot(DeviceContext, &stats);
+            us4oemInterruptFillAffinityStats(DeviceContext, &stats);
+            us4oemStatsSnapshotTeardown(DeviceContext, &stats);
+
+            LONG64 sequence = (LONG64)shared->sequence;
+            InterlockedExchange64((volatile LONG64*)&shared->sequence, sequence + 1);
+            shared->stats = stats;
+            shared->publish_timestamp = us4oemLatencyTimestamp();
+            InterlockedExchange64((volatile LONG64*)&shared->sequence, sequence + 2);
+        }
+
+        InterlockedExchange(&DeviceContext->SharedStatsPublishing, 0);
+
+        // Someone who published after our last check saw us still writing and left it to us
+        if (InterlockedCompareExchange(&DeviceContext->SharedStatsDirty, 0, 0) == 0) {
+            break;
+        }
+    }
+
+    if (irql < DISPATCH_LEVEL) {
+        KeLowerIrql(irql);
+    }
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <ntddk.h>
+#include <wdf.h>
+
+#include "us4oem.h"
+#include "irqhandoff.h"
+
+EXTERN_C_START
+
+//
+// Helpers for US4OEM_COUNTERS. The counters are written from the DPC and from IOCTL handlers running
+// in parallel, so every access goes through an interlocked operation - never use ++/-- on them directly.
+//
+
+#define US4OEM_COUNTER_INCREMENT(DeviceContext, Counter) \
+    InterlockedIncrement64(&(DeviceContext)->Counters.Counter)
+
+#define US4OEM_COUNTER_DECREMENT(DeviceContext, Counter) \
+    InterlockedDecrement64(&(DeviceContext)->Counters.Counter)
+
+#define US4OEM_COUNTER_ADD(DeviceContext, Counter, Value) \
+    InterlockedAdd64(&(DeviceContext)->Counters.Counter, (Value))
+
+#define US4OEM_COUNTER_RESET(DeviceContext, Counter) \
+    InterlockedExchange64(&(DeviceContext)->Counters.Counter, 0)
+
+// Aligned 64-bit reads are atomic on every platform we build for, volatile keeps the compiler honest.
+#define US4OEM_COUNTER_READ(DeviceContext, Counter) \
+    (*(volatile LONG64*)&(DeviceContext)->Counters.Counter)
+
+// Raises a maximum-so-far value, retrying if another CPU raced us.
+FORCEINLINE VOID us4oemCounterRaiseMax(volatile LONG64* Max, LONG64 Value) {
+    LONG64 current = *Max;
+
+    while (Value > current) {
+        LONG64 previous = InterlockedCompareExchange64(Max, Value, current);
+        if (previous == current) {
+            break;
+        }
+        current = previous;
+    }
+}
+
+// Fills in the user-facing statistics structure from the live counters.
+// Each field is read atomically, but the snapshot as a whole is not.
+FORCEINLINE VOID us4oemStatsSnapshot(PUS4OEM_CONTEXT DeviceContext, us4oem_stats* Stats) {
+    Stats->irq_count = (size_t)US4OEM_COUNTER_READ(DeviceContext, IrqCount);
+    Stats->irq_pending_count = (size_t)US4OEM_COUNTER_READ(DeviceContext, IrqPendingCount);
+    Stats->dma_contig_alloc_count = (size_t)US4OEM_COUNTER_READ(DeviceContext, DmaContigAllocCount);
+    Stats->dma_contig_free_count = (size_t)US4OEM_COUNTER_READ(DeviceContext, DmaContigFreeCount);
+    Stats->dma_sg_alloc_count = (size_t)US4OEM_COUNTER_READ(DeviceContext, DmaSgAllocCount);
+    Stats->dma_sg_free_count = (size_t)US4OEM_COUNTER_READ(DeviceContext, DmaSgFreeCount);
+    Stats->file_open_count = (size_t)US4OEM_COUNTER_READ(DeviceContext, FileOpenCount);
+}
+
+// Fills in the teardown fields of us4oem_stats, only for callers whose buffer has room for them.
+FORCEINLINE VOID us4oemStatsSnapshotTeardown(PUS4OEM_CONTEXT DeviceContext, us4oem_stats* Stats) {
+    Stats->teardown_count = (unsigned long long)US4OEM_COUNTER_READ(DeviceContext, TeardownCount);
+    Stats->teardown_buffer_count = (unsigned long long)US4OEM_COUNTER_READ(DeviceContext, TeardownBufferCount);
+    Stats->teardown_ticks = US4OEM_COUNTER_READ(DeviceContext, TeardownTicks);
+    Stats->teardown_max_ticks = US4OEM_COUNTER_READ(DeviceContext, TeardownMaxTicks);
+    Stats->teardown_last_ticks = US4OEM_COUNTER_READ(DeviceContext, TeardownLastTicks);
+    Stats->teardown_last_workers = (unsigned long)US4OEM_COUNTER_READ(DeviceContext, TeardownLastWorkers);
+    Stats->teardown_pending = (unsigned long)DeviceContext->TeardownsPending;
+}
+
+// How long counters changed outside the DPC can wait before they show up in the shared statistics page
+#define US4OEM_STATS_PUBLISH_DELAY_MS 10
+
+// Allocates the shared statistics page (see us4oem_shared_stats) and its timer; both live as long as the device.
+NTSTATUS us4oemStatsInitialize(WDFDEVICE Device);
+
+// Copies the live counters to the shared statistics page, at IRQL <= DISPATCH_LEVEL. Only the DPC and the
+// stats timer call this; everyone else uses us4oemStatsMarkDirty, so the page isn't rewritten on every IOCTL.
+// Any number of callers can publish at once: if a publish is already writing the page, it picks up the new values
+// before it's done, and the other callers return right away.
+VOID us4oemStatsPublish(PUS4OEM_CONTEXT DeviceContext);
+
+// Call after changing counters outside the DPC, at IRQL <= DISPATCH_LEVEL. The change is published by the next DPC,
+// or at the latest US4OEM_STATS_PUBLISH_DELAY_MS later.
+VOID us4oemStatsMarkDirty(PUS4OEM_CONTEXT DeviceContext);
+
+EXTERN_C_END
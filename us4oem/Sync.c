@@ -1,72 +1,463 @@
 #include "ioctl.h"
+#include "latency.h"
 #include "sync.tmh"
 
+// The poll handlers and IOCTL_CLEAR_PENDING are on the fast queue and deliberately not pageable,
+// so the hot path never takes a page fault.
 #ifdef ALLOC_PRAGMA
-#pragma alloc_text (PAGE, us4oemIoctlPoll)
-#pragma alloc_text (PAGE, us4oemIoctlPollNonBlocking)
-#pragma alloc_text (PAGE, us4oemIoctlClearPending)
+#pragma alloc_text (PAGE, us4oemIoctlSetIrqModeration)
 #endif
 
+// Records the time user-space took to come back with another poll since the previous completion.
+static VOID us4oemRecordPollArrival(PUS4OEM_CONTEXT DeviceContext) {
+    LONGLONG lastCompletion = InterlockedExchange64(&DeviceContext->LastCompletionTimestamp, 0);
+
+    us4oemLatencyRecord(DeviceContext,
+        &DeviceContext->Latency.completion_to_next_poll,
+        lastCompletion,
+        us4oemLatencyTimestamp());
+
+    LONG64 inFlight = US4OEM_COUNTER_INCREMENT(DeviceContext, PollsInFlight);
+    us4oemCounterRaiseMax(&DeviceContext->Counters.PollsInFlightMax, inFlight);
+}
+
+// Every poll request that went through us4oemRecordPollArrival leaves through here.
+VOID us4oemPollRequestComplete(PUS4OEM_CONTEXT DeviceContext, WDFREQUEST Request, NTSTATUS Status, ULONG_PTR Information) {
+    US4OEM_COUNTER_DECREMENT(DeviceContext, PollsInFlight);
+    WdfRequestCompleteWithInformation(Request, Status, Information);
+}
+
+// Completes a POLL_EX request, reporting how many IRQs it consumed (possibly none, on timeout)
+// and how many are still pending.
+static VOID us4oemCompletePollExRequest(PUS4OEM_CONTEXT DeviceContext, WDFREQUEST Request, LONG64 IrqsConsumed, LONGLONG Now) {
+    us4oem_poll_ex_response* response = NULL;
+
+    // The buffer size was validated by the dispatcher, this can't really fail
+    NTSTATUS status = WdfRequestRetrieveOutputBuffer(Request, sizeof(us4oem_poll_ex_response), (PVOID*)&response, NULL);
+    if (!NT_SUCCESS(status)) {
+        us4oemPollRequestComplete(DeviceContext, Request, status, 0);
+        return;
+    }
+
+    response->consumed = (unsigned long long)IrqsConsumed;
+    response->remaining = (unsigned long long)max(US4OEM_COUNTER_READ(DeviceContext, IrqPendingCount), 0);
+    response->timestamps.isr_timestamp = DeviceContext->LastIsrTimestamp;
+    response->timestamps.dpc_timestamp = DeviceContext->LastDpcTimestamp;
+    response->timestamps.completion_timestamp = Now;
+    response->timestamps.qpc_frequency = DeviceContext->QpcFrequency.QuadPart;
+    response->timestamps.irq_coalesced = (unsigned long)IrqsConsumed;
+
+    us4oemPollRequestComplete(DeviceContext, Request, STATUS_SUCCESS, sizeof(us4oem_poll_ex_response));
+}
+
+// Completes a poll request successfully, reporting how many IRQs it consumed.
+// Called both from the IOCTL handlers, the DPC and the timers, so this must not be pageable.
+VOID us4oemCompletePollRequest(PUS4OEM_CONTEXT DeviceContext, WDFREQUEST Request, LONG64 IrqsConsumed) {
+    LONGLONG now = us4oemLatencyTimestamp();
+
+    us4oemLatencyRecord(DeviceContext, &DeviceContext->Latency.dpc_to_completion, DeviceContext->LastDpcTimestamp, now);
+    DeviceContext->LastCompletionTimestamp = now;
+
+    us4oemEventRecord(DeviceContext, US4OEM_EVENT_POLL_COMPLETED, (ULONG)IrqsConsumed,
+        (ULONG64)max(US4OEM_COUNTER_READ(DeviceContext, IrqPendingCount), 0));
+    us4oemStatsMarkDirty(DeviceContext);
+
+    if (us4oemGetPollRequestContext(Request) != NULL) {
+        us4oemCompletePollExRequest(DeviceContext, Request, IrqsConsumed, now);
+        return;
+    }
+
+    // The response is optional - only fill it in if the caller gave us somewhere to put it.
+    // Callers built against older headers pass a shorter structure without irq_coalesced.
+    us4oem_poll_response* response = NULL;
+    size_t responseLength = 0;
+    if (NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, US4OEM_POLL_RESPONSE_MIN_SIZE, (PVOID*)&response, &responseLength))) {
+        response->isr_timestamp = DeviceContext->LastIsrTimestamp;
+        response->dpc_timestamp = DeviceContext->LastDpcTimestamp;
+        response->completion_timestamp = now;
+        response->qpc_frequency = DeviceContext->QpcFrequency.QuadPart;
+
+        if (responseLength < sizeof(us4oem_poll_response)) {
+            us4oemPollRequestComplete(DeviceContext, Request, STATUS_SUCCESS, US4OEM_POLL_RESPONSE_MIN_SIZE);
+            return;
+        }
+
+        response->irq_coalesced = (unsigned long)IrqsConsumed;
+        us4oemPollRequestComplete(DeviceContext, Request, STATUS_SUCCESS, sizeof(us4oem_poll_response));
+        return;
+    }
+
+    us4oemPollRequestComplete(DeviceContext, Request, STATUS_SUCCESS, 0);
+}
+
+// Interrupt moderation is active when waiters should collect more than one IRQ at a time.
+static BOOLEAN us4oemModerationEnabled(PUS4OEM_CONTEXT DeviceContext) {
+    return DeviceContext->ModerationMaxIrqs > 1;
+}
+
+// Microseconds left until the current batch of pending IRQs is due, 0 if it's due already
+// (or has no time limit, check ModerationMaxDelayUs).
+static LONGLONG us4oemModerationRemainingUs(PUS4OEM_CONTEXT DeviceContext) {
+    LONGLONG elapsedUs = (us4oemLatencyTimestamp() - DeviceContext->ModerationBatchStart) * 1000000LL /
+        DeviceContext->QpcFrequency.QuadPart;
+
+    return elapsedUs >= (LONGLONG)DeviceContext->ModerationMaxDelayUs ? 0 : DeviceContext->ModerationMaxDelayUs - elapsedUs;
+}
+
+// Whether the pending IRQs should be handed to a waiter right away.
+static BOOLEAN us4oemModerationReady(PUS4OEM_CONTEXT DeviceContext) {
+    LONG64 pending = US4OEM_COUNTER_READ(DeviceContext, IrqPendingCount);
+
+    if (pending <= 0) {
+        return FALSE;
+    }
+    if (!us4oemModerationEnabled(DeviceContext) || pending >= (LONG64)DeviceContext->ModerationMaxIrqs) {
+        return TRUE;
+    }
+    return DeviceContext->ModerationMaxDelayUs != 0 && us4oemModerationRemainingUs(DeviceContext) == 0;
+}
+
+// Takes pending IRQs for a poll request: POLL_EX takes up to the number it asked for, legacy polls
+// take one at a time normally and the whole batch when moderating. Returns the number of IRQs consumed.
+static LONG64 us4oemConsumePendingIrqs(PUS4OEM_CONTEXT DeviceContext, WDFREQUEST Request) {
+    PUS4OEM_POLL_REQUEST_CONTEXT pollContext = us4oemGetPollRequestContext(Request);
+    volatile LONG64* pending = &DeviceContext->Counters.IrqPendingCount;
+
+    if (pollContext != NULL) {
+        return us4oemIrqPendingTake(pending, pollContext->MaxEvents);
+    }
+    if (us4oemModerationEnabled(DeviceContext)) {
+        return us4oemIrqPendingClear(pending);
+    }
+    return us4oemIrqPendingTake(pending, 1);
+}
+
+// Makes sure a parked waiter gets completed once the batch deadline passes, even if no more IRQs arrive.
+static VOID us4oemModerationArmTimer(PUS4OEM_CONTEXT DeviceContext) {
+    if (DeviceContext->ModerationMaxDelayUs == 0 || DeviceContext->ModerationTimer == NULL) {
+        return;
+    }
+    if (InterlockedCompareExchange(&DeviceContext->ModerationTimerArmed, 1, 0) == 0) {
+        LONGLONG remainingUs = us4oemModerationRemainingUs(DeviceContext);
+        WdfTimerStart(DeviceContext->ModerationTimer, WDF_REL_TIMEOUT_IN_US(max(remainingUs, 1)));
+    }
+}
+
+static VOID us4oemModerationCancelTimer(PUS4OEM_CONTEXT DeviceContext) {
+    // If the timer is already running its callback will clear the flag itself
+    if (DeviceContext->ModerationTimerArmed && WdfTimerStop(DeviceContext->ModerationTimer, FALSE)) {
+        InterlockedExchange(&DeviceContext->ModerationTimerArmed, 0);
+    }
+}
+
+// Takes the parked poll request out of the parked queue, NULL if there's none. Until the caller either
+// completes it (us4oemCompleteParkedPollRequest) or puts it back (us4oemRequeuePollRequest), no other
+// poll can park, as PollWaiting stays set.
+static WDFREQUEST us4oemTakeParkedPollRequest(PUS4OEM_CONTEXT DeviceContext) {
+    WDFREQUEST request = NULL;
+
+    // Cheap check first, so the DPC doesn't take the queue lock when nobody is waiting
+    if (!us4oemIrqWaiterPresent(&DeviceContext->PollWaiting) ||
+        !NT_SUCCESS(WdfIoQueueRetrieveNextRequest(DeviceContext->Queues[US4OEM_QUEUE_PARKED], &request))) {
+        return NULL;
+    }
+
+    return request;
+}
+
+// Completes a request taken out of the parked queue and lets the next poll park.
+static VOID us4oemCompleteParkedPollRequest(PUS4OEM_CONTEXT DeviceContext, WDFREQUEST Request, LONG64 IrqsConsumed) {
+    us4oemQueueLeave(DeviceContext, US4OEM_QUEUE_PARKED, Request);
+    us4oemIrqWaiterRelease(&DeviceContext->PollWaiting);
+    us4oemCompletePollRequest(DeviceContext, Request, IrqsConsumed);
+}
+
+// Puts a request taken out of the parked queue back at its head. Returns FALSE if that failed
+// (e.g. the request got canceled meanwhile), in which case the request is completed.
+static BOOLEAN us4oemRequeuePollRequest(PUS4OEM_CONTEXT DeviceContext, WDFREQUEST Request) {
+    NTSTATUS status = WdfRequestRequeue(Request);
+
+    if (!NT_SUCCESS(status)) {
+        us4oemQueueLeave(DeviceContext, US4OEM_QUEUE_PARKED, Request);
+        us4oemIrqWaiterRelease(&DeviceContext->PollWaiting);
+        us4oemPollRequestComplete(DeviceContext, Request, status, 0);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// The parked queue for us4oemIrqHandoffService
+static int us4oemHandoffReady(void* Context) {
+    return us4oemModerationReady((PUS4OEM_CONTEXT)Context);
+}
+
+static void* us4oemHandoffTakeWaiter(void* Context) {
+    return us4oemTakeParkedPollRequest((PUS4OEM_CONTEXT)Context);
+}
+
+static long long us4oemHandoffConsume(void* Context, void* Request) {
+    return us4oemConsumePendingIrqs((PUS4OEM_CONTEXT)Context, (WDFREQUEST)Request);
+}
+
+static void us4oemHandoffComplete(void* Context, void* Request, long long Consumed) {
+    us4oemModerationCancelTimer((PUS4OEM_CONTEXT)Context);
+    us4oemCompleteParkedPollRequest((PUS4OEM_CONTEXT)Context, (WDFREQUEST)Request, Consumed);
+}
+
+static int us4oemHandoffRequeue(void* Context, void* Request) {
+    return us4oemRequeuePollRequest((PUS4OEM_CONTEXT)Context, (WDFREQUEST)Request);
+}
+
+static const US4OEM_IRQ_HANDOFF_OPS us4oemHandoffOps = {
+    us4oemHandoffReady,
+    us4oemHandoffTakeWaiter,
+    us4oemHandoffConsume,
+    us4oemHandoffComplete,
+    us4oemHandoffRequeue,
+};
+
+// Hands pending IRQs to the parked poll request, if there are both and moderation allows it.
+// Called by the DPC after counting an IRQ, by the poll handler after parking a request, and by the
+// moderation timer, so whichever comes last sees every half (see IrqHandoff.h). The parked queue's lock
+// is only taken while somebody is waiting.
+// Must not be pageable.
+VOID us4oemServicePendingRequest(PUS4OEM_CONTEXT DeviceContext) {
+    if (!us4oemIrqHandoffService(&us4oemHandoffOps, DeviceContext)) {
+        return;
+    }
+
+    // Not enough IRQs for the waiter yet - make sure it doesn't wait past the deadline
+    if (us4oemIrqWaiterPresent(&DeviceContext->PollWaiting) && US4OEM_COUNTER_READ(DeviceContext, IrqPendingCount) > 0) {
+        us4oemModerationArmTimer(DeviceContext);
+    }
+}
+
+VOID us4oemEvtModerationTimer(WDFTIMER Timer) {
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext((WDFDEVICE)WdfTimerGetParentObject(Timer));
+
+    InterlockedExchange(&deviceContext->ModerationTimerArmed, 0);
+    us4oemServicePendingRequest(deviceContext);
+}
+
+// (Re)starts the POLL_EX timeout for a request parked with the given deadline, if it has one
+static VOID us4oemStartPollTimeout(PUS4OEM_CONTEXT DeviceContext, LONGLONG Deadline) {
+    if (Deadline != 0) {
+        LONGLONG remainingUs = (Deadline - us4oemLatencyTimestamp()) * 1000000LL / DeviceContext->QpcFrequency.QuadPart;
+        WdfTimerStart(DeviceContext->PollTimeoutTimer, WDF_REL_TIMEOUT_IN_US(max(remainingUs, 1)));
+    }
+}
+
+// Parks a poll request in the parked queue until IRQs arrive (or it times out, or gets canceled).
+// Only one request can wait at a time, any other gets STATUS_DEVICE_BUSY.
+static VOID us4oemParkPollRequest(PUS4OEM_CONTEXT DeviceContext, WDFREQUEST Request) {
+    // Read the deadline before parking, the request can be completed by the DPC as soon as it's visible
+    PUS4OEM_POLL_REQUEST_CONTEXT pollContext = us4oemGetPollRequestContext(Request);
+    LONGLONG deadline = pollContext != NULL ? pollContext->Deadline : 0;
+
+    if (!us4oemIrqWaiterClaim(&DeviceContext->PollWaiting)) {
+        us4oemEventRecord(DeviceContext, US4OEM_EVENT_POLL_BUSY, 1, 0);
+        us4oemPollRequestComplete(DeviceContext, Request, STATUS_DEVICE_BUSY, 0);
+        return;
+    }
+
+    us4oemQueueEnter(DeviceContext, US4OEM_QUEUE_PARKED, Request);
+
+    NTSTATUS status = WdfRequestForwardToIoQueue(Request, DeviceContext->Queues[US4OEM_QUEUE_PARKED]);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "WdfRequestForwardToIoQueue failed %!STATUS!", status);
+        us4oemQueueLeave(DeviceContext, US4OEM_QUEUE_PARKED, Request);
+        us4oemIrqWaiterRelease(&DeviceContext->PollWaiting);
+        us4oemPollRequestComplete(DeviceContext, Request, status, 0);
+        return;
+    }
+
+    us4oemEventRecord(DeviceContext, US4OEM_EVENT_POLL_PARKED, 0, 0);
+    us4oemStartPollTimeout(DeviceContext, deadline);
+
+    // An IRQ might have been counted after our check but before we parked, in which case the DPC
+    // found no waiter - make sure it doesn't sit there until the next one.
+    us4oemServicePendingRequest(DeviceContext);
+}
+
+// Times out the parked POLL_EX request. The timer is (re)started whenever such a request is parked, and never
+// stopped on completion, so it may fire for a request that's long gone - anything not yet due is put back.
+VOID us4oemEvtPollTimeoutTimer(WDFTIMER Timer) {
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext((WDFDEVICE)WdfTimerGetParentObject(Timer));
+
+    WDFREQUEST request = us4oemTakeParkedPollRequest(deviceContext);
+    if (request == NULL) {
+        return;
+    }
+
+    PUS4OEM_POLL_REQUEST_CONTEXT pollContext = us4oemGetPollRequestContext(request);
+    LONGLONG deadline = pollContext != NULL ? pollContext->Deadline : 0;
+
+    if (deadline != 0 && us4oemLatencyTimestamp() >= deadline) {
+        // Not an error - whatever arrived in the meantime still counts, we just stop waiting for more
+        LONG64 consumed = us4oemConsumePendingIrqs(deviceContext, request);
+        us4oemEventRecord(deviceContext, US4OEM_EVENT_POLL_TIMEOUT, (ULONG)consumed, 0);
+        us4oemCompleteParkedPollRequest(deviceContext, request, consumed);
+        return;
+    }
+
+    if (us4oemRequeuePollRequest(deviceContext, request)) {
+        us4oemStartPollTimeout(deviceContext, deadline);
+        us4oemServicePendingRequest(deviceContext);
+    }
+}
+
+// A parked poll was canceled, e.g. because its handle was closed
+VOID us4oemEvtParkedPollCanceled(WDFQUEUE Queue, WDFREQUEST Request) {
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(WdfIoQueueGetDevice(Queue));
+
+    us4oemQueueLeave(deviceContext, US4OEM_QUEUE_PARKED, Request);
+    us4oemIrqWaiterRelease(&deviceContext->PollWaiting);
+    us4oemPollRequestComplete(deviceContext, Request, STATUS_CANCELLED, 0);
+}
+
 VOID us4oemIoctlPoll(
-    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer
+    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength
 ) {
     UNREFERENCED_PARAMETER(InputBuffer);
     UNREFERENCED_PARAMETER(OutputBuffer);
-
-    PAGED_CODE();
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
 
     PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
 
-    // If there are IRQs left to be processed, we can complete the request immediately
-    if (deviceContext->Stats.irq_pending_count > 0) {
-        WdfRequestComplete(Request, STATUS_SUCCESS);
-        deviceContext->Stats.irq_pending_count--;
-        return;
+    us4oemRecordPollArrival(deviceContext);
+
+    // If there are IRQs left to be processed (and moderation agrees), we can complete the request immediately
+    if (us4oemModerationReady(deviceContext)) {
+        LONG64 consumed = us4oemConsumePendingIrqs(deviceContext, Request);
+        if (consumed > 0) {
+            us4oemCompletePollRequest(deviceContext, Request, consumed);
+            return;
+        }
     }
 
     // Wait for the interrupt to be signaled
-    if (deviceContext->PendingRequest) {
-        WdfRequestComplete(Request, STATUS_DEVICE_BUSY);
+    us4oemParkPollRequest(deviceContext, Request);
+}
+
+VOID us4oemIoctlPollEx(
+    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength
+) {
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBuffer);
+
+    us4oem_poll_ex_argument* arg = (us4oem_poll_ex_argument*)InputBuffer;
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+
+    us4oemRecordPollArrival(deviceContext);
+
+    // The context marks the request as POLL_EX for whoever ends up completing it
+    WDF_OBJECT_ATTRIBUTES attributes;
+    PUS4OEM_POLL_REQUEST_CONTEXT pollContext = NULL;
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, US4OEM_POLL_REQUEST_CONTEXT);
+
+    NTSTATUS status = WdfObjectAllocateContext(Request, &attributes, (PVOID*)&pollContext);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "WdfObjectAllocateContext failed %!STATUS!", status);
+        us4oemPollRequestComplete(deviceContext, Request, status, 0);
         return;
     }
-    deviceContext->PendingRequest = Request;
+
+    pollContext->MaxEvents = arg->max_events;
+    pollContext->Deadline = 0;
+
+    // A zero timeout never waits, even if nothing is pending
+    if (arg->timeout_us == 0 || us4oemModerationReady(deviceContext)) {
+        LONG64 consumed = us4oemConsumePendingIrqs(deviceContext, Request);
+        if (consumed > 0 || arg->timeout_us == 0) {
+            us4oemCompletePollRequest(deviceContext, Request, consumed);
+            return;
+        }
+    }
+
+    if (arg->timeout_us != US4OEM_POLL_TIMEOUT_INFINITE) {
+        pollContext->Deadline = us4oemLatencyTimestamp() +
+            (LONGLONG)arg->timeout_us * deviceContext->QpcFrequency.QuadPart / 1000000LL;
+    }
+
+    us4oemParkPollRequest(deviceContext, Request);
 }
 
 VOID us4oemIoctlPollNonBlocking(
-    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer
+    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength
 ) {
     UNREFERENCED_PARAMETER(InputBuffer);
     UNREFERENCED_PARAMETER(OutputBuffer);
-
-    PAGED_CODE();
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
 
     PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
 
-    // If there are IRQs left to be processed, we can complete the request immediately
-    if (deviceContext->Stats.irq_pending_count > 0) {
-        WdfRequestComplete(Request, STATUS_SUCCESS);
-        deviceContext->Stats.irq_pending_count--;
+    us4oemRecordPollArrival(deviceContext);
+
+    // If there are IRQs left to be processed, we can complete the request immediately.
+    // Moderation doesn't apply here, the caller explicitly asked not to wait.
+    LONG64 consumed = us4oemConsumePendingIrqs(deviceContext, Request);
+    if (consumed > 0) {
+        us4oemCompletePollRequest(deviceContext, Request, consumed);
         return;
     }
-    // No pending IRQs, complete with STATUS_DEVICE_BUSY
-    TraceEvents(TRACE_LEVEL_INFORMATION,
+    // No pending IRQs, complete with STATUS_DEVICE_BUSY. Callers spin on this, so no WPP in release builds.
+    us4oemEventRecord(deviceContext, US4OEM_EVENT_POLL_BUSY, 0, 0);
+    TraceHotPath(TRACE_LEVEL_VERBOSE,
         TRACE_IOCTL,
         "No pending IRQs, completing request with STATUS_DEVICE_BUSY");
-    WdfRequestComplete(Request, STATUS_DEVICE_BUSY);
+    us4oemPollRequestComplete(deviceContext, Request, STATUS_DEVICE_BUSY, 0);
 }
 
-VOID us4oemIoctlClearPending(
-    WDFDEVICE Device, WDFREQUEST Request, PVOID OutputBuffer, PVOID InputBuffer
+NTSTATUS us4oemIoctlClearPending(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
 ) {
+    UNREFERENCED_PARAMETER(BytesReturned);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
     UNREFERENCED_PARAMETER(OutputBuffer);
     UNREFERENCED_PARAMETER(InputBuffer);
 
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+
+    // Clear the pending IRQs
+    us4oemIrqPendingClear(&deviceContext->Counters.IrqPendingCount);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS us4oemIoctlSetIrqModeration(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(BytesReturned);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBuffer);
+
     PAGED_CODE();
 
+    us4oem_irq_moderation_argument* arg = (us4oem_irq_moderation_argument*)InputBuffer;
     PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
 
-    // Clear the pending IRQs
-    deviceContext->Stats.irq_pending_count = 0;
+    if (arg->max_irqs == US4OEM_IRQ_MODERATION_UNLIMITED && arg->max_delay_us == 0) {
+        // Waiters would never be completed
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "IRQ moderation needs a count or a time limit");
+        return STATUS_INVALID_PARAMETER;
+    }
 
-    WdfRequestComplete(Request, STATUS_SUCCESS);
-}
\ No newline at end of file
+    deviceContext->ModerationMaxDelayUs = arg->max_delay_us;
+    deviceContext->ModerationMaxIrqs = arg->max_irqs;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION,
+        TRACE_IOCTL,
+        "IRQ moderation set to %lu IRQs / %lu us",
+        arg->max_irqs, arg->max_delay_us);
+
+    // A waiter might be due under the new settings
+    us4oemServicePendingRequest(deviceContext);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,352 @@
+#include "ioctl.h"
+#include "teardown.h"
+#include "latency.h"
+#include "teardown.tmh"
+
+// The worker side runs in system threads, at PASSIVE_LEVEL but possibly with the device half torn down,
+// so only the entry points are pageable.
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, us4oemDmaTeardown)
+#pragma alloc_text (PAGE, us4oemDmaTeardownDrain)
+#pragma alloc_text (PAGE, us4oemIoctlSetTeardownOptions)
+#endif
+
+// Fewer buffers than this per thread aren't worth the work item
+#define US4OEM_TEARDOWN_MIN_BUFFERS_PER_WORKER 4
+
+typedef struct _US4OEM_TEARDOWN_JOB US4OEM_TEARDOWN_JOB, *PUS4OEM_TEARDOWN_JOB;
+
+// A run of consecutive scatter-gather entries released by one thread
+typedef struct _US4OEM_TEARDOWN_SLICE {
+    PUS4OEM_TEARDOWN_JOB Job;
+    PIO_WORKITEM WorkItem; // NULL if the slice is run by the thread that started the teardown
+    LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)* First;
+    ULONG Count;
+} US4OEM_TEARDOWN_SLICE, *PUS4OEM_TEARDOWN_SLICE;
+
+struct _US4OEM_TEARDOWN_JOB {
+    WDFMEMORY Memory; // Holds the job itself
+    PUS4OEM_CONTEXT DeviceContext;
+    BOOLEAN Async;
+    volatile LONG Remaining; // Slices not released yet
+    KEVENT Done; // Set once Remaining drops to 0, synchronous teardowns only
+    LONGLONG Start; // QPC
+    ULONG BufferCount;
+    LINKED_LIST_ENTRY_TYPE_FOR(WDFCOMMONBUFFER)* Contiguous; // Released along with the first slice
+    ULONG SliceCount;
+    US4OEM_TEARDOWN_SLICE Slices[US4OEM_TEARDOWN_MAX_WORKERS];
+};
+
+VOID us4oemDmaReleaseScatterGather(PUS4OEM_CONTEXT DeviceContext, MEMORY_ALLOCATION* Allocation) {
+    if (Allocation->length != 0) {
+        US4OEM_COUNTER_ADD(DeviceContext, DmaSgBytes, -(LONG64)Allocation->length);
+        US4OEM_COUNTER_ADD(DeviceContext, DmaSgChunks, -(LONG64)Allocation->chunk_count);
+        Allocation->length = 0;
+        Allocation->chunk_count = 0;
+    }
+    if (Allocation->transaction != NULL) {
+        WdfObjectDelete(Allocation->transaction);
+        Allocation->transaction = NULL;
+    }
+    if (Allocation->memory_locked) {
+        Allocation->memory_locked = FALSE;
+        MmUnlockPages(Allocation->mdl);
+    }
+    if (Allocation->memory != NULL) {
+        WdfObjectDelete(Allocation->memory);
+        Allocation->memory = NULL;
+    }
+    if (Allocation->mdl != NULL) {
+        IoFreeMdl(Allocation->mdl);
+        Allocation->mdl = NULL;
+    }
+}
+
+VOID us4oemDmaReleaseContiguous(PUS4OEM_CONTEXT DeviceContext, WDFCOMMONBUFFER CommonBuffer) {
+    US4OEM_COUNTER_ADD(DeviceContext, DmaContigBytes, -(LONG64)WdfCommonBufferGetLength(CommonBuffer));
+    WdfObjectDelete(CommonBuffer);
+}
+
+// Releases a detached run of contiguous buffers along with their list entries.
+// The pools are thread safe, so entries can go back to them from any thread.
+static VOID us4oemTeardownContiguous(PUS4OEM_CONTEXT DeviceContext, LINKED_LIST_ENTRY_TYPE_FOR(WDFCOMMONBUFFER)* Entry) {
+    while (Entry != NULL) {
+        LINKED_LIST_ENTRY_TYPE_FOR(WDFCOMMONBUFFER)* next = Entry->Next;
+
+        us4oemDmaReleaseContiguous(DeviceContext, *Entry->Item);
+        US4OEM_COUNTER_INCREMENT(DeviceContext, DmaContigFreeCount);
+        __LINKED_LIST_FREE(DeviceContext->DmaContiguousBuffersPool, Entry, sizeof(*Entry));
+
+        Entry = next;
+    }
+}
+
+// Same as above for Count scatter-gather buffers starting at Entry
+static VOID us4oemTeardownScatterGather(PUS4OEM_CONTEXT DeviceContext, LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)* Entry, ULONG Count) {
+    for (ULONG i = 0; i < Count && Entry != NULL; i++) {
+        LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)* next = Entry->Next;
+
+        us4oemDmaReleaseScatterGather(DeviceContext, Entry->Item);
+        US4OEM_COUNTER_INCREMENT(DeviceContext, DmaSgFreeCount);
+        __LINKED_LIST_FREE(DeviceContext->DmaScatterGatherMemoryPool, Entry, sizeof(*Entry));
+
+        Entry = next;
+    }
+}
+
+static VOID us4oemTeardownRecord(PUS4OEM_CONTEXT DeviceContext, LONGLONG Start, ULONG BufferCount, ULONG Workers) {
+    LONG64 ticks = us4oemLatencyTimestamp() - Start;
+
+    US4OEM_COUNTER_INCREMENT(DeviceContext, TeardownCount);
+    US4OEM_COUNTER_ADD(DeviceContext, TeardownBufferCount, BufferCount);
+    US4OEM_COUNTER_ADD(DeviceContext, TeardownTicks, ticks);
+    us4oemCounterRaiseMax(&DeviceContext->Counters.TeardownMaxTicks, ticks);
+    InterlockedExchange64(&DeviceContext->Counters.TeardownLastTicks, ticks);
+    InterlockedExchange64(&DeviceContext->Counters.TeardownLastWorkers, Workers);
+
+    us4oemStatsMarkDirty(DeviceContext);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER,
+        "Released %lu DMA buffers on %lu threads in %lld QPC ticks", BufferCount, Workers, ticks);
+}
+
+static VOID us4oemTeardownRunSlice(PUS4OEM_TEARDOWN_SLICE Slice) {
+    PUS4OEM_TEARDOWN_JOB job = Slice->Job;
+    PUS4OEM_CONTEXT deviceContext = job->DeviceContext;
+
+    if (Slice == &job->Slices[0]) {
+        us4oemTeardownContiguous(deviceContext, job->Contiguous);
+    }
+    us4oemTeardownScatterGather(deviceContext, Slice->First, Slice->Count);
+
+    if (InterlockedDecrement(&job->Remaining) != 0) {
+        return;
+    }
+
+    // Last slice done: this thread owns the job now
+    us4oemTeardownRecord(deviceContext, job->Start, job->BufferCount, job->SliceCount);
+
+    if (job->Async) {
+        WdfObjectDelete(job->Memory);
+        InterlockedDecrement(&deviceContext->TeardownsPending);
+    } else {
+        KeSetEvent(&job->Done, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+// IO_WORKITEM rather than ExQueueWorkItem: the I/O manager holds a reference on the device object until
+// the routine returns, so the driver can't be unloaded under a running asynchronous teardown.
+static VOID us4oemTeardownWorker(PDEVICE_OBJECT DeviceObject, PVOID Context) {
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    PUS4OEM_TEARDOWN_SLICE slice = (PUS4OEM_TEARDOWN_SLICE)Context;
+
+    // The item is already off the queue; the slice (and the job) may be gone once it has run
+    IoFreeWorkItem(slice->WorkItem);
+    us4oemTeardownRunSlice(slice);
+}
+
+// Takes the contiguous buffers picked by Lease (see us4oemDmaTeardown) out of the device's list and returns them
+// as a chain linked by Next, from here on only reachable from this teardown. Their handles go now too, so
+// RELEASE_HANDLE can't get at a buffer that's being torn down, and so do their mappings, which must not outlive
+// them. Called with DmaLock held.
+static LINKED_LIST_ENTRY_TYPE_FOR(WDFCOMMONBUFFER)* us4oemTeardownDetachContiguous(PUS4OEM_CONTEXT DeviceContext, ULONG Lease, ULONG* Count) {
+    LINKED_LIST_ENTRY_TYPE_FOR(WDFCOMMONBUFFER)* head = NULL;
+    LINKED_LIST_ENTRY_TYPE_FOR(WDFCOMMONBUFFER)* tail = NULL;
+    LINKED_LIST_ENTRY_TYPE_FOR(WDFCOMMONBUFFER)* entry = LINKED_LIST_HEAD(WDFCOMMONBUFFER, DeviceContext->DmaContiguousBuffers);
+
+    while (entry != NULL) {
+        LINKED_LIST_ENTRY_TYPE_FOR(WDFCOMMONBUFFER)* next = entry->Next;
+        PUS4OEM_COMMON_BUFFER_CONTEXT context = us4oemGetCommonBufferContext(*entry->Item);
+
+        if (Lease == US4OEM_TEARDOWN_ALL || context->Lease == Lease) {
+            LINKED_LIST_UNLINK(WDFCOMMONBUFFER, DeviceContext->DmaContiguousBuffers, entry);
+            us4oemHandleClose(DeviceContext, context->Handle, US4OEM_HANDLE_TYPE_CONTIGUOUS);
+            us4oemMemReleaseBufferMappings(DeviceContext, &context->Mappings);
+
+            entry->Next = NULL;
+            if (tail != NULL) {
+                tail->Next = entry;
+            } else {
+                head = entry;
+            }
+            tail = entry;
+            (*Count)++;
+        }
+
+        entry = next;
+    }
+
+    return head;
+}
+
+// Same for the scatter-gather buffers
+static LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)* us4oemTeardownDetachScatterGather(PUS4OEM_CONTEXT DeviceContext, ULONG Lease, ULONG* Count) {
+    LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)* head = NULL;
+    LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)* tail = NULL;
+    LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)* entry = LINKED_LIST_HEAD(MEMORY_ALLOCATION, DeviceContext->DmaScatterGatherMemory);
+
+    while (entry != NULL) {
+        LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)* next = entry->Next;
+
+        if (Lease == US4OEM_TEARDOWN_ALL || entry->Item->lease == Lease) {
+            LINKED_LIST_UNLINK(MEMORY_ALLOCATION, DeviceContext->DmaScatterGatherMemory, entry);
+            us4oemHandleClose(DeviceContext, entry->Item->handle, US4OEM_HANDLE_TYPE_SCATTER_GATHER);
+            us4oemMemReleaseBufferMappings(DeviceContext, &entry->Item->mappings);
+
+            entry->Next = NULL;
+            if (tail != NULL) {
+                tail->Next = entry;
+            } else {
+                head = entry;
+            }
+            tail = entry;
+            (*Count)++;
+        }
+
+        entry = next;
+    }
+
+    return head;
+}
+
+VOID us4oemDmaTeardown(WDFDEVICE Device, ULONG Lease, BOOLEAN Async) {
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    LONGLONG start = us4oemLatencyTimestamp();
+    ULONG contiguousCount = 0;
+    ULONG sgCount = 0;
+
+    WdfWaitLockAcquire(deviceContext->DmaLock, NULL);
+    LINKED_LIST_ENTRY_TYPE_FOR(WDFCOMMONBUFFER)* contiguous = us4oemTeardownDetachContiguous(deviceContext, Lease, &contiguousCount);
+    LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)* sg = us4oemTeardownDetachScatterGather(deviceContext, Lease, &sgCount);
+    WdfWaitLockRelease(deviceContext->DmaLock);
+
+    if (contiguousCount == 0 && sgCount == 0) {
+        return;
+    }
+
+    // The buffers no longer count as allocated, whenever they actually get released
+    US4OEM_COUNTER_ADD(deviceContext, DmaContigAllocCount, -(LONG64)contiguousCount);
+    US4OEM_COUNTER_ADD(deviceContext, DmaSgAllocCount, -(LONG64)sgCount);
+
+    ULONG workers = deviceContext->TeardownMaxWorkers;
+    if (workers == 0) {
+        workers = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    }
+    workers = min(workers, US4OEM_TEARDOWN_MAX_WORKERS);
+    workers = min(workers, max(1, sgCount / US4OEM_TEARDOWN_MIN_BUFFERS_PER_WORKER));
+
+    WDF_OBJECT_ATTRIBUTES attributes;
+    WDFMEMORY memory;
+    PUS4OEM_TEARDOWN_JOB job = NULL;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    NTSTATUS status = WdfMemoryCreate(&attributes, NonPagedPoolNx, 'r4su', sizeof(US4OEM_TEARDOWN_JOB), &memory, (PVOID*)&job);
+    if (!NT_SUCCESS(status)) {
+        // Still have to release everything, just do it here and now
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DRIVER, "WdfMemoryCreate failed for the teardown job %!STATUS!", status);
+        us4oemTeardownContiguous(deviceContext, contiguous);
+        us4oemTeardownScatterGather(deviceContext, sg, sgCount);
+        us4oemTeardownRecord(deviceContext, start, contiguousCount + sgCount, 1);
+        return;
+    }
+
+    RtlZeroMemory(job, sizeof(US4OEM_TEARDOWN_JOB));
+    job->Memory = memory;
+    job->DeviceContext = deviceContext;
+    job->Async = Async;
+    job->Start = start;
+    job->BufferCount = contiguousCount + sgCount;
+    job->Contiguous = contiguous;
+    job->SliceCount = workers;
+    job->Remaining = (LONG)workers;
+    KeInitializeEvent(&job->Done, NotificationEvent, FALSE);
+
+    // Split the SG list into runs of (nearly) equal length
+    LINKED_LIST_ENTRY_TYPE_FOR(MEMORY_ALLOCATION)* entry = sg;
+    for (ULONG i = 0; i < workers; i++) {
+        PUS4OEM_TEARDOWN_SLICE slice = &job->Slices[i];
+
+        slice->Job = job;
+        slice->First = entry;
+        slice->Count = sgCount / workers + (i < sgCount % workers ? 1 : 0);
+
+        for (ULONG j = 0; j < slice->Count; j++) {
+            entry = entry->Next;
+        }
+    }
+
+    if (Async) {
+        InterlockedIncrement(&deviceContext->TeardownsPending);
+    }
+
+    // A synchronous teardown keeps the first slice for this thread, it would only be waiting otherwise.
+    // Slices that can't get a work item are run here as well. The job stays alive as long as any slice
+    // hasn't run, but an asynchronous one can be gone once the last of them is queued or run.
+    PDEVICE_OBJECT deviceObject = WdfDeviceWdmGetDeviceObject(Device);
+    PUS4OEM_TEARDOWN_SLICE localSlices[US4OEM_TEARDOWN_MAX_WORKERS];
+    ULONG localCount = 0;
+
+    for (ULONG i = 0; i < workers; i++) {
+        PUS4OEM_TEARDOWN_SLICE slice = &job->Slices[i];
+
+        if (i > 0 || Async) {
+            slice->WorkItem = IoAllocateWorkItem(deviceObject);
+        }
+
+        if (slice->WorkItem != NULL) {
+            IoQueueWorkItem(slice->WorkItem, us4oemTeardownWorker, DelayedWorkQueue, slice);
+        } else {
+            localSlices[localCount++] = slice;
+        }
+    }
+
+    for (ULONG i = 0; i < localCount; i++) {
+        us4oemTeardownRunSlice(localSlices[i]);
+    }
+
+    if (!Async) {
+        KeWaitForSingleObject(&job->Done, Executive, KernelMode, FALSE, NULL);
+        WdfObjectDelete(job->Memory);
+    }
+}
+
+VOID us4oemDmaTeardownDrain(PUS4OEM_CONTEXT DeviceContext) {
+    PAGED_CODE();
+
+    LARGE_INTEGER interval;
+    interval.QuadPart = -10LL * 1000; // 1 ms, relative
+
+    while (InterlockedCompareExchange(&DeviceContext->TeardownsPending, 0, 0) != 0) {
+        KeDelayExecutionThread(KernelMode, FALSE, &interval);
+    }
+}
+
+NTSTATUS us4oemIoctlSetTeardownOptions(
+    WDFDEVICE Device, PVOID OutputBuffer, PVOID InputBuffer, size_t OutputBufferLength, size_t InputBufferLength, size_t* BytesReturned
+) {
+    UNREFERENCED_PARAMETER(OutputBuffer);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(BytesReturned);
+
+    PAGED_CODE();
+
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext(Device);
+    us4oem_teardown_options* options = (us4oem_teardown_options*)InputBuffer;
+
+    if ((options->flags & ~US4OEM_TEARDOWN_FLAG_ASYNC_CLOSE) != 0 || options->max_workers > US4OEM_TEARDOWN_MAX_WORKERS) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_IOCTL, "Invalid teardown options (flags 0x%lx, %lu workers)",
+            options->flags, options->max_workers);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    deviceContext->TeardownFlags = options->flags;
+    deviceContext->TeardownMaxWorkers = options->max_workers;
+
+    return STATUS_SUCCESS;
+}
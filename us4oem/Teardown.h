@@ -0,0 +1,31 @@
+#pragma once
+
+#include <ntddk.h>
+#include <wdf.h>
+
+#include "us4oem.h"
+
+EXTERN_C_START
+
+// Which buffers us4oemDmaTeardown releases: the ones kept by the lease with that id (see us4oemLeaseStart),
+// or one of these
+#define US4OEM_TEARDOWN_UNLEASED 0 // Those not kept by a lease, i.e. all of them unless a lease is running
+#define US4OEM_TEARDOWN_ALL MAXULONG
+
+// Releases DMA buffers of the device, picked by Lease. They're taken out of the lists up front (under DmaLock, which
+// must not be held by the caller), so new buffers can be allocated while the old ones are still being released.
+// Scatter-gather buffers are split across system worker threads.
+// With Async, returns as soon as the work is queued, otherwise once every buffer is released. PASSIVE_LEVEL only.
+VOID us4oemDmaTeardown(WDFDEVICE Device, ULONG Lease, BOOLEAN Async);
+
+// Waits until asynchronous teardowns started earlier are done. Must be called before the device goes away.
+VOID us4oemDmaTeardownDrain(PUS4OEM_CONTEXT DeviceContext);
+
+// Releases what a scatter-gather allocation holds: transaction, page lock, memory, MDL. Leaves the list entry
+// and the alloc/free counters alone, but takes the buffer off the byte and chunk gauges.
+VOID us4oemDmaReleaseScatterGather(PUS4OEM_CONTEXT DeviceContext, MEMORY_ALLOCATION* Allocation);
+
+// Same for a contiguous buffer: deletes it and takes it off the byte gauge.
+VOID us4oemDmaReleaseContiguous(PUS4OEM_CONTEXT DeviceContext, WDFCOMMONBUFFER CommonBuffer);
+
+EXTERN_C_END
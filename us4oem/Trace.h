@@ -38,6 +38,30 @@
 #define WPP_RECORDER_FLAGS_LEVEL_ARGS(flags, lvl) WPP_RECORDER_LEVEL_FLAGS_ARGS(lvl, flags)
 #define WPP_RECORDER_FLAGS_LEVEL_FILTER(flags, lvl) WPP_RECORDER_LEVEL_FLAGS_FILTER(lvl, flags)
 
+//
+// Trace points on the hot path (every IOCTL, every poll, every IRQ) use TraceHotPath instead of TraceEvents.
+// With the in-flight recorder every TraceEvents call formats its message, enabled or not; TraceHotPath calls
+// compile out completely unless US4OEM_HOT_PATH_TRACING is set (debug builds by default, or define it
+// in the project). For cheap diagnostics in release builds, use the binary event ring instead (see Events.h).
+//
+#ifndef US4OEM_HOT_PATH_TRACING
+#if DBG
+#define US4OEM_HOT_PATH_TRACING 1
+#else
+#define US4OEM_HOT_PATH_TRACING 0
+#endif
+#endif
+
+#define WPP_HOTPATH_LEVEL_FLAGS_LOGGER(hotpath, lvl, flags) \
+           WPP_LEVEL_LOGGER(flags)
+
+#define WPP_HOTPATH_LEVEL_FLAGS_ENABLED(hotpath, lvl, flags) \
+           (US4OEM_HOT_PATH_TRACING && WPP_LEVEL_FLAGS_ENABLED(lvl, flags))
+
+#define WPP_RECORDER_HOTPATH_LEVEL_FLAGS_ARGS(hotpath, lvl, flags) WPP_RECORDER_LEVEL_FLAGS_ARGS(lvl, flags)
+#define WPP_RECORDER_HOTPATH_LEVEL_FLAGS_FILTER(hotpath, lvl, flags) \
+           (US4OEM_HOT_PATH_TRACING && WPP_RECORDER_LEVEL_FLAGS_FILTER(lvl, flags))
+
 //
 // This comment block is scanned by the trace preprocessor to define our
 // Trace function.
@@ -45,5 +69,6 @@
 // begin_wpp config
 // FUNC Trace{FLAGS=MYDRIVER_ALL_INFO}(LEVEL, MSG, ...);
 // FUNC TraceEvents(LEVEL, FLAGS, MSG, ...);
+// FUNC TraceHotPath{HOTPATH=1}(LEVEL, FLAGS, MSG, ...);
 // end_wpp
 //
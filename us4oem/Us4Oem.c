@@ -12,6 +12,7 @@ us4oemCreateDevice(
 {
     WDF_OBJECT_ATTRIBUTES deviceAttributes;
 	WDF_OBJECT_ATTRIBUTES fileAttributes;
+    WDF_OBJECT_ATTRIBUTES requestAttributes;
     WDF_FILEOBJECT_CONFIG fileConfig;
     WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
     PUS4OEM_CONTEXT deviceContext;
@@ -25,10 +26,10 @@ us4oemCreateDevice(
         &fileConfig,
         us4oemEvtDeviceFileCreate,
         us4oemEvtFileClose,
-        WDF_NO_EVENT_CALLBACK
+        us4oemEvtFileCleanup
         );
 
-    WDF_OBJECT_ATTRIBUTES_INIT(&fileAttributes);
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&fileAttributes, US4OEM_FILE_CONTEXT);
 
     WdfDeviceInitSetFileObjectConfig(
         DeviceInit,
@@ -36,8 +37,17 @@ us4oemCreateDevice(
         &fileAttributes
     );
 
+    // Every request carries a US4OEM_REQUEST_CONTEXT, used for the queue statistics
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, US4OEM_REQUEST_CONTEXT);
+
+    WdfDeviceInitSetRequestAttributes(DeviceInit, &requestAttributes);
+
+    // Mapping IOCTLs are handled in the caller's thread, the rest is passed on to the queues
+    WdfDeviceInitSetIoInCallerContextCallback(DeviceInit, us4oemEvtIoInCallerContext);
+
     // Create device
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&deviceAttributes, US4OEM_CONTEXT);
+    deviceAttributes.EvtCleanupCallback = us4oemEvtDeviceContextCleanup;
 
 	// We want unbuffered I/O for this device (for performance)
     WdfDeviceInitSetIoType(DeviceInit, WdfDeviceIoDirect);
@@ -57,6 +67,36 @@ us4oemCreateDevice(
 		// Initialize the device context
 		RtlZeroMemory(deviceContext, sizeof(US4OEM_CONTEXT));
 
+        KeQueryPerformanceCounter(&deviceContext->QpcFrequency);
+
+        InitializeListHead(&deviceContext->Mappings);
+        InitializeListHead(&deviceContext->OpenFiles);
+
+        // Pools for the DMA buffer lists, so allocating and freeing list items doesn't go to the memory manager
+        status = LINKED_LIST_INITIALIZE(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers);
+        if (NT_SUCCESS(status)) {
+            status = LINKED_LIST_INITIALIZE(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory);
+            if (NT_SUCCESS(status)) {
+                deviceContext->DmaListsInitialized = TRUE;
+            } else {
+                LINKED_LIST_DELETE(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers);
+            }
+        }
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "ExInitializeLookasideListEx failed %!STATUS!", status);
+            return status;
+        }
+
+        WDF_OBJECT_ATTRIBUTES lockAttributes;
+        WDF_OBJECT_ATTRIBUTES_INIT(&lockAttributes);
+        lockAttributes.ParentObject = device;
+
+        status = WdfWaitLockCreate(&lockAttributes, &deviceContext->DmaLock);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "WdfWaitLockCreate failed for the DMA lists %!STATUS!", status);
+            return status;
+        }
+
         status = WdfDeviceCreateDeviceInterface(
             device,
             &GUID_DEVINTERFACE_us4oem,
@@ -93,8 +133,76 @@ us4oemCreateDevice(
                     &deviceContext->DmaEnabler
                 );
             }
+
+            if (NT_SUCCESS(status)) {
+                // Interrupt moderation timer; needs to be high resolution, as the delays are in microseconds
+                WDF_TIMER_CONFIG timerConfig;
+                WDF_OBJECT_ATTRIBUTES timerAttributes;
+
+                WDF_TIMER_CONFIG_INIT(&timerConfig, us4oemEvtModerationTimer);
+                timerConfig.UseHighResolutionTimer = WdfTrue;
+
+                WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
+                timerAttributes.ParentObject = device;
+
+                status = WdfTimerCreate(&timerConfig, &timerAttributes, &deviceContext->ModerationTimer);
+                if (!NT_SUCCESS(status)) {
+                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "WdfTimerCreate failed %!STATUS!", status);
+                }
+            }
+
+            if (NT_SUCCESS(status)) {
+                // POLL_EX timeout timer, same requirements as above
+                WDF_TIMER_CONFIG timerConfig;
+                WDF_OBJECT_ATTRIBUTES timerAttributes;
+
+                WDF_TIMER_CONFIG_INIT(&timerConfig, us4oemEvtPollTimeoutTimer);
+                timerConfig.UseHighResolutionTimer = WdfTrue;
+
+                WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
+                timerAttributes.ParentObject = device;
+
+                status = WdfTimerCreate(&timerConfig, &timerAttributes, &deviceContext->PollTimeoutTimer);
+                if (!NT_SUCCESS(status)) {
+                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "WdfTimerCreate failed %!STATUS!", status);
+                }
+            }
+
+            if (NT_SUCCESS(status)) {
+                status = us4oemEventInitialize(device);
+            }
+
+            if (NT_SUCCESS(status)) {
+                status = us4oemStatsInitialize(device);
+            }
+
+            if (NT_SUCCESS(status)) {
+                status = us4oemHandleInitialize(device);
+            }
+
+            if (NT_SUCCESS(status)) {
+                status = us4oemLeaseInitialize(device);
+            }
         }
     }
 
     return status;
-}
\ No newline at end of file
+}
+
+VOID
+us4oemEvtDeviceContextCleanup(
+    _In_ WDFOBJECT DeviceObject
+    )
+{
+    PUS4OEM_CONTEXT deviceContext = us4oemGetContext((WDFDEVICE)DeviceObject);
+
+    if (deviceContext->DmaListsInitialized) {
+        // The buffers themselves are released in us4oemEvtDeviceReleaseHardware, this only returns what's left of the lists
+        LINKED_LIST_CLEAR(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers);
+        LINKED_LIST_CLEAR(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory);
+
+        LINKED_LIST_DELETE(WDFCOMMONBUFFER, deviceContext->DmaContiguousBuffers);
+        LINKED_LIST_DELETE(MEMORY_ALLOCATION, deviceContext->DmaScatterGatherMemory);
+        deviceContext->DmaListsInitialized = FALSE;
+    }
+}
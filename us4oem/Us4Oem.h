@@ -30,8 +30,71 @@ typedef struct _MEMORY_ALLOCATION
 	PMDL mdl;
 	WDFDMATRANSACTION transaction;
 	BOOLEAN memory_locked;
+	SIZE_T length; // Bytes, for the statistics
+	ULONG chunk_count; // Scatter-gather elements the buffer is made of
+	us4oem_handle handle; // US4OEM_INVALID_HANDLE if the handle table was full
+	LIST_ENTRY mappings; // US4OEM_MAPPING.BufferLink, released before the buffer is
+	ULONG lease; // Id of the lease keeping the buffer, 0 if none; see us4oemLeaseStart
 } MEMORY_ALLOCATION, *PMEMORY_ALLOCATION;
 
+// Live counters behind us4oem_stats, see Stats.h for the accessors.
+// The IRQ counters are hammered by the DPC and the poll handlers on different CPUs, so each gets
+// its own cache line. The context itself is only 16-byte aligned, but fields >= 64 bytes apart
+// can never share a line regardless.
+typedef struct _US4OEM_COUNTERS
+{
+    DECLSPEC_CACHEALIGN volatile LONG64 IrqCount;
+    DECLSPEC_CACHEALIGN volatile LONG64 IrqPendingCount;
+
+    // Cold counters, these can share a line
+    DECLSPEC_CACHEALIGN volatile LONG64 DmaContigAllocCount;
+    volatile LONG64 DmaContigFreeCount;
+    volatile LONG64 DmaSgAllocCount;
+    volatile LONG64 DmaSgFreeCount;
+    volatile LONG64 FileOpenCount;
+    volatile LONG64 IoctlRejectedCount; // Unsupported IOCTLs, buffers too small, wrong IRQL
+
+    // DMA teardowns, see Teardown.c; times in QPC ticks
+    volatile LONG64 TeardownCount;
+    volatile LONG64 TeardownBufferCount;
+    volatile LONG64 TeardownTicks;
+    volatile LONG64 TeardownMaxTicks;
+    volatile LONG64 TeardownLastTicks;
+    volatile LONG64 TeardownLastWorkers;
+
+    // Gauges behind us4oem_extended_stats
+    volatile LONG64 DmaContigBytes;
+    volatile LONG64 DmaContigMaxBytes;
+    volatile LONG64 DmaSgBytes;
+    volatile LONG64 DmaSgChunks;
+    volatile LONG64 DmaSgMaxChunks;
+    volatile LONG64 MappedBytes;
+    volatile LONG64 MapCount;
+
+    // Written by every poll, so not with the cold counters
+    DECLSPEC_CACHEALIGN volatile LONG64 PollsInFlight;
+    volatile LONG64 PollsInFlightMax;
+    volatile LONG64 IrqIntervalEwma; // QPC ticks, only written by the DPC
+} US4OEM_COUNTERS;
+
+// Per-IOCTL statistics, see us4oem_ioctl_call_stats
+typedef struct _US4OEM_IOCTL_COUNTERS
+{
+    volatile LONG64 Calls;
+    volatile LONG64 Ticks; // QPC ticks spent in the handler, total
+    volatile LONG64 MaxTicks;
+} US4OEM_IOCTL_COUNTERS, *PUS4OEM_IOCTL_COUNTERS;
+
+// Per-queue statistics, see us4oem_queue_call_stats
+typedef struct _US4OEM_QUEUE_COUNTERS
+{
+    volatile LONG64 Requests;
+    volatile LONG64 Depth;
+    volatile LONG64 MaxDepth;
+    volatile LONG64 WaitTicks; // QPC ticks spent waiting in the queue, total
+    volatile LONG64 MaxWaitTicks;
+} US4OEM_QUEUE_COUNTERS, *PUS4OEM_QUEUE_COUNTERS;
+
 USE_IN_LINKED_LISTS(WDFCOMMONBUFFER);
 USE_IN_LINKED_LISTS(MEMORY_ALLOCATION);
 
@@ -42,14 +105,81 @@ typedef struct _US4OEM_CONTEXT
 
 	WDFINTERRUPT Interrupt; // Interrupt object for the device
 
-    us4oem_stats Stats; // Statistics for the device
-
-	WDFREQUEST PendingRequest; // Request that is waiting for an IRQ
+	// Queued by the ISR. A plain KDPC rather than the one built into WDFINTERRUPT, so we can pin it to a processor
+	// (and un-pin it again), see us4oemInterruptConfigureDpc.
+	KDPC InterruptDpc;
+	ULONG DpcTargetProcessor; // US4OEM_PROCESSOR_ANY when the DPC runs on whichever processor took the interrupt
+	ULONG DpcImportance; // KDPC_IMPORTANCE
+	volatile LONG DpcReconfiguring; // Set while the KDPC is being changed, the ISR doesn't queue it meanwhile
+	BOOLEAN DpcDeferred; // An IRQ came while DpcReconfiguring, protected by the interrupt lock
+
+    US4OEM_COUNTERS Counters; // Statistics for the device
+
+	// Read-only copy of the statistics mapped into clients, see us4oemStatsPublish
+	us4oem_shared_stats* SharedStats; // A page of its own
+	volatile LONG SharedStatsPublishing; // Set while a publish is writing the page
+	volatile LONG SharedStatsDirty; // Counters changed since the publish in progress took its snapshot
+	WDFTIMER StatsTimer; // Publishes what us4oemStatsMarkDirty left behind, when no DPC came along to do it
+	volatile LONG StatsTimerArmed;
+    US4OEM_IOCTL_COUNTERS IoctlCounters[US4OEM_IOCTL_STATS_SLOTS]; // Indexed by US4OEM_IOCTL_INDEX
+
+	// Set while a poll request is waiting for an IRQ in (or is being taken out of) the parked queue.
+	// Only one request can wait at a time, see us4oemParkPollRequest.
+	DECLSPEC_CACHEALIGN volatile LONG PollWaiting;
+
+	WDFQUEUE Queues[US4OEM_QUEUE_COUNT]; // Indexed by us4oem_queue, see us4oemQueueInitialize
+	US4OEM_QUEUE_COUNTERS QueueCounters[US4OEM_QUEUE_COUNT];
+
+	// Binary event rings, see Events.h. EventMask is checked at every recording point, and only changes by IOCTL.
+	volatile ULONG EventMask; // US4OEM_EVENT_MASK() bits of the event types being recorded
+	ULONG EventRingCount;
+	struct _US4OEM_EVENT_RING* EventRings; // One per processor, indexed by KeGetCurrentProcessorNumberEx
+
+	LARGE_INTEGER QpcFrequency; // Used to convert QPC ticks to time
+	volatile LONGLONG LastIsrTimestamp; // QPC at the most recent ISR
+	volatile LONGLONG LastDpcTimestamp; // QPC at the most recent DPC
+	volatile LONGLONG LastCompletionTimestamp; // QPC at the most recent poll completion, 0 once consumed by the next poll
+	us4oem_latency_stats Latency; // IRQ latency histograms
+
+	// Interrupt moderation, see US4OEM_WIN32_IOCTL_SET_IRQ_MODERATION
+	volatile ULONG ModerationMaxIrqs; // Complete waiters once this many IRQs are pending; <= 1 disables moderation
+	volatile ULONG ModerationMaxDelayUs; // ...or this long after the first pending IRQ; 0 for no time limit
+	volatile LONGLONG ModerationBatchStart; // QPC of the first IRQ counted since the pending count was last 0
+	WDFTIMER ModerationTimer; // Completes the waiter when the batch deadline passes
+	volatile LONG ModerationTimerArmed;
+
+	WDFTIMER PollTimeoutTimer; // Times out a parked POLL_EX request, see us4oemEvtPollTimeoutTimer
 
 	WDFDMAENABLER DmaEnabler; // DMA enabler for the device
 
 	BOOLEAN StickyMode; // If TRUE, buffers will be released as soon as the device handle is closed
 
+	// How DMA buffers are released, see US4OEM_WIN32_IOCTL_SET_TEARDOWN_OPTIONS and Teardown.c
+	volatile ULONG TeardownFlags; // US4OEM_TEARDOWN_FLAG_*
+	volatile ULONG TeardownMaxWorkers; // 0 for one per processor
+	volatile LONG TeardownsPending; // Asynchronous teardowns still running
+
+	// DMA buffers kept past a close in sticky mode, see US4OEM_WIN32_IOCTL_SET_LEASE and Lease.c
+	volatile LONG64 LeaseToken; // 0 if no lease is set
+	volatile ULONG LeaseDurationMs;
+	volatile LONG LeaseRunning; // Set from close until attached or run out, under DmaLock; whoever clears it decides the buffers' fate
+	ULONG LeaseId; // Of the running (or last) lease, stamped on the buffers it keeps; under DmaLock
+	WDFTIMER LeaseTimer; // Passive level, releases the buffers when the lease runs out
+
+	// Handles of the DMA buffers and mappings, see Handle.h. Free slots are a list threaded through the table.
+	struct _US4OEM_HANDLE_ENTRY* Handles; // US4OEM_MAX_HANDLES slots
+	ULONG HandleFreeHead; // Index + 1 of the first free slot, 0 if the table is full
+	WDFSPINLOCK HandleLock;
+
+	BOOLEAN DmaListsInitialized; // The pools of the lists below are set up, see us4oemCreateDevice
+
+	// Held while the lists below are changed or walked, and while a buffer found in them is being mapped.
+	// Passive level only; the handle table has a lock of its own and can be used under this one.
+	WDFWAITLOCK DmaLock;
+
+	LIST_ENTRY Mappings; // Every US4OEM_MAPPING.Link, see Mem.c
+	LIST_ENTRY OpenFiles; // US4OEM_FILE_CONTEXT.Link of every open handle, so the mappings of a process can go with its last one
+
 	LINKED_LIST_POINTERS(WDFCOMMONBUFFER, DmaContiguousBuffers) // Linked list of contiguous DMA buffers
 
 	LINKED_LIST_POINTERS(MEMORY_ALLOCATION, DmaScatterGatherMemory) // Linked list of scatter-gather DMA buffers
@@ -10,6 +10,8 @@
 #include <initguid.h> 
 #endif
 
+#include <stddef.h>
+
 // Driver version
 typedef unsigned long us4oem_driver_version_t;
 
@@ -23,7 +25,7 @@ typedef unsigned long us4oem_driver_version_t;
 
 // Can be used to check if the driver version is compatible with the application.
 // Also used in the IOCTL handler itself.
-#define US4OEM_DRIVER_VERSION ASSEMBLE_US4OEM_DRIVER_VERSION(0, 6, 2)
+#define US4OEM_DRIVER_VERSION ASSEMBLE_US4OEM_DRIVER_VERSION(0, 7, 0)
 
 // Define an Interface Guid so that apps can find the device and talk to it.
 DEFINE_GUID (GUID_DEVINTERFACE_us4oem,
@@ -47,11 +49,13 @@ DEFINE_GUID (GUID_DEVINTERFACE_us4oem,
 // Synchronization mechanism for user-mode applications to access the device.
 // The request will complete when there's a pending IRQ to be handled, if there's none it will wait
 // until an IRQ is received. Note this might block the thread, so use with caution.
+// Optionally returns us4oem_poll_response in the output buffer, if one large enough is provided.
 #define US4OEM_WIN32_IOCTL_POLL \
     CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 3, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 // Non-blocking version of the above. It will complete immediately if there's a pending IRQ,
 // otherwise it will complete with STATUS_DEVICE_BUSY.
+// Optionally returns us4oem_poll_response in the output buffer, if one large enough is provided.
 #define US4OEM_WIN32_IOCTL_POLL_NONBLOCKING \
     CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 4, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
@@ -66,6 +70,8 @@ DEFINE_GUID (GUID_DEVINTERFACE_us4oem,
 
 // Allocate a scatter-gather DMA buffer. Call with us4oem_dma_allocation_argument in the input buffer.
 // Returns us4oem_dma_scatter_gather_buffer_response in the output buffer.
+// Fails with STATUS_BUFFER_TOO_SMALL if the output buffer can't hold every chunk; in a batch, the response's
+// chunk_count and length_used then tell the size needed.
 // Note: length MUST be <= US4OEM_DMA_SG_MAX_SIZE
 #define US4OEM_WIN32_IOCTL_ALLOCATE_DMA_SG_BUFFER \
     CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 7, METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -78,7 +84,7 @@ DEFINE_GUID (GUID_DEVINTERFACE_us4oem,
 #define US4OEM_WIN32_IOCTL_DEALLOCATE_DMA_SG_BUFFER \
     CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 9, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
-// Deallocate all DMA buffers allocated by the device.
+// Deallocate all DMA buffers allocated by the device, except the ones kept by a running lease (see SET_LEASE).
 #define US4OEM_WIN32_IOCTL_DEALLOCATE_ALL_DMA_BUFFERS \
     CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 10, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
@@ -87,19 +93,171 @@ DEFINE_GUID (GUID_DEVINTERFACE_us4oem,
 #define US4OEM_WIN32_IOCTL_SET_STICKY_MODE \
     CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 11, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+// Read the IRQ latency histograms. Returns us4oem_latency_stats in the output buffer.
+#define US4OEM_WIN32_IOCTL_READ_LATENCY_STATS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 12, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Configure interrupt moderation: blocking polls complete once enough IRQs are pending or enough time has
+// passed since the first of them, whichever comes first, consuming all pending IRQs at once.
+// Call with us4oem_irq_moderation_argument in the input buffer.
+#define US4OEM_WIN32_IOCTL_SET_IRQ_MODERATION \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 13, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Poll with a timeout, consuming up to a given number of pending IRQs at once.
+// Call with us4oem_poll_ex_argument in the input buffer, returns us4oem_poll_ex_response.
+// Completes successfully on timeout too, with consumed set to 0.
+#define US4OEM_WIN32_IOCTL_POLL_EX \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 14, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Set the processors the interrupt and its DPC run on. Call with us4oem_irq_affinity_argument in the input buffer.
+// DPC settings apply immediately (fails with ERROR_BUSY while another call is changing them). The interrupt affinity is stored in the device's registry key and applies
+// the next time the device is started (a connected interrupt can't be moved).
+// The effective settings are reported by US4OEM_WIN32_IOCTL_READ_STATS.
+#define US4OEM_WIN32_IOCTL_SET_IRQ_AFFINITY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 15, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Read per-IOCTL call counts and handler times, returns us4oem_ioctl_stats.
+#define US4OEM_WIN32_IOCTL_READ_IOCTL_STATS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 16, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Execute several IOCTLs in one call. Pass the same buffer as input and output: us4oem_batch_header followed by
+// the commands, see us4oem_batch_command. The results are written back in place; returns header.total_length bytes.
+// Only IOCTLs that complete immediately can be batched (e.g. not the polls). A batch with DMA allocations or
+// deallocations waits its turn behind the other ones; such a batch can't also map or release a handle
+// (US4OEM_WIN32_IOCTL_MMAP, US4OEM_WIN32_IOCTL_RELEASE_HANDLE), as those run in the calling thread, and fails with
+// STATUS_INVALID_PARAMETER.
+#define US4OEM_WIN32_IOCTL_SUBMIT_BATCH \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 17, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Read request counts, depths and wait times of the driver's I/O queues, returns us4oem_queue_stats.
+#define US4OEM_WIN32_IOCTL_READ_QUEUE_STATS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 18, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Read and write BAR 0/4 registers without mapping the BAR, for clients that aren't allowed to.
+// Pass the same buffer as input and output: us4oem_reg_access_header followed by op_count us4oem_reg_op.
+// The operations run in order until the first failure; results are written back in place.
+// In a batch, reserve an output of the same size as the input; the results are written there instead.
+#define US4OEM_WIN32_IOCTL_REGISTER_ACCESS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 19, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Returns us4oem_capabilities, truncated to the output buffer (at least US4OEM_CAPABILITIES_MIN_SIZE bytes).
+// The size field says how much of it the driver knows about; anything past that is left zeroed.
+#define US4OEM_WIN32_IOCTL_GET_CAPABILITIES \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 20, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Takes us4oem_event_read_argument and returns us4oem_event_ring, the recent events of one processor.
+#define US4OEM_WIN32_IOCTL_READ_EVENTS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 21, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Takes an unsigned long mask of US4OEM_EVENT_MASK() bits, the event types to record from now on; 0 stops recording.
+#define US4OEM_WIN32_IOCTL_SET_EVENT_MASK \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 22, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Configure how DMA buffers are released on close (in sticky mode), DEALLOCATE_ALL_DMA_BUFFERS and device removal.
+// Call with us4oem_teardown_options in the input buffer. Timings are reported by US4OEM_WIN32_IOCTL_READ_STATS.
+#define US4OEM_WIN32_IOCTL_SET_TEARDOWN_OPTIONS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 23, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Returns us4oem_extended_stats (gauges, rates and per-IOCTL counts), truncated to the output buffer
+// (at least US4OEM_EXTENDED_STATS_MIN_SIZE bytes). The size field says how much of it the driver filled in.
+#define US4OEM_WIN32_IOCTL_READ_EXTENDED_STATS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 24, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Release a DMA buffer or a mapping by its handle (see us4oem_handle). Call with us4oem_handle in the input buffer.
+// DMA buffers are deallocated like with DEALLOCATE_*, mappings are unmapped; only the process that made a mapping can do that.
+// A buffer's mappings are unmapped along with it, and a process's mappings once it has closed its last handle to the device.
+#define US4OEM_WIN32_IOCTL_RELEASE_HANDLE \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 25, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Keep the DMA buffers alive for a while after the device is closed in sticky mode, so a restarted process can
+// take them over instead of allocating again. Call with us4oem_lease_argument in the input buffer; a token or
+// duration of 0 clears the lease. The setting stays until it's changed, every close in sticky mode starts it.
+#define US4OEM_WIN32_IOCTL_SET_LEASE \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 26, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Take over the buffers of a running lease, call with the lease's token (unsigned long long) in the input buffer.
+// The buffers and their handles stay as they were. Fails with STATUS_NOT_FOUND if no lease is running (never set,
+// or it ran out and the buffers are gone) and STATUS_ACCESS_DENIED if the token doesn't match.
+// A lease keeps the buffers the device had when it started; buffers allocated while it runs aren't part of it and
+// are left alone when it runs out. Only one lease runs at a time, a sticky close during it releases that client's
+// own buffers right away.
+#define US4OEM_WIN32_IOCTL_ATTACH_LEASE \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, US4OEM_WIN32_IOCTL_BASE + 27, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
 // ====== Driver Information Structure ======
 typedef struct _us4oem_driver_info {
     us4oem_driver_version_t version; // Driver version
     char name[32]; // Driver name, e.g. "us4oem win32 driver"
 } us4oem_driver_info;
 
+// ====== Capabilities Structure ======
+
+#define US4OEM_CAPABILITIES_VERSION 1 // Bumped whenever fields are appended to us4oem_capabilities
+
+// Optional features, for us4oem_capabilities.features
+#define US4OEM_CAPABILITY_POLL_EX 0x1 // US4OEM_WIN32_IOCTL_POLL_EX
+#define US4OEM_CAPABILITY_IRQ_MODERATION 0x2 // US4OEM_WIN32_IOCTL_SET_IRQ_MODERATION
+#define US4OEM_CAPABILITY_IRQ_AFFINITY 0x4 // US4OEM_WIN32_IOCTL_SET_IRQ_AFFINITY
+#define US4OEM_CAPABILITY_LATENCY_STATS 0x8 // US4OEM_WIN32_IOCTL_READ_LATENCY_STATS
+#define US4OEM_CAPABILITY_IOCTL_STATS 0x10 // US4OEM_WIN32_IOCTL_READ_IOCTL_STATS
+#define US4OEM_CAPABILITY_QUEUE_STATS 0x20 // US4OEM_WIN32_IOCTL_READ_QUEUE_STATS
+#define US4OEM_CAPABILITY_BATCH 0x40 // US4OEM_WIN32_IOCTL_SUBMIT_BATCH
+#define US4OEM_CAPABILITY_REGISTER_ACCESS 0x80 // US4OEM_WIN32_IOCTL_REGISTER_ACCESS
+#define US4OEM_CAPABILITY_MSI 0x100 // The interrupt is message signaled, see msi_vector_count
+#define US4OEM_CAPABILITY_NUMA_NODE 0x200 // numa_node is known
+#define US4OEM_CAPABILITY_EVENT_RING 0x400 // US4OEM_WIN32_IOCTL_READ_EVENTS
+#define US4OEM_CAPABILITY_TEARDOWN 0x800 // US4OEM_WIN32_IOCTL_SET_TEARDOWN_OPTIONS, teardown fields of us4oem_stats
+#define US4OEM_CAPABILITY_SHARED_STATS 0x1000 // MMAP_AREA_STATS, see us4oem_shared_stats
+#define US4OEM_CAPABILITY_EXTENDED_STATS 0x2000 // US4OEM_WIN32_IOCTL_READ_EXTENDED_STATS
+#define US4OEM_CAPABILITY_HANDLES 0x4000 // US4OEM_WIN32_IOCTL_RELEASE_HANDLE, mapping DMA buffers by handle
+#define US4OEM_CAPABILITY_MMAP_AT_ADDRESS 0x8000 // us4oem_mmap_argument::address
+#define US4OEM_CAPABILITY_LEASE 0x10000 // US4OEM_WIN32_IOCTL_SET_LEASE, US4OEM_WIN32_IOCTL_ATTACH_LEASE
+
+#define US4OEM_NUMA_NODE_UNKNOWN ((unsigned long)0xFFFFFFFF)
+
+typedef struct _us4oem_capabilities {
+    unsigned long size; // Bytes of this structure filled in by the driver
+    unsigned long version; // US4OEM_CAPABILITIES_VERSION the driver was built with
+    us4oem_driver_version_t driver_version; // Same as in us4oem_driver_info
+    unsigned long reserved;
+    unsigned long long features; // US4OEM_CAPABILITY_*
+
+    // Limits
+    unsigned long long max_dma_contig_size; // Largest contiguous DMA allocation, in bytes
+    unsigned long long max_dma_sg_size; // Largest scatter-gather DMA allocation, in bytes
+    unsigned long max_sg_chunks; // Most chunks a scatter-gather allocation can be made of
+    unsigned long page_size; // In bytes
+    unsigned long large_page_size; // In bytes, 0 if DMA buffers never use large pages
+    unsigned long msi_vector_count; // Message signaled interrupts in use, 0 for a line based interrupt
+    unsigned long max_batch_commands; // US4OEM_BATCH_MAX_COMMANDS
+    unsigned long max_reg_ops; // US4OEM_REG_MAX_OPS
+    unsigned long numa_node; // NUMA node of the device, US4OEM_NUMA_NODE_UNKNOWN if not known
+    unsigned long reserved2;
+} us4oem_capabilities;
+
+// Shortest output buffer GET_CAPABILITIES accepts: everything up to and including features.
+#define US4OEM_CAPABILITIES_MIN_SIZE (4 * sizeof(unsigned long) + sizeof(unsigned long long))
+
+// ====== Handles ======
+
+// DMA buffers and mappings get a handle when they're created. It identifies them in constant time, unlike
+// their VA/PA, which the driver has to search its lists for. Opaque; handles of released objects are never reused.
+typedef unsigned long long us4oem_handle;
+
+#define US4OEM_INVALID_HANDLE ((us4oem_handle)0)
+
+// Handles alive at once, per device. DMA buffers created past that work as before, they just get US4OEM_INVALID_HANDLE;
+// mapping fails with STATUS_INSUFFICIENT_RESOURCES instead, as a mapping without a handle could never be released.
+#define US4OEM_MAX_HANDLES 4096
+
 // ====== Memory Mapping Area Definitions ======
 
 typedef enum _us4oem_mmap_area {
     MMAP_AREA_BAR_0 = 0, // BAR 0 ("PCIDMA", 512 KiB = 0x0200)
     MMAP_AREA_BAR_4 = 1, // BAR 4 ("US4OEM", 64 MiB = 0x0400_0000)
     MMAP_AREA_DMA = 2, // Any DMA allocation (specify VA)
-    MMAP_AREA_MAX = MMAP_AREA_DMA
+    MMAP_AREA_STATS = 3, // The shared statistics page (us4oem_shared_stats), read-only
+    MMAP_AREA_MAX = MMAP_AREA_STATS
 } us4oem_mmap_area;
 
 typedef struct _us4oem_mmap_argument {
@@ -107,11 +265,20 @@ typedef struct _us4oem_mmap_argument {
 	void* va; // Virtual address for DMA allocations
 
     unsigned long length_limit; // Maps the whole area if 0
+    us4oem_handle handle; // DMA allocation to map instead of the one at va, if not US4OEM_INVALID_HANDLE
+
+    // Where to map the area in the caller's address space, NULL to let the system choose. Must be free and
+    // aligned to the allocation granularity (64 KiB); the IOCTL fails rather than map it anywhere else.
+    // Needs US4OEM_CAPABILITY_MMAP_AT_ADDRESS, older callers can leave it out (US4OEM_MMAP_ARGUMENT_MIN_SIZE).
+    void* address;
 } us4oem_mmap_argument;
 
+#define US4OEM_MMAP_ARGUMENT_MIN_SIZE offsetof(us4oem_mmap_argument, address)
+
 typedef struct _us4oem_mmap_response {
     void* address;
     unsigned long length_mapped;
+    us4oem_handle handle; // Of the mapping, to unmap it with US4OEM_WIN32_IOCTL_RELEASE_HANDLE
 } us4oem_mmap_response;
 
 // ====== Statistics Structure ======
@@ -129,8 +296,323 @@ typedef struct _us4oem_stats
 
     size_t file_open_count; // Number of times the device char device has been opened to be used by a client
 
+    // Interrupt and DPC placement, see US4OEM_WIN32_IOCTL_SET_IRQ_AFFINITY
+    unsigned long long irq_affinity; // Processors the interrupt is delivered to, within irq_affinity_group
+    unsigned short irq_affinity_group;
+    unsigned long dpc_target_processor; // Processor index the DPC is pinned to, US4OEM_PROCESSOR_ANY if it isn't
+    unsigned long dpc_importance; // US4OEM_DPC_IMPORTANCE_*
+
+    // DMA teardowns (close in sticky mode, DEALLOCATE_ALL_DMA_BUFFERS, device removal) that released anything.
+    // Times are QPC ticks from the start of the teardown to the last buffer released.
+    unsigned long long teardown_count;
+    unsigned long long teardown_buffer_count; // Buffers released by them, total
+    long long teardown_ticks; // Total
+    long long teardown_max_ticks;
+    long long teardown_last_ticks;
+    unsigned long teardown_last_workers; // Threads the most recent teardown was split across
+    unsigned long teardown_pending; // Asynchronous teardowns still running, see US4OEM_TEARDOWN_FLAG_ASYNC_CLOSE
+
 } us4oem_stats;
 
+// Sizes of older versions of us4oem_stats, READ_STATS accepts any of them:
+// before the affinity fields were added, and before the teardown fields were added.
+#define US4OEM_STATS_MIN_SIZE (7 * sizeof(size_t))
+#define US4OEM_STATS_AFFINITY_SIZE offsetof(us4oem_stats, teardown_count)
+
+// ====== Shared Statistics Page ======
+
+// The driver keeps a copy of us4oem_stats in a page that clients can map read-only (MMAP_AREA_STATS),
+// so reading the statistics takes no system call. The driver updates it on every interrupt, and otherwise
+// within about 10 ms of the counters changing (US4OEM_STATS_PUBLISH_DELAY_MS), so it may lag an IOCTL slightly.
+//
+// The page is a seqlock; the driver is the only writer, and never leaves an update half done:
+//   writer: sequence = odd (sequence + 1), write stats, sequence = even (sequence + 1)
+//   reader: read sequence, retry while it's odd; copy stats; read sequence again, retry if it changed.
+// Both sides need acquire/release ordering around the sequence, see the SDK's Us4OemSharedStats.
+typedef struct _us4oem_shared_stats {
+    volatile unsigned long long sequence; // Odd while an update is in progress
+    unsigned long size; // sizeof(us4oem_stats) the driver was built with, copy no more than this
+    unsigned long reserved;
+    long long publish_timestamp; // QPC of the most recent update
+    us4oem_stats stats;
+} us4oem_shared_stats;
+
+// ====== IRQ Latency Structures ======
+
+// All timestamps are raw QueryPerformanceCounter/KeQueryPerformanceCounter ticks, which share
+// the same time base in user and kernel mode. A timestamp of 0 means it was not recorded.
+typedef struct _us4oem_poll_response {
+    long long isr_timestamp; // When the ISR of the most recent IRQ ran
+    long long dpc_timestamp; // When the DPC of the most recent IRQ ran
+    long long completion_timestamp; // When the poll request was completed by the driver
+    long long qpc_frequency; // Ticks per second
+    unsigned long irq_coalesced; // Number of IRQs consumed by this poll, > 1 when moderation is enabled
+} us4oem_poll_response;
+
+// Size of us4oem_poll_response before irq_coalesced was added; shorter buffers get no response at all.
+#define US4OEM_POLL_RESPONSE_MIN_SIZE (4 * sizeof(long long))
+
+#define US4OEM_POLL_TIMEOUT_INFINITE ((unsigned long)0xFFFFFFFF)
+
+typedef struct _us4oem_poll_ex_argument {
+    unsigned long timeout_us; // How long to wait for an IRQ; 0 to not wait at all, US4OEM_POLL_TIMEOUT_INFINITE to wait forever
+    unsigned long max_events; // Consume at most this many pending IRQs, 0 for all of them
+} us4oem_poll_ex_argument;
+
+typedef struct _us4oem_poll_ex_response {
+    unsigned long long consumed; // IRQs consumed by this poll, 0 if it timed out
+    unsigned long long remaining; // IRQs still pending afterwards
+    us4oem_poll_response timestamps; // Same as returned by US4OEM_WIN32_IOCTL_POLL
+} us4oem_poll_ex_response;
+
+#define US4OEM_LATENCY_HISTOGRAM_BUCKETS 32
+
+// Log2 histogram: bucket i counts samples in [2^i, 2^(i+1)) ns; bucket 0 also holds 0 ns
+// and the last bucket holds everything above its lower bound.
+typedef struct _us4oem_latency_histogram {
+    unsigned long long buckets[US4OEM_LATENCY_HISTOGRAM_BUCKETS];
+    unsigned long long sample_count; // Total number of samples recorded
+    unsigned long long total_ns; // Sum of all samples, for computing the mean
+    unsigned long long max_ns; // Largest sample recorded
+} us4oem_latency_histogram;
+
+typedef struct _us4oem_latency_stats {
+    us4oem_latency_histogram isr_to_dpc; // ISR entry -> DPC entry
+    us4oem_latency_histogram dpc_to_completion; // DPC entry -> poll request completion
+    us4oem_latency_histogram completion_to_next_poll; // Poll completion -> next poll request arriving
+} us4oem_latency_stats;
+
+// ====== IOCTL Statistics ======
+
+#define US4OEM_IOCTL_STATS_SLOTS 64
+
+typedef struct _us4oem_ioctl_call_stats {
+    unsigned long long calls;
+    unsigned long long total_ns; // Time spent in the handler; doesn't include time a request spends parked (e.g. polls)
+    unsigned long long max_ns;
+} us4oem_ioctl_call_stats;
+
+typedef struct _us4oem_ioctl_stats {
+    us4oem_ioctl_call_stats ioctls[US4OEM_IOCTL_STATS_SLOTS]; // Indexed by IOCTL function code - US4OEM_WIN32_IOCTL_BASE
+    unsigned long long rejected; // Unsupported IOCTLs, buffers too small, etc.
+} us4oem_ioctl_stats;
+
+// ====== Extended Statistics ======
+
+#define US4OEM_EXTENDED_STATS_VERSION 1 // Bumped whenever fields are appended to us4oem_extended_stats
+
+// Gauges (current values) and totals for capacity planning. Every snapshot carries its own timestamp,
+// so rates can be computed from two of them.
+typedef struct _us4oem_extended_stats {
+    unsigned long size; // Bytes of this structure filled in by the driver
+    unsigned long version; // US4OEM_EXTENDED_STATS_VERSION the driver was built with
+    long long timestamp; // QPC when the snapshot was taken
+    long long qpc_frequency;
+
+    // IRQs
+    unsigned long long irq_count; // Same as us4oem_stats.irq_count
+    long long irq_interval_ewma_ticks; // Moving average (weight 1/8) of the QPC ticks between IRQs, 0 before the second one
+    long long last_irq_timestamp; // QPC of the most recent IRQ's DPC, 0 if there was none
+
+    // DMA memory
+    unsigned long long dma_contig_bytes; // In contiguous DMA buffers currently allocated
+    unsigned long long dma_contig_max_bytes; // Largest contiguous DMA buffer allocated so far
+    unsigned long long dma_sg_bytes; // In scatter-gather DMA buffers currently allocated
+    unsigned long long dma_sg_chunks; // Chunks the current scatter-gather buffers are made of, total
+    unsigned long long dma_sg_max_chunks; // Most chunks a single scatter-gather buffer was made of so far
+    unsigned long long bytes_pinned; // Non-pageable DMA memory, dma_contig_bytes + dma_sg_bytes
+
+    // User space mappings (BARs, DMA buffers, the statistics page)
+    unsigned long long bytes_mapped; // Mapped and not unmapped yet
+    unsigned long long map_count; // Mappings made so far
+
+    // Polls
+    unsigned long long polls_in_flight; // Poll requests in the driver right now, waiting or being completed
+    unsigned long long polls_in_flight_max; // Peak of the above
+
+    unsigned long long ioctl_calls[US4OEM_IOCTL_STATS_SLOTS]; // Indexed like us4oem_ioctl_stats.ioctls
+} us4oem_extended_stats;
+
+// Shortest output buffer READ_EXTENDED_STATS accepts: everything up to and including qpc_frequency.
+#define US4OEM_EXTENDED_STATS_MIN_SIZE (2 * sizeof(unsigned long) + 2 * sizeof(long long))
+
+// ====== I/O Queues ======
+
+// IOCTLs are spread over several queues, so slow ones (e.g. a large SG allocation) don't hold up the polls
+typedef enum _us4oem_queue {
+    US4OEM_QUEUE_DEFAULT = 0, // Everything not listed below; mapping, RELEASE_HANDLE and batches run in the caller's thread and count here
+    US4OEM_QUEUE_FAST = 1, // Polls, statistics and IRQ control
+    US4OEM_QUEUE_SEQUENTIAL = 2, // DMA allocation and deallocation, one at a time
+    US4OEM_QUEUE_PARKED = 3, // Blocking polls waiting for an IRQ
+    US4OEM_QUEUE_COUNT
+} us4oem_queue;
+
+typedef struct _us4oem_queue_call_stats {
+    unsigned long long requests; // Requests that entered the queue
+    unsigned long long depth; // Requests waiting in the queue right now
+    unsigned long long max_depth;
+    unsigned long long total_wait_ns; // Time spent waiting in the queue; for parked polls, until completed or cancelled
+    unsigned long long max_wait_ns;
+} us4oem_queue_call_stats;
+
+typedef struct _us4oem_queue_stats {
+    us4oem_queue_call_stats queues[US4OEM_QUEUE_COUNT]; // Indexed by us4oem_queue
+} us4oem_queue_stats;
+
+// ====== Event Ring ======
+
+// The driver keeps the most recent events of each processor in a ring of fixed-size binary records.
+// Recording an event costs a few stores, unlike a formatted trace message, so it can stay enabled in production.
+#define US4OEM_EVENT_RING_SIZE 128 // Events kept per processor, a power of two
+
+typedef enum _us4oem_event_type {
+    US4OEM_EVENT_ISR = 0, // arg0: message ID
+    US4OEM_EVENT_DPC = 1, // arg0: IRQs pending after counting this one
+    US4OEM_EVENT_IOCTL = 2, // Handler returned; arg0: IOCTL code, arg1: status (STATUS_PENDING if it kept the request)
+    US4OEM_EVENT_POLL_PARKED = 3, // A poll is waiting for IRQs
+    US4OEM_EVENT_POLL_COMPLETED = 4, // arg0: IRQs consumed, arg1: IRQs still pending
+    US4OEM_EVENT_POLL_TIMEOUT = 5, // A POLL_EX request stopped waiting; arg0: IRQs consumed
+    US4OEM_EVENT_POLL_BUSY = 6, // A poll was turned away; arg0: 0 if nothing was pending, 1 if another poll is waiting
+    US4OEM_EVENT_TYPE_COUNT
+} us4oem_event_type;
+
+#define US4OEM_EVENT_MASK(type) (1UL << (type))
+#define US4OEM_EVENT_MASK_ALL (US4OEM_EVENT_MASK(US4OEM_EVENT_TYPE_COUNT) - 1)
+
+typedef struct _us4oem_event {
+    unsigned long long sequence; // Per processor, starting at 1; gaps mean events were overwritten before being read
+    long long timestamp; // QPC
+    unsigned long type; // us4oem_event_type
+    unsigned long arg0;
+    unsigned long long arg1;
+} us4oem_event;
+
+typedef struct _us4oem_event_read_argument {
+    unsigned long processor; // Processor index (across all groups), below us4oem_event_ring.processor_count
+} us4oem_event_read_argument;
+
+typedef struct _us4oem_event_ring {
+    unsigned long processor_count; // Number of processors that have a ring
+    unsigned long event_mask; // Event types currently recorded, see US4OEM_WIN32_IOCTL_SET_EVENT_MASK
+    unsigned long long recorded; // Events ever recorded on this processor
+    unsigned long count; // Valid entries in events, oldest first
+    unsigned long reserved;
+    us4oem_event events[US4OEM_EVENT_RING_SIZE];
+} us4oem_event_ring;
+
+// ====== Command Batches ======
+
+#define US4OEM_BATCH_MAX_COMMANDS 256
+
+#define US4OEM_BATCH_FLAG_CONTINUE_ON_ERROR 0x1 // Keep going after a command fails instead of skipping the rest
+
+#define US4OEM_BATCH_STATUS_NOT_RUN ((long)0xC0000120) // STATUS_CANCELLED, command skipped after an earlier failure
+
+typedef struct _us4oem_batch_header {
+    unsigned long command_count; // Number of commands following the header
+    unsigned long flags; // US4OEM_BATCH_FLAG_*
+    unsigned long long total_length; // Size of the header and all the commands, in bytes
+    unsigned long executed; // [out] Number of commands that were run
+    long status; // [out] Status (NTSTATUS) of the first failed command, 0 if all succeeded
+} us4oem_batch_header;
+
+// Each command is followed by its input data and then room for its output, both padded to 8 bytes
+typedef struct _us4oem_batch_command {
+    unsigned long ioctl; // US4OEM_WIN32_IOCTL_*
+    unsigned long input_length;
+    unsigned long output_length;
+    long status; // [out] Status (NTSTATUS) of the command, US4OEM_BATCH_STATUS_NOT_RUN if it was skipped
+    unsigned long long bytes_returned; // [out] Bytes written to the output area
+} us4oem_batch_command;
+
+#define US4OEM_BATCH_ALIGN(length) (((length) + 7) & ~(size_t)7)
+
+// Size of a command including its data areas
+#define US4OEM_BATCH_COMMAND_SIZE(input_length, output_length) \
+    (sizeof(us4oem_batch_command) + US4OEM_BATCH_ALIGN(input_length) + US4OEM_BATCH_ALIGN(output_length))
+
+// ====== Register Access ======
+
+#define US4OEM_REG_MAX_OPS 4096
+#define US4OEM_REG_POLL_MAX_TIMEOUT_US 1000000 // 1 s
+
+typedef enum _us4oem_reg_op_type {
+    US4OEM_REG_OP_READ = 0, // value = register
+    US4OEM_REG_OP_WRITE = 1, // register = value
+    US4OEM_REG_OP_READ_MODIFY_WRITE = 2, // register = (register & ~mask) | (value & mask), value = register before the change
+    US4OEM_REG_OP_POLL = 3, // Wait until (register & mask) == (value & mask), at most timeout_us; value = last read
+} us4oem_reg_op_type;
+
+typedef struct _us4oem_reg_access_header {
+    unsigned long op_count; // Number of us4oem_reg_op following the header
+    unsigned long executed; // [out] Number of operations that succeeded
+    long status; // [out] Status (NTSTATUS) of the failed operation (at index executed), 0 if all succeeded
+    unsigned long reserved;
+} us4oem_reg_access_header;
+
+typedef struct _us4oem_reg_op {
+    unsigned char bar; // 0 or 4
+    unsigned char width; // Access width in bytes: 1, 2, 4 or 8; the offset must be aligned to it
+    unsigned char op; // us4oem_reg_op_type
+    unsigned char reserved;
+    unsigned long timeout_us; // US4OEM_REG_OP_POLL only, up to US4OEM_REG_POLL_MAX_TIMEOUT_US
+    unsigned long long offset; // Byte offset in the BAR
+    unsigned long long value; // [in/out] See us4oem_reg_op_type
+    unsigned long long mask; // US4OEM_REG_OP_READ_MODIFY_WRITE and US4OEM_REG_OP_POLL only
+} us4oem_reg_op;
+
+#define US4OEM_REG_ACCESS_SIZE(op_count) (sizeof(us4oem_reg_access_header) + (op_count) * sizeof(us4oem_reg_op))
+
+// ====== Interrupt Moderation ======
+
+#define US4OEM_IRQ_MODERATION_UNLIMITED ((unsigned long)0xFFFFFFFF) // Use as max_irqs for a time limit only
+
+typedef struct _us4oem_irq_moderation_argument {
+    unsigned long max_irqs; // Complete waiters once this many IRQs are pending; 0 or 1 disables moderation
+    unsigned long max_delay_us; // ...or this long after the first pending IRQ; 0 for no time limit
+} us4oem_irq_moderation_argument;
+
+// ====== Interrupt Affinity ======
+
+#define US4OEM_PROCESSOR_ANY ((unsigned long)0xFFFFFFFF)
+
+// Same values as KDPC_IMPORTANCE
+#define US4OEM_DPC_IMPORTANCE_LOW 0
+#define US4OEM_DPC_IMPORTANCE_MEDIUM 1 // Default
+#define US4OEM_DPC_IMPORTANCE_HIGH 2
+#define US4OEM_DPC_IMPORTANCE_MEDIUM_HIGH 3
+
+#define US4OEM_IRQ_AFFINITY_SET_DPC 0x1 // Apply dpc_target_processor and dpc_importance
+#define US4OEM_IRQ_AFFINITY_SET_INTERRUPT 0x2 // Apply interrupt_affinity
+
+typedef struct _us4oem_irq_affinity_argument {
+    unsigned long flags; // US4OEM_IRQ_AFFINITY_SET_*, what to change
+    unsigned long long interrupt_affinity; // Processors (in the device's group) the interrupt may target, 0 to let Windows decide
+    unsigned long dpc_target_processor; // Processor index to run the DPC on, US4OEM_PROCESSOR_ANY for the one that took the interrupt
+    unsigned long dpc_importance; // US4OEM_DPC_IMPORTANCE_*
+} us4oem_irq_affinity_argument;
+
+// ====== DMA Teardown ======
+
+#define US4OEM_TEARDOWN_MAX_WORKERS 16
+
+#define US4OEM_TEARDOWN_FLAG_ASYNC_CLOSE 0x1 // Close returns right away, the buffers are released in the background
+
+typedef struct _us4oem_teardown_options {
+    unsigned long flags; // US4OEM_TEARDOWN_FLAG_*
+    unsigned long max_workers; // Threads releasing buffers in parallel, 0 for one per processor (up to US4OEM_TEARDOWN_MAX_WORKERS)
+} us4oem_teardown_options;
+
+// ====== DMA Buffer Lease ======
+
+#define US4OEM_LEASE_MAX_DURATION_MS ((unsigned long)(60 * 60 * 1000)) // 1 hour
+
+typedef struct _us4oem_lease_argument {
+    unsigned long long token; // Chosen by the client, needed to attach; 0 clears the lease
+    unsigned long duration_ms; // How long the buffers are kept after close, at most US4OEM_LEASE_MAX_DURATION_MS
+    unsigned long reserved; // Must be 0
+} us4oem_lease_argument;
+
 // ====== DMA Allocation Structure ======
 
 #define US4OEM_DMA_SG_MAX_SIZE ((unsigned long)0x80000000) // 2 GiB, Windows limitation
@@ -143,6 +625,7 @@ typedef struct _us4oem_dma_allocation_argument {
 typedef struct _us4oem_dma_contiguous_buffer_response {
 	void* va; // Virtual address of the allocated buffer - note: this is NOT mapped to user-mode memory
     unsigned long long pa; // Physical address of the allocated buffer
+    us4oem_handle handle; // To map and release the buffer without a lookup
 } us4oem_dma_contiguous_buffer_response;
 
 typedef struct _us4oem_dma_scatter_gather_buffer_chunk {
@@ -155,7 +638,8 @@ typedef struct _us4oem_dma_scatter_gather_buffer_response {
 	void* va; // Virtual address of the allocated buffer - note: this is NOT mapped to user-mode memory
     size_t chunk_count; // Number of chunks in the scatter-gather buffer
 	size_t length_used; // Total size of this structure - see US4OEM_DMA_SG_RESPONSE_NEEDED_SIZE(chunk_count)
-    
+    us4oem_handle handle; // To map and release the buffer without a lookup
+
     //us4oem_dma_scatter_gather_buffer_chunk chunks[<DYNAMIC>]; // Array of chunks, size is variable based on chunk_count
 	us4oem_dma_scatter_gather_buffer_chunk chunks[1]; // This used as a placeholder
 